@@ -6,6 +6,24 @@
 //
 
 #define DEFAULT_AGENT_MAX_ITERATIONS 5
+#define DEFAULT_AGENT_TOOLS_TTL 300
+#define DEFAULT_AGENT_RESULT_TOKENS 2048
+#define DEFAULT_AGENT_TOOL_WORKERS 4
+#define DEFAULT_AGENT_EMBED_BATCH 32
+#define DEFAULT_AGENT_LOOP_PATIENCE 2
+#define AGENT_MAX_TOOL_CALLS 16   // tool calls taken from one model response
+#define AGENT_LOCAL_TOOL_MAX_ROWS 1000  // rows a registered SQL tool returns to the model
+#define AGENT_TOOL_EMBED_BYTES 1024     // description bytes embedded per tool for tool_top_k
+#define AGENT_RUNTIME_SHARDS 16   // tool result cache shards of a shared runtime, one mutex each
+#define AGENT_RUNTIME_IDLE_WORKERS 64  // worker connections a shared runtime keeps between runs
+#define AGENT_MAX_FINISHED_JOBS 64  // finished agent_run_async() jobs kept for agent_jobs
+#define AGENT_CLIENT_DATA "sqlite-agent"  // sqlite3_set_clientdata() name of the connection state
+
+// Conservative bytes-per-token estimate, used when the model tokenizer is not available
+#define AGENT_BYTES_PER_TOKEN 3
+#define AGENT_MIN_CONTEXT_TOKENS 4096
+#define AGENT_MIN_RESULT_TOKENS 64
+#define AGENT_RESPONSE_TOKENS 512  // room left for each model reply
 
 //#define AGENT_DEBUG 1
 #ifdef AGENT_DEBUG
@@ -20,9 +38,379 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <time.h>
+
+#if defined(__SSE2__) && (defined(__GNUC__) || defined(__clang__))
+  #include <emmintrin.h>
+  #define AGENT_JSON_SSE2 1
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  #include <arm_neon.h>
+  #define AGENT_JSON_NEON 1
+#endif
+
+#ifdef _WIN32
+  #include <windows.h>
+  typedef HANDLE agent_thread;
+  typedef DWORD (WINAPI *agent_thread_fn)(void*);
+  #define AGENT_THREAD_FUNC DWORD WINAPI
+  #define AGENT_THREAD_RETURN 0
+#else
+  #include <pthread.h>
+  typedef pthread_t agent_thread;
+  typedef void* (*agent_thread_fn)(void*);
+  #define AGENT_THREAD_FUNC void*
+  #define AGENT_THREAD_RETURN NULL
+#endif
 
 SQLITE_EXTENSION_INIT1
 
+typedef struct {
+  char *name;
+  char *description;
+  char *inputschema;
+  char *sql;          // statement of a tool of agent_tools, NULL for the MCP tools
+} agent_tool;
+
+// Tools advertised by the MCP server and registered with agent_register_tool(),
+// kept between agent_run calls so that tools/list is not re-issued for every goal.
+// A runtime shares the MCP listing alone; each connection merges it with the
+// tools of its own agent_tools table into the catalog its runs use.
+typedef struct {
+  agent_tool *tools;
+  int tool_count;
+  char *prompt;             // formatted "Available tools:" fragment, ready to paste into prompts
+  size_t prompt_len;
+  char *grammar;            // GBNF of the table mode tool calls, built on first use
+  sqlite3_uint64 hash;      // of prompt: the same tools listed again hash the same
+  sqlite3_uint64 source;    // hash of the MCP listing merged into a connection catalog, 0 for none
+  sqlite3_int64 loaded_at;  // time() of the MCP listing, or of the merge without one
+  int refs;                 // runtime and connections holding an MCP listing
+} agent_tool_catalog;
+
+#define AGENT_TOOL_CACHE_BUCKETS 256  // hash buckets of a tool result cache, a power of two
+
+// Result of an earlier tool call, reused while the TTL of the tool lasts
+typedef struct agent_cached_result agent_cached_result;
+struct agent_cached_result {
+  char *key;                // tool name, newline, canonical args
+  sqlite3_uint64 hash;
+  unsigned char *result;    // agent_pack() of the result, unpacked on each hit
+  int result_size;
+  sqlite3_int64 created_at;
+  agent_cached_result *next;   // in the bucket of the hash
+  agent_cached_result *newer;
+  agent_cached_result *older;
+};
+
+// Results by key hash, with the entries also linked from the most recent to
+// the oldest, which is dropped first
+typedef struct {
+  agent_cached_result *buckets[AGENT_TOOL_CACHE_BUCKETS];
+  agent_cached_result *newest;
+  agent_cached_result *oldest;
+  int count;
+} agent_tool_cache;
+
+// Per-connection settings, changed with agent_config() or for one call by the
+// options argument of agent_run()
+typedef struct {
+  int max_iterations;       // agent_run iterations when the call does not pass them
+  int timeout_ms;           // wall-clock budget of an agent_run call, 0 for none
+  int token_budget;         // tokens sent to and generated by the model in an agent_run call, 0 for none
+  int tools_ttl;            // seconds before the tool catalog is listed again, 0 disables caching
+  int persistent_context;   // keep the chat context between agent_run calls with the same preamble
+  int on_conflict;          // AGENT_ON_CONFLICT_* applied to the table mode INSERT
+  int result_tokens;        // tokens of a tool result kept in the conversation
+  int max_context;          // upper bound for the chat context size in tokens, 0 for none
+  int trace;                // agent_run calls kept in agent_trace, 0 disables tracing
+  int grammar;              // table mode: constrain tool calls and extraction answers with a GBNF grammar
+  int streaming;            // table mode: extract and commit rows after each tool result
+  int early_stop;           // stream loop replies from llm_chat() and stop at a complete answer
+  int prefetch;             // start streamed tool calls on the workers before the reply ends
+  int compact;              // minify, project and paginate JSON tool results
+  int checkpoint;           // record runs and tool results in agent_runs/agent_steps
+  int loop_patience;        // iterations without progress before the loop is redirected, 0 disables the policy
+  int tool_top_k;           // tools closest to the goal listed in the prompt, 0 lists them all
+  int tool_writes;          // local tools may be statements that write to the database
+  int embed_batch;          // rows embedded per UPDATE after a table mode run
+  int tool_workers;         // MCP connections running the tool calls of one response concurrently
+  int batch_workers;        // job connections running the goals of one agent_run_each() call
+  int tool_cache_ttl;       // seconds a tool result is reused for the same call, 0 disables the cache
+  char *tool_cache_tools;   // ';' separated tools cached, optionally as name=ttl, NULL for all
+  char *tool_cache_exclude; // ';' separated tools never cached
+  char *worker_extensions;  // ';' separated extensions loaded by each worker connection
+  char *worker_init;        // SQL run on each new worker connection, NULL runs tool calls serially
+  char *job_init;           // SQL run on each job connection before its first run
+  char *runtime;            // shared runtime joined by the connection, NULL for private caches
+} agent_options;
+
+enum {
+  AGENT_ON_CONFLICT_ABORT,
+  AGENT_ON_CONFLICT_IGNORE,
+  AGENT_ON_CONFLICT_REPLACE,
+  AGENT_ON_CONFLICT_UPDATE
+};
+
+static const char *const agent_on_conflict_names[] = {"abort", "ignore", "replace", "update", NULL};
+static const char *const agent_on_conflict_verbs[] = {"", "OR IGNORE ", "OR REPLACE ", ""};
+
+// Chat context left alive by the previous agent_run call
+typedef struct {
+  sqlite3_uint64 preamble_hash;  // hash of the preamble the chat was started with, 0 when unusable
+  int ctx_size;                  // llm_context_size() right after the chat was created
+  char *tools;                   // tool_top_k: tools listed in the preamble, NULL for the whole catalog
+  sqlite3_uint64 tools_catalog;  // hash of the catalog they were selected from
+  int tools_k;                   // tool_top_k they were selected with
+} agent_chat_state;
+
+// Internal statements issued on every iteration
+typedef enum {
+  AGENT_STMT_CHAT_RESPOND,
+  AGENT_STMT_CHAT_STREAM,
+  AGENT_STMT_CALL_TOOL,
+  AGENT_STMT_CONTEXT_SIZE,
+  AGENT_STMT_CONTEXT_USED,
+  AGENT_STMT_TOKEN_COUNT,
+  AGENT_STMT_SAMPLER_CREATE,
+  AGENT_STMT_SAMPLER_GRAMMAR,
+  AGENT_STMT_SAMPLER_GREEDY,
+  AGENT_STMT_SAMPLER_FREE,
+  AGENT_STMT_COUNT
+} agent_stmt_id;
+
+static const char *agent_stmt_sql[AGENT_STMT_COUNT] = {
+  "SELECT llm_chat_respond(?)",
+  "SELECT reply FROM llm_chat(?)",
+  "SELECT text FROM mcp_call_tool_respond(?, ?)",
+  "SELECT llm_context_size()",
+  "SELECT llm_context_used()",
+  "SELECT llm_token_count(?)",
+  // A grammar chain is built by three statements, in this order
+  "SELECT llm_sampler_create()",
+  "SELECT llm_sampler_init_grammar(?)",
+  "SELECT llm_sampler_init_greedy()",
+  "SELECT llm_sampler_free()",
+};
+
+// Private database connection used to call MCP tools from a worker thread
+typedef struct {
+  sqlite3 *db;
+  sqlite3_stmt *call;   // mcp_call_tool_respond() on db
+  int failed;           // worker_init failed on this connection
+  sqlite3_uint64 setup; // hash of the worker options the connection was opened with
+} agent_worker;
+
+// Worker connections are opened by their thread on first use and kept until
+// the worker options change or the database is closed
+typedef struct {
+  agent_worker *workers;
+  int count;
+  int disabled;         // a worker could not be initialized, calls run serially
+} agent_pool;
+
+typedef struct {
+  sqlite3_mutex *mutex;
+  agent_tool_cache cache;
+} agent_cache_shard;
+
+// Caches shared by the connections of a process whose runtime option names
+// it: the tool catalog, the tool results and the idle worker connections.
+// The LLM context stays with each connection. Runtimes are found by name
+// under SQLITE_MUTEX_STATIC_APP1 and released with their last connection;
+// tool results are spread over shards by key hash so that lookups of
+// concurrent runs rarely wait on each other.
+typedef struct agent_runtime agent_runtime;
+struct agent_runtime {
+  char *name;
+  int refs;                       // connections that joined the runtime, guarded by the static mutex
+  sqlite3_mutex *mutex;           // guards catalog, its refs, and idle
+  agent_tool_catalog *catalog;    // last MCP listing of any connection, NULL until the first one
+  agent_worker *idle;             // worker connections not borrowed by a run
+  int idle_count;
+  agent_cache_shard shards[AGENT_RUNTIME_SHARDS];
+  agent_runtime *next;
+};
+
+typedef enum {
+  AGENT_JOB_QUEUED,
+  AGENT_JOB_RUNNING,
+  AGENT_JOB_DONE,
+  AGENT_JOB_FAILED,
+  AGENT_JOB_CANCELLED
+} agent_job_status;
+
+static const char *const agent_job_status_names[] = {"queued", "running", "done", "failed", "cancelled"};
+
+// An agent_run_async() call. The job thread owns its connection and reports
+// through the fields below, which are guarded by mutex.
+typedef struct agent_job agent_job;
+struct agent_job {
+  sqlite3_int64 id;
+  sqlite3_mutex *mutex;     // shared by all jobs of the creating connection
+  sqlite3_value *args[5];   // agent_run() arguments
+  int argc;
+  char *filename;           // database the job connection opens
+  agent_options options;    // copy of the creating connection options
+  agent_thread thread;
+  int started;              // thread was created and must be joined
+  agent_job_status status;
+  int cancel;               // agent_cancel() was called
+  int iteration;            // last iteration started by the run
+  sqlite3_value *result;    // agent_run() result once done
+  char *error;              // error message once failed
+  sqlite3 *db;              // job connection while it is open, for sqlite3_interrupt()
+  int batch;                // the job connection runs several agent_run_each() goals
+  int rows;                 // rows stored by the last run on the job connection
+  sqlite3_int64 created_at;
+  sqlite3_int64 finished_at;
+  agent_job *next;
+};
+
+// Column affinities, as SQLite derives them from the declared type
+enum {
+  AGENT_AFFINITY_BLOB,      // no declared type, or BLOB
+  AGENT_AFFINITY_TEXT,
+  AGENT_AFFINITY_NUMERIC,
+  AGENT_AFFINITY_INTEGER,
+  AGENT_AFFINITY_REAL
+};
+
+// Column of a table mode target, from PRAGMA table_info
+typedef struct {
+  char *name;
+  char *type;               // declared type, "" when the column has none
+  int affinity;             // AGENT_AFFINITY_* of type
+  int embedding;            // BLOB column named embedding or *_embedding, filled after the insert
+  int bind_idx;             // INSERT parameter of the column, 0 for embedding columns
+} agent_column;
+
+// Target table of table mode runs. Descriptors are kept per connection and
+// resolved again when the schema_version of any attached schema changes; the
+// INSERT is prepared
+// on first use and finalized with the other internal statements.
+typedef struct agent_table agent_table;
+struct agent_table {
+  char *name;
+  agent_column *columns;
+  int column_count;
+  int embedding_col_count;
+  char *schema;             // column list shown to the model
+  sqlite3_int64 schema_version;  // agent_schema_version() the columns were read at
+  sqlite3_stmt *insert;     // INSERT of the extracted rows, NULL until prepared
+  int insert_on_conflict;   // on_conflict the INSERT was built with
+  int returns_rowid;        // the INSERT returns the rowid of each stored row
+  agent_table *next;
+};
+
+// Embedding column set up with vector_init() on this connection
+typedef struct agent_vector_index agent_vector_index;
+struct agent_vector_index {
+  char *table_name;
+  char *column;
+  int dimension;
+  sqlite3_int64 schema_version;  // agent_schema_version() when vector_init() ran
+  agent_vector_index *next;
+};
+
+// Events of the last agent_run calls, for agent_trace and the trace hook
+typedef struct {
+  sqlite3_agent_trace_event *events;  // oldest first, name and detail owned
+  int count;
+  int capacity;
+  sqlite3_int64 run_id;     // current or last run
+  sqlite3_int64 runs;       // agent_run calls started, the id of the latest
+  int step;
+  int iteration;
+  int active;               // the current run records events
+  sqlite3_agent_trace_callback hook;
+  void *hook_arg;
+} agent_trace;
+
+// Budgets of the agent_run call running on a connection. They are checked
+// between steps and while a reply streams, never inside a call already made.
+typedef struct {
+  double started;           // agent_clock_ms() when the call started
+  double deadline;          // agent_clock_ms() when timeout_ms runs out, 0 for none
+  sqlite3_int64 tokens;     // tokens sent to and generated by the model so far
+} agent_limits;
+
+typedef struct agent_stats_set agent_stats_set;
+
+// Per-connection state, stored as the user data of the agent_* functions
+typedef struct agent_connection {
+  agent_options options;
+  const agent_options *run_options;  // options of the agent_run call in progress, &options outside one
+  agent_pool pool;
+  agent_tool_catalog *catalog;  // listing used by the runs of this connection, NULL until loaded
+  agent_tool_cache tool_cache;  // results of local tools, and of MCP tools outside a runtime
+  agent_runtime *runtime;       // shared runtime named by the runtime option, NULL for none
+  agent_chat_state chat;
+  sqlite3_stmt *stmts[AGENT_STMT_COUNT];
+  int no_tokenizer;         // llm_token_count() could not be prepared during this agent_run call
+  int no_grammar;           // grammar sampling failed during this agent_run call
+  int no_stream;            // llm_chat() could not be prepared during this agent_run call
+  int grammar_active;       // the sampler chain was replaced by a grammar one
+  agent_job *jobs;          // agent_run_async() jobs started on this connection, by id
+  sqlite3_int64 last_job_id;
+  sqlite3_mutex *job_mutex;
+  int job_cursors;          // open agent_jobs cursors, finished jobs are not freed meanwhile
+  agent_job *job;           // job this connection runs, NULL outside agent_run_async()
+  int batch;                // agent_run_each() cursors running goals on this connection
+  int last_rows;            // rows stored by the last agent_run call
+  agent_vector_index *vector_indexes;
+  sqlite3_uint64 tool_vectors;  // hash of the catalog embedded in agent_tool_vectors, 0 for none
+  agent_table *tables;      // table mode targets, most recently used first
+  agent_trace trace;
+  agent_stats_set *stats;   // latency histograms of the steps run here, NULL when out of memory
+  agent_limits limits;
+  sqlite3_agent_loop_callback loop_hook;
+  void *loop_hook_arg;
+} agent_connection;
+
+typedef struct {
+  const char *name;
+  size_t offset;
+  int min_value;
+  const char *const *choices;  // NULL-terminated names for enumerated options, NULL for integers
+  int is_text;                 // value is an owned char*, NULL when unset
+  int connection_only;         // set with agent_config() only, not by the options of one call
+} agent_option_def;
+
+static const agent_option_def agent_option_defs[] = {
+  {"max_iterations", offsetof(agent_options, max_iterations), 1, NULL, 0, 0},
+  {"timeout_ms", offsetof(agent_options, timeout_ms), 0, NULL, 0, 0},
+  {"token_budget", offsetof(agent_options, token_budget), 0, NULL, 0, 0},
+  {"tools_ttl", offsetof(agent_options, tools_ttl), 0, NULL, 0, 0},
+  {"persistent_context", offsetof(agent_options, persistent_context), 0, NULL, 0, 0},
+  {"on_conflict", offsetof(agent_options, on_conflict), 0, agent_on_conflict_names, 0, 0},
+  {"result_tokens", offsetof(agent_options, result_tokens), AGENT_MIN_RESULT_TOKENS, NULL, 0, 0},
+  {"max_context", offsetof(agent_options, max_context), 0, NULL, 0, 0},
+  {"trace", offsetof(agent_options, trace), 0, NULL, 0, 0},
+  {"grammar", offsetof(agent_options, grammar), 0, NULL, 0, 0},
+  {"streaming", offsetof(agent_options, streaming), 0, NULL, 0, 0},
+  {"early_stop", offsetof(agent_options, early_stop), 0, NULL, 0, 0},
+  {"prefetch", offsetof(agent_options, prefetch), 0, NULL, 0, 0},
+  {"compact", offsetof(agent_options, compact), 0, NULL, 0, 0},
+  {"checkpoint", offsetof(agent_options, checkpoint), 0, NULL, 0, 0},
+  {"loop_patience", offsetof(agent_options, loop_patience), 0, NULL, 0, 0},
+  {"tool_top_k", offsetof(agent_options, tool_top_k), 0, NULL, 0, 0},
+  {"tool_writes", offsetof(agent_options, tool_writes), 0, NULL, 0, 0},
+  {"embed_batch", offsetof(agent_options, embed_batch), 1, NULL, 0, 0},
+  {"tool_workers", offsetof(agent_options, tool_workers), 1, NULL, 0, 1},
+  {"batch_workers", offsetof(agent_options, batch_workers), 1, NULL, 0, 1},
+  {"tool_cache_ttl", offsetof(agent_options, tool_cache_ttl), 0, NULL, 0, 0},
+  {"tool_cache_tools", offsetof(agent_options, tool_cache_tools), 0, NULL, 1, 0},
+  {"tool_cache_exclude", offsetof(agent_options, tool_cache_exclude), 0, NULL, 1, 0},
+  {"worker_extensions", offsetof(agent_options, worker_extensions), 0, NULL, 1, 1},
+  {"worker_init", offsetof(agent_options, worker_init), 0, NULL, 1, 1},
+  {"job_init", offsetof(agent_options, job_init), 0, NULL, 1, 1},
+  {"runtime", offsetof(agent_options, runtime), 0, NULL, 1, 1},
+};
+
+#define AGENT_OPTION_COUNT (int)(sizeof(agent_option_defs) / sizeof(agent_option_defs[0]))
+
 static void agent_version(
   sqlite3_context *context,
   int argc,
@@ -31,1026 +419,6922 @@ static void agent_version(
   sqlite3_result_text(context, SQLITE_AGENT_VERSION, -1, NULL);
 }
 
-static char* agent_call_mcp_tool(sqlite3 *db, const char *tool_name, const char *tool_args) {
-  sqlite3_stmt *stmt;
-  char sql[1024];
-  snprintf(sql, sizeof(sql), "SELECT text FROM mcp_call_tool_respond(?, ?)");
-
-  int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-  if (rc != SQLITE_OK) {
-    DF("Failed to prepare mcp_call_tool_respond(): %s", sqlite3_errmsg(db));
-    return NULL;
-  }
+// MARK: - JSON tokenizer
+
+// Single pass, resumable JSON tokenizer. Tokens reference the parsed buffer by
+// offset, so values can be bound without copying. Feeding a longer version of
+// the same buffer continues from where the previous call stopped.
+
+#define AGENT_JSON_MAX_DEPTH 64
+
+typedef enum {
+  AGENT_JSON_OBJECT = 1,
+  AGENT_JSON_ARRAY,
+  AGENT_JSON_STRING,
+  AGENT_JSON_PRIMITIVE
+} agent_json_type;
+
+typedef enum {
+  AGENT_JSON_ERROR = -1,
+  AGENT_JSON_PARTIAL = 0,
+  AGENT_JSON_COMPLETE = 1
+} agent_json_status;
+
+typedef struct {
+  agent_json_type type;
+  int start;    // first byte: the bracket, the first char inside quotes, or the primitive
+  int end;      // one past the last byte: past the bracket, or up to the closing quote
+  int next;     // index of the first token after this subtree, 0 while a container is open
+  int escaped;  // string contains backslash escapes
+} agent_json_token;
+
+typedef struct {
+  agent_json_token *tokens;
+  int count;
+  int capacity;
+  int pos;                              // next byte to scan
+  int stack[AGENT_JSON_MAX_DEPTH];      // open containers
+  int members[AGENT_JSON_MAX_DEPTH];    // direct children of each open container
+  int depth;
+  int root;                             // root token, -1 until the first value starts
+} agent_json_parser;
+
+#ifdef AGENT_PROFILE
+static double agent_clock_ms(void);
+static void agent_stats_add(agent_connection *conn, const char *kind, const char *name, double ms);
+#endif
 
-  sqlite3_bind_text(stmt, 1, tool_name, -1, SQLITE_TRANSIENT);
-  sqlite3_bind_text(stmt, 2, tool_args, -1, SQLITE_TRANSIENT);
+static void agent_json_init(agent_json_parser *parser) {
+  memset(parser, 0, sizeof(*parser));
+  parser->root = -1;
+}
 
-  // Collect all text results from the virtual table
-  char *result_buffer = malloc(32768);
-  if (!result_buffer) {
-    sqlite3_finalize(stmt);
-    return NULL;
-  }
-  result_buffer[0] = '\0';
-  
-  int has_results = 0;
-  while (sqlite3_step(stmt) == SQLITE_ROW) {
-    const char *text = (const char*)sqlite3_column_text(stmt, 0);
-    if (text) {
-      if (has_results) {
-        strncat(result_buffer, "\n", 32767 - strlen(result_buffer));
-      }
-      strncat(result_buffer, text, 32767 - strlen(result_buffer));
-      has_results = 1;
-    }
-  }
-  
-  sqlite3_finalize(stmt);
-  
-  if (!has_results) {
-    free(result_buffer);
-    return NULL;
-  }
-  
-  return result_buffer;
+static void agent_json_free(agent_json_parser *parser) {
+  sqlite3_free(parser->tokens);
+  agent_json_init(parser);
 }
 
-static char* agent_get_tools_list(sqlite3 *db) {
-  sqlite3_stmt *stmt;
-  int rc = sqlite3_prepare_v2(db, "SELECT name, description, inputschema FROM mcp_list_tools_respond", -1, &stmt, NULL);
-  if (rc != SQLITE_OK) {
-    DF("Failed to prepare mcp_list_tools_respond query: %s", sqlite3_errmsg(db));
-    return NULL;
+static int agent_json_add(agent_json_parser *parser, agent_json_type type, int start, int end) {
+  if (parser->count == parser->capacity) {
+    int capacity = parser->capacity ? parser->capacity * 2 : 64;
+    agent_json_token *tokens = sqlite3_realloc64(parser->tokens, capacity * sizeof(agent_json_token));
+    if (!tokens) return -1;
+    parser->tokens = tokens;
+    parser->capacity = capacity;
   }
+  int index = parser->count++;
+  agent_json_token *token = &parser->tokens[index];
+  token->type = type;
+  token->start = start;
+  token->end = end;
+  token->next = (type == AGENT_JSON_OBJECT || type == AGENT_JSON_ARRAY) ? 0 : index + 1;
+  token->escaped = 0;
+  if (parser->root < 0) parser->root = index;
+  if (parser->depth > 0) parser->members[parser->depth - 1]++;
+  return index;
+}
 
-  char *formatted = malloc(65536);  // Increased buffer size for schemas
-  if (!formatted) {
-    sqlite3_finalize(stmt);
-    return NULL;
-  }
+// Returns the offset of the first '"' or '\\' at or after pos, len if none
+static int agent_json_scan_string_scalar(const char *js, int pos, int len) {
+  while (pos < len && js[pos] != '"' && js[pos] != '\\') pos++;
+  return pos;
+}
 
-  strcpy(formatted, "Available tools:\n");
-  int tool_count = 0;
-  
-  while (sqlite3_step(stmt) == SQLITE_ROW) {
-    const char *name = (const char*)sqlite3_column_text(stmt, 0);
-    const char *description = (const char*)sqlite3_column_text(stmt, 1);
-    const char *inputschema = (const char*)sqlite3_column_text(stmt, 2);
-    
-    if (name) {
-      tool_count++;
-      char tool_line[1024];
-      snprintf(tool_line, sizeof(tool_line), 
-               "- %s: %s\n%s\n", 
-               name, 
-               description ? description : "(no description)",
-               inputschema ? inputschema : "(no input schema)");
-      
-      size_t remaining = 65535 - strlen(formatted);
-      if (strlen(tool_line) < remaining) {
-        strcat(formatted, tool_line);
-      }
-    }
+// Same as agent_json_scan_string_scalar(), 16 bytes at a time with SSE2 or NEON
+static int agent_json_scan_string(const char *js, int pos, int len) {
+#if defined(AGENT_JSON_SSE2)
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  while (pos + 16 <= len) {
+    __m128i chunk = _mm_loadu_si128((const __m128i*)(js + pos));
+    int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+                                              _mm_cmpeq_epi8(chunk, backslash)));
+    if (mask) return pos + __builtin_ctz(mask);
+    pos += 16;
   }
-  
-  sqlite3_finalize(stmt);
-  
-  if (tool_count == 0) {
-    free(formatted);
-    return NULL;
+#elif defined(AGENT_JSON_NEON)
+  const uint8x16_t quote = vdupq_n_u8('"');
+  const uint8x16_t backslash = vdupq_n_u8('\\');
+  while (pos + 16 <= len) {
+    uint8x16_t chunk = vld1q_u8((const uint8_t*)(js + pos));
+    uint8x16_t hits = vorrq_u8(vceqq_u8(chunk, quote), vceqq_u8(chunk, backslash));
+    if (vmaxvq_u8(hits)) break;
+    pos += 16;
   }
-  
-  DF("Formatted %d tools for agent context", tool_count);
-  return formatted;
+#endif
+  return agent_json_scan_string_scalar(js, pos, len);
 }
 
-static int agent_create_chat_context(sqlite3 *db, const char *tools_list) {
-  int rc;
-  sqlite3_stmt *ctx_check_stmt;
-  int existing_ctx_size = 0;
+// Tokenizes js[parser->pos..len). Returns AGENT_JSON_COMPLETE once the first
+// top-level object or array is closed, AGENT_JSON_PARTIAL when more input is
+// needed and AGENT_JSON_ERROR on malformed input.
+static agent_json_status agent_json_tokenize(agent_json_parser *parser, const char *js, int len) {
+  if (parser->root >= 0 && parser->depth == 0) return AGENT_JSON_COMPLETE;
 
-  rc = sqlite3_prepare_v2(db, "SELECT llm_context_size()", -1, &ctx_check_stmt, 0);
-  if (rc == SQLITE_OK) {
-    if (sqlite3_step(ctx_check_stmt) == SQLITE_ROW) {
-      existing_ctx_size = sqlite3_column_int(ctx_check_stmt, 0);
-      DF("Existing context size: %d", existing_ctx_size);
+  while (parser->pos < len) {
+    int pos = parser->pos;
+    char c = js[pos];
+
+    if (c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == ',' || c == ':') {
+      parser->pos++;
+      continue;
     }
-    sqlite3_finalize(ctx_check_stmt);
-  }
 
-  int tools_list_len = (int)strlen(tools_list);
-  int calculated_ctx_size = tools_list_len * 2;
+    int in_object = parser->depth > 0 &&
+                    parser->tokens[parser->stack[parser->depth - 1]].type == AGENT_JSON_OBJECT;
+    int expect_key = in_object && (parser->members[parser->depth - 1] % 2) == 0;
+
+    if (c == '{' || c == '[') {
+      if (expect_key || parser->depth == AGENT_JSON_MAX_DEPTH) return AGENT_JSON_ERROR;
+      int index = agent_json_add(parser, c == '{' ? AGENT_JSON_OBJECT : AGENT_JSON_ARRAY, pos, pos + 1);
+      if (index < 0) return AGENT_JSON_ERROR;
+      parser->stack[parser->depth] = index;
+      parser->members[parser->depth] = 0;
+      parser->depth++;
+      parser->pos++;
+      continue;
+    }
 
-  if (calculated_ctx_size < 4096) {
-    calculated_ctx_size = 4096;
-  }
+    if (c == '}' || c == ']') {
+      if (parser->depth == 0) return AGENT_JSON_ERROR;
+      agent_json_token *open = &parser->tokens[parser->stack[parser->depth - 1]];
+      if ((c == '}') != (open->type == AGENT_JSON_OBJECT)) return AGENT_JSON_ERROR;
+      if (in_object && !expect_key) return AGENT_JSON_ERROR;
+      open->end = pos + 1;
+      open->next = parser->count;
+      parser->depth--;
+      parser->pos++;
+      if (parser->depth == 0) return AGENT_JSON_COMPLETE;
+      continue;
+    }
 
-  DF("Calculated context size: %d (tools list: %d bytes)", calculated_ctx_size, tools_list_len);
+    if (parser->depth == 0) return AGENT_JSON_ERROR;
+
+    if (c == '"') {
+      int escaped = 0;
+      int end = pos + 1;
+      for (;;) {
+        end = agent_json_scan_string(js, end, len);
+        if (end >= len) return AGENT_JSON_PARTIAL;
+        if (js[end] == '"') break;
+        escaped = 1;
+        end += 2;
+        if (end > len) return AGENT_JSON_PARTIAL;
+      }
+      int index = agent_json_add(parser, AGENT_JSON_STRING, pos + 1, end);
+      if (index < 0) return AGENT_JSON_ERROR;
+      parser->tokens[index].escaped = escaped;
+      parser->pos = end + 1;
+      continue;
+    }
 
-  int ctx_size = (existing_ctx_size > calculated_ctx_size) ? existing_ctx_size : calculated_ctx_size;
+    if (expect_key) return AGENT_JSON_ERROR;
 
-  char create_cmd[256];
-  snprintf(create_cmd, sizeof(create_cmd),
-           "SELECT llm_context_create_chat('context_size=%d')", ctx_size);
-  rc = sqlite3_exec(db, create_cmd, 0, 0, 0);
+    int end = pos;
+    while (end < len && js[end] != ',' && js[end] != ']' && js[end] != '}' &&
+           js[end] != ' ' && js[end] != '\t' && js[end] != '\n' && js[end] != '\r' && js[end] != ':') {
+      end++;
+    }
+    if (end >= len) return AGENT_JSON_PARTIAL;
+    if (agent_json_add(parser, AGENT_JSON_PRIMITIVE, pos, end) < 0) return AGENT_JSON_ERROR;
+    parser->pos = end;
+  }
 
-  DF("Created chat context with size: %d", ctx_size);
+  return AGENT_JSON_PARTIAL;
+}
 
-  return rc;
+// Tokenizes like agent_json_tokenize(); profile builds count the time spent
+// in the stats, under "json:parse"
+static agent_json_status agent_json_parse(agent_json_parser *parser, const char *js, int len) {
+#ifdef AGENT_PROFILE
+  double started = agent_clock_ms();
+  agent_json_status status = agent_json_tokenize(parser, js, len);
+  agent_stats_add(NULL, "json", "parse", agent_clock_ms() - started);
+  return status;
+#else
+  return agent_json_tokenize(parser, js, len);
+#endif
 }
 
-static void agent_run_func(
-  sqlite3_context *context,
-  int argc,
-  sqlite3_value **argv
-){
-  if (argc < 1 || argc > 4) {
-    sqlite3_result_error(context, "agent_run requires 1-4 arguments: (goal, [table_name], [max_iterations], [system_prompt])", -1);
-    return;
+static int agent_json_equals(const char *js, const agent_json_token *token, const char *text) {
+  size_t len = (size_t)(token->end - token->start);
+  return strlen(text) == len && memcmp(js + token->start, text, len) == 0;
+}
+
+// Returns the token index of the value stored under key in an object, -1 if absent
+static int agent_json_object_get(const agent_json_parser *parser, const char *js, int object, const char *key) {
+  const agent_json_token *tokens = parser->tokens;
+  int end = tokens[object].next ? tokens[object].next : parser->count;
+  for (int k = object + 1; k + 1 < end; k = tokens[k + 1].next) {
+    if (tokens[k + 1].next == 0) break;
+    if (tokens[k].type == AGENT_JSON_STRING && agent_json_equals(js, &tokens[k], key)) return k + 1;
   }
+  return -1;
+}
 
-  const char *goal = (const char*)sqlite3_value_text(argv[0]);
-  const char *table_name = NULL;
-  int max_iterations = DEFAULT_AGENT_MAX_ITERATIONS;
-  const char *custom_system_prompt = NULL;
+static int agent_json_hex(const char *p) {
+  int value = 0;
+  for (int i = 0; i < 4; i++) {
+    char c = p[i];
+    value <<= 4;
+    if (c >= '0' && c <= '9') value |= c - '0';
+    else if (c >= 'a' && c <= 'f') value |= c - 'a' + 10;
+    else if (c >= 'A' && c <= 'F') value |= c - 'A' + 10;
+    else return -1;
+  }
+  return value;
+}
 
-  if (argc >= 2) {
-    if (sqlite3_value_type(argv[1]) == SQLITE_INTEGER) {
-      max_iterations = sqlite3_value_int(argv[1]);
-      table_name = NULL;
-    } else {
-      table_name = (const char*)sqlite3_value_text(argv[1]);
-      if (table_name && strlen(table_name) == 0) {
-        table_name = NULL;
+// Decodes the escapes of js[start..end) into out, which must hold end-start+1
+// bytes. Returns the decoded length.
+static int agent_json_unescape(const char *js, int start, int end, char *out) {
+  int n = 0;
+  for (int i = start; i < end; i++) {
+    char c = js[i];
+    if (c != '\\' || i + 1 >= end) {
+      out[n++] = c;
+      continue;
+    }
+    c = js[++i];
+    switch (c) {
+      case 'b': out[n++] = '\b'; break;
+      case 'f': out[n++] = '\f'; break;
+      case 'n': out[n++] = '\n'; break;
+      case 'r': out[n++] = '\r'; break;
+      case 't': out[n++] = '\t'; break;
+      case 'u': {
+        int cp = (i + 4 < end) ? agent_json_hex(js + i + 1) : -1;
+        if (cp < 0) {
+          out[n++] = 'u';
+          break;
+        }
+        i += 4;
+        if (cp >= 0xD800 && cp <= 0xDBFF && i + 6 < end && js[i + 1] == '\\' && js[i + 2] == 'u') {
+          int low = agent_json_hex(js + i + 3);
+          if (low >= 0xDC00 && low <= 0xDFFF) {
+            cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+            i += 6;
+          }
+        }
+        // A \uXXXX escape is 6 bytes, enough room for the 4 byte UTF-8 form
+        if (cp < 0x80) {
+          out[n++] = (char)cp;
+        } else if (cp < 0x800) {
+          out[n++] = (char)(0xC0 | (cp >> 6));
+          out[n++] = (char)(0x80 | (cp & 0x3F));
+        } else if (cp < 0x10000) {
+          out[n++] = (char)(0xE0 | (cp >> 12));
+          out[n++] = (char)(0x80 | ((cp >> 6) & 0x3F));
+          out[n++] = (char)(0x80 | (cp & 0x3F));
+        } else {
+          out[n++] = (char)(0xF0 | (cp >> 18));
+          out[n++] = (char)(0x80 | ((cp >> 12) & 0x3F));
+          out[n++] = (char)(0x80 | ((cp >> 6) & 0x3F));
+          out[n++] = (char)(0x80 | (cp & 0x3F));
+        }
+        break;
       }
+      default: out[n++] = c; break;
     }
   }
+  out[n] = '\0';
+  return n;
+}
 
-  if (argc >= 3) {
-    max_iterations = sqlite3_value_int(argv[2]);
+// Copies a token into a NUL-terminated buffer, decoding string escapes.
+// Returns 0 when the value does not fit.
+static int agent_json_copy(const char *js, const agent_json_token *token, char *out, size_t out_size) {
+  size_t len = (size_t)(token->end - token->start);
+  if (len >= out_size) return 0;
+  if (token->type == AGENT_JSON_STRING && token->escaped) {
+    agent_json_unescape(js, token->start, token->end, out);
+  } else {
+    memcpy(out, js + token->start, len);
+    out[len] = '\0';
   }
+  return 1;
+}
 
-  if (argc == 4) {
-    custom_system_prompt = (const char*)sqlite3_value_text(argv[3]);
+// Returns a sqlite3_malloc'd copy of a token, with string escapes decoded
+static char* agent_json_dup(const char *js, const agent_json_token *token) {
+  int len = token->end - token->start;
+  char *out = sqlite3_malloc(len + 1);
+  if (!out) return NULL;
+  if (token->type == AGENT_JSON_STRING && token->escaped) {
+    agent_json_unescape(js, token->start, token->end, out);
+  } else {
+    memcpy(out, js + token->start, len);
+    out[len] = '\0';
   }
+  return out;
+}
 
-  if (!goal) {
-    sqlite3_result_error(context, "goal must be non-null", -1);
+// Binds one extracted JSON value to an INSERT parameter. Plain strings point
+// into the JSON buffer, which must outlive the statement step.
+static void agent_json_bind(sqlite3_stmt *stmt, int idx, const char *js,
+                            const agent_json_token *token, int affinity) {
+  int len = token->end - token->start;
+  const char *value = js + token->start;
+
+  if (token->type == AGENT_JSON_PRIMITIVE && len == 4 && memcmp(value, "null", 4) == 0) {
+    sqlite3_bind_null(stmt, idx);
     return;
   }
 
-  sqlite3 *db = sqlite3_context_db_handle(context);
+  int is_integer = affinity == AGENT_AFFINITY_INTEGER;
+  int is_real = affinity == AGENT_AFFINITY_REAL;
 
-  if (!table_name) {
-    D("MODE 1: Text-Only Response");
-    sqlite3_stmt *stmt = NULL;
-    int rc;
-    char final_result[8192] = {0};
+  if (token->type == AGENT_JSON_PRIMITIVE &&
+      ((len == 4 && memcmp(value, "true", 4) == 0) || (len == 5 && memcmp(value, "false", 5) == 0))) {
+    if (is_integer || is_real || affinity == AGENT_AFFINITY_NUMERIC) sqlite3_bind_int(stmt, idx, value[0] == 't');
+    else sqlite3_bind_text(stmt, idx, value, len, SQLITE_STATIC);
+    return;
+  }
 
-    char *tools_list = agent_get_tools_list(db);
-    if (!tools_list) {
-      D("ERROR: Failed to list MCP tools");
-      sqlite3_result_error(context, "Not connected. Call mcp_connect() first", -1);
+  if (is_integer || is_real) {
+    if (token->type != AGENT_JSON_PRIMITIVE && token->type != AGENT_JSON_STRING) {
+      sqlite3_bind_null(stmt, idx);
       return;
     }
-    DF("Received tools list (length=%zu)", strlen(tools_list));
+    char num_str[64];
+    if (!agent_json_copy(js, token, num_str, sizeof(num_str))) {
+      sqlite3_bind_null(stmt, idx);
+    } else if (is_integer) {
+      sqlite3_bind_int64(stmt, idx, atoll(num_str));
+    } else {
+      sqlite3_bind_double(stmt, idx, atof(num_str));
+    }
+    return;
+  }
 
-    rc = agent_create_chat_context(db, tools_list);
-    if (rc != SQLITE_OK) {
-      D("ERROR: Failed to create LLM chat context");
-      free(tools_list);
-      sqlite3_result_error(context, "Failed to create LLM chat context", -1);
+  if (token->type == AGENT_JSON_STRING && token->escaped) {
+    char *decoded = sqlite3_malloc(len + 1);
+    if (!decoded) {
+      sqlite3_bind_null(stmt, idx);
       return;
     }
+    int decoded_len = agent_json_unescape(js, token->start, token->end, decoded);
+    sqlite3_bind_text(stmt, idx, decoded, decoded_len, sqlite3_free);
+    return;
+  }
 
-    for (int i = 0; i < max_iterations; i++) {
-      DF("Iteration %d/%d", i+1, max_iterations);
-
-      char system_prompt[32768];
-      if (custom_system_prompt && strlen(custom_system_prompt) > 0) {
-        strncpy(system_prompt, custom_system_prompt, sizeof(system_prompt) - 1);
-        system_prompt[sizeof(system_prompt) - 1] = '\0';
-      } else {
-        snprintf(system_prompt, sizeof(system_prompt),
-          "You are an AI agent that can use tools to accomplish tasks.\n\n"
-          "%s\n"
-          "User goal: %s\n\n"
-          "To use a tool, respond with EXACTLY this format:\n"
-          "TOOL_CALL: tool_name\n"
-          "ARGS: {\"param1\": \"value1\", \"param2\": \"value2\"}\n\n"
-          "After the tool executes, you'll see the result and can call another tool or provide a final answer.\n"
-          "Type DONE only when you have completed the task.",
-          tools_list, goal);
-      }
-
-      DF("System prompt (length=%zu):\n%s", strlen(system_prompt), system_prompt);
+  // Strings, numbers and nested objects or arrays are stored as their text
+  sqlite3_bind_text(stmt, idx, value, len, SQLITE_STATIC);
+}
 
-      rc = sqlite3_prepare_v2(db, "SELECT llm_chat_respond(?)", -1, &stmt, 0);
-      if (rc != SQLITE_OK) {
-        D("ERROR: Failed to prepare LLM query");
-        free(tools_list);
-        sqlite3_result_error(context, "Failed to prepare LLM query", -1);
-        return;
-      }
+// Appends text[0..len) as a JSON string
+static void agent_json_append_string(sqlite3_str *out, const char *text, int len) {
+  sqlite3_str_appendchar(out, 1, '"');
+  int plain = 0;
+  for (int i = 0; i < len; i++) {
+    unsigned char c = (unsigned char)text[i];
+    if (c >= 0x20 && c != '"' && c != '\\') continue;
+    sqlite3_str_append(out, text + plain, i - plain);
+    plain = i + 1;
+    switch (c) {
+      case '"': sqlite3_str_appendall(out, "\\\""); break;
+      case '\\': sqlite3_str_appendall(out, "\\\\"); break;
+      case '\n': sqlite3_str_appendall(out, "\\n"); break;
+      case '\r': sqlite3_str_appendall(out, "\\r"); break;
+      case '\t': sqlite3_str_appendall(out, "\\t"); break;
+      default: sqlite3_str_appendf(out, "\\u%04x", c); break;
+    }
+  }
+  sqlite3_str_append(out, text + plain, len - plain);
+  sqlite3_str_appendchar(out, 1, '"');
+}
 
-      sqlite3_bind_text(stmt, 1, system_prompt, -1, SQLITE_TRANSIENT);
+// MARK: - Run state
+
+// A tool call requested by the model
+typedef struct {
+  char name[256];
+  char *args;
+  char *result;   // joined text rows, NULL when the call failed
+  int done;       // the call was attempted
+  int cached;     // the result came from the tool result cache
+  int prefetched; // the result came from a call started while the reply was streamed
+  int replayed;   // the result came from agent_steps of the resumed run
+  int local;      // the tool is a statement of agent_tools, run on the agent_run connection
+  double ms;      // time spent in mcp_call_tool_respond or the local statement
+} agent_tool_call;
+
+typedef struct agent_prefetch agent_prefetch;
+static void agent_prefetch_free(agent_prefetch *prefetch);
+
+// What the iterations of a run brought so far, for agent_policy_step()
+typedef struct {
+  sqlite3_uint64 *seen;    // hashes of the calls made (tool and canonical args) and of their results
+  int seen_count;
+  int seen_alloc;
+  char *filled;            // table mode: per column, some tool result had a value for it
+  int filled_count;
+  int rows;                // rows stored at the last step
+  int stalled;             // consecutive iterations without new results, columns or rows
+} agent_policy;
+
+// Buffers of one agent_run call. They grow to whatever the prompts and tool
+// results need and are released together when the call returns, whichever
+// path it takes.
+typedef struct {
+  char *preamble;        // static part of the first prompt (tool catalog and rules)
+  char *message;         // next message for llm_chat_respond
+  char *response;        // copy of the last model response
+  char *result;          // text mode: final answer or last tool result
+  char *extracted;       // table mode: extraction response
+  char *grammar;         // table mode: GBNF of the extraction answer
+  sqlite3_str *history;  // table mode: tool results collected for extraction, or the calls made when streaming
+  sqlite3_stmt *insert;  // table mode: INSERT of the extracted rows, owned by the table descriptor
+  sqlite3_int64 *rowids;   // table mode: rows stored by this run, for their embeddings
+  int rowid_count;
+  int rowid_alloc;
+  agent_tool_call *calls;  // tool calls of the last response
+  int call_count;
+  int table_mode;
+  int rows;                // table mode: rows stored
+  agent_prefetch *prefetch;  // calls started while the last reply was streamed
+  sqlite3_int64 checkpoint_id;  // agent_runs row of the run, 0 when it is not recorded
+  int checkpoint_step;     // agent_steps recorded for the run
+  int resumed;             // started by agent_resume(): tool calls already made are replayed
+  int start_iteration;     // agent_resume(): iterations completed before
+  char *saved_history;     // agent_resume(): history of the last checkpoint
+  char *tools;             // tool_top_k: tools listed in the prompt, NULL for the whole catalog
+  char **pending;          // text mode: later pages of compacted results, one message each
+  int pending_count;
+  int pending_next;        // first page not sent yet
+  int pending_alloc;
+  int finished;            // the call returned its result
+  agent_options options;   // connection options with the overrides of this call
+  agent_policy policy;
+} agent_run_state;
+
+static void agent_run_set(char **slot, char *value) {
+  sqlite3_free(*slot);
+  *slot = value;
+}
 
-      if (sqlite3_step(stmt) != SQLITE_ROW) {
-        sqlite3_finalize(stmt);
-        D("ERROR: LLM did not respond");
-        free(tools_list);
-        sqlite3_result_error(context, "LLM did not respond", -1);
-        return;
-      }
+static int agent_run_add_rowid(agent_run_state *run, sqlite3_int64 rowid) {
+  if (run->rowid_count == run->rowid_alloc) {
+    int alloc = run->rowid_alloc ? run->rowid_alloc * 2 : 64;
+    sqlite3_int64 *rowids = sqlite3_realloc64(run->rowids, alloc * sizeof(sqlite3_int64));
+    if (!rowids) return SQLITE_NOMEM;
+    run->rowids = rowids;
+    run->rowid_alloc = alloc;
+  }
+  run->rowids[run->rowid_count++] = rowid;
+  return SQLITE_OK;
+}
 
-      const char *llm_response = (const char*)sqlite3_column_text(stmt, 0);
-      if (!llm_response) {
-        D("WARNING: LLM returned NULL response, ending loop");
-        sqlite3_finalize(stmt);
-        break;
-      }
+// Queues text, a message owned by the run, behind the pages not sent yet
+static int agent_run_add_pending(agent_run_state *run, char *text) {
+  if (!text) return SQLITE_NOMEM;
+  if (run->pending_count == run->pending_alloc) {
+    int alloc = run->pending_alloc ? run->pending_alloc * 2 : 8;
+    char **pending = sqlite3_realloc64(run->pending, alloc * sizeof(char*));
+    if (!pending) {
+      sqlite3_free(text);
+      return SQLITE_NOMEM;
+    }
+    run->pending = pending;
+    run->pending_alloc = alloc;
+  }
+  run->pending[run->pending_count++] = text;
+  return SQLITE_OK;
+}
 
-      DF("LLM Response (length=%zu):\n%s", strlen(llm_response), llm_response);
+static void agent_run_clear_calls(agent_run_state *run) {
+  for (int i = 0; i < run->call_count; i++) {
+    sqlite3_free(run->calls[i].args);
+    sqlite3_free(run->calls[i].result);
+  }
+  run->call_count = 0;
+}
 
-      if (strstr(llm_response, "DONE") != NULL) {
-        D("Agent said DONE - ending loop");
-        strncpy(final_result, llm_response, sizeof(final_result) - 1);
-        sqlite3_finalize(stmt);
-        break;
-      }
+// Appends a call and returns it, NULL when the response already has
+// AGENT_MAX_TOOL_CALLS calls or memory is exhausted
+static agent_tool_call* agent_run_add_call(agent_run_state *run) {
+  if (!run->calls) {
+    run->calls = sqlite3_malloc64(AGENT_MAX_TOOL_CALLS * sizeof(agent_tool_call));
+    if (!run->calls) return NULL;
+  }
+  if (run->call_count == AGENT_MAX_TOOL_CALLS) return NULL;
+  agent_tool_call *call = &run->calls[run->call_count++];
+  memset(call, 0, sizeof(*call));
+  return call;
+}
 
-      const char *tool_call_marker = strstr(llm_response, "TOOL_CALL:");
-      const char *args_marker = strstr(llm_response, "ARGS:");
+static int agent_options_copy(agent_options *dst, const agent_options *src);
+static void agent_options_free(agent_options *options);
+
+static void agent_run_state_free(agent_run_state *run) {
+  agent_run_clear_calls(run);
+  sqlite3_free(run->calls);
+  sqlite3_free(run->preamble);
+  sqlite3_free(run->message);
+  sqlite3_free(run->response);
+  sqlite3_free(run->result);
+  sqlite3_free(run->extracted);
+  sqlite3_free(run->grammar);
+  sqlite3_free(sqlite3_str_finish(run->history));
+  sqlite3_free(run->rowids);
+  sqlite3_free(run->saved_history);
+  sqlite3_free(run->tools);
+  for (int i = 0; i < run->pending_count; i++) sqlite3_free(run->pending[i]);
+  sqlite3_free(run->pending);
+  agent_prefetch_free(run->prefetch);
+  sqlite3_free(run->policy.seen);
+  sqlite3_free(run->policy.filled);
+  agent_options_free(&run->options);
+  memset(run, 0, sizeof(*run));
+}
 
-      if (!tool_call_marker) {
-        D("No TOOL_CALL marker - treating as final answer");
-        strncpy(final_result, llm_response, sizeof(final_result) - 1);
-        sqlite3_finalize(stmt);
-        break;
-      }
+// Hot statements are prepared once and reset between uses. They only live for
+// the duration of an agent_run call: a statement left unfinalized would make
+// sqlite3_close() fail with SQLITE_BUSY before the function destructor runs.
+static sqlite3_stmt* agent_stmt_acquire(sqlite3 *db, agent_connection *conn, agent_stmt_id id) {
+  if (!conn->stmts[id]) {
+    int rc = sqlite3_prepare_v3(db, agent_stmt_sql[id], -1, SQLITE_PREPARE_PERSISTENT,
+                                &conn->stmts[id], NULL);
+    if (rc != SQLITE_OK) {
+      DF("Failed to prepare '%s': %s", agent_stmt_sql[id], sqlite3_errmsg(db));
+      conn->stmts[id] = NULL;
+      return NULL;
+    }
+  }
+  return conn->stmts[id];
+}
 
-      if (!args_marker) {
-        D("WARNING: Found TOOL_CALL but missing ARGS - defaulting to empty args");
-      }
+static void agent_stmt_release(sqlite3_stmt *stmt) {
+  if (!stmt) return;
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+}
 
-      tool_call_marker += 10;
-      while (*tool_call_marker == ' ' || *tool_call_marker == '\n') tool_call_marker++;
-      const char *tool_end = strchr(tool_call_marker, '\n');
-      if (!tool_end) tool_end = tool_call_marker + strlen(tool_call_marker);
+static void agent_stmt_cache_clear(agent_connection *conn) {
+  for (int i = 0; i < AGENT_STMT_COUNT; i++) {
+    sqlite3_finalize(conn->stmts[i]);
+    conn->stmts[i] = NULL;
+  }
+  // Extensions may be loaded between calls, so the tokenizer is probed again
+  conn->no_tokenizer = 0;
+  conn->no_grammar = 0;
+  conn->no_stream = 0;
+  for (agent_table *table = conn->tables; table; table = table->next) {
+    sqlite3_finalize(table->insert);
+    table->insert = NULL;
+  }
+}
 
-      char tool_name_buf[256] = {0};
-      int tool_name_len = tool_end - tool_call_marker;
-      if (tool_name_len > 255) tool_name_len = 255;
-      strncpy(tool_name_buf, tool_call_marker, tool_name_len);
+static int agent_stmt_query_int(sqlite3 *db, agent_connection *conn, agent_stmt_id id, int *value) {
+  sqlite3_stmt *stmt = agent_stmt_acquire(db, conn, id);
+  if (!stmt) return SQLITE_ERROR;
 
-      char *p = tool_name_buf + strlen(tool_name_buf) - 1;
-      while (p > tool_name_buf && (*p == ' ' || *p == '\n' || *p == '\r')) {
-        *p = '\0';
-        p--;
-      }
+  int rc = sqlite3_step(stmt);
+  if (rc == SQLITE_ROW) {
+    *value = sqlite3_column_int(stmt, 0);
+    rc = SQLITE_OK;
+  }
+  agent_stmt_release(stmt);
+  return rc;
+}
 
-      char tool_args[2048] = {0};
-      if (args_marker) {
-        args_marker += 5;
-        while (*args_marker == ' ' || *args_marker == '\n') args_marker++;
-
-        const char *args_start = strchr(args_marker, '{');
-        if (args_start) {
-          int brace_count = 1;
-          const char *p = args_start + 1;
-          while (*p && brace_count > 0) {
-            if (*p == '{') brace_count++;
-            else if (*p == '}') brace_count--;
-            if (brace_count > 0) p++;
-          }
-          if (brace_count == 0) {
-            size_t len = p - args_start + 1;
-            if (len < sizeof(tool_args)) {
-              strncpy(tool_args, args_start, len);
-              tool_args[len] = '\0';
-            }
-          }
-        } else {
-          const char *newline = strchr(args_marker, '\n');
-          size_t len = newline ? (newline - args_marker) : strlen(args_marker);
-          if (len >= sizeof(tool_args)) len = sizeof(tool_args) - 1;
-          strncpy(tool_args, args_marker, len);
-          tool_args[len] = '\0';
-        }
-      } else {
-        strcpy(tool_args, "{}");
-      }
+// The writes of one step go in a savepoint: it nests in a transaction of the
+// caller, whose work is left alone and whose COMMIT or ROLLBACK decides for
+// the rows too, and outside one it is a transaction of its own.
+static int agent_savepoint_begin(sqlite3 *db) {
+  return sqlite3_exec(db, "SAVEPOINT agent_write", 0, 0, 0);
+}
 
-      DF("Extracted tool: '%s' args: '%s'", tool_name_buf, tool_args);
+// Releases the savepoint, after rolling its writes back unless ok. Returns
+// the result of the release, which commits when the savepoint is outermost.
+static int agent_savepoint_end(sqlite3 *db, int ok) {
+  int rc = ok ? sqlite3_exec(db, "RELEASE agent_write", 0, 0, 0) : SQLITE_ERROR;
+  if (rc != SQLITE_OK) {
+    sqlite3_exec(db, "ROLLBACK TO agent_write", 0, 0, 0);
+    sqlite3_exec(db, "RELEASE agent_write", 0, 0, 0);
+  }
+  return ok ? rc : SQLITE_OK;
+}
 
-      sqlite3_finalize(stmt);
+// Runs a prepared mcp_call_tool_respond() statement and returns its text rows
+// joined by newlines, to be released with sqlite3_free. NULL when the tool
+// returned no rows.
+static char* agent_tool_result(sqlite3 *db, sqlite3_stmt *stmt, const char *tool_name, const char *tool_args) {
+  sqlite3_bind_text(stmt, 1, tool_name, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 2, tool_args, -1, SQLITE_STATIC);
 
-      char *tool_result = agent_call_mcp_tool(db, tool_name_buf, tool_args);
-      if (!tool_result) {
-        DF("ERROR: Failed to execute tool '%s'", tool_name_buf);
-        snprintf(final_result, sizeof(final_result),
-                "{\"error\": \"Failed to execute tool %s\"}", tool_name_buf);
-        break;
-      }
+  // Collect all text results from the virtual table
+  sqlite3_str *result = sqlite3_str_new(db);
+  int has_results = 0;
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
+    const char *text = (const char*)sqlite3_column_text(stmt, 0);
+    if (text) {
+      if (has_results) sqlite3_str_appendchar(result, 1, '\n');
+      sqlite3_str_append(result, text, sqlite3_column_bytes(stmt, 0));
+      has_results = 1;
+    }
+  }
+  
+  agent_stmt_release(stmt);
+  
+  char *result_text = sqlite3_str_finish(result);
+  if (!has_results) {
+    sqlite3_free(result_text);
+    return NULL;
+  }
+  
+  // Empty results finish as NULL
+  return result_text ? result_text : sqlite3_mprintf("%s", "");
+}
 
-      DF("Tool result (length=%zu): %.500s%s",
-         strlen(tool_result),
-         tool_result,
-         strlen(tool_result) > 500 ? "..." : "");
+static char* agent_call_mcp_tool(sqlite3 *db, agent_connection *conn, const char *tool_name, const char *tool_args) {
+  sqlite3_stmt *stmt = agent_stmt_acquire(db, conn, AGENT_STMT_CALL_TOOL);
+  if (!stmt) {
+    DF("Failed to prepare mcp_call_tool_respond(): %s", sqlite3_errmsg(db));
+    return NULL;
+  }
+  return agent_tool_result(db, stmt, tool_name, tool_args);
+}
 
-      strncpy(final_result, tool_result, sizeof(final_result) - 1);
-      free(tool_result);
+// MARK: - Local tools
+
+// Tools registered with agent_register_tool() are rows of agent_tools in the
+// main database. They are listed with the MCP tools, a local tool hiding an
+// MCP tool of the same name, and run on the agent_run connection as prepared
+// statements: each named parameter (:name, @name or $name) is bound to the
+// argument of that name, other parameters to the whole arguments object.
+// Rows come back as a JSON array of objects, in the result format of the MCP tools.
+
+static const char agent_local_tools_schema[] =
+  "CREATE TABLE IF NOT EXISTS agent_tools ("
+  "name TEXT PRIMARY KEY, description TEXT, inputschema TEXT, sql TEXT NOT NULL, created_at INTEGER)";
+
+// Binds the parameters of a local tool statement from the JSON arguments.
+// Returns 0 when args is not a JSON object.
+static int agent_local_tool_bind(sqlite3_stmt *stmt, const char *args) {
+  agent_json_parser parser;
+  agent_json_init(&parser);
+  int len = (int)strlen(args);
+  if (agent_json_parse(&parser, args, len) != AGENT_JSON_COMPLETE ||
+      parser.tokens[parser.root].type != AGENT_JSON_OBJECT) {
+    agent_json_free(&parser);
+    return 0;
+  }
 
-      if (strstr(final_result, "\"error\"")) {
-        D("Tool returned error, continuing to next iteration");
-        continue;
+  int count = sqlite3_bind_parameter_count(stmt);
+  for (int i = 1; i <= count; i++) {
+    const char *name = sqlite3_bind_parameter_name(stmt, i);
+    if (!name || name[0] == '?') {
+      sqlite3_bind_text(stmt, i, args, len, SQLITE_STATIC);
+      continue;
+    }
+    int value = agent_json_object_get(&parser, args, parser.root, name + 1);
+    if (value < 0) continue;  // left NULL
+    const agent_json_token *token = &parser.tokens[value];
+    int affinity = AGENT_AFFINITY_NUMERIC;
+    if (token->type == AGENT_JSON_PRIMITIVE && (isdigit((unsigned char)args[token->start]) || args[token->start] == '-')) {
+      affinity = AGENT_AFFINITY_INTEGER;
+      for (int k = token->start; k < token->end; k++) {
+        if (args[k] == '.' || args[k] == 'e' || args[k] == 'E') affinity = AGENT_AFFINITY_REAL;
       }
     }
-
-    free(tools_list);
-
-    sqlite3_result_text(context, final_result, -1, SQLITE_TRANSIENT);
-    return;
+    agent_json_bind(stmt, i, args, token, affinity);
   }
+  agent_json_free(&parser);
+  return 1;
+}
 
-  D("MODE 2: Table Extraction Mode");
-  char schema_query[512];
-  snprintf(schema_query, sizeof(schema_query), "PRAGMA table_info(%s)", table_name);
+// Replaces out with an error result saying message
+static void agent_local_tool_error(sqlite3_str *out, const char *message) {
+  sqlite3_str_reset(out);
+  sqlite3_str_appendall(out, "{\"isError\":true,\"error\":");
+  agent_json_append_string(out, message, (int)strlen(message));
+  sqlite3_str_appendchar(out, 1, '}');
+}
 
-  sqlite3_stmt *stmt;
-  int rc = sqlite3_prepare_v2(db, schema_query, -1, &stmt, 0);
-  if (rc != SQLITE_OK) {
-    sqlite3_result_error(context, "Failed to query table schema", -1);
-    return;
+// Runs the statement of a local tool, a statement writing to the database only
+// when writes is set. Failures are reported in the result, as the MCP tools
+// report theirs, so that the model can correct its call. Past
+// AGENT_LOCAL_TOOL_MAX_ROWS the rows are given as {"rows":[...],"truncated":true}.
+static char* agent_call_local_tool(sqlite3 *db, const char *sql, const char *tool_args, int writes) {
+  sqlite3_str *out = sqlite3_str_new(db);
+  sqlite3_stmt *stmt = NULL;
+  if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+    agent_local_tool_error(out, sqlite3_errmsg(db));
+    return sqlite3_str_finish(out);
+  }
+  if (!writes && !sqlite3_stmt_readonly(stmt)) {
+    sqlite3_finalize(stmt);
+    agent_local_tool_error(out, "the tool writes to the database and the tool_writes option is off");
+    return sqlite3_str_finish(out);
+  }
+  if (!agent_local_tool_bind(stmt, tool_args)) {
+    sqlite3_finalize(stmt);
+    agent_local_tool_error(out, "arguments must be a JSON object");
+    return sqlite3_str_finish(out);
   }
 
-  char schema_desc[4096] = "Table columns:\n";
-  char column_names[256][64];
-  char column_types[256][16];
-  int column_count = 0;
-  int embedding_col_indices[32];
-  int embedding_col_count = 0;
+  int columns = sqlite3_column_count(stmt);
+  int rows = 0;
+  int truncated = 0;
+  int rc;
+  sqlite3_str_appendchar(out, 1, '[');
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    // One row past the limit tells the model that more were left out
+    if (rows == AGENT_LOCAL_TOOL_MAX_ROWS) {
+      truncated = 1;
+      break;
+    }
+    if (rows++ > 0) sqlite3_str_appendchar(out, 1, ',');
+    sqlite3_str_appendchar(out, 1, '{');
+    for (int c = 0; c < columns; c++) {
+      const char *name = sqlite3_column_name(stmt, c);
+      if (c > 0) sqlite3_str_appendchar(out, 1, ',');
+      agent_json_append_string(out, name ? name : "", name ? (int)strlen(name) : 0);
+      sqlite3_str_appendchar(out, 1, ':');
+      int type = sqlite3_column_type(stmt, c);
+      int subtype = sqlite3_value_subtype(sqlite3_column_value(stmt, c));
+      const char *text = type == SQLITE_BLOB ? NULL : (const char*)sqlite3_column_text(stmt, c);
+      int bytes = sqlite3_column_bytes(stmt, c);
+      switch (type) {
+        case SQLITE_NULL: sqlite3_str_appendall(out, "null"); break;
+        case SQLITE_INTEGER:
+        case SQLITE_FLOAT: sqlite3_str_append(out, text, bytes); break;
+        case SQLITE_BLOB: {
+          const unsigned char *blob = (const unsigned char*)sqlite3_column_blob(stmt, c);
+          sqlite3_str_appendchar(out, 1, '"');
+          for (int k = 0; k < bytes; k++) sqlite3_str_appendf(out, "%02x", blob[k]);
+          sqlite3_str_appendchar(out, 1, '"');
+          break;
+        }
+        default:
+          // Values of the JSON functions are nested as they are
+          if (subtype == 'J') sqlite3_str_append(out, text, bytes);
+          else agent_json_append_string(out, text, bytes);
+          break;
+      }
+    }
+    sqlite3_str_appendchar(out, 1, '}');
+  }
+  sqlite3_str_appendchar(out, 1, ']');
+  if (!truncated && rc != SQLITE_DONE) agent_local_tool_error(out, sqlite3_errmsg(db));
+  sqlite3_finalize(stmt);
+  char *result = sqlite3_str_finish(out);
+  if (!truncated || !result) return result;
+  char *wrapped = sqlite3_mprintf("{\"rows\":%s,\"truncated\":true}", result);
+  sqlite3_free(result);
+  return wrapped;
+}
+
+// MARK: - Trace
+
+#define AGENT_TRACE_MAX_EVENTS 4096  // events kept per connection, the oldest are dropped first
+
+// Monotonic clock in milliseconds, for durations
+static double agent_clock_ms(void) {
+#ifdef _WIN32
+  LARGE_INTEGER frequency, counter;
+  QueryPerformanceFrequency(&frequency);
+  QueryPerformanceCounter(&counter);
+  return (double)counter.QuadPart * 1000.0 / (double)frequency.QuadPart;
+#else
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)now.tv_sec * 1000.0 + (double)now.tv_nsec / 1e6;
+#endif
+}
+
+static void agent_trace_event_free(sqlite3_agent_trace_event *event) {
+  sqlite3_free((char*)event->name);
+  sqlite3_free((char*)event->detail);
+}
+
+static void agent_trace_clear(agent_trace *trace) {
+  for (int i = 0; i < trace->count; i++) agent_trace_event_free(&trace->events[i]);
+  sqlite3_free(trace->events);
+  trace->events = NULL;
+  trace->count = 0;
+  trace->capacity = 0;
+}
+
+// Starts the events of a new agent_run call, dropping the runs beyond the
+// trace option
+static void agent_trace_begin(agent_connection *conn) {
+  agent_trace *trace = &conn->trace;
+  trace->run_id = ++trace->runs;
+  trace->step = 0;
+  trace->iteration = 0;
+  trace->active = conn->run_options->trace > 0 || trace->hook != NULL;
+
+  int keep = 0;
+  while (keep < trace->count && trace->events[keep].run_id <= trace->run_id - conn->run_options->trace) keep++;
+  for (int i = 0; i < keep; i++) agent_trace_event_free(&trace->events[i]);
+  if (keep > 0) {
+    trace->count -= keep;
+    memmove(trace->events, trace->events + keep, trace->count * sizeof(sqlite3_agent_trace_event));
+  }
+}
+
+static void agent_trace_add(agent_connection *conn, const char *kind, const char *name, double duration_ms,
+                            int tokens_in, int tokens_out, sqlite3_int64 bytes, sqlite3_int64 rows,
+                            const char *detail) {
+  agent_trace *trace = &conn->trace;
+  if (!trace->active) return;
+
+  sqlite3_agent_trace_event event = {
+    trace->run_id, ++trace->step, trace->iteration, kind, name, duration_ms,
+    tokens_in, tokens_out, bytes, rows, detail, (sqlite3_int64)time(NULL)
+  };
+  if (trace->hook) trace->hook(trace->hook_arg, &event);
+  if (conn->run_options->trace <= 0) return;
+
+  if (trace->count == AGENT_TRACE_MAX_EVENTS) {
+    agent_trace_event_free(&trace->events[0]);
+    trace->count--;
+    memmove(trace->events, trace->events + 1, trace->count * sizeof(sqlite3_agent_trace_event));
+  }
+  if (trace->count == trace->capacity) {
+    int capacity = trace->capacity ? trace->capacity * 2 : 64;
+    sqlite3_agent_trace_event *events = sqlite3_realloc64(trace->events, capacity * sizeof(sqlite3_agent_trace_event));
+    if (!events) return;
+    trace->events = events;
+    trace->capacity = capacity;
+  }
+  event.name = name ? sqlite3_mprintf("%s", name) : NULL;
+  event.detail = detail ? sqlite3_mprintf("%s", detail) : NULL;
+  trace->events[trace->count++] = event;
+}
+
+// MARK: - Stats
+
+// Latency histograms, one per trace kind and name ("llm:chat", "tool:search",
+// "insert:listings"), read with agent_stats(). Each connection counts its
+// steps in its own set under its own mutex, so runs on different connections
+// never wait on each other; agent_stats() merges the sets of the process.
+// Buckets are log-linear over microseconds like HDR histograms: 16 linear
+// buckets per power of two keep every percentile within 1/16 of its value,
+// from 1 us to 2^40 us, in 640 counters.
+
+#define AGENT_STATS_SUB_BITS 4
+#define AGENT_STATS_SUB_BUCKETS (1 << AGENT_STATS_SUB_BITS)
+#define AGENT_STATS_BUCKETS (40 * AGENT_STATS_SUB_BUCKETS)
+
+typedef struct agent_histogram agent_histogram;
+struct agent_histogram {
+  char *key;
+  sqlite3_uint64 count;
+  double sum_ms;
+  double min_ms;
+  double max_ms;
+  unsigned int buckets[AGENT_STATS_BUCKETS];
+  agent_histogram *next;    // in key order
+};
+
+struct agent_stats_set {
+  agent_histogram *histograms;
+  sqlite3_mutex *mutex;     // guards histograms, the step counts run under it alone
+  agent_stats_set *next;
+};
+
+// Sets of the open connections, and the shared set that keeps the steps of
+// closed connections and of callers without one. All guarded by
+// SQLITE_MUTEX_STATIC_APP2, taken before the mutex of a set. The shared set
+// is freed with the last connection.
+static agent_stats_set *agent_stats_sets;
+static agent_histogram *agent_stats_shared;
+
+static int agent_stats_bucket(double ms) {
+  sqlite3_uint64 us = ms > 0 ? (sqlite3_uint64)(ms * 1000.0) : 0;
+  if (us < AGENT_STATS_SUB_BUCKETS) return (int)us;
+  int msb = AGENT_STATS_SUB_BITS;
+  while (msb < 63 && (us >> (msb + 1))) msb++;
+  int bucket = (msb - AGENT_STATS_SUB_BITS + 1) * AGENT_STATS_SUB_BUCKETS +
+               (int)((us >> (msb - AGENT_STATS_SUB_BITS)) & (AGENT_STATS_SUB_BUCKETS - 1));
+  return bucket < AGENT_STATS_BUCKETS ? bucket : AGENT_STATS_BUCKETS - 1;
+}
+
+// Middle of a bucket, in milliseconds
+static double agent_stats_bucket_ms(int bucket) {
+  if (bucket < AGENT_STATS_SUB_BUCKETS) return bucket / 1000.0;
+  int shift = bucket / AGENT_STATS_SUB_BUCKETS - 1;
+  sqlite3_uint64 low = (sqlite3_uint64)(AGENT_STATS_SUB_BUCKETS + bucket % AGENT_STATS_SUB_BUCKETS) << shift;
+  return (low + ((sqlite3_uint64)1 << shift) / 2.0) / 1000.0;
+}
+
+// Histogram of key in the list, added in key order when missing, NULL when
+// out of memory
+static agent_histogram *agent_stats_find(agent_histogram **list, const char *key) {
+  agent_histogram **slot = list;
+  int cmp = 1;
+  while (*slot && (cmp = strcmp((*slot)->key, key)) < 0) slot = &(*slot)->next;
+  if (*slot && cmp == 0) return *slot;
+
+  agent_histogram *histogram = sqlite3_malloc(sizeof(agent_histogram));
+  if (histogram) memset(histogram, 0, sizeof(*histogram));
+  if (!histogram || !(histogram->key = sqlite3_mprintf("%s", key))) {
+    sqlite3_free(histogram);
+    return NULL;
+  }
+  histogram->next = *slot;
+  *slot = histogram;
+  return histogram;
+}
+
+// Adds the steps of every histogram of from into the list
+static void agent_stats_merge(agent_histogram **list, const agent_histogram *from) {
+  for (; from; from = from->next) {
+    if (from->count == 0) continue;
+    agent_histogram *histogram = agent_stats_find(list, from->key);
+    if (!histogram) continue;
+    if (histogram->count == 0 || from->min_ms < histogram->min_ms) histogram->min_ms = from->min_ms;
+    if (histogram->count == 0 || from->max_ms > histogram->max_ms) histogram->max_ms = from->max_ms;
+    histogram->count += from->count;
+    histogram->sum_ms += from->sum_ms;
+    for (int b = 0; b < AGENT_STATS_BUCKETS; b++) histogram->buckets[b] += from->buckets[b];
+  }
+}
+
+// Frees the list, returns how many histograms it held
+static int agent_stats_free(agent_histogram *histograms) {
+  int count = 0;
+  while (histograms) {
+    agent_histogram *histogram = histograms;
+    histograms = histogram->next;
+    sqlite3_free(histogram->key);
+    sqlite3_free(histogram);
+    count++;
+  }
+  return count;
+}
+
+// Registers the set of a new connection, NULL when out of memory: its steps
+// then go to the shared set
+static agent_stats_set *agent_stats_open(void) {
+  agent_stats_set *set = sqlite3_malloc(sizeof(agent_stats_set));
+  if (!set) return NULL;
+  memset(set, 0, sizeof(*set));
+  set->mutex = sqlite3_mutex_alloc(SQLITE_MUTEX_FAST);
+  if (!set->mutex) {
+    sqlite3_free(set);
+    return NULL;
+  }
+  sqlite3_mutex *mutex = sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_APP2);
+  sqlite3_mutex_enter(mutex);
+  set->next = agent_stats_sets;
+  agent_stats_sets = set;
+  sqlite3_mutex_leave(mutex);
+  return set;
+}
+
+// Moves the steps of a closing connection into the shared set, which goes
+// away with the last connection
+static void agent_stats_close(agent_stats_set *set) {
+  agent_histogram *dropped = NULL;
+  sqlite3_mutex *mutex = sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_APP2);
+  sqlite3_mutex_enter(mutex);
+  if (set) {
+    agent_stats_set **slot = &agent_stats_sets;
+    while (*slot && *slot != set) slot = &(*slot)->next;
+    if (*slot) *slot = set->next;
+    agent_stats_merge(&agent_stats_shared, set->histograms);
+  }
+  if (!agent_stats_sets) {
+    dropped = agent_stats_shared;
+    agent_stats_shared = NULL;
+  }
+  sqlite3_mutex_leave(mutex);
+
+  agent_stats_free(dropped);
+  if (!set) return;
+  agent_stats_free(set->histograms);
+  sqlite3_mutex_free(set->mutex);
+  sqlite3_free(set);
+}
+
+// Counts a step of ms milliseconds under "kind:name", or kind without a name,
+// in the set of conn
+static void agent_stats_add(agent_connection *conn, const char *kind, const char *name, double ms) {
+  char key[320];
+  if (name) snprintf(key, sizeof(key), "%s:%s", kind, name);
+  else snprintf(key, sizeof(key), "%s", kind);
+
+  agent_stats_set *set = conn ? conn->stats : NULL;
+  sqlite3_mutex *mutex = set ? set->mutex : sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_APP2);
+  sqlite3_mutex_enter(mutex);
+  agent_histogram *histogram = agent_stats_find(set ? &set->histograms : &agent_stats_shared, key);
+  if (histogram) {
+    if (histogram->count == 0 || ms < histogram->min_ms) histogram->min_ms = ms;
+    if (histogram->count == 0 || ms > histogram->max_ms) histogram->max_ms = ms;
+    histogram->count++;
+    histogram->sum_ms += ms;
+    histogram->buckets[agent_stats_bucket(ms)]++;
+  }
+  sqlite3_mutex_leave(mutex);
+}
+
+// Value under which a fraction q of the steps of histogram took
+static double agent_stats_percentile(const agent_histogram *histogram, double q) {
+  sqlite3_uint64 rank = (sqlite3_uint64)(q * histogram->count + 0.999999);
+  if (rank < 1) rank = 1;
+  sqlite3_uint64 seen = 0;
+  for (int b = 0; b < AGENT_STATS_BUCKETS; b++) {
+    seen += histogram->buckets[b];
+    if (seen < rank) continue;
+    double ms = agent_stats_bucket_ms(b);
+    if (ms < histogram->min_ms) ms = histogram->min_ms;
+    if (ms > histogram->max_ms) ms = histogram->max_ms;
+    return ms;
+  }
+  return histogram->max_ms;
+}
+
+// agent_stats(): the histograms of every connection as a JSON object of
+// {"count", "mean_ms", "min_ms", "p50_ms", "p90_ms", "p99_ms", "max_ms"} by key
+static void agent_stats_func(
+  sqlite3_context *context,
+  int argc,
+  sqlite3_value **argv
+){
+  agent_histogram *histograms = NULL;
+  sqlite3_mutex *mutex = sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_APP2);
+  sqlite3_mutex_enter(mutex);
+  agent_stats_merge(&histograms, agent_stats_shared);
+  for (agent_stats_set *set = agent_stats_sets; set; set = set->next) {
+    sqlite3_mutex_enter(set->mutex);
+    agent_stats_merge(&histograms, set->histograms);
+    sqlite3_mutex_leave(set->mutex);
+  }
+  sqlite3_mutex_leave(mutex);
+
+  sqlite3_str *out = sqlite3_str_new(sqlite3_context_db_handle(context));
+  sqlite3_str_appendchar(out, 1, '{');
+  for (agent_histogram *h = histograms; h; h = h->next) {
+    if (h != histograms) sqlite3_str_appendchar(out, 1, ',');
+    agent_json_append_string(out, h->key, (int)strlen(h->key));
+    sqlite3_str_appendf(out, ":{\"count\":%llu,\"mean_ms\":%.3f,\"min_ms\":%.3f,\"p50_ms\":%.3f,"
+                             "\"p90_ms\":%.3f,\"p99_ms\":%.3f,\"max_ms\":%.3f}",
+                        (unsigned long long)h->count, h->sum_ms / h->count, h->min_ms,
+                        agent_stats_percentile(h, 0.5), agent_stats_percentile(h, 0.9),
+                        agent_stats_percentile(h, 0.99), h->max_ms);
+  }
+  sqlite3_str_appendchar(out, 1, '}');
+  agent_stats_free(histograms);
+
+  char *json = sqlite3_str_finish(out);
+  if (!json) {
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+  sqlite3_result_text(context, json, -1, sqlite3_free);
+  sqlite3_result_subtype(context, 'J');
+}
+
+// agent_stats_reset(): drops every histogram, returns how many keys there were
+static void agent_stats_reset_func(
+  sqlite3_context *context,
+  int argc,
+  sqlite3_value **argv
+){
+  agent_histogram *histograms = NULL;
+  sqlite3_mutex *mutex = sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_APP2);
+  sqlite3_mutex_enter(mutex);
+  agent_histogram *dropped = agent_stats_shared;
+  agent_stats_shared = NULL;
+  agent_stats_merge(&histograms, dropped);
+  agent_stats_free(dropped);
+  for (agent_stats_set *set = agent_stats_sets; set; set = set->next) {
+    sqlite3_mutex_enter(set->mutex);
+    dropped = set->histograms;
+    set->histograms = NULL;
+    sqlite3_mutex_leave(set->mutex);
+    agent_stats_merge(&histograms, dropped);
+    agent_stats_free(dropped);
+  }
+  sqlite3_mutex_leave(mutex);
+  sqlite3_result_int(context, agent_stats_free(histograms));
+}
 
-  while (sqlite3_step(stmt) == SQLITE_ROW && column_count < 256) {
-    const char *col_name = (const char*)sqlite3_column_text(stmt, 1);
-    const char *col_type = (const char*)sqlite3_column_text(stmt, 2);
+// MARK: - Packed storage
+
+// Compact format of the tool results and histories the extension keeps, in
+// memory and in its tables: a format byte, the text length as a varint, then
+// the text as it is, or LZ77 compressed as sequences of literals and matches
+// (a token with both lengths in nibbles, extended by 255 bytes, the literals,
+// a 16-bit offset). Tool results are repetitive JSON and shrink several times.
+// The format byte holds the method in its low nibble and the version of the
+// layout in the high one. Values written before the version bits existed
+// read as version 0, which has the same layout; a later version is refused
+// rather than decoded wrongly.
+
+#define AGENT_PACK_STORED 0
+#define AGENT_PACK_LZ 1
+#define AGENT_PACK_VERSION 1
+#define AGENT_PACK_METHOD(format) ((format) & 0x0f)
+#define AGENT_PACK_MIN 128        // shorter texts are stored as they are
+#define AGENT_PACK_HASH_BITS 12   // positions remembered by the match finder
+
+static int agent_pack_length(unsigned char *out, int n, int len) {
+  while (len >= 255) {
+    out[n++] = 255;
+    len -= 255;
+  }
+  out[n++] = (unsigned char)len;
+  return n;
+}
 
-    if (!col_name || !col_type) continue;
+static int agent_pack_sequence(unsigned char *out, int n, const unsigned char *literals, int literal_len,
+                               int offset, int match_len) {
+  int extra = match_len ? match_len - 4 : 0;
+  out[n++] = (unsigned char)((literal_len < 15 ? literal_len : 15) << 4 | (extra < 15 ? extra : 15));
+  if (literal_len >= 15) n = agent_pack_length(out, n, literal_len - 15);
+  memcpy(out + n, literals, literal_len);
+  n += literal_len;
+  if (!match_len) return n;
+  out[n++] = (unsigned char)(offset & 0xff);
+  out[n++] = (unsigned char)(offset >> 8);
+  if (extra >= 15) n = agent_pack_length(out, n, extra - 15);
+  return n;
+}
 
-    strncpy(column_names[column_count], col_name, 63);
-    column_names[column_count][63] = '\0';
-    strncpy(column_types[column_count], col_type, 15);
-    column_types[column_count][15] = '\0';
+// Packs text[0..len) into a new buffer of *size bytes, compressed when that
+// makes it smaller. Returns NULL when out of memory.
+static unsigned char* agent_pack(const char *text, int len, int *size) {
+  // Literals only need one length byte per 255 of them beyond the header
+  unsigned char *out = sqlite3_malloc64((sqlite3_uint64)len + len / 255 + 16);
+  if (!out) return NULL;
+  const unsigned char *in = (const unsigned char*)text;
+  int header = 1;
+  for (unsigned int v = (unsigned int)len; ; v >>= 7) {
+    out[header++] = (unsigned char)(v < 0x80 ? v : (v & 0x7f) | 0x80);
+    if (v < 0x80) break;
+  }
 
-    if (strcmp(col_type, "BLOB") == 0 &&
-        (strcmp(col_name, "embedding") == 0 || strstr(col_name, "_embedding"))) {
-      if (embedding_col_count < 32) {
-        embedding_col_indices[embedding_col_count++] = column_count;
+  int n = header;
+  if (len >= AGENT_PACK_MIN) {
+    int table[1 << AGENT_PACK_HASH_BITS];
+    memset(table, 0xff, sizeof(table));
+    int anchor = 0;
+    for (int i = 0; i + 4 <= len; ) {
+      unsigned int sequence;
+      memcpy(&sequence, in + i, 4);
+      unsigned int h = (sequence * 2654435761u) >> (32 - AGENT_PACK_HASH_BITS);
+      int ref = table[h];
+      table[h] = i;
+      if (ref < 0 || i - ref > 0xffff || memcmp(in + ref, in + i, 4) != 0) {
+        i++;
+        continue;
       }
+      int match = 4;
+      while (i + match < len && in[ref + match] == in[i + match]) match++;
+      n = agent_pack_sequence(out, n, in + anchor, i - anchor, i - ref, match);
+      i += match;
+      anchor = i;
     }
+    n = agent_pack_sequence(out, n, in + anchor, len - anchor, 0, 0);
+  }
 
-    int is_embedding = 0;
-    for (int i = 0; i < embedding_col_count; i++) {
-      if (embedding_col_indices[i] == column_count) {
-        is_embedding = 1;
-        break;
-      }
+  if (len < AGENT_PACK_MIN || n >= header + len) {
+    out[0] = AGENT_PACK_VERSION << 4 | AGENT_PACK_STORED;
+    memcpy(out + header, in, len);
+    n = header + len;
+  } else {
+    out[0] = AGENT_PACK_VERSION << 4 | AGENT_PACK_LZ;
+  }
+  *size = n;
+  return out;
+}
+
+// Returns the NUL-terminated text of a packed buffer, NULL when it is not a
+// valid one or out of memory. Stored data is never trusted: every length and
+// offset is checked against both buffers.
+static char* agent_unpack(const unsigned char *data, int size) {
+  if (size < 2 || data[0] >> 4 > AGENT_PACK_VERSION || AGENT_PACK_METHOD(data[0]) > AGENT_PACK_LZ) return NULL;
+  int method = AGENT_PACK_METHOD(data[0]);
+  int p = 1;
+  unsigned int len = 0;
+  for (int shift = 0; ; shift += 7) {
+    if (p == size || shift > 28) return NULL;
+    len |= (unsigned int)(data[p] & 0x7f) << shift;
+    if (!(data[p++] & 0x80)) break;
+  }
+  if (len > 0x7fffffff) return NULL;
+  if (method == AGENT_PACK_STORED && (unsigned int)(size - p) != len) return NULL;
+  // No input byte decodes to more than 255 output bytes, so a forged length
+  // cannot make the buffer below huge
+  if (method == AGENT_PACK_LZ && (sqlite3_uint64)len > (sqlite3_uint64)(size - p) * 255) return NULL;
+
+  char *out = sqlite3_malloc64((sqlite3_uint64)len + 1);
+  if (!out) return NULL;
+  if (method == AGENT_PACK_STORED) {
+    memcpy(out, data + p, len);
+    out[len] = '\0';
+    return out;
+  }
+
+  int n = 0;
+  while (p < size) {
+    int token = data[p++];
+    int literal_len = token >> 4;
+    if (literal_len == 15) {
+      int b;
+      do {
+        if (p == size) goto corrupt;
+        b = data[p++];
+        literal_len += b;
+      } while (b == 255 && literal_len < size);
     }
-    if (!is_embedding) {
-      char col_desc[128];
-      snprintf(col_desc, sizeof(col_desc), "  - %s (%s)\n", col_name, col_type);
-      strncat(schema_desc, col_desc, sizeof(schema_desc) - strlen(schema_desc) - 1);
+    if (literal_len > size - p || (unsigned int)literal_len > len - n) goto corrupt;
+    memcpy(out + n, data + p, literal_len);
+    n += literal_len;
+    p += literal_len;
+    if (p == size) break;
+
+    if (size - p < 2) goto corrupt;
+    int offset = data[p] | data[p + 1] << 8;
+    p += 2;
+    int match = token & 15;
+    if (match == 15) {
+      int b;
+      do {
+        if (p == size) goto corrupt;
+        b = data[p++];
+        match += b;
+      } while (b == 255 && (unsigned int)match <= len);
     }
+    match += 4;
+    if (offset == 0 || offset > n || (unsigned int)match > len - n) goto corrupt;
+    // Byte by byte: a match may overlap the bytes it produces
+    for (int k = 0; k < match; k++) out[n + k] = out[n - offset + k];
+    n += match;
+  }
+  if ((unsigned int)n != len) goto corrupt;
+  out[n] = '\0';
+  return out;
+
+corrupt:
+  sqlite3_free(out);
+  return NULL;
+}
+
+// Binds text to stmt, packed into a BLOB when that is smaller; text must
+// outlive the statement step
+static void agent_bind_packed(sqlite3_stmt *stmt, int idx, const char *text) {
+  int len = (int)strlen(text);
+  int size = 0;
+  unsigned char *packed = len >= AGENT_PACK_MIN ? agent_pack(text, len, &size) : NULL;
+  if (packed && AGENT_PACK_METHOD(packed[0]) == AGENT_PACK_LZ) {
+    sqlite3_bind_blob(stmt, idx, packed, size, sqlite3_free);
+  } else {
+    sqlite3_free(packed);
+    sqlite3_bind_text(stmt, idx, text, len, SQLITE_STATIC);
+  }
+}
 
-    column_count++;
+// Copy of the text of a column written by agent_bind_packed(), NULL for NULL
+// or when the BLOB cannot be unpacked
+static char* agent_column_unpacked(sqlite3_stmt *stmt, int column) {
+  int type = sqlite3_column_type(stmt, column);
+  if (type == SQLITE_NULL) return NULL;
+  if (type == SQLITE_BLOB) {
+    return agent_unpack((const unsigned char*)sqlite3_column_blob(stmt, column), sqlite3_column_bytes(stmt, column));
   }
-  sqlite3_finalize(stmt);
+  return sqlite3_mprintf("%s", sqlite3_column_text(stmt, column));
+}
 
-  if (column_count == 0) {
-    sqlite3_result_error(context, "Table does not exist or has no columns", -1);
+// agent_unpack(value): the text of a packed BLOB of the agent tables, other values as they are
+static void agent_unpack_func(
+  sqlite3_context *context,
+  int argc,
+  sqlite3_value **argv
+){
+  if (sqlite3_value_type(argv[0]) != SQLITE_BLOB) {
+    sqlite3_result_value(context, argv[0]);
+    return;
+  }
+  const unsigned char *data = (const unsigned char*)sqlite3_value_blob(argv[0]);
+  char *text = agent_unpack(data, sqlite3_value_bytes(argv[0]));
+  if (!text) {
+    sqlite3_result_error(context, "agent_unpack: not a packed value", -1);
     return;
   }
+  sqlite3_result_text(context, text, -1, sqlite3_free);
+}
 
-  DF("Goal: %s", goal);
-  DF("Table: %s", table_name);
-  DF("Max iterations: %d", max_iterations);
+// MARK: - Tool result cache
 
-  char *tools_list = agent_get_tools_list(db);
-  if (!tools_list) {
-    D("ERROR: Failed to list MCP tools");
-    sqlite3_result_error(context, "Not connected. Call mcp_connect() first", -1);
+#define AGENT_TOOL_CACHE_SIZE 256  // results kept per connection or runtime shard, the oldest are dropped first
+
+static sqlite3_uint64 agent_hash(const char *text) {
+  sqlite3_uint64 hash = 14695981039346656037ULL;
+  for (const unsigned char *p = (const unsigned char*)text; *p; p++) {
+    hash ^= *p;
+    hash *= 1099511628211ULL;
+  }
+  return hash ? hash : 1;
+}
+
+// Results that report a failure are never reused. MCP tools flag one with
+// "isError": true in the result object, or in its "result" member when the
+// JSON-RPC response is returned whole. Strings are skipped whole and nested
+// values are not looked at, so data mentioning errors is not taken for one.
+static int agent_tool_result_is_error(const char *result) {
+  int len = (int)strlen(result);
+  int pos = 0;
+  while (pos < len && isspace((unsigned char)result[pos])) pos++;
+  if (pos >= len || result[pos] != '{') return 0;
+
+  int depth = 0;
+  int in_result = 0;      // depth 2 is the object of the top-level "result" member
+  int key_result = 0;     // the last top-level key was "result"
+  for (; pos < len; pos++) {
+    char c = result[pos];
+    if (c == '{' || c == '[') {
+      if (++depth == 2) in_result = (c == '{' && key_result);
+      continue;
+    }
+    if (c == '}' || c == ']') {
+      if (--depth == 0) return 0;
+      continue;
+    }
+    if (c != '"') continue;
+
+    int start = pos + 1, end = start;
+    for (;;) {
+      end = agent_json_scan_string(result, end, len);
+      if (end >= len) return 0;
+      if (result[end] == '"') break;
+      end += 2;
+    }
+    pos = end;
+    if (depth != 1 && !(depth == 2 && in_result)) continue;
+
+    int next = end + 1;
+    while (next < len && isspace((unsigned char)result[next])) next++;
+    if (next >= len || result[next] != ':') continue;  // a value, not a key
+    int n = end - start;
+    if (depth == 1) key_result = (n == 6 && memcmp(result + start, "result", 6) == 0);
+    if (n != 7 || memcmp(result + start, "isError", 7) != 0) continue;
+    next++;
+    while (next < len && isspace((unsigned char)result[next])) next++;
+    if (len - next >= 4 && memcmp(result + next, "true", 4) == 0 &&
+        !isalnum((unsigned char)result[next + 4])) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Returns the ';' separated entry of list naming tool ("name" or "name=ttl"),
+// NULL when the list does not have it
+static const char* agent_tool_list_find(const char *list, const char *tool) {
+  size_t len = strlen(tool);
+  for (const char *p = list; p && *p; ) {
+    while (*p == ' ' || *p == ';') p++;
+    if (strncmp(p, tool, len) == 0 && (p[len] == '\0' || p[len] == ';' || p[len] == '=' || p[len] == ' ')) {
+      return p;
+    }
+    p = strchr(p, ';');
+  }
+  return NULL;
+}
+
+// Seconds results of tool are reused, 0 when the tool is not cached
+static int agent_tool_cache_ttl(const agent_options *options, const char *tool) {
+  if (agent_tool_list_find(options->tool_cache_exclude, tool)) return 0;
+  if (!options->tool_cache_tools) return options->tool_cache_ttl;
+
+  const char *entry = agent_tool_list_find(options->tool_cache_tools, tool);
+  if (!entry) return 0;
+  entry += strlen(tool);
+  while (*entry == ' ') entry++;
+  return *entry == '=' ? atoi(entry + 1) : options->tool_cache_ttl;
+}
+
+// Writes the JSON value at token with object members sorted by key and no
+// whitespace, so that equivalent arguments give the same text
+static void agent_json_canonical(sqlite3_str *out, const char *js, const agent_json_parser *parser, int token) {
+  const agent_json_token *tokens = parser->tokens;
+  const agent_json_token *t = &tokens[token];
+
+  if (t->type == AGENT_JSON_STRING) {
+    sqlite3_str_appendf(out, "\"%.*s\"", t->end - t->start, js + t->start);
+    return;
+  }
+  if (t->type == AGENT_JSON_PRIMITIVE) {
+    sqlite3_str_append(out, js + t->start, t->end - t->start);
     return;
   }
-  DF("Received tools list (length=%zu)", strlen(tools_list));
 
-  char system_prompt[20480];
+  int end = t->next;
+  if (t->type == AGENT_JSON_ARRAY) {
+    sqlite3_str_appendchar(out, 1, '[');
+    for (int i = token + 1; i < end; i = tokens[i].next) {
+      if (i > token + 1) sqlite3_str_appendchar(out, 1, ',');
+      agent_json_canonical(out, js, parser, i);
+    }
+    sqlite3_str_appendchar(out, 1, ']');
+    return;
+  }
 
-  if (custom_system_prompt && strlen(custom_system_prompt) > 0) {
-    strncpy(system_prompt, custom_system_prompt, sizeof(system_prompt) - 1);
-    system_prompt[sizeof(system_prompt) - 1] = '\0';
+  int count = 0;
+  for (int k = token + 1; k + 1 < end; k = tokens[k + 1].next) count++;
+  int *keys = sqlite3_malloc64((count ? count : 1) * sizeof(int));
+  if (!keys) {
+    sqlite3_str_append(out, js + t->start, t->end - t->start);
+    return;
+  }
+  count = 0;
+  for (int k = token + 1; k + 1 < end; k = tokens[k + 1].next) {
+    // Insertion sort: argument objects have a handful of members
+    int pos = count++;
+    while (pos > 0) {
+      const agent_json_token *a = &tokens[keys[pos - 1]], *b = &tokens[k];
+      int alen = a->end - a->start, blen = b->end - b->start;
+      int cmp = memcmp(js + a->start, js + b->start, alen < blen ? alen : blen);
+      if (cmp < 0 || (cmp == 0 && alen <= blen)) break;
+      keys[pos] = keys[pos - 1];
+      pos--;
+    }
+    keys[pos] = k;
+  }
+
+  sqlite3_str_appendchar(out, 1, '{');
+  for (int i = 0; i < count; i++) {
+    if (i > 0) sqlite3_str_appendchar(out, 1, ',');
+    agent_json_canonical(out, js, parser, keys[i]);
+    sqlite3_str_appendchar(out, 1, ':');
+    agent_json_canonical(out, js, parser, keys[i] + 1);
+  }
+  sqlite3_str_appendchar(out, 1, '}');
+  sqlite3_free(keys);
+}
+
+// Cache key of a call: the tool name and its canonical arguments, or the
+// arguments as given when they are not valid JSON
+static char* agent_tool_cache_key(sqlite3 *db, const agent_tool_call *call) {
+  const char *args = call->args ? call->args : "";
+  agent_json_parser parser;
+  agent_json_init(&parser);
+  sqlite3_str *key = sqlite3_str_new(db);
+  sqlite3_str_appendf(key, "%s\n", call->name);
+  if (agent_json_parse(&parser, args, (int)strlen(args)) == AGENT_JSON_COMPLETE) {
+    agent_json_canonical(key, args, &parser, parser.root);
   } else {
-    snprintf(system_prompt, sizeof(system_prompt),
-      "You are a tool-calling agent. You MUST respond with ONLY a tool call, nothing else.\n\n"
-      "%s\n\n"
-      "TARGET DATA SCHEMA:\n"
-      "You need to collect data that will populate a table with these columns:\n"
-      "%s\n"
-      "Make sure to search for properties/items that have information matching these columns.\n\n"
-      "IMPORTANT RULES:\n"
-      "1. Your response must be ONLY in this EXACT JSON format:\n"
-      "   {\"tool\": \"tool_name\", \"args\": {\"param1\": \"value1\", \"param2\": 123}}\n"
-      "2. Do NOT include explanations, reasoning, or any other text\n"
-      "3. Do NOT use markdown code blocks or backticks\n"
-      "4. Use the exact parameter names from the reference above\n"
-      "5. Use proper JSON: keys in \"quotes\", boolean as true/false (lowercase), strings in \"quotes\"\n"
-      "6. You can make MULTIPLE tool calls across iterations to gather detailed data\n"
-      "7. Type DONE only when you have retrieved sufficient detailed information\n\n"
-      "CRITICAL: Extract actual values from previous tool responses\n"
-      "✓ CORRECT: {\"args\": {\"name\": \"sqlite-agent\"}}   (literal value from response)\n"
-      "✗ WRONG:   {\"args\": {\"name\": \"{{items[0].name}}\"}}  (template syntax - will fail!)\n"
-      "✗ WRONG:   {\"args\": {\"name\": \"<name-from-search>\"}} (placeholder - will fail!)\n"
-      "When you receive tool responses, read the actual values and use them directly.\n\n"
-      "Task: %s\n\n"
-      "Respond with ONLY the JSON tool call:",
-      tools_list, schema_desc, goal);
+    sqlite3_str_appendall(key, args);
+  }
+  agent_json_free(&parser);
+  return sqlite3_str_finish(key);
+}
+
+static void agent_tool_cache_clear(agent_tool_cache *cache) {
+  while (cache->newest) {
+    agent_cached_result *entry = cache->newest;
+    cache->newest = entry->older;
+    sqlite3_free(entry->key);
+    sqlite3_free(entry->result);
+    sqlite3_free(entry);
   }
+  memset(cache, 0, sizeof(*cache));
+}
 
-  DF("System prompt (length=%zu):\n%s", strlen(system_prompt), system_prompt);
+// Runtime shards are picked by the low bits of the hash, buckets by the high ones
+static agent_cached_result** agent_tool_cache_bucket(agent_tool_cache *cache, sqlite3_uint64 hash) {
+  return &cache->buckets[(hash >> 32) & (AGENT_TOOL_CACHE_BUCKETS - 1)];
+}
 
-  rc = agent_create_chat_context(db, tools_list);
-  if (rc != SQLITE_OK) {
-    D("ERROR: Failed to create LLM chat context");
-    free(tools_list);
-    sqlite3_result_error(context, "Failed to create LLM chat context", -1);
-    return;
+static void agent_tool_cache_remove(agent_tool_cache *cache, agent_cached_result *entry) {
+  agent_cached_result **link = agent_tool_cache_bucket(cache, entry->hash);
+  while (*link != entry) link = &(*link)->next;
+  *link = entry->next;
+  if (entry->newer) entry->newer->older = entry->older;
+  else cache->newest = entry->older;
+  if (entry->older) entry->older->newer = entry->newer;
+  else cache->oldest = entry->newer;
+  sqlite3_free(entry->key);
+  sqlite3_free(entry->result);
+  sqlite3_free(entry);
+  cache->count--;
+}
+
+// Returns a copy of the cached result of key, dropping it once expired
+static char* agent_tool_cache_get(agent_tool_cache *cache, const char *key, int ttl) {
+  sqlite3_uint64 hash = agent_hash(key);
+  for (agent_cached_result *entry = *agent_tool_cache_bucket(cache, hash); entry; entry = entry->next) {
+    if (entry->hash != hash || strcmp(entry->key, key) != 0) continue;
+    if ((sqlite3_int64)time(NULL) - entry->created_at < ttl) {
+      return agent_unpack(entry->result, entry->result_size);
+    }
+    agent_tool_cache_remove(cache, entry);
+    return NULL;
   }
+  return NULL;
+}
 
-  // Calculate dynamic truncation based on available context space
-  int tools_list_len = (int)strlen(tools_list);
-  int system_prompt_len = (int)strlen(system_prompt);
-  int extraction_prompt_overhead = 2000; // Overhead for extraction prompt template
-  int safety_margin = 1024; // Additional buffer for JSON overhead
+// Takes ownership of key
+static void agent_tool_cache_put(agent_tool_cache *cache, char *key, const char *result) {
+  agent_cached_result *entry = sqlite3_malloc(sizeof(agent_cached_result));
+  int size = 0;
+  unsigned char *packed = agent_pack(result, (int)strlen(result), &size);
+  if (!entry || !packed) {
+    sqlite3_free(entry);
+    sqlite3_free(packed);
+    sqlite3_free(key);
+    return;
+  }
+  entry->key = key;
+  entry->hash = agent_hash(key);
+  entry->result = packed;
+  entry->result_size = size;
+  entry->created_at = (sqlite3_int64)time(NULL);
+
+  // A result stored again replaces the previous one
+  agent_cached_result **bucket = agent_tool_cache_bucket(cache, entry->hash);
+  for (agent_cached_result *old = *bucket; old; old = old->next) {
+    if (old->hash == entry->hash && strcmp(old->key, key) == 0) {
+      agent_tool_cache_remove(cache, old);
+      break;
+    }
+  }
+  entry->next = *bucket;
+  *bucket = entry;
+  entry->newer = NULL;
+  entry->older = cache->newest;
+  if (cache->newest) cache->newest->newer = entry;
+  else cache->oldest = entry;
+  cache->newest = entry;
+
+  if (++cache->count > AGENT_TOOL_CACHE_SIZE) agent_tool_cache_remove(cache, cache->oldest);
+}
 
-  // Context size (from agent_create_chat_context logic: tools_list_len * 2, min 4096)
-  int ctx_size = tools_list_len * 2;
-  if (ctx_size < 4096) ctx_size = 4096;
+// MARK: - Tool calls
 
-  // Calculate available space for conversation history
-  // ctx_size must accommodate: tools_list + system_prompt + conversation_history + extraction_prompt
-  int available_for_conversation = ctx_size - tools_list_len - system_prompt_len
-                                    - extraction_prompt_overhead - safety_margin;
+// Collects the {"tool": ..., "args": {...}} objects of a model response: the
+// first such object, or every one of the first array that holds any. Braces
+// inside strings and text around the JSON are handled.
+static int agent_is_word_char(char c) {
+  return isalnum((unsigned char)c) || c == '_';
+}
 
-  // Ensure minimum reasonable space
-  if (available_for_conversation < 8192) available_for_conversation = 8192;
+// State of a DONE search over a streamed reply
+typedef struct {
+  size_t pos;         // next byte to scan
+  int in_string;
+  int escape;
+} agent_done_scan;
+
+// Resumes the search over the first len bytes of a reply that may still grow.
+// A DONE is only taken once the byte after it has arrived, so the last four
+// bytes are scanned again on the next call; a complete reply passes its
+// length + 1 for the terminating NUL to count as that byte.
+static const char* agent_find_done_next(agent_done_scan *scan, const char *reply, size_t len) {
+  size_t i = scan->pos;
+  for (; i + 4 < len; i++) {
+    const char *p = reply + i;
+    if (scan->in_string) {
+      if (scan->escape) scan->escape = 0;
+      else if (*p == '\\') scan->escape = 1;
+      else if (*p == '"' || *p == '\n') scan->in_string = 0;
+    } else if (*p == '"') {
+      scan->in_string = 1;
+    } else if (*p == 'D' && strncmp(p, "DONE", 4) == 0 &&
+               (i == 0 || !agent_is_word_char(p[-1])) && !agent_is_word_char(p[4])) {
+      scan->pos = i;
+      return p;
+    }
+  }
+  scan->pos = i;
+  return NULL;
+}
 
-  // Assume average of max_iterations/2 tool calls, allocate space for each
-  size_t dynamic_truncate_at = available_for_conversation / ((max_iterations + 1) / 2);
+// Returns the first DONE of reply written as a word outside JSON strings, so
+// that "DONE" in tool arguments or quoted data does not end the loop. A quote
+// left open at the end of a line is prose, not JSON, and is closed there.
+static const char* agent_find_done(const char *reply) {
+  agent_done_scan scan = {0};
+  return agent_find_done_next(&scan, reply, strlen(reply) + 1);
+}
 
-  // Apply reasonable bounds
-  if (dynamic_truncate_at < 4096) dynamic_truncate_at = 4096;     // Minimum per tool
-  if (dynamic_truncate_at > 50000) dynamic_truncate_at = 50000;   // Maximum per tool
+static int agent_find_tool_calls(const char *text, agent_run_state *run) {
+  int len = (int)strlen(text);
+  agent_json_parser parser;
+  agent_run_clear_calls(run);
 
-  DF("Dynamic truncation: ctx_size=%d, tools=%d, system=%d, available=%d, truncate_at=%zu",
-     ctx_size, tools_list_len, system_prompt_len, available_for_conversation, dynamic_truncate_at);
+  for (const char *p = strpbrk(text, "[{"); p && run->call_count == 0; p = strpbrk(p + 1, "[{")) {
+    agent_json_init(&parser);
+    parser.pos = (int)(p - text);
+    if (agent_json_parse(&parser, text, len) != AGENT_JSON_COMPLETE) {
+      agent_json_free(&parser);
+      continue;
+    }
 
-  DF("Starting agent loop with max_iterations=%d", max_iterations);
-  char conversation_history[32768] = {0};
-  int consecutive_errors = 0;
-  char last_error[512] = {0};
-  for (int loop = 0; loop < max_iterations; loop++) {
-    DF("Table loop %d/%d", loop+1, max_iterations);
+    const agent_json_token *tokens = parser.tokens;
+    int first = parser.root, end = tokens[parser.root].next;
+    if (tokens[parser.root].type == AGENT_JSON_ARRAY) first = parser.root + 1;
+    else end = first + 1;
+
+    for (int obj = first; obj < end && tokens[obj].next; obj = tokens[obj].next) {
+      if (tokens[obj].type != AGENT_JSON_OBJECT) continue;
+      int tool = agent_json_object_get(&parser, text, obj, "tool");
+      if (tool < 0 || tokens[tool].type != AGENT_JSON_STRING) continue;
+
+      agent_tool_call *call = agent_run_add_call(run);
+      if (!call) break;
+      int args = agent_json_object_get(&parser, text, obj, "args");
+      call->args = (args < 0) ? sqlite3_mprintf("{}") : agent_json_dup(text, &tokens[args]);
+      if (!call->args || !agent_json_copy(text, &tokens[tool], call->name, sizeof(call->name))) {
+        sqlite3_free(call->args);
+        run->call_count--;
+      }
+    }
+    agent_json_free(&parser);
+  }
+  return run->call_count;
+}
 
-    char user_message[24576];
-    if (loop == 0) {
-      snprintf(user_message, sizeof(user_message), "%s", system_prompt);
+// Collects the TOOL_CALL: name / ARGS: {...} pairs of a text mode response.
+// A missing ARGS line defaults to empty arguments.
+static int agent_find_text_tool_calls(const char *text, agent_run_state *run) {
+  agent_run_clear_calls(run);
+
+  for (const char *marker = strstr(text, "TOOL_CALL:"); marker; ) {
+    const char *next_marker = strstr(marker + 10, "TOOL_CALL:");
+    const char *name = marker + 10;
+    while (*name == ' ' || *name == '\n') name++;
+    const char *name_end = strchr(name, '\n');
+    if (!name_end) name_end = name + strlen(name);
+    if (next_marker && name_end > next_marker) name_end = next_marker;
+    while (name_end > name && (name_end[-1] == ' ' || name_end[-1] == '\r')) name_end--;
+
+    agent_tool_call *call = agent_run_add_call(run);
+    if (!call) break;
+    int name_len = (int)(name_end - name);
+    if (name_len > (int)sizeof(call->name) - 1) name_len = (int)sizeof(call->name) - 1;
+    memcpy(call->name, name, name_len);
+    call->name[name_len] = '\0';
+
+    const char *args_marker = strstr(name_end, "ARGS:");
+    if (args_marker && (!next_marker || args_marker < next_marker)) {
+      args_marker += 5;
+      while (*args_marker == ' ' || *args_marker == '\n') args_marker++;
+
+      const char *args_start = strchr(args_marker, '{');
+      if (args_start && (!next_marker || args_start < next_marker)) {
+        agent_json_parser parser;
+        agent_json_init(&parser);
+        parser.pos = (int)(args_start - text);
+        if (agent_json_parse(&parser, text, (int)strlen(text)) == AGENT_JSON_COMPLETE) {
+          call->args = agent_json_dup(text, &parser.tokens[parser.root]);
+        }
+        agent_json_free(&parser);
+      } else {
+        const char *newline = strchr(args_marker, '\n');
+        int len = newline ? (int)(newline - args_marker) : (int)strlen(args_marker);
+        call->args = sqlite3_mprintf("%.*s", len, args_marker);
+      }
+      if (!call->args) call->args = sqlite3_mprintf("%s", "");
     } else {
-      snprintf(user_message, sizeof(user_message), "Continue");
+      D("WARNING: Found TOOL_CALL but missing ARGS - defaulting to empty args");
+      call->args = sqlite3_mprintf("{}");
     }
+    if (!call->args) {
+      run->call_count--;
+      break;
+    }
+    marker = next_marker;
+  }
+  return run->call_count;
+}
 
-    rc = sqlite3_prepare_v2(db, "SELECT llm_chat_respond(?)", -1, &stmt, 0);
+static void agent_pool_close(agent_pool *pool) {
+  for (int i = 0; i < pool->count; i++) {
+    sqlite3_finalize(pool->workers[i].call);
+    if (pool->workers[i].db) sqlite3_close(pool->workers[i].db);
+  }
+  sqlite3_free(pool->workers);
+  memset(pool, 0, sizeof(*pool));
+}
+
+// Opens a worker connection: loads worker_extensions, runs worker_init and
+// prepares the tool call statement. Runs on the worker thread, so that MCP
+// sessions of all workers are established concurrently.
+static int agent_worker_open(agent_worker *worker, const agent_options *options) {
+  int rc = sqlite3_open_v2(":memory:", &worker->db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL);
+  if (rc == SQLITE_OK && options->worker_extensions) {
+    sqlite3_db_config(worker->db, SQLITE_DBCONFIG_ENABLE_LOAD_EXTENSION, 1, NULL);
+    char *paths = sqlite3_mprintf("%s", options->worker_extensions);
+    if (!paths) rc = SQLITE_NOMEM;
+    for (char *path = paths; rc == SQLITE_OK && path && *path; ) {
+      char *sep = strchr(path, ';');
+      if (sep) *sep = '\0';
+      if (*path) {
+        char *err = NULL;
+        rc = sqlite3_load_extension(worker->db, path, NULL, &err);
+        if (rc != SQLITE_OK) {
+          DF("Worker failed to load '%s': %s", path, err ? err : "");
+        }
+        sqlite3_free(err);
+      }
+      path = sep ? sep + 1 : NULL;
+    }
+    sqlite3_free(paths);
+  }
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_exec(worker->db, options->worker_init, NULL, NULL, NULL);
     if (rc != SQLITE_OK) {
-      D("ERROR: Failed to prepare LLM query");
-      continue;
+      DF("Worker init failed: %s", sqlite3_errmsg(worker->db));
+    }
+  }
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_prepare_v3(worker->db, agent_stmt_sql[AGENT_STMT_CALL_TOOL], -1,
+                            SQLITE_PREPARE_PERSISTENT, &worker->call, NULL);
+  }
+  if (rc != SQLITE_OK) worker->failed = 1;
+  return rc;
+}
+
+typedef struct {
+  agent_worker *worker;
+  const agent_options *options;
+  agent_tool_call *calls;
+  int first;    // this worker runs calls first, first + stride, ...
+  int stride;
+  int count;
+} agent_worker_task;
+
+static AGENT_THREAD_FUNC agent_worker_main(void *arg) {
+  agent_worker_task *task = (agent_worker_task*)arg;
+  agent_worker *worker = task->worker;
+
+  if (!worker->db && agent_worker_open(worker, task->options) != SQLITE_OK) return AGENT_THREAD_RETURN;
+  if (worker->failed) return AGENT_THREAD_RETURN;
+
+  for (int i = task->first; i < task->count; i += task->stride) {
+    agent_tool_call *call = &task->calls[i];
+    if (call->done) continue;  // rejected, or answered from the cache
+    double started = agent_clock_ms();
+    call->result = agent_tool_result(worker->db, worker->call, call->name, call->args);
+    call->ms = agent_clock_ms() - started;
+    call->done = 1;
+  }
+  return AGENT_THREAD_RETURN;
+}
+
+static int agent_thread_start(agent_thread *thread, agent_thread_fn fn, void *arg) {
+#ifdef _WIN32
+  *thread = CreateThread(NULL, 0, fn, arg, 0, NULL);
+  return *thread != NULL;
+#else
+  return pthread_create(thread, NULL, fn, arg) == 0;
+#endif
+}
+
+static void agent_thread_join(agent_thread thread) {
+#ifdef _WIN32
+  WaitForSingleObject(thread, INFINITE);
+  CloseHandle(thread);
+#else
+  pthread_join(thread, NULL);
+#endif
+}
+
+static void agent_runtime_take_workers(agent_runtime *runtime, agent_pool *pool);
+
+// Worker connections of the pool, allocated on first use, or NULL when tool
+// calls cannot leave the agent_run connection. With a shared runtime the
+// slots are filled with its idle connections opened with the same options.
+static agent_worker* agent_pool_workers(agent_connection *conn) {
+  agent_pool *pool = &conn->pool;
+  if (!conn->options.worker_init || pool->disabled || !sqlite3_threadsafe()) return NULL;
+  if (!pool->workers) {
+    pool->workers = sqlite3_malloc64(conn->options.tool_workers * sizeof(agent_worker));
+    if (pool->workers) {
+      memset(pool->workers, 0, conn->options.tool_workers * sizeof(agent_worker));
+      pool->count = conn->options.tool_workers;
+
+      char *setup = sqlite3_mprintf("%s\n%s", conn->options.worker_extensions ? conn->options.worker_extensions : "",
+                                    conn->options.worker_init);
+      sqlite3_uint64 hash = setup ? agent_hash(setup) : 0;
+      sqlite3_free(setup);
+      for (int w = 0; w < pool->count; w++) pool->workers[w].setup = hash;
+      if (conn->runtime && hash) agent_runtime_take_workers(conn->runtime, pool);
+    }
+  }
+  return pool->workers;
+}
+
+// Once a worker connection failed to initialize, all calls run serially
+static void agent_pool_check(agent_pool *pool) {
+  for (int w = 0; w < pool->count; w++) {
+    if (pool->workers[w].failed) {
+      D("WARNING: Worker connection failed, running tool calls serially");
+      agent_pool_close(pool);
+      pool->disabled = 1;
+      break;
     }
+  }
+}
 
-    sqlite3_bind_text(stmt, 1, user_message, -1, SQLITE_TRANSIENT);
+// MARK: - Shared runtime
+
+static agent_runtime *agent_runtimes;  // guarded by SQLITE_MUTEX_STATIC_APP1
+
+static void agent_catalog_release(agent_tool_catalog *catalog);
+static const char* agent_catalog_local(const agent_tool_catalog *catalog, const char *name);
+
+static void agent_runtime_free(agent_runtime *runtime) {
+  for (int i = 0; i < AGENT_RUNTIME_SHARDS; i++) {
+    agent_tool_cache_clear(&runtime->shards[i].cache);
+    sqlite3_mutex_free(runtime->shards[i].mutex);
+  }
+  agent_pool idle = {runtime->idle, runtime->idle_count, 0};
+  agent_pool_close(&idle);
+  agent_catalog_release(runtime->catalog);
+  sqlite3_mutex_free(runtime->mutex);
+  sqlite3_free(runtime->name);
+  sqlite3_free(runtime);
+}
+
+// Returns the runtime called name with a reference taken, creating it on first use
+static agent_runtime* agent_runtime_acquire(const char *name) {
+  sqlite3_mutex *global = sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_APP1);
+  sqlite3_mutex_enter(global);
+  agent_runtime *runtime = agent_runtimes;
+  while (runtime && strcmp(runtime->name, name) != 0) runtime = runtime->next;
+
+  if (!runtime && (runtime = sqlite3_malloc(sizeof(agent_runtime))) != NULL) {
+    memset(runtime, 0, sizeof(*runtime));
+    int ok = (runtime->name = sqlite3_mprintf("%s", name)) != NULL;
+    // Mutexes are NULL, and their calls no-ops, when SQLite is built single-threaded
+    if (ok && sqlite3_threadsafe()) {
+      ok = (runtime->mutex = sqlite3_mutex_alloc(SQLITE_MUTEX_FAST)) != NULL;
+      for (int i = 0; ok && i < AGENT_RUNTIME_SHARDS; i++) {
+        ok = (runtime->shards[i].mutex = sqlite3_mutex_alloc(SQLITE_MUTEX_FAST)) != NULL;
+      }
+    }
+    if (ok) {
+      runtime->next = agent_runtimes;
+      agent_runtimes = runtime;
+      DF("Created shared runtime '%s'", name);
+    } else {
+      agent_runtime_free(runtime);
+      runtime = NULL;
+    }
+  }
+  if (runtime) runtime->refs++;
+  sqlite3_mutex_leave(global);
+  return runtime;
+}
+
+static void agent_runtime_release(agent_runtime *runtime) {
+  if (!runtime) return;
+  sqlite3_mutex *global = sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_APP1);
+  sqlite3_mutex_enter(global);
+  int last = --runtime->refs == 0;
+  if (last) {
+    agent_runtime **link = &agent_runtimes;
+    while (*link != runtime) link = &(*link)->next;
+    *link = runtime->next;
+  }
+  sqlite3_mutex_leave(global);
+  if (last) {
+    DF("Released shared runtime '%s'", runtime->name);
+    agent_runtime_free(runtime);
+  }
+}
+
+// Moves idle connections opened with the same worker options into the empty
+// slots of pool; the other slots open their connection on first use
+static void agent_runtime_take_workers(agent_runtime *runtime, agent_pool *pool) {
+  int taken = 0;
+  sqlite3_mutex_enter(runtime->mutex);
+  for (int w = 0; w < pool->count; w++) {
+    for (int i = runtime->idle_count - 1; i >= 0; i--) {
+      if (runtime->idle[i].setup != pool->workers[w].setup) continue;
+      pool->workers[w] = runtime->idle[i];
+      runtime->idle[i] = runtime->idle[--runtime->idle_count];
+      taken++;
+      break;
+    }
+  }
+  sqlite3_mutex_leave(runtime->mutex);
+  DF("Took %d idle worker connections of runtime '%s'", taken, runtime->name);
+}
+
+// Gives the open worker connections of the pool back to the runtime once a
+// run is done with them, so that the next run of any connection reuses them
+static void agent_pool_release(agent_connection *conn) {
+  agent_pool *pool = &conn->pool;
+  agent_runtime *runtime = conn->runtime;
+  if (!runtime || !pool->workers) return;
+
+  sqlite3_mutex_enter(runtime->mutex);
+  if (!runtime->idle) {
+    runtime->idle = sqlite3_malloc64(AGENT_RUNTIME_IDLE_WORKERS * sizeof(agent_worker));
+  }
+  for (int w = 0; w < pool->count; w++) {
+    agent_worker *worker = &pool->workers[w];
+    if (!worker->db || worker->failed || !worker->setup || !runtime->idle ||
+        runtime->idle_count == AGENT_RUNTIME_IDLE_WORKERS) continue;
+    runtime->idle[runtime->idle_count++] = *worker;
+    memset(worker, 0, sizeof(*worker));
+  }
+  sqlite3_mutex_leave(runtime->mutex);
+
+  // Connections the runtime has no room for are closed
+  int disabled = pool->disabled;
+  agent_pool_close(pool);
+  pool->disabled = disabled;
+}
+
+// Drops the catalog and worker connections of conn and leaves its runtime
+static void agent_runtime_detach(agent_connection *conn) {
+  agent_pool_release(conn);
+  agent_pool_close(&conn->pool);
+  agent_catalog_release(conn->catalog);
+  conn->catalog = NULL;
+  agent_runtime_release(conn->runtime);
+  conn->runtime = NULL;
+}
+
+// Joins the runtime named by the runtime option, leaving the current one
+static int agent_runtime_attach(agent_connection *conn) {
+  agent_runtime_detach(conn);
+  if (!conn->options.runtime) return SQLITE_OK;
+  conn->runtime = agent_runtime_acquire(conn->options.runtime);
+  return conn->runtime ? SQLITE_OK : SQLITE_NOMEM;
+}
+
+// Returns a copy of the cached result of key, from the runtime shard of the key
+// when shared. Results of local tools stay with the connection that ran them.
+static char* agent_cache_get(agent_connection *conn, const char *key, int local, int ttl) {
+  if (!conn->runtime || local) return agent_tool_cache_get(&conn->tool_cache, key, ttl);
+  agent_cache_shard *shard = &conn->runtime->shards[agent_hash(key) % AGENT_RUNTIME_SHARDS];
+  sqlite3_mutex_enter(shard->mutex);
+  char *result = agent_tool_cache_get(&shard->cache, key, ttl);
+  sqlite3_mutex_leave(shard->mutex);
+  return result;
+}
+
+// Takes ownership of key
+static void agent_cache_put(agent_connection *conn, char *key, int local, const char *result) {
+  if (!conn->runtime || local) {
+    agent_tool_cache_put(&conn->tool_cache, key, result);
+    return;
+  }
+  agent_cache_shard *shard = &conn->runtime->shards[agent_hash(key) % AGENT_RUNTIME_SHARDS];
+  sqlite3_mutex_enter(shard->mutex);
+  agent_tool_cache_put(&shard->cache, key, result);
+  sqlite3_mutex_leave(shard->mutex);
+}
+
+static void agent_cache_clear(agent_connection *conn) {
+  agent_tool_cache_clear(&conn->tool_cache);
+  if (!conn->runtime) return;
+  for (int i = 0; i < AGENT_RUNTIME_SHARDS; i++) {
+    agent_cache_shard *shard = &conn->runtime->shards[i];
+    sqlite3_mutex_enter(shard->mutex);
+    agent_tool_cache_clear(&shard->cache);
+    sqlite3_mutex_leave(shard->mutex);
+  }
+}
+
+// Tool calls started while the reply holding them is still generated, with
+// the prefetch option. Call i runs on worker i, so at most tool_workers calls
+// of a reply are prefetched; agent_call_tools() takes the results of the calls
+// the parsed reply still holds and discards the others.
+struct agent_prefetch {
+  agent_tool_call calls[AGENT_MAX_TOOL_CALLS];
+  agent_worker_task tasks[AGENT_MAX_TOOL_CALLS];
+  agent_thread threads[AGENT_MAX_TOOL_CALLS];
+  int started[AGENT_MAX_TOOL_CALLS];
+  int count;
+};
+
+// Waits for the prefetched calls and drops their results
+static void agent_prefetch_clear(agent_prefetch *prefetch) {
+  if (!prefetch) return;
+  for (int i = 0; i < prefetch->count; i++) {
+    if (prefetch->started[i]) agent_thread_join(prefetch->threads[i]);
+    sqlite3_free(prefetch->calls[i].args);
+    sqlite3_free(prefetch->calls[i].result);
+  }
+  memset(prefetch, 0, sizeof(*prefetch));
+}
+
+static void agent_prefetch_free(agent_prefetch *prefetch) {
+  agent_prefetch_clear(prefetch);
+  sqlite3_free(prefetch);
+}
+
+static int agent_checkpoint_replay(sqlite3 *db, agent_run_state *run, agent_tool_call *call);
+
+// Starts the calls of segment, the part of a streamed reply that ends with the
+// last complete call. Calls with template arguments, answered by the cache or
+// the checkpoint, or beyond the number of workers are left to
+// agent_call_tools().
+static void agent_prefetch_start(sqlite3 *db, agent_connection *conn, agent_run_state *run,
+                                 const char *segment, int table_mode) {
+  agent_worker *workers = agent_pool_workers(conn);
+  if (!workers) return;
+  if (!run->prefetch) {
+    run->prefetch = sqlite3_malloc64(sizeof(agent_prefetch));
+    if (!run->prefetch) return;
+    memset(run->prefetch, 0, sizeof(agent_prefetch));
+  }
+  agent_prefetch *prefetch = run->prefetch;
+
+  agent_run_state parsed = {0};
+  if (table_mode) agent_find_tool_calls(segment, &parsed);
+  else agent_find_text_tool_calls(segment, &parsed);
+
+  for (int i = 0; i < parsed.call_count; i++) {
+    agent_tool_call *call = &parsed.calls[i];
+    if (prefetch->count >= conn->pool.count || strstr(call->args, "{{") ||
+        agent_catalog_local(conn->catalog, call->name)) continue;
+    // A resumed run does not call again what its checkpoint recorded
+    if (agent_checkpoint_replay(db, run, call)) continue;
+    int ttl = agent_tool_cache_ttl(conn->run_options, call->name);
+    if (ttl > 0) {
+      char *key = agent_tool_cache_key(db, call);
+      char *cached = key ? agent_cache_get(conn, key, 0, ttl) : NULL;
+      sqlite3_free(key);
+      sqlite3_free(cached);
+      if (cached) continue;
+    }
+
+    int n = prefetch->count++;
+    prefetch->calls[n] = *call;
+    call->args = NULL;
+    prefetch->tasks[n] = (agent_worker_task){&workers[n], conn->run_options, prefetch->calls, n, 1, n + 1};
+    prefetch->started[n] = agent_thread_start(&prefetch->threads[n], agent_worker_main, &prefetch->tasks[n]);
+    DF("Prefetching tool '%s' on worker %d", call->name, n);
+  }
+  agent_run_clear_calls(&parsed);
+  sqlite3_free(parsed.calls);
+}
+
+// Gives call the result of the identical prefetched call, if one completed
+static int agent_prefetch_take(agent_prefetch *prefetch, agent_tool_call *call) {
+  for (int i = 0; prefetch && i < prefetch->count; i++) {
+    agent_tool_call *fetched = &prefetch->calls[i];
+    if (!fetched->done || !fetched->args || strcmp(fetched->name, call->name) != 0 ||
+        strcmp(fetched->args, call->args) != 0) continue;
+    call->result = fetched->result;
+    call->ms = fetched->ms;
+    call->done = 1;
+    call->prefetched = 1;
+    fetched->result = NULL;
+    fetched->done = 0;
+    return 1;
+  }
+  return 0;
+}
+
+// MARK: - Checkpoints
+
+// With the checkpoint option every agent_run call is a row of agent_runs,
+// updated after each iteration with the history collected so far, and every
+// tool result a row of agent_steps. agent_resume() runs a call that did not
+// finish again from its last checkpoint: the loop continues at the saved
+// iteration and the calls already made are answered from agent_steps.
+// Writes are separate statements, so each one is durable on its own.
+// Histories and results are packed (see agent_pack), and a result is stored
+// once in agent_payloads, by hash, however many steps and runs return it.
+
+static const char agent_checkpoint_schema[] =
+  "CREATE TABLE IF NOT EXISTS agent_runs ("
+  "id INTEGER PRIMARY KEY, goal TEXT NOT NULL, table_name TEXT, max_iterations INTEGER NOT NULL, "
+  "system_prompt TEXT, status TEXT NOT NULL, iteration INTEGER NOT NULL DEFAULT 0, "
+  "rows INTEGER NOT NULL DEFAULT 0, history, result, created_at INTEGER, updated_at INTEGER);"
+  "CREATE TABLE IF NOT EXISTS agent_steps ("
+  "run_id INTEGER NOT NULL, step INTEGER NOT NULL, iteration INTEGER NOT NULL, tool TEXT NOT NULL, "
+  "args TEXT, result_hash TEXT, result TEXT, created_at INTEGER, PRIMARY KEY (run_id, step));"
+  "CREATE TABLE IF NOT EXISTS agent_payloads (hash TEXT PRIMARY KEY, size INTEGER NOT NULL, data BLOB NOT NULL)";
+
+// Records a new run, or marks a resumed one running again. Without the tables
+// (a read-only database, say) the run goes on unrecorded.
+static void agent_checkpoint_begin(sqlite3 *db, agent_connection *conn, agent_run_state *run,
+                                   sqlite3_value *goal, const char *table_name, int max_iterations,
+                                   const char *system_prompt) {
+  if (!run->checkpoint_id && !conn->run_options->checkpoint) return;
+  sqlite3_stmt *stmt = NULL;
+
+  if (run->checkpoint_id) {
+    // Tables of a database recorded by an earlier version may be missing
+    sqlite3_exec(db, agent_checkpoint_schema, 0, 0, 0);
+    if (sqlite3_prepare_v2(db, "UPDATE agent_runs SET status = 'running', updated_at = ?2 WHERE id = ?1",
+                           -1, &stmt, 0) == SQLITE_OK) {
+      sqlite3_bind_int64(stmt, 1, run->checkpoint_id);
+      sqlite3_bind_int64(stmt, 2, (sqlite3_int64)time(NULL));
+      sqlite3_step(stmt);
+    }
+    sqlite3_finalize(stmt);
+    if (sqlite3_prepare_v2(db, "SELECT max(step) FROM agent_steps WHERE run_id = ?1", -1, &stmt, 0) == SQLITE_OK) {
+      sqlite3_bind_int64(stmt, 1, run->checkpoint_id);
+      if (sqlite3_step(stmt) == SQLITE_ROW) run->checkpoint_step = sqlite3_column_int(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    return;
+  }
+
+  if (sqlite3_exec(db, agent_checkpoint_schema, 0, 0, 0) != SQLITE_OK ||
+      sqlite3_prepare_v2(db, "INSERT INTO agent_runs (goal, table_name, max_iterations, system_prompt, "
+                             "status, created_at, updated_at) VALUES (?1, ?2, ?3, ?4, 'running', ?5, ?5)",
+                         -1, &stmt, 0) != SQLITE_OK) {
+    DF("WARNING: Cannot record the run in agent_runs: %s", sqlite3_errmsg(db));
+    return;
+  }
+  sqlite3_bind_value(stmt, 1, goal);
+  if (table_name) sqlite3_bind_text(stmt, 2, table_name, -1, SQLITE_STATIC);
+  sqlite3_bind_int(stmt, 3, max_iterations);
+  if (system_prompt) sqlite3_bind_text(stmt, 4, system_prompt, -1, SQLITE_STATIC);
+  sqlite3_bind_int64(stmt, 5, (sqlite3_int64)time(NULL));
+  if (sqlite3_step(stmt) == SQLITE_DONE) run->checkpoint_id = sqlite3_last_insert_rowid(db);
+  sqlite3_finalize(stmt);
+  DF("Run recorded as agent_runs %lld", run->checkpoint_id);
+}
+
+// Saves the iterations completed and the history that later ones build on
+static void agent_checkpoint_save(sqlite3 *db, agent_run_state *run, int iteration, const char *history) {
+  if (!run->checkpoint_id) return;
+  sqlite3_stmt *stmt = NULL;
+  if (sqlite3_prepare_v2(db, "UPDATE agent_runs SET iteration = ?2, rows = ?3, history = ?4, updated_at = ?5 "
+                             "WHERE id = ?1", -1, &stmt, 0) == SQLITE_OK) {
+    sqlite3_bind_int64(stmt, 1, run->checkpoint_id);
+    sqlite3_bind_int(stmt, 2, iteration);
+    sqlite3_bind_int(stmt, 3, run->rows);
+    if (history) agent_bind_packed(stmt, 4, history);
+    sqlite3_bind_int64(stmt, 5, (sqlite3_int64)time(NULL));
+    sqlite3_step(stmt);
+  }
+  sqlite3_finalize(stmt);
+}
+
+// Stores result in agent_payloads under hash, unless it is there already.
+// Returns 0 when the hash is taken by a different result, or on error.
+static int agent_checkpoint_payload(sqlite3 *db, const char *hash, const char *result) {
+  int len = (int)strlen(result);
+  sqlite3_stmt *stmt = NULL;
+  int stored = 0;
+  if (sqlite3_prepare_v2(db, "INSERT OR IGNORE INTO agent_payloads (hash, size, data) VALUES (?1, ?2, ?3)",
+                         -1, &stmt, 0) == SQLITE_OK) {
+    int size = 0;
+    unsigned char *packed = agent_pack(result, len, &size);
+    sqlite3_bind_text(stmt, 1, hash, -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 2, len);
+    if (packed) sqlite3_bind_blob(stmt, 3, packed, size, sqlite3_free);
+    if (sqlite3_step(stmt) == SQLITE_DONE) stored = sqlite3_changes(db) ? 1 : -1;
+  }
+  sqlite3_finalize(stmt);
+  if (stored >= 0) return stored;
+
+  // Seen before: the common case, but a 64-bit hash can still collide
+  int same = 0;
+  if (sqlite3_prepare_v2(db, "SELECT size, data FROM agent_payloads WHERE hash = ?1", -1, &stmt, 0) == SQLITE_OK) {
+    sqlite3_bind_text(stmt, 1, hash, -1, SQLITE_STATIC);
+    if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_int(stmt, 0) == len) {
+      char *text = agent_column_unpacked(stmt, 1);
+      same = text && strcmp(text, result) == 0;
+      sqlite3_free(text);
+    }
+  }
+  sqlite3_finalize(stmt);
+  return same;
+}
+
+// Records the result of a call, keyed by its canonical arguments. Errors and
+// short results are kept in the row, the others in agent_payloads.
+static void agent_checkpoint_step(sqlite3 *db, agent_connection *conn, agent_run_state *run,
+                                  const agent_tool_call *call) {
+  if (!run->checkpoint_id || !call->result) return;
+  char *key = agent_tool_cache_key(db, call);
+  char hash[17];
+  snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)agent_hash(call->result));
+  int inline_result = strlen(call->result) < AGENT_PACK_MIN || agent_tool_result_is_error(call->result) ||
+                      !agent_checkpoint_payload(db, hash, call->result);
+  sqlite3_stmt *stmt = NULL;
+  if (key && sqlite3_prepare_v2(db, "INSERT OR REPLACE INTO agent_steps (run_id, step, iteration, tool, args, "
+                                    "result_hash, result, created_at) VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8)",
+                                -1, &stmt, 0) == SQLITE_OK) {
+    sqlite3_bind_int64(stmt, 1, run->checkpoint_id);
+    sqlite3_bind_int(stmt, 2, ++run->checkpoint_step);
+    sqlite3_bind_int(stmt, 3, conn->trace.iteration);
+    sqlite3_bind_text(stmt, 4, call->name, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 5, key + strlen(call->name) + 1, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 6, hash, -1, SQLITE_STATIC);
+    if (inline_result) sqlite3_bind_text(stmt, 7, call->result, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 8, (sqlite3_int64)time(NULL));
+    sqlite3_step(stmt);
+  }
+  sqlite3_finalize(stmt);
+  sqlite3_free(key);
+}
+
+// Answers a call of a resumed run with the last successful result of the
+// same call in agent_steps
+static int agent_checkpoint_replay(sqlite3 *db, agent_run_state *run, agent_tool_call *call) {
+  if (!run->resumed || !run->checkpoint_id) return 0;
+  char *key = agent_tool_cache_key(db, call);
+  sqlite3_stmt *stmt = NULL;
+  if (key && sqlite3_prepare_v2(db, "SELECT s.result, p.data FROM agent_steps s LEFT JOIN agent_payloads p "
+                                    "ON s.result IS NULL AND p.hash = s.result_hash "
+                                    "WHERE s.run_id = ?1 AND s.tool = ?2 AND s.args = ?3 ORDER BY s.step DESC",
+                                -1, &stmt, 0) == SQLITE_OK) {
+    sqlite3_bind_int64(stmt, 1, run->checkpoint_id);
+    sqlite3_bind_text(stmt, 2, call->name, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 3, key + strlen(call->name) + 1, -1, SQLITE_STATIC);
+    while (!call->result && sqlite3_step(stmt) == SQLITE_ROW) {
+      const char *result = (const char*)sqlite3_column_text(stmt, 0);
+      if (result && !agent_tool_result_is_error(result)) call->result = sqlite3_mprintf("%s", result);
+      else if (!result) call->result = agent_column_unpacked(stmt, 1);
+    }
+  }
+  sqlite3_finalize(stmt);
+  sqlite3_free(key);
+  return call->result != NULL;
+}
+
+// Calls made before the last checkpoint, one "- name args" line each, for
+// the message that restarts the chat of a resumed run
+static char* agent_checkpoint_calls(sqlite3 *db, const agent_run_state *run) {
+  sqlite3_stmt *stmt = NULL;
+  sqlite3_str *out = sqlite3_str_new(db);
+  if (sqlite3_prepare_v2(db, "SELECT tool, args FROM agent_steps WHERE run_id = ?1 ORDER BY step",
+                         -1, &stmt, 0) == SQLITE_OK) {
+    sqlite3_bind_int64(stmt, 1, run->checkpoint_id);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+      sqlite3_str_appendf(out, "- %s %.200s\n", sqlite3_column_text(stmt, 0), sqlite3_column_text(stmt, 1));
+    }
+  }
+  sqlite3_finalize(stmt);
+  return sqlite3_str_finish(out);
+}
+
+// Marks the run done with its result, or failed so that it can be resumed
+static void agent_checkpoint_end(sqlite3 *db, const agent_run_state *run) {
+  if (!run->checkpoint_id) return;
+  sqlite3_stmt *stmt = NULL;
+  if (sqlite3_prepare_v2(db, "UPDATE agent_runs SET status = ?2, rows = ?3, result = ?4, updated_at = ?5 "
+                             "WHERE id = ?1", -1, &stmt, 0) == SQLITE_OK) {
+    sqlite3_bind_int64(stmt, 1, run->checkpoint_id);
+    sqlite3_bind_text(stmt, 2, run->finished ? "done" : "failed", -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 3, run->rows);
+    if (run->finished && run->table_mode) sqlite3_bind_int(stmt, 4, run->rows);
+    else if (run->finished) agent_bind_packed(stmt, 4, run->result ? run->result : "");
+    sqlite3_bind_int64(stmt, 5, (sqlite3_int64)time(NULL));
+    sqlite3_step(stmt);
+  }
+  sqlite3_finalize(stmt);
+}
+
+// Executes the tool calls of one response. Calls of local tools run first, on
+// the agent_run connection. Several MCP calls are spread over the worker
+// connections when worker_init is configured, each worker running its share
+// in order; calls a worker could not run, and single calls, go through the
+// agent_run connection. Results stay in call order.
+static void agent_call_tools(sqlite3 *db, agent_connection *conn, agent_run_state *run) {
+  agent_pool *pool = &conn->pool;
+  int count = run->call_count;
+  int workers = conn->options.tool_workers;
+  if (workers > count) workers = count;
+
+  // Prefetched calls finish before the workers are reused
+  if (run->prefetch && run->prefetch->count > 0) {
+    for (int i = 0; i < run->prefetch->count; i++) {
+      if (run->prefetch->started[i]) agent_thread_join(run->prefetch->threads[i]);
+      run->prefetch->started[i] = 0;
+    }
+    agent_pool_check(pool);
+  }
+
+  // Calls answered from agent_steps, by a prefetch or from the cache are done
+  // before any worker starts
+  char *keys[AGENT_MAX_TOOL_CALLS] = {0};
+  int rejected[AGENT_MAX_TOOL_CALLS] = {0};
+  int pending = 0;
+  for (int i = 0; i < count; i++) {
+    agent_tool_call *call = &run->calls[i];
+    rejected[i] = call->done;
+    if (!call->done && agent_checkpoint_replay(db, run, call)) {
+      DF("Tool '%s' answered from agent_steps", call->name);
+      call->done = 1;
+      call->replayed = 1;
+    }
+    if (!call->done && agent_prefetch_take(run->prefetch, call)) {
+      DF("Tool '%s' answered by a prefetched call", call->name);
+    }
+    int ttl = call->done ? 0 : agent_tool_cache_ttl(conn->run_options, call->name);
+    if (ttl > 0) {
+      keys[i] = agent_tool_cache_key(db, call);
+      int local = agent_catalog_local(conn->catalog, call->name) != NULL;
+      call->result = keys[i] ? agent_cache_get(conn, keys[i], local, ttl) : NULL;
+      if (call->result) {
+        DF("Tool '%s' answered from the cache", call->name);
+        call->done = 1;
+        call->cached = 1;
+        sqlite3_free(keys[i]);
+        keys[i] = NULL;
+      }
+    }
+    if (!call->done) pending++;
+  }
+  agent_prefetch_clear(run->prefetch);
+
+  for (int i = 0; i < count; i++) {
+    agent_tool_call *call = &run->calls[i];
+    const char *sql = call->done ? NULL : agent_catalog_local(conn->catalog, call->name);
+    if (!sql) continue;
+    double started = agent_clock_ms();
+    call->result = agent_call_local_tool(db, sql, call->args, conn->run_options->tool_writes);
+    call->ms = agent_clock_ms() - started;
+    call->done = 1;
+    call->local = 1;
+    pending--;
+  }
+  if (workers > pending) workers = pending;
+
+  if (workers > 1 && agent_pool_workers(conn)) {
+    agent_worker_task tasks[AGENT_MAX_TOOL_CALLS];
+    agent_thread threads[AGENT_MAX_TOOL_CALLS];
+    int started[AGENT_MAX_TOOL_CALLS] = {0};
+    for (int w = 0; pool->workers && w < workers; w++) {
+      tasks[w] = (agent_worker_task){&pool->workers[w], conn->run_options, run->calls, w, workers, count};
+      started[w] = agent_thread_start(&threads[w], agent_worker_main, &tasks[w]);
+    }
+    for (int w = 0; w < workers; w++) {
+      if (started[w]) agent_thread_join(threads[w]);
+    }
+    agent_pool_check(pool);
+    DF("Ran %d tool calls on %d workers", count, workers);
+  }
+
+  for (int i = 0; i < count; i++) {
+    agent_tool_call *call = &run->calls[i];
+    if (call->done) continue;
+    double started = agent_clock_ms();
+    call->result = agent_call_mcp_tool(db, conn, call->name, call->args);
+    call->ms = agent_clock_ms() - started;
+    call->done = 1;
+  }
+
+  for (int i = 0; i < count; i++) {
+    const agent_tool_call *call = &run->calls[i];
+    if (rejected[i]) continue;
+    if (call->result && !call->cached && !call->replayed) agent_stats_add(conn, "tool", call->name, call->ms);
+    agent_trace_add(conn, "tool", call->name, call->ms, 0, 0,
+                    call->result ? (sqlite3_int64)strlen(call->result) : 0, 0,
+                    call->cached ? "cached" : call->prefetched ? "prefetched" :
+                    call->replayed ? "replayed" : call->local ? "local" : (call->result ? NULL : "failed"));
+    if (!call->replayed) agent_checkpoint_step(db, conn, run, call);
+  }
+
+  for (int i = 0; i < count; i++) {
+    const char *result = run->calls[i].result;
+    if (keys[i] && result && !agent_tool_result_is_error(result)) {
+      agent_cache_put(conn, keys[i], run->calls[i].local, result);
+    } else {
+      sqlite3_free(keys[i]);
+    }
+  }
+}
+
+// MARK: - Token budget
+
+// Token sizes come from the model tokenizer through llm_token_count(). When it
+// is missing the byte length is converted with AGENT_BYTES_PER_TOKEN.
+static int agent_token_count(sqlite3 *db, agent_connection *conn, const char *text, int len) {
+  if (len < 0) len = (int)strlen(text);
+  if (len == 0) return 0;
+
+  if (!conn->no_tokenizer) {
+    sqlite3_stmt *stmt = agent_stmt_acquire(db, conn, AGENT_STMT_TOKEN_COUNT);
+    if (stmt) {
+      int count = -1;
+      sqlite3_bind_text(stmt, 1, text, len, SQLITE_STATIC);
+      if (sqlite3_step(stmt) == SQLITE_ROW) count = sqlite3_column_int(stmt, 0);
+      agent_stmt_release(stmt);
+      if (count >= 0) return count;
+    }
+    conn->no_tokenizer = 1;
+  }
+  return (len + AGENT_BYTES_PER_TOKEN - 1) / AGENT_BYTES_PER_TOKEN;
+}
+
+// Returns the byte length of the longest prefix of text, cut on a UTF-8
+// boundary, that fits in max_tokens
+static int agent_token_prefix(sqlite3 *db, agent_connection *conn, const char *text, int len,
+                              int max_tokens) {
+  int tokens = agent_token_count(db, conn, text, len);
+  if (tokens <= max_tokens) return len;
+
+  // Start from the proportional cut and shrink until the tokenizer agrees;
+  // tokens are roughly uniform so this settles in one or two rounds
+  int cut = (int)((sqlite3_int64)len * max_tokens / tokens);
+  for (int round = 0; cut > 0 && round < 8; round++) {
+    while (cut > 0 && ((unsigned char)text[cut] & 0xC0) == 0x80) cut--;
+    tokens = agent_token_count(db, conn, text, cut);
+    if (tokens <= max_tokens) break;
+    cut = (int)((sqlite3_int64)cut * max_tokens / tokens) - 1;
+  }
+  return cut > 0 ? cut : 0;
+}
+
+// Returns 1 once the agent_run call is past its timeout_ms or token_budget
+static int agent_limits_reached(agent_connection *conn) {
+  if (conn->limits.deadline > 0 && agent_clock_ms() >= conn->limits.deadline) return 1;
+  return conn->run_options->token_budget > 0 && conn->limits.tokens > conn->run_options->token_budget;
+}
+
+// Fails the agent_run call with the budget it went past
+static void agent_limits_result(sqlite3_context *context, agent_connection *conn) {
+  double elapsed = agent_clock_ms() - conn->limits.started;
+  int tokens = conn->run_options->token_budget > 0 && conn->limits.tokens > conn->run_options->token_budget;
+  char *message = tokens ?
+    sqlite3_mprintf("agent_run exceeded its token_budget: %lld of %d tokens used",
+                    conn->limits.tokens, conn->run_options->token_budget) :
+    sqlite3_mprintf("agent_run exceeded its timeout_ms: stopped after %.0f of %d ms",
+                    elapsed, conn->run_options->timeout_ms);
+  agent_trace_add(conn, "limit", tokens ? "token_budget" : "timeout_ms", elapsed, 0, 0, 0, 0, message);
+  sqlite3_result_error(context, message ? message : "agent_run exceeded its budget", -1);
+  sqlite3_free(message);
+}
+
+// Counts a model call against token_budget and records it in the trace
+static void agent_chat_account(sqlite3 *db, agent_connection *conn, const char *stage, double duration,
+                               const char *message, const char *reply, const char *error) {
+  if (!conn->trace.active && conn->run_options->token_budget == 0) return;
+  int tokens_in = agent_token_count(db, conn, message, -1);
+  int tokens_out = reply ? agent_token_count(db, conn, reply, -1) : 0;
+  conn->limits.tokens += tokens_in + tokens_out;
+  agent_trace_add(conn, "llm", stage, duration, tokens_in, tokens_out,
+                  reply ? (sqlite3_int64)strlen(reply) : 0, 0, error);
+}
+
+// Binds message to the llm_chat_respond() statement and steps it, recording
+// the call in the trace under stage
+static int agent_chat_step(sqlite3 *db, agent_connection *conn, sqlite3_stmt *stmt,
+                           const char *stage, const char *message) {
+  sqlite3_bind_text(stmt, 1, message, -1, SQLITE_STATIC);
+  double started = agent_clock_ms();
+  int rc = sqlite3_step(stmt);
+  double duration = agent_clock_ms() - started;
+  if (rc == SQLITE_ROW) agent_stats_add(conn, "llm", stage, duration);
+  const char *response = rc == SQLITE_ROW ? (const char*)sqlite3_column_text(stmt, 0) : NULL;
+  agent_chat_account(db, conn, stage, duration, message, response,
+                     rc == SQLITE_ROW ? NULL : sqlite3_errmsg(db));
+  return rc;
+}
+
+// Incremental scan of a reply streamed by llm_chat()
+typedef struct {
+  int table_mode;
+  size_t scanned;     // bytes of the reply already scanned
+  int depth;          // brackets open in the current JSON value
+  int in_string;
+  int escape;
+  int array;          // table mode: the current top-level value is an array
+  size_t start;       // table mode: offset of the current top-level value
+  int in_args;        // text mode: after ARGS:, until its object closes
+  size_t closed;      // end of the last complete call, 0 before the first
+  agent_done_scan done;  // table mode: DONE search, resumed on each chunk
+} agent_stream;
+
+// Scans the bytes of reply received since the last call and returns the
+// length the reply can be cut to, or 0 to keep generating. Table mode stops at
+// DONE, after a top-level array, or after the first object naming a tool once
+// anything but DONE follows, as agent_find_tool_calls() only takes that
+// value. Text mode stops after the last ARGS object once the model writes
+// anything but another TOOL_CALL; a text mode DONE is still read to the end,
+// as the reply is the run result.
+static size_t agent_stream_scan(agent_stream *stream, const char *reply, size_t len) {
+  if (stream->table_mode) {
+    const char *done = agent_find_done_next(&stream->done, reply, len);
+    if (done) return (size_t)(done - reply) + 4;
+  }
+
+  for (size_t i = stream->scanned; i < len && !(stream->table_mode && stream->closed); i++) {
+    char c = reply[i];
+    if (stream->depth > 0) {
+      if (stream->in_string) {
+        if (stream->escape) stream->escape = 0;
+        else if (c == '\\') stream->escape = 1;
+        else if (c == '"') stream->in_string = 0;
+      } else if (c == '"') {
+        stream->in_string = 1;
+      } else if (c == '{' || c == '[') {
+        stream->depth++;
+      } else if ((c == '}' || c == ']') && --stream->depth == 0) {
+        if (stream->table_mode && !stream->array) {
+          const char *tool = strstr(reply + stream->start, "\"tool\"");
+          if (!tool || tool > reply + i) continue;
+        }
+        stream->closed = i + 1;
+        stream->in_args = 0;
+        if (stream->array) {
+          stream->scanned = i + 1;
+          return stream->closed;
+        }
+      }
+    } else if (stream->table_mode ? (c == '{' || c == '[') : (stream->in_args && c == '{')) {
+      stream->depth = 1;
+      stream->array = (c == '[');
+      stream->start = i;
+    } else if (!stream->table_mode && c == ':' && i >= 4 && strncmp(reply + i - 4, "ARGS", 4) == 0) {
+      stream->in_args = 1;
+    }
+  }
+  stream->scanned = len;
+  if (!stream->closed || stream->depth > 0 || stream->in_args) return 0;
+
+  const char *rest = reply + stream->closed;
+  while (isspace((unsigned char)*rest)) rest++;
+  if (!*rest) return 0;
+  size_t n = strlen(rest);
+  if (stream->table_mode) return strncmp(rest, "DONE", n < 4 ? n : 4) == 0 ? 0 : stream->closed;
+  return strncmp(rest, "TOOL_CALL:", n < 10 ? n : 10) == 0 ? 0 : stream->closed;
+}
+
+// One model turn of the agent loop. With early_stop the reply is streamed from
+// llm_chat() and generation is stopped by resetting the statement as soon as
+// agent_stream_scan() says the answer is complete; otherwise, or when
+// llm_chat() is not available, llm_chat_respond() returns it whole. With
+// prefetch the reply is streamed too, and each call is started on a worker as
+// soon as it is complete. *reply is set to a copy of the reply, NULL when the
+// model returned nothing.
+static int agent_chat_turn(sqlite3 *db, agent_connection *conn, agent_run_state *run,
+                           const char *message, int table_mode, char **reply) {
+  *reply = NULL;
+  agent_prefetch_clear(run->prefetch);
+  sqlite3_stmt *stmt = NULL;
+  if ((conn->run_options->early_stop || conn->run_options->prefetch) && !conn->no_stream) {
+    stmt = agent_stmt_acquire(db, conn, AGENT_STMT_CHAT_STREAM);
+    if (!stmt) {
+      D("WARNING: llm_chat() not available, replies are not streamed");
+      conn->no_stream = 1;
+    }
+  }
+
+  if (!stmt) {
+    stmt = agent_stmt_acquire(db, conn, AGENT_STMT_CHAT_RESPOND);
+    if (!stmt) return SQLITE_ERROR;
+    int rc = agent_chat_step(db, conn, stmt, "chat", message);
+    const char *text = rc == SQLITE_ROW ? (const char*)sqlite3_column_text(stmt, 0) : NULL;
+    if (text) *reply = sqlite3_mprintf("%s", text);
+    agent_stmt_release(stmt);
+    if (rc != SQLITE_ROW) return rc;
+    return (text && !*reply) ? SQLITE_NOMEM : SQLITE_OK;
+  }
+
+  double started = agent_clock_ms();
+  double first = 0;   // time of the first reply bytes: the prompt is processed
+  agent_stream stream = {0};
+  stream.table_mode = table_mode;
+  sqlite3_str *text = sqlite3_str_new(db);
+  size_t cut = 0;
+  size_t dispatched = 0;  // end of the calls already prefetched
+  int rc;
+  sqlite3_bind_text(stmt, 1, message, -1, SQLITE_STATIC);
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    int bytes = sqlite3_column_bytes(stmt, 0);
+    if (bytes == 0) continue;
+    if (first == 0) first = agent_clock_ms();
+    sqlite3_str_append(text, (const char*)sqlite3_column_text(stmt, 0), bytes);
+    if (sqlite3_str_errcode(text) != SQLITE_OK) break;
+    const char *received = sqlite3_str_value(text);
+    size_t stop = agent_stream_scan(&stream, received, (size_t)sqlite3_str_length(text));
+    // A table mode reply holds a single call value
+    if (conn->run_options->prefetch && stream.closed > dispatched && !(table_mode && dispatched)) {
+      char *segment = sqlite3_mprintf("%.*s", (int)(stream.closed - dispatched), received + dispatched);
+      if (segment) agent_prefetch_start(db, conn, run, segment, table_mode);
+      sqlite3_free(segment);
+      dispatched = stream.closed;
+    }
+    if (stop && conn->run_options->early_stop) {
+      cut = stop;
+      break;
+    }
+    // Past timeout_ms the generation is stopped, the reply is not used
+    if (conn->limits.deadline > 0 && agent_clock_ms() >= conn->limits.deadline) {
+      rc = SQLITE_INTERRUPT;
+      break;
+    }
+  }
+  if (rc == SQLITE_ROW || rc == SQLITE_DONE) rc = sqlite3_str_errcode(text);
+  size_t received = (size_t)sqlite3_str_length(text);
+  *reply = sqlite3_str_finish(text);
+  if (*reply && cut) (*reply)[cut] = '\0';
+  if (cut) {
+    DF("Reply complete after %zu bytes, generation stopped", received);
+  }
+
+  double ended = agent_clock_ms();
+  if (rc == SQLITE_OK && first > 0) {
+    agent_stats_add(conn, "llm", "chat", ended - started);
+    agent_stats_add(conn, "llm", "prefill", first - started);
+    agent_stats_add(conn, "llm", "decode", ended - first);
+  }
+  char detail[64];
+  if (cut) snprintf(detail, sizeof(detail), "stopped after %zu bytes", received);
+  agent_chat_account(db, conn, "chat", ended - started, message, *reply,
+                     rc == SQLITE_INTERRUPT ? "timeout_ms" :
+                     rc != SQLITE_OK ? sqlite3_errmsg(db) : (cut ? detail : NULL));
+  // Resetting the cursor ends the generation and closes the assistant turn
+  // before the next prompt is sent, so the chat history keeps alternating
+  agent_stmt_release(stmt);
+
+  if (rc != SQLITE_OK) {
+    sqlite3_free(*reply);
+    *reply = NULL;
+  }
+  return rc;
+}
+
+// Records that text[0..len) was cut to kept bytes to fit max_tokens
+static void agent_trace_truncate(sqlite3 *db, agent_connection *conn, const char *name,
+                                 const char *text, int len, int kept, int max_tokens) {
+  if (!conn->trace.active) return;
+  char detail[64];
+  snprintf(detail, sizeof(detail), "kept %d of %d bytes", kept, len);
+  agent_trace_add(conn, "truncate", name, 0, agent_token_count(db, conn, text, len), max_tokens,
+                  len, 0, detail);
+}
+
+// Context plan of one chat
+typedef struct {
+  int ctx_size;       // tokens to allocate for the chat context
+  int result_tokens;  // tokens each tool result may take
+} agent_budget;
+
+// Sizes a chat holding a prompt of prompt_tokens followed by turns exchanges of
+// one tool result and one reply. With max_context the context is capped and
+// the per-result share shrinks to fit.
+static void agent_budget_plan(const agent_connection *conn, int prompt_tokens, int turns,
+                              agent_budget *budget) {
+  if (turns < 1) turns = 1;
+  budget->result_tokens = conn->run_options->result_tokens;
+  budget->ctx_size = prompt_tokens + turns * (budget->result_tokens + AGENT_RESPONSE_TOKENS);
+
+  int max_context = conn->run_options->max_context;
+  if (max_context > 0 && budget->ctx_size > max_context) {
+    budget->ctx_size = max_context;
+    budget->result_tokens = (max_context - prompt_tokens) / turns - AGENT_RESPONSE_TOKENS;
+    if (budget->result_tokens < AGENT_MIN_RESULT_TOKENS) budget->result_tokens = AGENT_MIN_RESULT_TOKENS;
+  }
+  if (budget->ctx_size < AGENT_MIN_CONTEXT_TOKENS) budget->ctx_size = AGENT_MIN_CONTEXT_TOKENS;
+}
+
+static void agent_catalog_clear(agent_tool_catalog *catalog) {
+  for (int i = 0; i < catalog->tool_count; i++) {
+    sqlite3_free(catalog->tools[i].name);
+    sqlite3_free(catalog->tools[i].description);
+    sqlite3_free(catalog->tools[i].inputschema);
+    sqlite3_free(catalog->tools[i].sql);
+  }
+  sqlite3_free(catalog->tools);
+  sqlite3_free(catalog->prompt);
+  sqlite3_free(catalog->grammar);
+  memset(catalog, 0, sizeof(*catalog));
+}
+
+// Drops a reference to catalog; the caller holds the runtime mutex when the
+// catalog may be shared
+static void agent_catalog_release(agent_tool_catalog *catalog) {
+  if (!catalog || --catalog->refs > 0) return;
+  agent_catalog_clear(catalog);
+  sqlite3_free(catalog);
+}
+
+// Makes catalog, with the reference of the caller, the catalog of conn. mcp,
+// the listing it was merged from, becomes the listing of the runtime of conn;
+// its reference is dropped without a runtime.
+static void agent_catalog_set(agent_connection *conn, agent_tool_catalog *catalog, agent_tool_catalog *mcp) {
+  agent_runtime *runtime = conn->runtime;
+  agent_catalog_release(conn->catalog);
+  conn->catalog = catalog;
+  if (runtime && mcp) {
+    sqlite3_mutex_enter(runtime->mutex);
+    agent_catalog_release(runtime->catalog);
+    runtime->catalog = mcp;
+    sqlite3_mutex_leave(runtime->mutex);
+  } else {
+    agent_catalog_release(mcp);  // never published, no other holder
+  }
+}
+
+// Adds a tool to catalog, unless one of its first known tools has the same name
+static int agent_catalog_add_tool(agent_tool_catalog *catalog, int known, int *capacity, sqlite3_str *prompt,
+                                  const char *name, const char *description, const char *inputschema,
+                                  const char *sql) {
+  int duplicate = 0;
+  for (int i = 0; i < known && !duplicate; i++) duplicate = strcmp(catalog->tools[i].name, name) == 0;
+  if (duplicate) {
+    DF("MCP tool '%s' is hidden by the local tool of the same name", name);
+    return SQLITE_OK;
+  }
+
+  if (catalog->tool_count == *capacity) {
+    int new_capacity = *capacity ? *capacity * 2 : 16;
+    agent_tool *tools = sqlite3_realloc64(catalog->tools, new_capacity * sizeof(agent_tool));
+    if (!tools) return SQLITE_NOMEM;
+    catalog->tools = tools;
+    *capacity = new_capacity;
+  }
+
+  agent_tool *tool = &catalog->tools[catalog->tool_count++];
+  tool->name = sqlite3_mprintf("%s", name);
+  tool->description = sqlite3_mprintf("%s", description ? description : "(no description)");
+  tool->inputschema = sqlite3_mprintf("%s", inputschema ? inputschema : "(no input schema)");
+  tool->sql = sql ? sqlite3_mprintf("%s", sql) : NULL;
+
+  sqlite3_str_appendf(prompt, "- %s: %s\n%s\n", tool->name, tool->description, tool->inputschema);
+  return SQLITE_OK;
+}
+
+// Adds the tools of a name, description, inputschema[, sql] query to catalog,
+// skipping the names it already has. Returns the result of the last step.
+static int agent_catalog_add(agent_tool_catalog *catalog, int *capacity, sqlite3_str *prompt, sqlite3_stmt *stmt) {
+  int known = catalog->tool_count;
+  int rc;
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    const char *name = (const char*)sqlite3_column_text(stmt, 0);
+    if (!name) continue;
+    const char *sql = sqlite3_column_count(stmt) > 3 ? (const char*)sqlite3_column_text(stmt, 3) : NULL;
+    if (agent_catalog_add_tool(catalog, known, capacity, prompt, name,
+                               (const char*)sqlite3_column_text(stmt, 1),
+                               (const char*)sqlite3_column_text(stmt, 2), sql) != SQLITE_OK) {
+      return SQLITE_NOMEM;
+    }
+  }
+  return rc;
+}
+
+// Moves the tools of loaded into a new catalog with one reference
+static int agent_catalog_finish(agent_tool_catalog *loaded, sqlite3_str *prompt, agent_tool_catalog **out) {
+  loaded->prompt_len = sqlite3_str_length(prompt);
+  loaded->prompt = sqlite3_str_finish(prompt);
+  agent_tool_catalog *catalog = NULL;
+  if (!loaded->prompt || !(catalog = sqlite3_malloc(sizeof(agent_tool_catalog)))) {
+    agent_catalog_clear(loaded);
+    return SQLITE_NOMEM;
+  }
+  *catalog = *loaded;
+  catalog->hash = agent_hash(catalog->prompt);
+  catalog->refs = 1;
+  *out = catalog;
+  return SQLITE_OK;
+}
+
+// Lists the tools of the MCP server into a new catalog with one reference
+static int agent_catalog_list(sqlite3 *db, agent_tool_catalog **out) {
+  agent_tool_catalog loaded = {0};
+  int capacity = 0;
+  sqlite3_stmt *stmt = NULL;
+  int rc = sqlite3_prepare_v2(db, "SELECT name, description, inputschema FROM mcp_list_tools_respond", -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    DF("Failed to prepare mcp_list_tools_respond query: %s", sqlite3_errmsg(db));
+    return rc;
+  }
+  sqlite3_str *prompt = sqlite3_str_new(db);
+  rc = agent_catalog_add(&loaded, &capacity, prompt, stmt);
+  sqlite3_finalize(stmt);
+  if (rc != SQLITE_DONE) {
+    agent_catalog_clear(&loaded);
+    sqlite3_free(sqlite3_str_finish(prompt));
+    return rc == SQLITE_NOMEM ? rc : SQLITE_ERROR;
+  }
+  loaded.loaded_at = (sqlite3_int64)time(NULL);
+  return agent_catalog_finish(&loaded, prompt, out);
+}
+
+// Catalog of conn: the local tools of its agent_tools table, then the tools of
+// the MCP listing mcp that they do not hide. Without an MCP listing the local
+// tools are enough.
+static int agent_catalog_merge(sqlite3 *db, const agent_tool_catalog *mcp, agent_tool_catalog **out) {
+  agent_tool_catalog loaded = {0};
+  int capacity = 0;
+  sqlite3_str *prompt = sqlite3_str_new(db);
+  sqlite3_str_appendall(prompt, "Available tools:\n");
+
+  sqlite3_stmt *stmt = NULL;
+  int rc = SQLITE_DONE;
+  if (sqlite3_prepare_v2(db, "SELECT name, description, inputschema, sql FROM agent_tools ORDER BY name",
+                         -1, &stmt, NULL) == SQLITE_OK) {
+    rc = agent_catalog_add(&loaded, &capacity, prompt, stmt);
+  }
+  sqlite3_finalize(stmt);
+  int local_count = loaded.tool_count;
+  if (rc == SQLITE_DONE && !mcp && local_count > 0) {
+    DF("Listing only the %d local tools", local_count);
+  }
+  for (int i = 0; rc == SQLITE_DONE && mcp && i < mcp->tool_count; i++) {
+    const agent_tool *tool = &mcp->tools[i];
+    if (agent_catalog_add_tool(&loaded, local_count, &capacity, prompt, tool->name, tool->description,
+                               tool->inputschema, NULL) != SQLITE_OK) {
+      rc = SQLITE_NOMEM;
+    }
+  }
+
+  if (rc != SQLITE_DONE || loaded.tool_count == 0) {
+    agent_catalog_clear(&loaded);
+    sqlite3_free(sqlite3_str_finish(prompt));
+    return rc == SQLITE_DONE ? SQLITE_ERROR : rc;
+  }
+  loaded.source = mcp ? mcp->hash : 0;
+  loaded.loaded_at = mcp ? mcp->loaded_at : (sqlite3_int64)time(NULL);
+  rc = agent_catalog_finish(&loaded, prompt, out);
+  if (rc == SQLITE_OK) {
+    DF("Formatted %d tools for agent context", (*out)->tool_count);
+  }
+  return rc;
+}
+
+// Lists the MCP server and merges the listing with the local tools into a new
+// catalog for conn. *mcp is the listing, with one reference, or NULL when the
+// server could not be listed.
+static int agent_catalog_load(sqlite3 *db, agent_tool_catalog **mcp, agent_tool_catalog **out) {
+  *mcp = NULL;
+  int rc = agent_catalog_list(db, mcp);
+  if (rc == SQLITE_NOMEM) return rc;
+  rc = agent_catalog_merge(db, *mcp, out);
+  if (rc != SQLITE_OK) {
+    agent_catalog_release(*mcp);
+    *mcp = NULL;
+  }
+  return rc;
+}
+
+// Statement of the local tool name, NULL for an MCP or unknown tool
+static const char* agent_catalog_local(const agent_tool_catalog *catalog, const char *name) {
+  for (int i = 0; catalog && i < catalog->tool_count; i++) {
+    if (catalog->tools[i].sql && strcmp(catalog->tools[i].name, name) == 0) return catalog->tools[i].sql;
+  }
+  return NULL;
+}
+
+static int agent_catalog_fresh(const agent_connection *conn, const agent_tool_catalog *catalog) {
+  int ttl = conn->run_options->tools_ttl;
+  return catalog && ttl > 0 && (sqlite3_int64)time(NULL) - catalog->loaded_at < ttl;
+}
+
+// Returns the formatted tool list owned by the connection catalog, listing the
+// MCP server again only when the cached copy is missing or older than tools_ttl.
+// With a shared runtime, an MCP listing made by another connection is merged
+// with the local tools of this one instead.
+static const char* agent_get_tools_list(sqlite3 *db, agent_connection *conn) {
+  // A batch lists the tools once for all its goals
+  if (conn->catalog && conn->batch) {
+    DF("Using cached tool catalog (%d tools)", conn->catalog->tool_count);
+    return conn->catalog->prompt;
+  }
+
+  agent_runtime *runtime = conn->runtime;
+  if (runtime) {
+    sqlite3_mutex_enter(runtime->mutex);
+    agent_tool_catalog *shared = runtime->catalog;
+    if (agent_catalog_fresh(conn, shared) &&
+        (!conn->catalog || conn->catalog->source != shared->hash || conn->catalog->loaded_at != shared->loaded_at)) {
+      shared->refs++;
+    } else {
+      shared = NULL;
+    }
+    sqlite3_mutex_leave(runtime->mutex);
+
+    if (shared) {
+      agent_tool_catalog *merged = NULL;
+      int rc = agent_catalog_merge(db, shared, &merged);
+      sqlite3_mutex_enter(runtime->mutex);
+      agent_catalog_release(shared);
+      sqlite3_mutex_leave(runtime->mutex);
+      if (rc == SQLITE_OK) {
+        DF("Using the MCP listing of runtime '%s'", runtime->name);
+        agent_catalog_set(conn, merged, NULL);
+      }
+    }
+  }
+
+  if (agent_catalog_fresh(conn, conn->catalog)) {
+    DF("Using cached tool catalog (%d tools)", conn->catalog->tool_count);
+    return conn->catalog->prompt;
+  }
+
+  agent_tool_catalog *catalog, *mcp;
+  if (agent_catalog_load(db, &mcp, &catalog) != SQLITE_OK) return NULL;
+
+  agent_catalog_set(conn, catalog, mcp);
+  return catalog->prompt;
+}
+
+// MARK: - Tool selection
+
+// With tool_top_k the prompt lists only the k tools whose "name: description"
+// embedding is closest to the goal, so that the preamble of a server with
+// hundreds of tools stays the size of k of them. The tools are embedded once
+// per catalog listing into temp.agent_tool_vectors, set up with vector_init(),
+// and each goal takes the k nearest from vector_full_scan(). Calls of the
+// other tools still work.
+
+static const char agent_tool_vectors_schema[] =
+  "CREATE TEMP TABLE IF NOT EXISTS agent_tool_vectors (tool INTEGER PRIMARY KEY, embedding BLOB NOT NULL)";
+
+// Fills agent_tool_vectors with the tools of the connection catalog, unless it
+// holds them already. The embedding context must be current.
+static int agent_tool_vectors_build(sqlite3 *db, agent_connection *conn) {
+  agent_tool_catalog *catalog = conn->catalog;
+  if (conn->tool_vectors == catalog->hash) return SQLITE_OK;
+  conn->tool_vectors = 0;
+
+  // A savepoint groups the rows without ending a transaction of the caller
+  sqlite3_stmt *insert = NULL;
+  int rc = sqlite3_exec(db, agent_tool_vectors_schema, 0, 0, 0);
+  if (rc == SQLITE_OK) rc = sqlite3_prepare_v2(db, "INSERT INTO agent_tool_vectors (tool, embedding) "
+                                                   "VALUES (?1, llm_embed_generate(?2, ''))", -1, &insert, 0);
+  if (rc == SQLITE_OK) rc = agent_savepoint_begin(db);
+  if (rc != SQLITE_OK) {
+    sqlite3_finalize(insert);
+    return rc;
+  }
+
+  rc = sqlite3_exec(db, "DELETE FROM agent_tool_vectors", 0, 0, 0);
+  for (int i = 0; rc == SQLITE_OK && i < catalog->tool_count; i++) {
+    const agent_tool *tool = &catalog->tools[i];
+    char *text = sqlite3_mprintf("%s: %.*s", tool->name, AGENT_TOOL_EMBED_BYTES, tool->description);
+    if (!text) {
+      rc = SQLITE_NOMEM;
+      break;
+    }
+    sqlite3_bind_int(insert, 1, i);
+    sqlite3_bind_text(insert, 2, text, -1, sqlite3_free);
+    rc = sqlite3_step(insert) == SQLITE_DONE ? SQLITE_OK : sqlite3_errcode(db);
+    sqlite3_reset(insert);
+  }
+  sqlite3_finalize(insert);
+  int released = agent_savepoint_end(db, rc == SQLITE_OK);
+  if (rc != SQLITE_OK) return rc;
+  if (released != SQLITE_OK) return released;
+
+  int dimension = 0;
+  sqlite3_stmt *stmt = NULL;
+  if (sqlite3_prepare_v2(db, "SELECT length(embedding) / 4 FROM agent_tool_vectors LIMIT 1", -1, &stmt, 0) == SQLITE_OK &&
+      sqlite3_step(stmt) == SQLITE_ROW) {
+    dimension = sqlite3_column_int(stmt, 0);
+  }
+  sqlite3_finalize(stmt);
+  char *init = sqlite3_mprintf("SELECT vector_init('agent_tool_vectors', 'embedding', "
+                               "'dimension=%d,type=FLOAT32,distance=cosine')", dimension);
+  rc = init ? sqlite3_exec(db, init, 0, 0, 0) : SQLITE_NOMEM;
+  sqlite3_free(init);
+  if (rc != SQLITE_OK) return rc;
+
+  conn->tool_vectors = catalog->hash;
+  DF("Embedded %d tools with dimension %d", catalog->tool_count, dimension);
+  return SQLITE_OK;
+}
+
+// Tool list of the prompt of goal: the tool_top_k tools closest to it, in
+// catalog order. NULL lists the whole catalog: the option is off, the catalog
+// has no more than k tools, or the goal or the tools could not be embedded.
+// The embedding context replaces the chat context of the connection.
+static char* agent_tools_select(sqlite3 *db, agent_connection *conn, const char *goal) {
+  agent_tool_catalog *catalog = conn->catalog;
+  int k = conn->run_options->tool_top_k;
+  if (k <= 0 || !catalog || catalog->tool_count <= k) return NULL;
+
+  double started = agent_clock_ms();
+  if (sqlite3_exec(db, "SELECT llm_context_create_embedding('embedding_type=FLOAT32')", 0, 0, 0) != SQLITE_OK) {
+    DF("WARNING: Cannot embed the goal for tool_top_k: %s", sqlite3_errmsg(db));
+    return NULL;
+  }
+  conn->chat.preamble_hash = 0;
+
+  sqlite3_stmt *stmt = NULL;
+  char *selected = sqlite3_malloc64(catalog->tool_count);
+  int rc = selected ? agent_tool_vectors_build(db, conn) : SQLITE_NOMEM;
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_prepare_v2(db, "SELECT rowid FROM vector_full_scan('agent_tool_vectors', 'embedding', "
+                                "llm_embed_generate(?1, ''), ?2)", -1, &stmt, 0);
+  }
+  int count = 0;
+  if (rc == SQLITE_OK) {
+    memset(selected, 0, catalog->tool_count);
+    sqlite3_bind_text(stmt, 1, goal, -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 2, k);
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+      sqlite3_int64 tool = sqlite3_column_int64(stmt, 0);
+      if (tool >= 0 && tool < catalog->tool_count && !selected[tool]) {
+        selected[tool] = 1;
+        count++;
+      }
+    }
+    rc = (rc == SQLITE_DONE) ? SQLITE_OK : rc;
+  }
+  if (rc != SQLITE_OK || count == 0) {
+    DF("WARNING: Cannot select tools for tool_top_k: %s", rc == SQLITE_OK ? "no match" : sqlite3_errmsg(db));
+    // Built again next time, in case the table went away
+    conn->tool_vectors = 0;
+  }
+  sqlite3_finalize(stmt);
+  if (rc != SQLITE_OK || count == 0) {
+    sqlite3_free(selected);
+    return NULL;
+  }
+
+  sqlite3_str *out = sqlite3_str_new(db);
+  sqlite3_str_appendall(out, "Available tools:\n");
+  for (int i = 0; i < catalog->tool_count; i++) {
+    const agent_tool *tool = &catalog->tools[i];
+    if (selected[i]) sqlite3_str_appendf(out, "- %s: %s\n%s\n", tool->name, tool->description, tool->inputschema);
+  }
+  sqlite3_free(selected);
+
+  char *tools = sqlite3_str_finish(out);
+  if (tools) {
+    char detail[64];
+    snprintf(detail, sizeof(detail), "%d of %d", count, catalog->tool_count);
+    double duration = agent_clock_ms() - started;
+    agent_stats_add(conn, "tools", NULL, duration);
+    agent_trace_add(conn, "tools", NULL, duration, 0, 0, (sqlite3_int64)strlen(tools), count, detail);
+    DF("Selected %s tools (%zu of %zu bytes)", detail, strlen(tools), catalog->prompt_len);
+  }
+  return tools;
+}
+
+// With persistent_context, whether the tools listed in the chat left by the
+// previous call can be kept: selecting them again would embed the goal, which
+// replaces the chat context
+static int agent_tools_kept(const agent_connection *conn) {
+  return conn->run_options->persistent_context && conn->run_options->tool_top_k > 0 && conn->chat.preamble_hash &&
+         conn->catalog && conn->chat.tools_catalog == conn->catalog->hash &&
+         conn->chat.tools_k == conn->run_options->tool_top_k;
+}
+
+// Creates a chat context of exactly ctx_size tokens, as planned by agent_budget_plan()
+static int agent_create_chat_context(sqlite3 *db, int ctx_size) {
+  int rc;
+  char create_cmd[256];
+  snprintf(create_cmd, sizeof(create_cmd),
+           "SELECT llm_context_create_chat('context_size=%d')", ctx_size);
+  rc = sqlite3_exec(db, create_cmd, 0, 0, 0);
+
+  DF("Created chat context with size: %d", ctx_size);
+
+  return rc;
+}
+
+// With persistent_context, whether the chat left by the previous call was
+// started from preamble and has run_tokens free
+static int agent_chat_reusable(sqlite3 *db, agent_connection *conn, const char *preamble, int run_tokens) {
+  if (!conn->run_options->persistent_context || conn->chat.preamble_hash != agent_hash(preamble)) return 0;
+  int size = 0, used = 0;
+  if (agent_stmt_query_int(db, conn, AGENT_STMT_CONTEXT_SIZE, &size) == SQLITE_OK &&
+      size == conn->chat.ctx_size &&
+      agent_stmt_query_int(db, conn, AGENT_STMT_CONTEXT_USED, &used) == SQLITE_OK &&
+      size - used >= run_tokens) {
+    DF("Reusing chat context (used %d of %d)", used, size);
+    return 1;
+  }
+  return 0;
+}
+
+// Prepares the chat context for one agent_run call. With persistent_context the
+// chat left by the previous call is continued when it was started from the same
+// preamble and still has room, so the tool catalog and instructions are not
+// prefilled again. *reused tells the caller whether the preamble must be sent.
+// run_tokens is what this call adds on top of the preamble already in the chat.
+// tools is the tool_top_k selection listed in the preamble, kept with the chat.
+static int agent_chat_begin(sqlite3 *db, agent_connection *conn, const char *preamble, const char *tools,
+                            int ctx_size, int run_tokens, int *reused) {
+  *reused = agent_chat_reusable(db, conn, preamble, run_tokens);
+  if (*reused) return SQLITE_OK;
+  sqlite3_uint64 hash = agent_hash(preamble);
+
+  conn->chat.preamble_hash = 0;
+  int rc = agent_create_chat_context(db, ctx_size);
+  if (rc != SQLITE_OK) return rc;
+
+  if (conn->run_options->persistent_context &&
+      agent_stmt_query_int(db, conn, AGENT_STMT_CONTEXT_SIZE, &conn->chat.ctx_size) == SQLITE_OK) {
+    sqlite3_free(conn->chat.tools);
+    conn->chat.tools = tools ? sqlite3_mprintf("%s", tools) : NULL;
+    if (!tools || conn->chat.tools) {
+      conn->chat.preamble_hash = hash;
+      conn->chat.tools_catalog = conn->catalog ? conn->catalog->hash : 0;
+      conn->chat.tools_k = conn->run_options->tool_top_k;
+    }
+  }
+  return SQLITE_OK;
+}
+
+// Publishes the progress of a background run. Returns 1 when the run was
+// cancelled and must stop.
+static int agent_job_checkpoint(agent_connection *conn, int iteration) {
+  conn->trace.iteration = iteration;
+  agent_job *job = conn->job;
+  if (!job) return 0;
+  sqlite3_mutex_enter(job->mutex);
+  job->iteration = iteration;
+  int cancel = job->cancel;
+  sqlite3_mutex_leave(job->mutex);
+  return cancel;
+}
+
+static char* agent_extraction_prompt(const char *schema_desc, const char *history, int history_len) {
+  return sqlite3_mprintf(
+    "Extract structured data from the following information and format it as a JSON array.\n\n"
+    "%s\n\n"
+    "IMPORTANT:\n"
+    "- Return ONLY a JSON array of objects\n"
+    "- Each object must have these EXACT keys (matching column names):\n"
+    "%s\n"
+    "- Extract ALL available data that matches the schema\n"
+    "- Use null for missing values\n"
+    "- Do NOT include the 'embedding' column if present\n\n"
+    "CRITICAL ID EXTRACTION RULE:\n"
+    "If the schema has an 'id' column, look in the JSON data for fields like:\n"
+    "- \"id\", \"listing_id\", \"property_id\", \"item_id\", etc.\n"
+    "Extract the ACTUAL numeric/string ID value from the source data.\n"
+    "Example: if you see {\"id\": 123456789, \"title\": \"Rome Apartment\"}, use 123456789\n"
+    "NEVER use 0, 1, 2, 3 as IDs - use the real IDs from the data!\n\n"
+    "Data to extract:\n%.*s\n\n"
+    "Return ONLY the JSON array:",
+    schema_desc, schema_desc, history_len, history);
+}
+
+// MARK: - Table descriptors
+
+// Schema cookies of every schema of the connection folded into one value, -1
+// when one cannot be read. PRAGMA schema_version only reads main, and a
+// target table can live in temp or an attached database, or be shadowed
+// by a table created in temp.
+static sqlite3_int64 agent_schema_version(sqlite3 *db) {
+  sqlite3_stmt *list = NULL;
+  if (sqlite3_prepare_v2(db, "PRAGMA database_list", -1, &list, 0) != SQLITE_OK) return -1;
+
+  sqlite3_uint64 version = 0;
+  int rc = SQLITE_OK;
+  while (rc == SQLITE_OK && sqlite3_step(list) == SQLITE_ROW) {
+    char *sql = sqlite3_mprintf("PRAGMA \"%w\".schema_version", (const char*)sqlite3_column_text(list, 1));
+    sqlite3_stmt *stmt = NULL;
+    rc = sql ? sqlite3_prepare_v2(db, sql, -1, &stmt, 0) : SQLITE_NOMEM;
+    if (rc == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+      // Attaching, detaching or reordering schemas changes the value too
+      version = (version * 1000003) ^ (sqlite3_uint64)sqlite3_column_int64(list, 0);
+      version = (version * 1000003) ^ (unsigned int)sqlite3_column_int(stmt, 0);
+    } else {
+      rc = SQLITE_ERROR;
+    }
+    sqlite3_finalize(stmt);
+    sqlite3_free(sql);
+  }
+  sqlite3_finalize(list);
+  return rc == SQLITE_OK ? (sqlite3_int64)(version >> 1) : -1;
+}
+
+static int agent_type_has(const char *type, const char *word) {
+  int n = (int)strlen(word);
+  for (; *type; type++) {
+    if (sqlite3_strnicmp(type, word, n) == 0) return 1;
+  }
+  return 0;
+}
+
+// Affinity of a declared type, by the rules SQLite applies in CREATE TABLE
+static int agent_type_affinity(const char *type) {
+  if (agent_type_has(type, "INT")) return AGENT_AFFINITY_INTEGER;
+  if (agent_type_has(type, "CHAR") || agent_type_has(type, "CLOB") || agent_type_has(type, "TEXT")) {
+    return AGENT_AFFINITY_TEXT;
+  }
+  if (!type[0] || agent_type_has(type, "BLOB")) return AGENT_AFFINITY_BLOB;
+  if (agent_type_has(type, "REAL") || agent_type_has(type, "FLOA") || agent_type_has(type, "DOUB")) {
+    return AGENT_AFFINITY_REAL;
+  }
+  return AGENT_AFFINITY_NUMERIC;
+}
+
+static void agent_table_free(agent_table *table) {
+  for (int i = 0; i < table->column_count; i++) {
+    sqlite3_free(table->columns[i].name);
+    sqlite3_free(table->columns[i].type);
+  }
+  sqlite3_free(table->columns);
+  sqlite3_free(table->name);
+  sqlite3_free(table->schema);
+  sqlite3_finalize(table->insert);
+  sqlite3_free(table);
+}
+
+static void agent_tables_clear(agent_connection *conn) {
+  while (conn->tables) {
+    agent_table *table = conn->tables;
+    conn->tables = table->next;
+    agent_table_free(table);
+  }
+}
+
+// Reads the columns of table_name with PRAGMA table_info
+static int agent_table_load(sqlite3 *db, const char *table_name, sqlite3_int64 schema_version,
+                            agent_table **out) {
+  char *query = sqlite3_mprintf("PRAGMA table_info(%s)", table_name);
+  if (!query) return SQLITE_NOMEM;
+  sqlite3_stmt *stmt = NULL;
+  int rc = sqlite3_prepare_v2(db, query, -1, &stmt, 0);
+  sqlite3_free(query);
+  if (rc != SQLITE_OK) return rc;
+
+  agent_table *table = sqlite3_malloc(sizeof(agent_table));
+  if (!table) {
+    sqlite3_finalize(stmt);
+    return SQLITE_NOMEM;
+  }
+  memset(table, 0, sizeof(*table));
+  table->name = sqlite3_mprintf("%s", table_name);
+  table->schema_version = schema_version;
+  rc = table->name ? SQLITE_OK : SQLITE_NOMEM;
+
+  sqlite3_str *schema = sqlite3_str_new(db);
+  sqlite3_str_appendall(schema, "Table columns:\n");
+
+  int capacity = 0;
+  while (rc == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+    const char *name = (const char*)sqlite3_column_text(stmt, 1);
+    const char *type = (const char*)sqlite3_column_text(stmt, 2);
+    if (!name || !type) continue;
+
+    if (table->column_count == capacity) {
+      capacity = capacity ? capacity * 2 : 16;
+      agent_column *columns = sqlite3_realloc64(table->columns, (sqlite3_uint64)capacity * sizeof(agent_column));
+      if (!columns) {
+        rc = SQLITE_NOMEM;
+        break;
+      }
+      table->columns = columns;
+    }
+    agent_column *column = &table->columns[table->column_count++];
+    memset(column, 0, sizeof(*column));
+    column->name = sqlite3_mprintf("%s", name);
+    column->type = sqlite3_mprintf("%s", type);
+    if (!column->name || !column->type) {
+      rc = SQLITE_NOMEM;
+      break;
+    }
+    column->affinity = agent_type_affinity(type);
+
+    // Embedding columns are filled after the insert, so the model never sees them
+    column->embedding = column->affinity == AGENT_AFFINITY_BLOB && type[0] &&
+                        (strcmp(name, "embedding") == 0 || strstr(name, "_embedding"));
+    if (column->embedding) {
+      table->embedding_col_count++;
+    } else {
+      sqlite3_str_appendf(schema, "  - %s (%s)\n", name, type);
+    }
+  }
+  sqlite3_finalize(stmt);
+
+  table->schema = sqlite3_str_finish(schema);
+  if (rc == SQLITE_OK && !table->schema) rc = SQLITE_NOMEM;
+  if (rc != SQLITE_OK) {
+    agent_table_free(table);
+    return rc;
+  }
+  *out = table;
+  return SQLITE_OK;
+}
+
+// Descriptor of the target table, reused while the schema cookies are unchanged.
+// *out is NULL when the table does not exist or has no columns.
+static int agent_table_get(sqlite3 *db, agent_connection *conn, const char *table_name, agent_table **out) {
+  *out = NULL;
+  sqlite3_int64 schema_version = agent_schema_version(db);
+
+  for (agent_table **link = &conn->tables; *link; link = &(*link)->next) {
+    agent_table *table = *link;
+    if (sqlite3_stricmp(table->name, table_name) != 0) continue;
+    *link = table->next;
+    if (schema_version >= 0 && table->schema_version == schema_version) {
+      DF("Using cached schema of %s (%d columns)", table_name, table->column_count);
+      table->next = conn->tables;
+      conn->tables = table;
+      *out = table;
+      return SQLITE_OK;
+    }
+    agent_table_free(table);
+    break;
+  }
+
+  agent_table *table = NULL;
+  int rc = agent_table_load(db, table_name, schema_version, &table);
+  if (rc != SQLITE_OK) return rc;
+  if (table->column_count == 0) {
+    agent_table_free(table);
+    return SQLITE_OK;
+  }
+  table->next = conn->tables;
+  conn->tables = table;
+  *out = table;
+  return SQLITE_OK;
+}
+
+// MARK: - Result compaction
+
+// With the compact option, JSON tool results are minified, projected to the
+// members that can fill the target table, and split into pages of whole
+// array elements that each fit the per-result token budget, instead of being
+// cut at the budget.
+
+#define AGENT_MAX_RESULT_PAGES 32
+
+typedef struct {
+  char *text;
+  int first;    // first and last array element of the page, -1 when not paged
+  int last;
+} agent_result_page;
+
+typedef struct {
+  agent_result_page pages[AGENT_MAX_RESULT_PAGES];
+  int count;
+  int items;    // elements of the paged array
+} agent_result_pages;
+
+typedef struct {
+  const char *js;
+  const agent_json_parser *parser;
+  char (*columns)[64];  // normalized column names, NULL keeps every member
+  int column_count;
+} agent_compactor;
+
+static void agent_result_pages_free(agent_result_pages *pages) {
+  for (int i = 0; i < pages->count; i++) sqlite3_free(pages->pages[i].text);
+  pages->count = 0;
+}
+
+// Lowercase letters and digits of s[0..len)
+static void agent_compact_key(const char *s, int len, char *out, int size) {
+  int n = 0;
+  for (int i = 0; i < len && n < size - 1; i++) {
+    if (isalnum((unsigned char)s[i])) out[n++] = (char)tolower((unsigned char)s[i]);
+  }
+  out[n] = '\0';
+}
+
+// Groups of names, normalized by agent_compact_key(), that fill each other's
+// columns: a "link" member fills a url column
+static const char *agent_compact_aliases[][5] = {
+  {"url", "link", "href", "uri", NULL},
+  {"name", "title", NULL},
+  {"description", "desc", "summary", NULL},
+  {"price", "cost", NULL},
+  {"id", "identifier", NULL},
+};
+
+static int agent_compact_alias_group(const char *name) {
+  for (int g = 0; g < (int)(sizeof(agent_compact_aliases) / sizeof(agent_compact_aliases[0])); g++) {
+    for (int i = 0; agent_compact_aliases[g][i]; i++) {
+      if (strcmp(name, agent_compact_aliases[g][i]) == 0) return g;
+    }
+  }
+  return -1;
+}
+
+// A member fills a column when both names are equal once normalized, so
+// ignoring case and separators ("listing_url" fills listingUrl), or are in
+// the same group of agent_compact_aliases
+static int agent_compact_name_matches(const char *name, const char *column) {
+  if (!name[0]) return 0;
+  if (strcmp(name, column) == 0) return 1;
+  int group = agent_compact_alias_group(name);
+  return group >= 0 && group == agent_compact_alias_group(column);
+}
+
+static int agent_compact_matches(const agent_compactor *c, int key) {
+  const agent_json_token *t = &c->parser->tokens[key];
+  char name[64];
+  agent_compact_key(c->js + t->start, t->end - t->start, name, sizeof(name));
+  for (int i = 0; i < c->column_count; i++) {
+    if (agent_compact_name_matches(name, c->columns[i])) return 1;
+  }
+  return 0;
+}
+
+static int agent_compact_keeps(const agent_compactor *c, int token, int project);
+
+// How the object member whose key is at token key is kept: 0 dropped, 1 as a
+// whole, 2 projected further because only nested members fill columns
+static int agent_compact_member(const agent_compactor *c, int key, int project) {
+  const agent_json_token *value = &c->parser->tokens[key + 1];
+  if (!project || agent_compact_matches(c, key)) return agent_compact_keeps(c, key + 1, 0) ? 1 : 0;
+  if (value->type != AGENT_JSON_OBJECT && value->type != AGENT_JSON_ARRAY) return 0;
+  return agent_compact_keeps(c, key + 1, 1) ? 2 : 0;
+}
+
+// Whether anything is left of the value at token once null, empty strings,
+// empty containers and (with project) unmatched members are dropped
+static int agent_compact_keeps(const agent_compactor *c, int token, int project) {
+  const agent_json_token *tokens = c->parser->tokens, *t = &tokens[token];
+  if (t->type == AGENT_JSON_STRING) return t->end > t->start;
+  if (t->type == AGENT_JSON_PRIMITIVE) {
+    return !(t->end - t->start == 4 && memcmp(c->js + t->start, "null", 4) == 0);
+  }
+  if (t->type == AGENT_JSON_ARRAY) {
+    for (int i = token + 1; i < t->next; i = tokens[i].next) {
+      if (agent_compact_keeps(c, i, project)) return 1;
+    }
+    return 0;
+  }
+  for (int k = token + 1; k + 1 < t->next; k = tokens[k + 1].next) {
+    if (agent_compact_member(c, k, project)) return 1;
+  }
+  return 0;
+}
+
+static void agent_compact_write(sqlite3_str *out, const agent_compactor *c, int token, int project) {
+  const agent_json_token *tokens = c->parser->tokens, *t = &tokens[token];
+  if (t->type == AGENT_JSON_STRING) {
+    sqlite3_str_appendf(out, "\"%.*s\"", t->end - t->start, c->js + t->start);
+    return;
+  }
+  if (t->type == AGENT_JSON_PRIMITIVE) {
+    sqlite3_str_append(out, c->js + t->start, t->end - t->start);
+    return;
+  }
+
+  int first = 1;
+  if (t->type == AGENT_JSON_ARRAY) {
+    sqlite3_str_appendchar(out, 1, '[');
+    for (int i = token + 1; i < t->next; i = tokens[i].next) {
+      if (!agent_compact_keeps(c, i, project)) continue;
+      if (!first) sqlite3_str_appendchar(out, 1, ',');
+      agent_compact_write(out, c, i, project);
+      first = 0;
+    }
+    sqlite3_str_appendchar(out, 1, ']');
+    return;
+  }
+  sqlite3_str_appendchar(out, 1, '{');
+  for (int k = token + 1; k + 1 < t->next; k = tokens[k + 1].next) {
+    int kept = agent_compact_member(c, k, project);
+    if (!kept) continue;
+    if (!first) sqlite3_str_appendchar(out, 1, ',');
+    sqlite3_str_appendf(out, "\"%.*s\":", tokens[k].end - tokens[k].start, c->js + tokens[k].start);
+    agent_compact_write(out, c, k + 1, kept == 2);
+    first = 0;
+  }
+  sqlite3_str_appendchar(out, 1, '}');
+}
+
+// Byte span of the value at token, quotes included
+static void agent_json_span(const agent_json_token *t, int *start, int *end) {
+  int quoted = (t->type == AGENT_JSON_STRING);
+  *start = t->start - quoted;
+  *end = t->end + quoted;
+}
+
+static int agent_result_page_add(agent_result_pages *pages, char *text, int first, int last) {
+  if (!text) return SQLITE_NOMEM;
+  agent_result_page *page = &pages->pages[pages->count++];
+  page->text = text;
+  page->first = first;
+  page->last = last;
+  return SQLITE_OK;
+}
+
+// Label of page p, " (items 3-4 of 9)", saying on the last page which items
+// were left out past AGENT_MAX_RESULT_PAGES pages. Empty when not paged.
+static void agent_result_page_label(const agent_result_pages *pages, int p, const char *note,
+                                    char *label, int size) {
+  const agent_result_page *page = &pages->pages[p];
+  label[0] = '\0';
+  if (page->first < 0) return;
+  const agent_result_page *last = &pages->pages[pages->count - 1];
+  if (p == pages->count - 1 && last->last + 1 < pages->items) {
+    snprintf(label, size, " (items %d-%d of %d, items %d-%d were left out)", page->first + 1,
+             page->last + 1, pages->items, last->last + 2, pages->items);
+  } else {
+    snprintf(label, size, " (items %d-%d of %d%s)", page->first + 1, page->last + 1, pages->items,
+             note ? note : "");
+  }
+}
+
+// Splits the largest array of the compacted JSON text into pages of about
+// max_tokens, each page repeating the members around the array. Elements past
+// AGENT_MAX_RESULT_PAGES pages are left out. Returns 0 when nothing is worth
+// splitting.
+static int agent_compact_paginate(sqlite3 *db, agent_connection *conn, const char *text, int len,
+                                  int text_tokens, int max_tokens, agent_result_pages *pages) {
+  agent_json_parser parser;
+  agent_json_init(&parser);
+  if (agent_json_parse(&parser, text, len) != AGENT_JSON_COMPLETE) {
+    agent_json_free(&parser);
+    return 0;
+  }
+
+  int array = -1, array_len = 0;
+  for (int i = 0; i < parser.count; i++) {
+    const agent_json_token *t = &parser.tokens[i];
+    if (t->type != AGENT_JSON_ARRAY || t->next <= i + 2) continue;  // fewer than two elements
+    if (t->end - t->start > array_len) {
+      array = i;
+      array_len = t->end - t->start;
+    }
+  }
+  double bytes_per_token = (double)len / (text_tokens ? text_tokens : 1);
+  int frame = len - array_len;
+  // 10% headroom for the estimate
+  int page_bytes = (int)((max_tokens * bytes_per_token - frame) * 0.9);
+  if (array < 0 || page_bytes <= 0) {
+    agent_json_free(&parser);
+    return 0;
+  }
+
+  const agent_json_token *tokens = parser.tokens;
+  int prefix = tokens[array].start;
+  int suffix = tokens[array].end;
+  int index = 0, rc = SQLITE_OK;
+  pages->items = 0;
+  for (int i = array + 1; i < tokens[array].next; i = tokens[i].next) pages->items++;
+
+  int i = array + 1;
+  while (i < tokens[array].next && rc == SQLITE_OK) {
+    if (pages->count == AGENT_MAX_RESULT_PAGES) {
+      DF("WARNING: Tool result has more than %d pages, %d of %d items left out",
+         AGENT_MAX_RESULT_PAGES, pages->items - index, pages->items);
+      break;
+    }
+    int first = index, start, end, page_start, page_end;
+    agent_json_span(&tokens[i], &page_start, &page_end);
+    i = tokens[i].next;
+    index++;
+    // Whole elements are added while they fit, a single oversized one makes its own page
+    while (i < tokens[array].next) {
+      agent_json_span(&tokens[i], &start, &end);
+      if (end - page_start > page_bytes) break;
+      page_end = end;
+      i = tokens[i].next;
+      index++;
+    }
+    rc = agent_result_page_add(pages, sqlite3_mprintf("%.*s[%.*s]%s", prefix, text,
+                               page_end - page_start, text + page_start, text + suffix),
+                               first, index - 1);
+  }
+  agent_json_free(&parser);
+  if (rc != SQLITE_OK) {
+    agent_result_pages_free(pages);
+    return 0;
+  }
+  return pages->count;
+}
+
+// Compacts the result of tool into pages, projected to the columns of table
+// when given. Returns the number of pages, 0 when the result is not a JSON
+// object or array and is used as is.
+static int agent_compact_result(sqlite3 *db, agent_connection *conn, const agent_table *table,
+                                const char *tool, const char *result, int max_tokens,
+                                agent_result_pages *pages) {
+  memset(pages, 0, sizeof(*pages));
+  int len = (int)strlen(result);
+  int pos = 0;
+  while (pos < len && isspace((unsigned char)result[pos])) pos++;
+  if (pos == len || (result[pos] != '{' && result[pos] != '[')) return 0;
+
+  double started = conn->trace.active ? agent_clock_ms() : 0;
+  agent_json_parser parser;
+  agent_json_init(&parser);
+  parser.pos = pos;
+  if (agent_json_parse(&parser, result, len) != AGENT_JSON_COMPLETE) {
+    agent_json_free(&parser);
+    return 0;
+  }
+  int root = parser.root;
+  int end = parser.tokens[root].end;
+  while (end < len && isspace((unsigned char)result[end])) end++;
+  if (end < len) {
+    agent_json_free(&parser);
+    return 0;
+  }
+
+  agent_compactor compactor = {result, &parser, NULL, 0};
+  if (table && table->column_count > 0) {
+    compactor.columns = sqlite3_malloc64((sqlite3_uint64)table->column_count * 64);
+    for (int i = 0; compactor.columns && i < table->column_count; i++) {
+      const agent_column *column = &table->columns[i];
+      if (column->embedding) continue;
+      agent_compact_key(column->name, (int)strlen(column->name),
+                        compactor.columns[compactor.column_count++], 64);
+    }
+  }
+  // Without a single member for the table the result is only minified
+  int project = compactor.column_count > 0 && agent_compact_keeps(&compactor, root, 1);
+
+  sqlite3_str *out = sqlite3_str_new(db);
+  agent_compact_write(out, &compactor, root, project);
+  sqlite3_free(compactor.columns);
+  agent_json_free(&parser);
+  int compact_len = sqlite3_str_length(out);
+  char *compact = sqlite3_str_finish(out);
+  if (!compact) return 0;
+
+  int tokens = agent_token_count(db, conn, compact, compact_len);
+  if (tokens <= max_tokens ||
+      agent_compact_paginate(db, conn, compact, compact_len, tokens, max_tokens, pages) == 0) {
+    if (agent_result_page_add(pages, compact, -1, -1) != SQLITE_OK) return 0;
+  } else {
+    sqlite3_free(compact);
+  }
+
+  if (conn->trace.active) {
+    char detail[96];
+    snprintf(detail, sizeof(detail), "%s%d to %d bytes, %d pages",
+             project ? "projected, " : "", len, compact_len, pages->count);
+    agent_trace_add(conn, "compact", tool, agent_clock_ms() - started,
+                    agent_token_count(db, conn, result, len), tokens,
+                    len, pages->count, detail);
+  }
+  return pages->count;
+}
+
+// MARK: - Loop policy
+
+// With loop_patience, an iteration makes progress when it brings a successful
+// result unlike the earlier ones or stores rows; repeated calls and errors do
+// not. After loop_patience iterations without progress the next message tells
+// the model to change its approach, and the loop stops after one more. Table
+// mode stops at the first one once every target column had a value in some
+// result, as the data to extract is already there.
+
+#define AGENT_POLICY_HASH_SPANS 16  // spans of 32 bytes hashed from a long tool result
+
+static sqlite3_uint64 agent_policy_hash_span(sqlite3_uint64 hash, const char *text, size_t len) {
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    sqlite3_uint64 word;
+    memcpy(&word, text + i, 8);
+    hash = (hash ^ word) * 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 32;
+  }
+  for (; i < len; i++) hash = (hash ^ (unsigned char)text[i]) * 1099511628211ULL;
+  return hash;
+}
+
+// Hash of a tool result, telling repeated results apart from new ones. Long
+// results are sampled: their length and evenly spaced spans, which differ
+// for any two pages or queries, so that the policy costs little per call.
+static sqlite3_uint64 agent_policy_hash(const char *text) {
+  size_t len = strlen(text);
+  sqlite3_uint64 hash = 0x9e3779b97f4a7c15ULL ^ len;
+  if (len <= AGENT_POLICY_HASH_SPANS * 32) {
+    hash = agent_policy_hash_span(hash, text, len);
+  } else {
+    size_t stride = (len - 32) / (AGENT_POLICY_HASH_SPANS - 1);
+    for (int i = 0; i < AGENT_POLICY_HASH_SPANS; i++) {
+      hash = agent_policy_hash_span(hash, text + i * stride, 32);
+    }
+  }
+  return hash ? hash : 1;
+}
+
+// Records hash and returns 1 when it was already recorded
+static int agent_policy_seen(agent_policy *policy, sqlite3_uint64 hash) {
+  for (int i = 0; i < policy->seen_count; i++) {
+    if (policy->seen[i] == hash) return 1;
+  }
+  if (policy->seen_count == policy->seen_alloc) {
+    int alloc = policy->seen_alloc ? policy->seen_alloc * 2 : 32;
+    sqlite3_uint64 *seen = sqlite3_realloc64(policy->seen, alloc * sizeof(sqlite3_uint64));
+    if (!seen) return 0;
+    policy->seen = seen;
+    policy->seen_alloc = alloc;
+  }
+  policy->seen[policy->seen_count++] = hash;
+  return 0;
+}
+
+// Marks the columns of table named by the members of result that have a
+// value, and returns how many were not marked before. Results that are not
+// JSON, or wrap it in a string, mark none.
+static int agent_policy_fill(agent_policy *policy, const agent_table *table, const char *result) {
+  if (!policy->filled) {
+    policy->filled = sqlite3_malloc64(table->column_count ? table->column_count : 1);
+    if (!policy->filled) return 0;
+    memset(policy->filled, 0, table->column_count ? table->column_count : 1);
+  }
+  agent_json_parser parser;
+  agent_json_init(&parser);
+  int len = (int)strlen(result);
+  while (parser.pos < len && isspace((unsigned char)result[parser.pos])) parser.pos++;
+  if (agent_json_parse(&parser, result, len) != AGENT_JSON_COMPLETE) {
+    agent_json_free(&parser);
+    return 0;
+  }
+
+  int added = 0;
+  const agent_json_token *tokens = parser.tokens;
+  for (int t = 0; t < parser.count; t++) {
+    if (tokens[t].type != AGENT_JSON_OBJECT) continue;
+    for (int k = t + 1; k + 1 < tokens[t].next; k = tokens[k + 1].next) {
+      const agent_json_token *value = &tokens[k + 1];
+      int size = value->end - value->start;
+      if ((value->type == AGENT_JSON_PRIMITIVE && agent_json_equals(result, value, "null")) ||
+          (value->type == AGENT_JSON_STRING && size == 0) ||
+          (value->type != AGENT_JSON_STRING && value->type != AGENT_JSON_PRIMITIVE && value->next == k + 2)) {
+        continue;
+      }
+      char name[64], column[64];
+      agent_compact_key(result + tokens[k].start, tokens[k].end - tokens[k].start, name, sizeof(name));
+      for (int c = 0; c < table->column_count; c++) {
+        if (policy->filled[c] || table->columns[c].embedding) continue;
+        agent_compact_key(table->columns[c].name, (int)strlen(table->columns[c].name), column, sizeof(column));
+        if (!agent_compact_name_matches(name, column)) continue;
+        policy->filled[c] = 1;
+        added++;
+      }
+    }
+  }
+  agent_json_free(&parser);
+  policy->filled_count += added;
+  return added;
+}
+
+// Decides, after the tool calls of an iteration, whether the loop goes on:
+// returns a SQLITE_AGENT_LOOP_* value, from the loop hook when one is set
+static int agent_policy_step(sqlite3 *db, agent_connection *conn, agent_run_state *run,
+                             const agent_table *table, int iteration, int max_iterations) {
+  agent_policy *policy = &run->policy;
+  sqlite3_agent_loop_state state = {0};
+  state.run_id = conn->trace.run_id;
+  state.iteration = iteration;
+  state.max_iterations = max_iterations;
+  state.table_mode = run->table_mode;
+  state.calls = run->call_count;
+
+  int progress = 0;
+  for (int i = 0; i < run->call_count; i++) {
+    const agent_tool_call *call = &run->calls[i];
+    char *key = agent_tool_cache_key(db, call);
+    if (key && agent_policy_seen(policy, agent_hash(key))) state.repeated_calls++;
+    sqlite3_free(key);
+
+    if (!call->result || agent_tool_result_is_error(call->result)) {
+      state.failed_calls++;
+      continue;
+    }
+    if (agent_policy_seen(policy, agent_policy_hash(call->result))) continue;
+    state.new_results++;
+    progress = 1;
+    if (table) agent_policy_fill(policy, table, call->result);
+  }
+
+  int column_count = 0;
+  for (int c = 0; table && c < table->column_count; c++) {
+    if (!table->columns[c].embedding) column_count++;
+  }
+  if (run->rows > policy->rows) progress = 1;
+  policy->rows = run->rows;
+  policy->stalled = progress ? 0 : policy->stalled + 1;
+
+  state.stalled = policy->stalled;
+  state.columns_filled = policy->filled_count;
+  state.column_count = column_count;
+  state.rows = run->rows;
+
+  int patience = conn->run_options->loop_patience;
+  int decision = SQLITE_AGENT_LOOP_CONTINUE;
+  if (patience > 0 && policy->stalled > 0) {
+    if (policy->stalled > patience || (column_count > 0 && policy->filled_count == column_count)) {
+      decision = SQLITE_AGENT_LOOP_STOP;
+    } else if (policy->stalled == patience) {
+      decision = SQLITE_AGENT_LOOP_REDIRECT;
+    }
+  }
+  if (conn->loop_hook) {
+    decision = conn->loop_hook(conn->loop_hook_arg, &state, decision);
+    if (decision < SQLITE_AGENT_LOOP_CONTINUE || decision > SQLITE_AGENT_LOOP_STOP) {
+      decision = SQLITE_AGENT_LOOP_CONTINUE;
+    }
+  }
+
+  if (decision != SQLITE_AGENT_LOOP_CONTINUE) {
+    char detail[96];
+    snprintf(detail, sizeof(detail), "%s: %d iterations without progress, %d repeated calls",
+             decision == SQLITE_AGENT_LOOP_STOP ? "stop" : "redirect", policy->stalled, state.repeated_calls);
+    agent_trace_add(conn, "policy", NULL, 0, 0, 0, 0, run->rows, detail);
+    DF("Loop policy: %s", detail);
+  }
+  return decision;
+}
+
+static const char agent_policy_redirect[] =
+  "The last calls brought no new data. Do not repeat a tool call with the same arguments: "
+  "call a different tool or change the arguments, or type DONE if the task is complete.";
+
+// MARK: - Grammars
+
+// GBNF grammars for llm_sampler_init_grammar(), so that the model can only
+// answer with well formed tool calls and rows. Generation ends as soon as the
+// root rule is complete.
+
+static const char agent_gbnf_json_rules[] =
+  "ws ::= [ \\t\\n]{0,8}\n"
+  "string ::= \"\\\"\" ( [^\"\\\\\\x7F\\x00-\\x1F] | \"\\\\\" ([\"\\\\/bfnrt] | \"u\" [0-9a-fA-F]{4}) )* \"\\\"\"\n"
+  "integer ::= \"-\"? ([0-9] | [1-9] [0-9]{0,15})\n"
+  "number ::= integer (\".\" [0-9]+)? ([eE] [-+]? [0-9]+)?\n"
+  "boolean ::= \"true\" | \"false\"\n"
+  "value ::= object | array | string | number | boolean | \"null\"\n"
+  "object ::= \"{\" ws ( string ws \":\" ws value ( ws \",\" ws string ws \":\" ws value )* )? ws \"}\"\n"
+  "array ::= \"[\" ws ( value ( ws \",\" ws value )* )? ws \"]\"\n";
+
+// Appends the GBNF literal matching the JSON string whose raw (still escaped)
+// content is text[0..len)
+static void agent_gbnf_json_string(sqlite3_str *out, const char *text, int len) {
+  sqlite3_str_appendall(out, "\"\\\"");
+  for (int i = 0; i < len; i++) {
+    char c = text[i];
+    if (c == '"' || c == '\\') sqlite3_str_appendchar(out, 1, '\\');
+    if (c == '\n') {
+      sqlite3_str_appendall(out, "\\n");
+      continue;
+    }
+    sqlite3_str_appendchar(out, 1, c);
+  }
+  sqlite3_str_appendall(out, "\\\"\"");
+}
+
+// Rule of a value of JSON schema type, "value" when unknown
+static const char* agent_gbnf_schema_rule(const char *js, const agent_json_token *type) {
+  static const char *const names[] = {"string", "integer", "number", "boolean", "array", "object"};
+  if (type && type->type == AGENT_JSON_STRING) {
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+      if (agent_json_equals(js, type, names[i])) return names[i];
+    }
+  }
+  return "value";
+}
+
+// Rule of a value of a column, from the affinity of its declared type
+static const char* agent_gbnf_column_rule(const agent_column *column) {
+  switch (column->affinity) {
+    case AGENT_AFFINITY_INTEGER: return "integer";
+    case AGENT_AFFINITY_TEXT: return "string";
+    case AGENT_AFFINITY_BLOB: return "value";
+    case AGENT_AFFINITY_NUMERIC:
+      if (agent_type_has(column->type, "BOOL")) return "boolean | integer";
+      return "number";
+    default: return "number";
+  }
+}
+
+// Tool calls of the table mode loop: one call, an array of calls or DONE. The
+// args of each tool may only hold the properties of its inputschema, with the
+// declared types.
+static char* agent_gbnf_tool_calls(sqlite3 *db, const agent_tool_catalog *catalog) {
+  sqlite3_str *out = sqlite3_str_new(db);
+  sqlite3_str_appendall(out, "root ::= call | \"[\" ws call ( ws \",\" ws call )* ws \"]\" | \"DONE\"\n");
+  sqlite3_str_appendall(out, "call ::= ");
+  for (int i = 0; i < catalog->tool_count; i++) {
+    sqlite3_str_appendf(out, "%stool-%d", i ? " | " : "", i);
+  }
+  sqlite3_str_appendchar(out, 1, '\n');
+
+  for (int i = 0; i < catalog->tool_count; i++) {
+    const agent_tool *tool = &catalog->tools[i];
+    sqlite3_str_appendf(out, "tool-%d ::= \"{\" ws \"\\\"tool\\\"\" ws \":\" ws ", i);
+    agent_gbnf_json_string(out, tool->name, (int)strlen(tool->name));
+    sqlite3_str_appendf(out, " ws \",\" ws \"\\\"args\\\"\" ws \":\" ws args-%d ws \"}\"\n", i);
+
+    agent_json_parser parser;
+    agent_json_init(&parser);
+    const char *schema = tool->inputschema;
+    int properties = -1;
+    if (agent_json_parse(&parser, schema, (int)strlen(schema)) == AGENT_JSON_COMPLETE &&
+        parser.tokens[parser.root].type == AGENT_JSON_OBJECT) {
+      properties = agent_json_object_get(&parser, schema, parser.root, "properties");
+    }
+
+    if (properties < 0 || parser.tokens[properties].type != AGENT_JSON_OBJECT ||
+        parser.tokens[properties].next == properties + 1) {
+      sqlite3_str_appendf(out, "args-%d ::= object\n", i);
+      agent_json_free(&parser);
+      continue;
+    }
+
+    sqlite3_str_appendf(out, "args-%d ::= \"{\" ws ( arg-%d ( ws \",\" ws arg-%d )* )? ws \"}\"\n", i, i, i);
+    sqlite3_str_appendf(out, "arg-%d ::= ", i);
+    const agent_json_token *tokens = parser.tokens;
+    int end = tokens[properties].next;
+    for (int k = properties + 1; k + 1 < end; k = tokens[k + 1].next) {
+      const agent_json_token *type = NULL;
+      if (tokens[k + 1].type == AGENT_JSON_OBJECT) {
+        int t = agent_json_object_get(&parser, schema, k + 1, "type");
+        if (t >= 0) type = &tokens[t];
+      }
+      if (k > properties + 1) sqlite3_str_appendall(out, " | ");
+      agent_gbnf_json_string(out, schema + tokens[k].start, tokens[k].end - tokens[k].start);
+      sqlite3_str_appendf(out, " ws \":\" ws %s", agent_gbnf_schema_rule(schema, type));
+    }
+    sqlite3_str_appendchar(out, 1, '\n');
+    agent_json_free(&parser);
+  }
+
+  sqlite3_str_appendall(out, agent_gbnf_json_rules);
+  return sqlite3_str_finish(out);
+}
+
+// GBNF of the tool calls of the connection catalog, built once per listing
+static const char* agent_catalog_grammar(sqlite3 *db, agent_connection *conn) {
+  agent_tool_catalog *catalog = conn->catalog;
+  if (!catalog) return NULL;
+  if (!catalog->grammar) catalog->grammar = agent_gbnf_tool_calls(db, catalog);
+  return catalog->grammar;
+}
+
+// Extraction answer: an array of objects whose members are the non-embedding
+// columns of the table, each a value of the column type or null
+static char* agent_gbnf_rows(sqlite3 *db, const agent_table *table) {
+  sqlite3_str *out = sqlite3_str_new(db);
+  sqlite3_str_appendall(out,
+    "root ::= \"[\" ws ( row ( ws \",\" ws row )* )? ws \"]\"\n"
+    "row ::= \"{\" ws ( column ( ws \",\" ws column )* )? ws \"}\"\n"
+    "column ::= ");
+  int first = 1;
+  for (int i = 0; i < table->column_count; i++) {
+    const agent_column *column = &table->columns[i];
+    if (column->embedding) continue;
+    if (!first) sqlite3_str_appendall(out, " | ");
+    first = 0;
+    agent_gbnf_json_string(out, column->name, (int)strlen(column->name));
+    sqlite3_str_appendf(out, " ws \":\" ws ( %s | \"null\" )", agent_gbnf_column_rule(column));
+  }
+  if (first) sqlite3_str_appendall(out, "string ws \":\" ws value");
+  sqlite3_str_appendchar(out, 1, '\n');
+  sqlite3_str_appendall(out, agent_gbnf_json_rules);
+  return sqlite3_str_finish(out);
+}
+
+// Makes the next llm_chat_respond() follow grammar, or restores the default
+// sampler when grammar is NULL. Without grammar support in sqlite-ai, or when
+// the grammar option is off, answers stay unconstrained.
+static void agent_sampler_constrain(sqlite3 *db, agent_connection *conn, const char *grammar) {
+  if (!grammar) {
+    if (!conn->grammar_active) return;
+    sqlite3_stmt *stmt = agent_stmt_acquire(db, conn, AGENT_STMT_SAMPLER_FREE);
+    if (stmt) {
+      sqlite3_step(stmt);
+      agent_stmt_release(stmt);
+    }
+    conn->grammar_active = 0;
+    return;
+  }
+  if (!conn->run_options->grammar || conn->no_grammar) return;
+
+  // A new chain, the grammar, then greedy selection
+  int ignored = 0;
+  if (agent_stmt_query_int(db, conn, AGENT_STMT_SAMPLER_CREATE, &ignored) != SQLITE_OK) {
+    D("WARNING: llm_sampler_create() not available, answers are not constrained");
+    conn->no_grammar = 1;
+    return;
+  }
+  conn->grammar_active = 1;
+  sqlite3_stmt *stmt = agent_stmt_acquire(db, conn, AGENT_STMT_SAMPLER_GRAMMAR);
+  int rc = SQLITE_ERROR;
+  if (stmt) {
+    sqlite3_bind_text(stmt, 1, grammar, -1, SQLITE_STATIC);
+    rc = sqlite3_step(stmt) == SQLITE_ROW ? SQLITE_OK : SQLITE_ERROR;
+    agent_stmt_release(stmt);
+  }
+  if (rc == SQLITE_OK) rc = agent_stmt_query_int(db, conn, AGENT_STMT_SAMPLER_GREEDY, &ignored);
+  if (rc != SQLITE_OK) {
+    // The chain left half built is dropped for the default sampler
+    DF("WARNING: Grammar sampler failed: %s", sqlite3_errmsg(db));
+    agent_sampler_constrain(db, conn, NULL);
+    conn->no_grammar = 1;
+  }
+}
+
+// Asks the model for the rows found in data, in a fresh context sized for the
+// prompt and the answer, and keeps the answer in run->extracted. Under
+// max_context the data is cut to the tokens left over.
+static int agent_extract_rows(sqlite3 *db, agent_connection *conn, agent_run_state *run,
+                              const char *schema_desc, const char *data, int data_len,
+                              const char **error) {
+  agent_run_set(&run->message, agent_extraction_prompt(schema_desc, data, data_len));
+  if (!run->message) return SQLITE_NOMEM;
+
+  int prompt_tokens = agent_token_count(db, conn, run->message, -1);
+  int answer_tokens = conn->run_options->result_tokens;
+  int max_context = conn->run_options->max_context;
+  if (max_context > 0 && prompt_tokens + answer_tokens > max_context) {
+    int data_tokens = agent_token_count(db, conn, data, data_len);
+    int allowed = max_context - answer_tokens - (prompt_tokens - data_tokens);
+    if (allowed < AGENT_MIN_RESULT_TOKENS) allowed = AGENT_MIN_RESULT_TOKENS;
+    int cut = agent_token_prefix(db, conn, data, data_len, allowed);
+    agent_trace_truncate(db, conn, "extract", data, data_len, cut, allowed);
+    data_len = cut;
+    DF("Extraction data cut to %d tokens (%d bytes)", allowed, data_len);
+
+    agent_run_set(&run->message, agent_extraction_prompt(schema_desc, data, data_len));
+    if (!run->message) return SQLITE_NOMEM;
+    prompt_tokens = allowed + (prompt_tokens - data_tokens);
+  }
+
+  DF("=== FULL EXTRACTION PROMPT ===\n%s\n=== END EXTRACTION PROMPT ===", run->message);
+
+  int extraction_size = prompt_tokens + answer_tokens;
+  if (extraction_size < AGENT_MIN_CONTEXT_TOKENS) extraction_size = AGENT_MIN_CONTEXT_TOKENS;
+  if (max_context > 0 && extraction_size > max_context) extraction_size = max_context;
+  DF("Extraction context: prompt=%d, size=%d", prompt_tokens, extraction_size);
+  agent_create_chat_context(db, extraction_size);
+  agent_sampler_constrain(db, conn, run->grammar);
+
+  sqlite3_stmt *stmt = agent_stmt_acquire(db, conn, AGENT_STMT_CHAT_RESPOND);
+  if (!stmt) {
+    D("ERROR: Failed to prepare extraction query");
+    *error = "Failed to prepare extraction";
+    return SQLITE_ERROR;
+  }
+
+  if (agent_chat_step(db, conn, stmt, "extract", run->message) != SQLITE_ROW) {
+    D("ERROR: LLM extraction failed");
+    *error = "Failed to extract structured data";
+    agent_stmt_release(stmt);
+    return SQLITE_ERROR;
+  }
+
+  const char *json_data = (const char*)sqlite3_column_text(stmt, 0);
+  agent_run_set(&run->extracted, sqlite3_mprintf("%s", json_data ? json_data : "[]"));
+  agent_stmt_release(stmt);
+  if (!run->extracted) return SQLITE_NOMEM;
+
+  DF("=== FULL EXTRACTED JSON ===\n%s\n=== END EXTRACTED JSON ===", run->extracted);
+  return SQLITE_OK;
+}
+
+// Streaming: asks for the rows of one tool result page in the loop chat
+// itself, so only the page is prefilled and the conversation is kept. The
+// first request in a chat carries the extraction rules, later ones refer to
+// them. Returns SQLITE_FULL, with nothing sent, when the request and its
+// answer do not fit in the room left in the chat.
+static int agent_extract_page(sqlite3 *db, agent_connection *conn, agent_run_state *run,
+                              const char *schema_desc, const char *data, int *rules_sent,
+                              const char **error) {
+  agent_run_set(&run->message, *rules_sent ?
+    sqlite3_mprintf("Extract the rows of this tool result with the same keys as before.\n\n"
+                    "Data to extract:\n%s\n\nReturn ONLY the JSON array:", data) :
+    agent_extraction_prompt(schema_desc, data, (int)strlen(data)));
+  if (!run->message) return SQLITE_NOMEM;
+
+  int size = 0, used = 0;
+  if (agent_stmt_query_int(db, conn, AGENT_STMT_CONTEXT_SIZE, &size) == SQLITE_OK &&
+      agent_stmt_query_int(db, conn, AGENT_STMT_CONTEXT_USED, &used) == SQLITE_OK &&
+      used + agent_token_count(db, conn, run->message, -1) + conn->run_options->result_tokens > size) {
+    DF("Page does not fit in the chat (%d of %d tokens used)", used, size);
+    return SQLITE_FULL;
+  }
+
+  agent_sampler_constrain(db, conn, run->grammar);
+  sqlite3_stmt *stmt = agent_stmt_acquire(db, conn, AGENT_STMT_CHAT_RESPOND);
+  if (!stmt) {
+    *error = "Failed to prepare extraction";
+    return SQLITE_ERROR;
+  }
+  if (agent_chat_step(db, conn, stmt, "extract", run->message) != SQLITE_ROW) {
+    *error = "Failed to extract structured data";
+    agent_stmt_release(stmt);
+    return SQLITE_ERROR;
+  }
+  *rules_sent = 1;
+  const char *json_data = (const char*)sqlite3_column_text(stmt, 0);
+  agent_run_set(&run->extracted, sqlite3_mprintf("%s", json_data ? json_data : "[]"));
+  agent_stmt_release(stmt);
+  return run->extracted ? SQLITE_OK : SQLITE_NOMEM;
+}
+
+// One INSERT serves every extracted row: it is built from the table_info
+// columns and rebound for each object. With embedding columns it also returns
+// the rowids to embed, unless the table or the SQLite version has no
+// RETURNING rowid, in which case agent_table_store_rows() reads them from
+// sqlite3_last_insert_rowid(). The statement stays with the descriptor until
+// the internal statements are cleared, so a batch of runs prepares it once.
+static int agent_table_prepare_insert(sqlite3 *db, agent_connection *conn, agent_table *table,
+                                      sqlite3_stmt **out) {
+  int on_conflict = conn->run_options->on_conflict;
+  if (table->insert && table->insert_on_conflict == on_conflict) {
+    sqlite3_reset(table->insert);
+    sqlite3_clear_bindings(table->insert);
+    *out = table->insert;
+    return SQLITE_OK;
+  }
+  sqlite3_finalize(table->insert);
+  table->insert = NULL;
+  *out = NULL;
+
+  sqlite3_str *insert_sql = sqlite3_str_new(db);
+  sqlite3_str *update_part = sqlite3_str_new(db);
+  sqlite3_str *values_part = sqlite3_str_new(db);
+  sqlite3_str_appendf(insert_sql, "INSERT %sINTO %s (",
+                      agent_on_conflict_verbs[on_conflict], table->name);
+
+  int first_col = 1;
+  int bind_count = 0;
+  for (int i = 0; i < table->column_count; i++) {
+    const char *column = table->columns[i].name;
+    table->columns[i].bind_idx = 0;
+    if (sqlite3_str_length(update_part) > 0) sqlite3_str_appendall(update_part, ", ");
+    if (table->columns[i].embedding) {
+      // Updated rows get their embeddings generated again
+      sqlite3_str_appendf(update_part, "\"%w\" = NULL", column);
+      continue;
+    }
+    sqlite3_str_appendf(update_part, "\"%w\" = excluded.\"%w\"", column, column);
+
+    if (!first_col) {
+      sqlite3_str_appendall(insert_sql, ", ");
+      sqlite3_str_appendall(values_part, ", ");
+    }
+    sqlite3_str_appendf(insert_sql, "\"%w\"", column);
+    sqlite3_str_appendall(values_part, "?");
+    table->columns[i].bind_idx = ++bind_count;
+    first_col = 0;
+  }
+
+  char *values_sql = sqlite3_str_finish(values_part);
+  char *update_sql = sqlite3_str_finish(update_part);
+  sqlite3_str_appendf(insert_sql, ") VALUES (%s)", values_sql ? values_sql : "");
+  if (on_conflict == AGENT_ON_CONFLICT_UPDATE) {
+    sqlite3_str_appendf(insert_sql, " ON CONFLICT DO UPDATE SET %s", update_sql ? update_sql : "");
+  }
+  sqlite3_free(values_sql);
+  sqlite3_free(update_sql);
+
+  char *insert_query = sqlite3_str_finish(insert_sql);
+  if (!insert_query) return SQLITE_NOMEM;
+
+  int rc = SQLITE_ERROR;
+  table->returns_rowid = 0;
+  if (table->embedding_col_count > 0) {
+    char *returning_query = sqlite3_mprintf("%s RETURNING rowid", insert_query);
+    if (!returning_query) {
+      sqlite3_free(insert_query);
+      return SQLITE_NOMEM;
+    }
+    DF("Preparing INSERT: %s", returning_query);
+    rc = sqlite3_prepare_v3(db, returning_query, -1, SQLITE_PREPARE_PERSISTENT, &table->insert, 0);
+    sqlite3_free(returning_query);
+    table->returns_rowid = (rc == SQLITE_OK);
+  }
+
+  if (rc != SQLITE_OK) {
+    DF("Preparing INSERT: %s", insert_query);
+    rc = sqlite3_prepare_v3(db, insert_query, -1, SQLITE_PREPARE_PERSISTENT, &table->insert, 0);
+  }
+  sqlite3_free(insert_query);
+  if (rc != SQLITE_OK) {
+    DF("ERROR: Failed to prepare insert statement: %s", sqlite3_errmsg(db));
+    return rc;
+  }
+  table->insert_on_conflict = on_conflict;
+  *out = table->insert;
+  return SQLITE_OK;
+}
+
+// Inserts the rows of an extraction answer in one savepoint. Rows are the
+// objects of the first JSON array (or the single object) in the answer;
+// objects completed before a truncation or syntax error are still inserted.
+// On failure the savepoint is rolled back and *error describes the row.
+static int agent_table_store_rows(sqlite3 *db, agent_connection *conn, const agent_table *table,
+                                  agent_run_state *run, int *rows_inserted, char **error) {
+  double started = agent_clock_ms();
+  sqlite3_stmt *stmt = run->insert;
+  const char *extracted = run->extracted;
+  int first_rowid = run->rowid_count;
+  int first_inserted = *rows_inserted;
+
+  agent_json_parser parser;
+  agent_json_init(&parser);
+  const char *json_start = strpbrk(extracted, "[{");
+  if (json_start) {
+    parser.pos = (int)(json_start - extracted);
+    agent_json_parse(&parser, extracted, (int)strlen(extracted));
+  }
+
+  agent_json_token *tokens = parser.tokens;
+  int rows_token = parser.root;
+  if (rows_token >= 0 && tokens[rows_token].type == AGENT_JSON_OBJECT) {
+    // {"items": [...]} wraps the rows in a member array
+    int end = tokens[rows_token].next ? tokens[rows_token].next : parser.count;
+    for (int k = rows_token + 1; k + 1 < end && tokens[k + 1].next; k = tokens[k + 1].next) {
+      if (tokens[k + 1].type == AGENT_JSON_ARRAY) {
+        rows_token = k + 1;
+        break;
+      }
+    }
+  }
+
+  int rows_end = 0;
+  int row = -1;
+  if (rows_token >= 0 && tokens[rows_token].type == AGENT_JSON_ARRAY) {
+    rows_end = tokens[rows_token].next ? tokens[rows_token].next : parser.count;
+    row = rows_token + 1;
+  } else if (rows_token >= 0 && tokens[rows_token].next) {
+    rows_end = tokens[rows_token].next;
+    row = rows_token;
+  }
+
+  int rc = agent_savepoint_begin(db);
+  if (rc != SQLITE_OK) {
+    *error = sqlite3_mprintf("Failed to start storing rows: %s", sqlite3_errmsg(db));
+    agent_json_free(&parser);
+    return rc;
+  }
+
+  for (; row >= 0 && row < rows_end && tokens[row].next; row = tokens[row].next) {
+    if (tokens[row].type != AGENT_JSON_OBJECT) continue;
+    int obj = row;
+
+    DF("Found JSON object (length=%d): %.200s...", tokens[obj].end - tokens[obj].start, extracted + tokens[obj].start);
+
+    // Each member is matched to its column once; absent keys stay NULL
+    for (int k = obj + 1; k + 1 < tokens[obj].next; k = tokens[k + 1].next) {
+      for (int i = 0; i < table->column_count; i++) {
+        const agent_column *column = &table->columns[i];
+        if (column->bind_idx && agent_json_equals(extracted, &tokens[k], column->name)) {
+          agent_json_bind(stmt, column->bind_idx, extracted, &tokens[k + 1], column->affinity);
+          break;
+        }
+      }
+    }
+
+    #ifdef AGENT_DEBUG
+    char *expanded_sql = sqlite3_expanded_sql(stmt);
+    if (expanded_sql) {
+      DF("Full INSERT:\n%s", expanded_sql);
+      sqlite3_free(expanded_sql);
+    }
+    #endif
+
+    sqlite3_int64 last_rowid = sqlite3_last_insert_rowid(db);
+    rc = sqlite3_step(stmt);
+    while (rc == SQLITE_ROW) {
+      if (agent_run_add_rowid(run, sqlite3_column_int64(stmt, 0)) != SQLITE_OK) {
+        rc = SQLITE_NOMEM;
+        break;
+      }
+      rc = sqlite3_step(stmt);
+    }
+    // Without RETURNING the rowid of an inserted row still is the last one;
+    // a row updated by on_conflict=update is then not embedded again
+    if (rc == SQLITE_DONE && table->embedding_col_count > 0 && !table->returns_rowid &&
+        sqlite3_last_insert_rowid(db) != last_rowid &&
+        agent_run_add_rowid(run, sqlite3_last_insert_rowid(db)) != SQLITE_OK) {
+      rc = SQLITE_NOMEM;
+    }
+
+    if (rc != SQLITE_DONE) {
+      DF("ERROR: Insert failed (rc=%d): %s", rc, sqlite3_errmsg(db));
+      *error = sqlite3_mprintf("Failed to insert row: %s", sqlite3_errmsg(db));
+      sqlite3_reset(stmt);
+      sqlite3_clear_bindings(stmt);
+      break;
+    }
+    rc = SQLITE_OK;
+
+    // Rows skipped by ON CONFLICT IGNORE are not counted
+    if (sqlite3_changes(db) > 0) {
+      (*rows_inserted)++;
+      DF("Row %d inserted", *rows_inserted);
+    }
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+  }
+  agent_json_free(&parser);
+
+  int released = agent_savepoint_end(db, rc == SQLITE_OK);
+  if (rc == SQLITE_OK && released != SQLITE_OK) {
+    rc = released;
+    *error = sqlite3_mprintf("Failed to commit rows: %s", sqlite3_errmsg(db));
+  }
+  if (rc != SQLITE_OK) {
+    run->rowid_count = first_rowid;
+    *rows_inserted = first_inserted;
+  }
+  double duration = agent_clock_ms() - started;
+  agent_stats_add(conn, "insert", table->name, duration);
+  agent_trace_add(conn, "insert", table->name, duration, 0, 0,
+                  (sqlite3_int64)strlen(extracted), *rows_inserted - first_inserted, *error);
+  return rc;
+}
+
+// MARK: - Embedding map
+
+// agent_embedding_map keeps the source columns of each embedding column, as
+// chosen by the model on the first run or written by the user, so that later
+// runs skip the mapping prompt
+static char* agent_embedding_map_get(sqlite3 *db, const char *table_name, const char *column) {
+  sqlite3_stmt *stmt = NULL;
+  char *sources = NULL;
+  // A missing agent_embedding_map table fails the prepare: nothing cached yet
+  if (sqlite3_prepare_v2(db, "SELECT sources FROM agent_embedding_map "
+                             "WHERE table_name = ?1 AND column_name = ?2", -1, &stmt, 0) != SQLITE_OK) {
+    return NULL;
+  }
+  sqlite3_bind_text(stmt, 1, table_name, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 2, column, -1, SQLITE_STATIC);
+  if (sqlite3_step(stmt) == SQLITE_ROW) {
+    const char *value = (const char*)sqlite3_column_text(stmt, 0);
+    if (value && value[0]) sources = sqlite3_mprintf("%s", value);
+  }
+  sqlite3_finalize(stmt);
+  return sources;
+}
+
+static void agent_embedding_map_put(sqlite3 *db, const char *table_name, const char *column,
+                                    const char *sources) {
+  if (sqlite3_exec(db, "CREATE TABLE IF NOT EXISTS agent_embedding_map ("
+                       "table_name TEXT NOT NULL, column_name TEXT NOT NULL, sources TEXT NOT NULL, "
+                       "PRIMARY KEY (table_name, column_name))", 0, 0, 0) != SQLITE_OK) {
+    DF("WARNING: Cannot create agent_embedding_map: %s", sqlite3_errmsg(db));
+    return;
+  }
+
+  sqlite3_stmt *stmt = NULL;
+  if (sqlite3_prepare_v2(db, "INSERT OR REPLACE INTO agent_embedding_map (table_name, column_name, sources) "
+                             "VALUES (?1, ?2, ?3)", -1, &stmt, 0) != SQLITE_OK) {
+    return;
+  }
+  sqlite3_bind_text(stmt, 1, table_name, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 2, column, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 3, sources, -1, SQLITE_STATIC);
+  sqlite3_step(stmt);
+  sqlite3_finalize(stmt);
+}
+
+// Parses the comma-separated source columns of an embedding column, as
+// written in agent_embedding_map or answered by the model, and frees
+// selected. *sql is the expression of the text to embed and *list the
+// columns kept, both NULL when none of them is a column of table.
+static void agent_embedding_sources(sqlite3 *db, const agent_table *table, char *selected,
+                                    char **sql, char **list) {
+  sqlite3_str *embed = sqlite3_str_new(db);
+  sqlite3_str *sources = sqlite3_str_new(db);
+
+  char *token = strtok(selected, ",");
+  while (token != NULL) {
+    while (*token == ' ') token++;
+    char *end = token + strlen(token) - 1;
+    while (end > token && (*end == ' ' || *end == '\n' || *end == '\r')) {
+      *end = '\0';
+      end--;
+    }
+
+    int found = 0;
+    for (int i = 0; i < table->column_count; i++) {
+      if (strcmp(table->columns[i].name, token) == 0) {
+        found = 1;
+        break;
+      }
+    }
+
+    if (found) {
+      if (sqlite3_str_length(sources) > 0) {
+        sqlite3_str_appendall(embed, " || ' | ' || ");
+        sqlite3_str_appendchar(sources, 1, ',');
+      }
+      sqlite3_str_appendf(embed, "COALESCE(%s, '')", token);
+      sqlite3_str_appendall(sources, token);
+    }
+
+    token = strtok(NULL, ",");
+  }
+  sqlite3_free(selected);
+
+  *sql = sqlite3_str_finish(embed);
+  *list = sqlite3_str_finish(sources);
+}
+
+// MARK: - Embeddings
+
+// sqlite-vector keeps its index settings per connection and reads the rows
+// of the table when searching, so a column that vector_init() already set up
+// with the same dimension needs nothing for newly embedded rows. A schema
+// change (the table may have been recreated) sets it up again.
+static agent_vector_index* agent_vector_index_find(agent_connection *conn, const char *table_name,
+                                                   const char *column) {
+  for (agent_vector_index *index = conn->vector_indexes; index; index = index->next) {
+    if (sqlite3_stricmp(index->table_name, table_name) == 0 &&
+        sqlite3_stricmp(index->column, column) == 0) {
+      return index;
+    }
+  }
+  return NULL;
+}
+
+static void agent_vector_index_save(agent_connection *conn, const char *table_name,
+                                    const char *column, int dimension, sqlite3_int64 schema_version) {
+  agent_vector_index *index = agent_vector_index_find(conn, table_name, column);
+  if (!index) {
+    index = sqlite3_malloc(sizeof(agent_vector_index));
+    if (!index) return;
+    index->table_name = sqlite3_mprintf("%s", table_name);
+    index->column = sqlite3_mprintf("%s", column);
+    if (!index->table_name || !index->column) {
+      sqlite3_free(index->table_name);
+      sqlite3_free(index->column);
+      sqlite3_free(index);
+      return;
+    }
+    index->next = conn->vector_indexes;
+    conn->vector_indexes = index;
+  }
+  index->dimension = dimension;
+  index->schema_version = schema_version;
+}
+
+static void agent_vector_indexes_clear(agent_connection *conn) {
+  while (conn->vector_indexes) {
+    agent_vector_index *index = conn->vector_indexes;
+    conn->vector_indexes = index->next;
+    sqlite3_free(index->table_name);
+    sqlite3_free(index->column);
+    sqlite3_free(index);
+  }
+}
+
+// Embeds the rows stored by this run, embed_batch rowids at a time: the
+// source text of a group is read with one SELECT, each text is embedded,
+// and the BLOBs are written by one prepared UPDATE in a single savepoint.
+// sqlite-ai has no batched embedding call, so the model still runs once per
+// row; what is batched is the reading and the writing. source is the SQL
+// expression of the text to embed.
+static int agent_embed_rows(sqlite3 *db, agent_connection *conn, agent_run_state *run,
+                            const char *table_name, const char *column, const char *source) {
+  char *select_sql = sqlite3_mprintf(
+    "SELECT rowid, %s FROM %s WHERE rowid IN (SELECT value FROM json_each(?1)) AND \"%w\" IS NULL",
+    source, table_name, column);
+  char *update_sql = sqlite3_mprintf("UPDATE %s SET \"%w\" = ?1 WHERE rowid = ?2", table_name, column);
+  sqlite3_stmt *select = NULL, *embed = NULL, *update = NULL;
+  int rc = (select_sql && update_sql) ? SQLITE_OK : SQLITE_NOMEM;
+  if (rc == SQLITE_OK) rc = sqlite3_prepare_v2(db, select_sql, -1, &select, 0);
+  if (rc == SQLITE_OK) rc = sqlite3_prepare_v2(db, "SELECT llm_embed_generate(?1, '')", -1, &embed, 0);
+  if (rc == SQLITE_OK) rc = sqlite3_prepare_v2(db, update_sql, -1, &update, 0);
+  sqlite3_free(select_sql);
+  sqlite3_free(update_sql);
+  if (rc != SQLITE_OK) {
+    DF("ERROR: Failed to prepare embedding statements: %s", sqlite3_errmsg(db));
+  }
+
+  int batch = conn->run_options->embed_batch;
+  for (int first = 0; first < run->rowid_count && rc == SQLITE_OK; first += batch) {
+    int last = first + batch < run->rowid_count ? first + batch : run->rowid_count;
+    sqlite3_str *ids = sqlite3_str_new(db);
+    sqlite3_str_appendchar(ids, 1, '[');
+    for (int i = first; i < last; i++) {
+      sqlite3_str_appendf(ids, i > first ? ",%lld" : "%lld", run->rowids[i]);
+    }
+    sqlite3_str_appendchar(ids, 1, ']');
+    char *ids_json = sqlite3_str_finish(ids);
+    if (!ids_json) {
+      rc = SQLITE_NOMEM;
+      break;
+    }
+
+    int embedded = 0;
+    rc = agent_savepoint_begin(db);
+    if (rc != SQLITE_OK) {
+      sqlite3_free(ids_json);
+      DF("ERROR: Embedding savepoint failed: %s", sqlite3_errmsg(db));
+      break;
+    }
+    sqlite3_bind_text(select, 1, ids_json, -1, sqlite3_free);
+    while (rc == SQLITE_OK && sqlite3_step(select) == SQLITE_ROW) {
+      sqlite3_bind_value(embed, 1, sqlite3_column_value(select, 1));
+      if (sqlite3_step(embed) == SQLITE_ROW) {
+        sqlite3_bind_value(update, 1, sqlite3_column_value(embed, 0));
+        sqlite3_bind_int64(update, 2, sqlite3_column_int64(select, 0));
+        rc = sqlite3_step(update) == SQLITE_DONE ? SQLITE_OK : sqlite3_errcode(db);
+        sqlite3_reset(update);
+        embedded++;
+      } else {
+        rc = sqlite3_errcode(db);
+      }
+      sqlite3_reset(embed);
+    }
+    if (rc == SQLITE_OK) rc = sqlite3_reset(select);
+    else sqlite3_reset(select);
+    sqlite3_clear_bindings(select);
+    int released = agent_savepoint_end(db, rc == SQLITE_OK);
+    if (rc == SQLITE_OK) rc = released;
+    if (rc == SQLITE_OK) {
+      DF("Embedded %d rows of %s (batch of %d)", embedded, column, last - first);
+    } else {
+      DF("ERROR: Embedding update failed: %s", sqlite3_errmsg(db));
+    }
+  }
+
+  sqlite3_finalize(select);
+  sqlite3_finalize(embed);
+  sqlite3_finalize(update);
+  return rc;
+}
+
+static void agent_run_execute(
+  sqlite3_context *context,
+  int argc,
+  sqlite3_value **argv,
+  agent_run_state *run
+){
+  if (argc < 1 || argc > 5) {
+    sqlite3_result_error(context, "agent_run requires 1-5 arguments: (goal, [table_name], [max_iterations], [system_prompt], [options])", -1);
+    return;
+  }
+
+  sqlite3 *db = sqlite3_context_db_handle(context);
+  agent_connection *conn = (agent_connection*)sqlite3_user_data(context);
+  const char *goal = (const char*)sqlite3_value_text(argv[0]);
+  const char *table_name = NULL;
+  int max_iterations = conn->run_options->max_iterations;
+  const char *custom_system_prompt = NULL;
+
+  if (argc >= 2) {
+    if (sqlite3_value_type(argv[1]) == SQLITE_INTEGER) {
+      max_iterations = sqlite3_value_int(argv[1]);
+      table_name = NULL;
+    } else {
+      table_name = (const char*)sqlite3_value_text(argv[1]);
+      if (table_name && strlen(table_name) == 0) {
+        table_name = NULL;
+      }
+    }
+  }
+
+  if (argc >= 3 && sqlite3_value_type(argv[2]) != SQLITE_NULL) {
+    max_iterations = sqlite3_value_int(argv[2]);
+  }
+
+  if (argc >= 4) {
+    custom_system_prompt = (const char*)sqlite3_value_text(argv[3]);
+  }
+
+  if (!goal) {
+    sqlite3_result_error(context, "goal must be non-null", -1);
+    return;
+  }
+
+  agent_checkpoint_begin(db, conn, run, argv[0], table_name, max_iterations, custom_system_prompt);
+
+  if (!table_name) {
+    D("MODE 1: Text-Only Response");
+    int rc;
+
+    const char *tools_list = agent_get_tools_list(db, conn);
+    if (!tools_list) {
+      D("ERROR: Failed to list MCP tools");
+      sqlite3_result_error(context, "Not connected. Call mcp_connect() first", -1);
+      return;
+    }
+    // A chat that persistent_context continues keeps the tools it lists, unless
+    // it turns out to be full and a new one is started for this goal anyway
+    int keep_tools = agent_tools_kept(conn);
+    const char *catalog_tools = tools_list;
+    int preamble_tokens = 0;
+    agent_budget budget;
+    for (;;) {
+      sqlite3_free(run->tools);
+      run->tools = keep_tools ? (conn->chat.tools ? sqlite3_mprintf("%s", conn->chat.tools) : NULL)
+                              : agent_tools_select(db, conn, goal);
+      tools_list = run->tools ? run->tools : catalog_tools;
+      DF("Received tools list (length=%zu)", strlen(tools_list));
+
+      // The preamble is sent once; later turns only carry the new tool result
+      sqlite3_free(run->preamble);
+      if (custom_system_prompt && strlen(custom_system_prompt) > 0) {
+        run->preamble = sqlite3_mprintf("%s", custom_system_prompt);
+      } else {
+        run->preamble = sqlite3_mprintf(
+          "You are an AI agent that can use tools to accomplish tasks.\n\n"
+          "%s\n"
+          "To use a tool, respond with EXACTLY this format:\n"
+          "TOOL_CALL: tool_name\n"
+          "ARGS: {\"param1\": \"value1\", \"param2\": \"value2\"}\n"
+          "To call several independent tools at once, write one TOOL_CALL/ARGS pair per tool.\n\n"
+          "After the tool executes, you'll see the result and can call another tool or provide a final answer.\n"
+          "Type DONE only when you have completed the task.",
+          tools_list);
+      }
+      if (!run->preamble) {
+        sqlite3_result_error_nomem(context);
+        return;
+      }
+
+      // The context holds the preamble and the goal, then one tool result and
+      // one reply per iteration
+      preamble_tokens = agent_token_count(db, conn, run->preamble, -1);
+      int goal_tokens = agent_token_count(db, conn, goal, -1) + 16;
+      agent_budget_plan(conn, preamble_tokens + goal_tokens, max_iterations, &budget);
+      DF("Token budget: preamble=%d, context=%d, per result=%d",
+         preamble_tokens, budget.ctx_size, budget.result_tokens);
+      if (!keep_tools || agent_chat_reusable(db, conn, run->preamble, budget.ctx_size - preamble_tokens)) break;
+      keep_tools = 0;
+    }
+
+    int reused = 0;
+    rc = agent_chat_begin(db, conn, run->preamble, run->tools, budget.ctx_size,
+                          budget.ctx_size - preamble_tokens, &reused);
+    if (rc != SQLITE_OK) {
+      D("ERROR: Failed to create LLM chat context");
+      sqlite3_result_error(context, "Failed to create LLM chat context", -1);
+      return;
+    }
+
+    // A resumed run starts its new chat with the tool results of its last checkpoint
+    const char *saved = run->saved_history ? run->saved_history : "";
+    agent_run_set(&run->message, reused ? sqlite3_mprintf("New task.\nUser goal: %s%s%s", goal,
+                                                          saved[0] ? "\n\n" : "", saved)
+                                        : sqlite3_mprintf("%s\n\nUser goal: %s%s%s", run->preamble, goal,
+                                                          saved[0] ? "\n\n" : "", saved));
+    if (!run->message) {
+      sqlite3_result_error_nomem(context);
+      return;
+    }
+
+    for (int i = run->start_iteration; i < max_iterations; i++) {
+      if (i > run->start_iteration) agent_checkpoint_save(db, run, i, run->message);
+      if (agent_job_checkpoint(conn, i + 1)) {
+        sqlite3_result_error(context, "agent_run cancelled", -1);
+        return;
+      }
+      if (agent_limits_reached(conn)) {
+        agent_limits_result(context, conn);
+        return;
+      }
+      DF("Iteration %d/%d", i+1, max_iterations);
+      DF("Message (length=%zu):\n%s", strlen(run->message), run->message);
+
+      char *llm_response = NULL;
+      if (agent_chat_turn(db, conn, run, run->message, 0, &llm_response) != SQLITE_OK) {
+        if (agent_limits_reached(conn)) {
+          agent_limits_result(context, conn);
+          return;
+        }
+        D("ERROR: LLM did not respond");
+        sqlite3_result_error(context, "LLM did not respond", -1);
+        return;
+      }
+      agent_run_set(&run->response, llm_response);
+      if (!llm_response) {
+        D("WARNING: LLM returned NULL response, ending loop");
+        break;
+      }
+
+      DF("LLM Response (length=%zu):\n%s", strlen(llm_response), llm_response);
+
+      int done = agent_find_done(llm_response) != NULL;
+      int calls = done ? 0 : agent_find_text_tool_calls(llm_response, run);
+      // An answer given before the last page of a compacted result was read
+      // is kept for when the iterations run out, and the next page is sent
+      if (calls == 0 && run->pending_next < run->pending_count) {
+        agent_run_set(&run->result, sqlite3_mprintf("%s", llm_response));
+        if (!run->result) {
+          sqlite3_result_error_nomem(context);
+          return;
+        }
+        if (i + 1 == max_iterations) break;
+        DF("Answer before all result pages were read, %d pages left", run->pending_count - run->pending_next);
+        agent_run_set(&run->message, sqlite3_mprintf("%s\nAnswer again once you have read every item: "
+                                                     "call another tool or type DONE when you have completed the task.",
+                                                     run->pending[run->pending_next++]));
+        if (!run->message) {
+          sqlite3_result_error_nomem(context);
+          return;
+        }
+        continue;
+      }
+
+      if (done) {
+        D("Agent said DONE - ending loop");
+        agent_run_set(&run->result, sqlite3_mprintf("%s", llm_response));
+        break;
+      }
+
+      if (calls == 0) {
+        D("No TOOL_CALL marker - treating as final answer");
+        agent_run_set(&run->result, sqlite3_mprintf("%s", llm_response));
+        break;
+      }
+
+      // The reply is kept when it ends the run; tool calls are not started past a budget
+      if (agent_limits_reached(conn)) {
+        agent_limits_result(context, conn);
+        return;
+      }
+      agent_call_tools(db, conn, run);
+
+      // All results of the response go back in one message, sharing the
+      // per-iteration result budget
+      int result_tokens = budget.result_tokens / run->call_count;
+      if (result_tokens < AGENT_MIN_RESULT_TOKENS) result_tokens = AGENT_MIN_RESULT_TOKENS;
+      sqlite3_str *message = sqlite3_str_new(db);
+      sqlite3_str *results = sqlite3_str_new(db);
+      int failed = 0;
+      for (int c = 0; c < run->call_count; c++) {
+        agent_tool_call *call = &run->calls[c];
+        DF("Extracted tool: '%s' args: '%s'", call->name, call->args);
+        if (c > 0) sqlite3_str_appendchar(results, 1, '\n');
+
+        if (!call->result) {
+          DF("ERROR: Failed to execute tool '%s'", call->name);
+          sqlite3_str_appendf(results, "{\"error\": \"Failed to execute tool %s\"}", call->name);
+          sqlite3_str_appendf(message, "Tool %s failed\n", call->name);
+          failed++;
+          continue;
+        }
+
+        DF("Tool result (length=%zu): %.500s%s",
+           strlen(call->result),
+           call->result,
+           strlen(call->result) > 500 ? "..." : "");
+
+        // A compacted result shows its first page, whole elements only; the
+        // others are sent once the model has answered
+        agent_result_pages pages;
+        if (!conn->run_options->compact || agent_tool_result_is_error(call->result) ||
+            !agent_compact_result(db, conn, NULL, call->name, call->result, result_tokens, &pages)) {
+          pages.count = 0;
+        }
+        const char *shown = pages.count ? pages.pages[0].text : call->result;
+        int shown_len = (int)strlen(shown);
+        int keep = agent_token_prefix(db, conn, shown, shown_len, result_tokens);
+        char label[96] = "";
+        if (keep < shown_len) {
+          agent_trace_truncate(db, conn, call->name, shown, shown_len, keep, result_tokens);
+          snprintf(label, sizeof(label), " (truncated)");
+        } else if (pages.count > 1) {
+          agent_result_page_label(&pages, 0, ", the next items follow", label, sizeof(label));
+        }
+        sqlite3_str_appendall(results, call->result);
+        sqlite3_str_appendf(message, "Tool %s returned%s: %.*s\n", call->name, label, keep, shown);
+        for (int p = 1; p < pages.count && rc == SQLITE_OK; p++) {
+          const char *text = pages.pages[p].text;
+          int text_len = (int)strlen(text);
+          int page_keep = agent_token_prefix(db, conn, text, text_len, budget.result_tokens);
+          agent_result_page_label(&pages, p, NULL, label, sizeof(label));
+          rc = agent_run_add_pending(run, sqlite3_mprintf("Tool %s returned%s: %.*s\n",
+                                                          call->name, label, page_keep, text));
+        }
+        agent_result_pages_free(&pages);
+      }
+      sqlite3_str_appendall(message, "\nCall another tool or type DONE when you have completed the task.");
+      agent_run_set(&run->result, sqlite3_str_finish(results));
+      agent_run_set(&run->message, sqlite3_str_finish(message));
+      if (failed == run->call_count) break;
+      if (!run->message || !run->result || rc != SQLITE_OK) {
+        sqlite3_result_error_nomem(context);
+        return;
+      }
+
+      int decision = agent_policy_step(db, conn, run, NULL, i + 1, max_iterations);
+      if (decision == SQLITE_AGENT_LOOP_STOP) break;
+      if (decision == SQLITE_AGENT_LOOP_REDIRECT) {
+        agent_run_set(&run->message, sqlite3_mprintf("%s\n%s", run->message, agent_policy_redirect));
+        if (!run->message) {
+          sqlite3_result_error_nomem(context);
+          return;
+        }
+      }
+
+      if (strstr(run->result, "\"error\"")) {
+        D("Tool returned error, continuing to next iteration");
+        continue;
+      }
+    }
+    if (run->pending_next < run->pending_count) {
+      DF("WARNING: %d result pages were not sent, the iterations ran out",
+         run->pending_count - run->pending_next);
+      if (conn->trace.active) {
+        char detail[64];
+        snprintf(detail, sizeof(detail), "%d result pages not sent", run->pending_count - run->pending_next);
+        agent_trace_add(conn, "truncate", "pages", 0, 0, 0, 0, 0, detail);
+      }
+    }
+
+    run->finished = 1;
+    sqlite3_result_text(context, run->result ? run->result : "", -1, SQLITE_TRANSIENT);
+    return;
+  }
+
+  D("MODE 2: Table Extraction Mode");
+  run->table_mode = 1;
+  agent_table *table = NULL;
+  int rc = agent_table_get(db, conn, table_name, &table);
+  if (rc == SQLITE_NOMEM) {
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+  if (rc != SQLITE_OK) {
+    sqlite3_result_error(context, "Failed to query table schema", -1);
+    return;
+  }
+  if (!table) {
+    sqlite3_result_error(context, "Table does not exist or has no columns", -1);
+    return;
+  }
+  const char *schema_desc = table->schema;
+  sqlite3_stmt *stmt;
+
+  DF("Goal: %s", goal);
+  DF("Table: %s", table_name);
+  DF("Max iterations: %d", max_iterations);
+
+  const char *tools_list = agent_get_tools_list(db, conn);
+  if (!tools_list) {
+    D("ERROR: Failed to list MCP tools");
+    sqlite3_result_error(context, "Not connected. Call mcp_connect() first", -1);
+    return;
+  }
+  run->tools = agent_tools_select(db, conn, goal);
+  if (run->tools) tools_list = run->tools;
+  DF("Received tools list (length=%zu)", strlen(tools_list));
+
+  if (custom_system_prompt && strlen(custom_system_prompt) > 0) {
+    run->preamble = sqlite3_mprintf("%s", custom_system_prompt);
+  } else {
+    run->preamble = sqlite3_mprintf(
+      "You are a tool-calling agent. You MUST respond with ONLY a tool call, nothing else.\n\n"
+      "%s\n\n"
+      "TARGET DATA SCHEMA:\n"
+      "You need to collect data that will populate a table with these columns:\n"
+      "%s\n"
+      "Make sure to search for properties/items that have information matching these columns.\n\n"
+      "IMPORTANT RULES:\n"
+      "1. Your response must be ONLY in this EXACT JSON format:\n"
+      "   {\"tool\": \"tool_name\", \"args\": {\"param1\": \"value1\", \"param2\": 123}}\n"
+      "   To call several independent tools at once, respond with a JSON array of such objects\n"
+      "2. Do NOT include explanations, reasoning, or any other text\n"
+      "3. Do NOT use markdown code blocks or backticks\n"
+      "4. Use the exact parameter names from the reference above\n"
+      "5. Use proper JSON: keys in \"quotes\", boolean as true/false (lowercase), strings in \"quotes\"\n"
+      "6. You can make MULTIPLE tool calls across iterations to gather detailed data\n"
+      "7. Type DONE only when you have retrieved sufficient detailed information\n\n"
+      "CRITICAL: Extract actual values from previous tool responses\n"
+      "✓ CORRECT: {\"args\": {\"name\": \"sqlite-agent\"}}   (literal value from response)\n"
+      "✗ WRONG:   {\"args\": {\"name\": \"{{items[0].name}}\"}}  (template syntax - will fail!)\n"
+      "✗ WRONG:   {\"args\": {\"name\": \"<name-from-search>\"}} (placeholder - will fail!)\n"
+      "When you receive tool responses, read the actual values and use them directly.\n\n"
+      "Task: %s\n\n"
+      "Respond with ONLY the JSON tool call:",
+      tools_list, schema_desc, goal);
+  }
+  if (!run->preamble) {
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+
+  DF("System prompt (length=%zu):\n%s", strlen(run->preamble), run->preamble);
+
+  // Table mode replaces the chat context for extraction and embeddings, so it
+  // never leaves a chat that a later call could continue
+  conn->chat.preamble_hash = 0;
+
+  // The chat only sees the preamble, then "Continue" and a reply per
+  // iteration: tool results are collected for the extraction prompt instead.
+  // Streaming asks for the rows of each result in the chat, so it also holds
+  // the extraction rules and a page with its answer per iteration.
+  int preamble_tokens = agent_token_count(db, conn, run->preamble, -1);
+  agent_budget budget;
+  agent_budget_plan(conn, preamble_tokens, max_iterations, &budget);
+  int chat_size = preamble_tokens + max_iterations * (AGENT_RESPONSE_TOKENS + 8);
+  if (conn->run_options->streaming) {
+    char *rules = agent_extraction_prompt(schema_desc, "", 0);
+    chat_size += agent_token_count(db, conn, rules ? rules : "", -1) +
+                 max_iterations * (budget.result_tokens + conn->run_options->result_tokens);
+    sqlite3_free(rules);
+  }
+  if (chat_size < AGENT_MIN_CONTEXT_TOKENS) chat_size = AGENT_MIN_CONTEXT_TOKENS;
+  if (conn->run_options->max_context > 0 && chat_size > conn->run_options->max_context) {
+    chat_size = conn->run_options->max_context;
+  }
+
+  // A resumed run starts its chat with the calls made before its last checkpoint
+  int resume = 0;  // the chat was replaced by an extraction, run->message restarts it
+  int redirect = 0;  // the loop policy asks the model for another approach
+  int stored = 0;  // rows were asked for in the chat since the last reply
+  int rules_sent = 0;  // the chat holds the extraction rules
+  int start_size = chat_size;
+  if (run->resumed && run->start_iteration > 0) {
+    char *calls_made = agent_checkpoint_calls(db, run);
+    agent_run_set(&run->message, sqlite3_mprintf(
+      "%s\n\nTools already called, their data is collected:\n%sContinue with other calls, or type DONE.",
+      run->preamble, calls_made ? calls_made : ""));
+    start_size += agent_token_count(db, conn, calls_made ? calls_made : "", -1);
+    sqlite3_free(calls_made);
+    if (!run->message) {
+      sqlite3_result_error_nomem(context);
+      return;
+    }
+    if (conn->run_options->max_context > 0 && start_size > conn->run_options->max_context) {
+      start_size = conn->run_options->max_context;
+    }
+    resume = 1;
+  }
+
+  rc = agent_create_chat_context(db, start_size);
+  if (rc != SQLITE_OK) {
+    D("ERROR: Failed to create LLM chat context");
+    sqlite3_result_error(context, "Failed to create LLM chat context", -1);
+    return;
+  }
+
+  DF("Token budget: preamble=%d, chat=%d, per result=%d",
+     preamble_tokens, chat_size, budget.result_tokens);
+
+  // Streaming extracts and commits the rows of every tool result as soon as it
+  // arrives, so the INSERT is needed before the loop
+  int streaming = conn->run_options->streaming;
+  int rows_inserted = run->rows;
+  const char *error = NULL;
+  if (streaming) {
+    rc = agent_table_prepare_insert(db, conn, table, &run->insert);
+    if (rc != SQLITE_OK) {
+      if (rc == SQLITE_NOMEM) sqlite3_result_error_nomem(context);
+      else sqlite3_result_error(context, "Failed to prepare insert statement", -1);
+      return;
+    }
+  }
+
+  DF("Starting agent loop with max_iterations=%d", max_iterations);
+  // Grammars only when they will be used: building them walks every inputschema
+  const char *tool_grammar = NULL;
+  if (conn->run_options->grammar) {
+    tool_grammar = agent_catalog_grammar(db, conn);
+    run->grammar = agent_gbnf_rows(db, table);
+    DF("Tool call grammar:\n%s", tool_grammar ? tool_grammar : "(none)");
+  }
+
+  run->history = sqlite3_str_new(db);
+  if (run->saved_history) sqlite3_str_appendall(run->history, run->saved_history);
+  int consecutive_errors = 0;
+  char last_error[512] = {0};
+  int completed = run->start_iteration;
+  for (int loop = run->start_iteration; loop < max_iterations; loop++) {
+    if (loop > run->start_iteration) agent_checkpoint_save(db, run, loop, sqlite3_str_value(run->history));
+    completed = loop + 1;
+    if (agent_job_checkpoint(conn, loop + 1)) {
+      sqlite3_result_error(context, "agent_run cancelled", -1);
+      return;
+    }
+    if (agent_limits_reached(conn)) {
+      agent_limits_result(context, conn);
+      return;
+    }
+    DF("Table loop %d/%d", loop+1, max_iterations);
+
+    agent_sampler_constrain(db, conn, tool_grammar);
+    char *agent_response = NULL;
+    const char *next = resume ? run->message : loop == 0 ? run->preamble :
+                       redirect ? agent_policy_redirect :
+                       stored ? "The rows are stored. Continue with other calls, or type DONE." : "Continue";
+    rc = agent_chat_turn(db, conn, run, next, 1, &agent_response);
+    resume = 0;
+    redirect = 0;
+    stored = 0;
+    if (rc != SQLITE_OK) {
+      DF("ERROR: Failed to get LLM response (rc=%d): %s", rc, sqlite3_errmsg(db));
+      if (agent_limits_reached(conn)) {
+        agent_limits_result(context, conn);
+        return;
+      }
+      continue;
+    }
+
+    agent_run_set(&run->response, agent_response);
+    if (!run->response) {
+      D("WARNING: LLM returned NULL response");
+      break;
+    }
+
+    DF("Agent Response:\n%s", run->response);
+
+    if (agent_find_done(run->response)) {
+      D("Agent said DONE - ending loop");
+      break;
+    }
+
+    if (agent_find_tool_calls(run->response, run) == 0) {
+      D("WARNING: Could not parse tool call from agent response");
+      agent_trace_add(conn, "parse_error", NULL, 0, 0, 0, (sqlite3_int64)strlen(run->response), 0,
+                      "no tool call in the response");
+      int decision = agent_policy_step(db, conn, run, table, loop + 1, max_iterations);
+      if (decision == SQLITE_AGENT_LOOP_STOP) break;
+      redirect = decision == SQLITE_AGENT_LOOP_REDIRECT;
+      continue;
+    }
+
+    for (int c = 0; c < run->call_count; c++) {
+      agent_tool_call *call = &run->calls[c];
+      DF("Parsed tool: '%s' args: '%s'", call->name, call->args);
+
+      // "{{" cannot appear outside a string in valid JSON, "}}" closes nested objects
+      if (strstr(call->args, "{{") != NULL) {
+        D("ERROR: Tool args contain template syntax {{...}}");
+        agent_trace_add(conn, "parse_error", call->name, 0, 0, 0, (sqlite3_int64)strlen(call->args), 0,
+                        "template syntax in the args");
+        if (streaming) {
+          sqlite3_str_appendf(run->history, "- %s %.200s: rejected, template syntax\n", call->name, call->args);
+        } else {
+          sqlite3_str_appendf(run->history,
+                              "ERROR: Tool args contain invalid template syntax: %.200s\n", call->args);
+        }
+        call->done = 1;  // never sent to the server
+      }
+    }
+
+    if (agent_limits_reached(conn)) {
+      agent_limits_result(context, conn);
+      return;
+    }
+    agent_call_tools(db, conn, run);
+
+    int stop = 0;
+    for (int c = 0; c < run->call_count && !stop; c++) {
+      agent_tool_call *call = &run->calls[c];
+      const char *tool_result = call->result;
+      if (!tool_result) {
+        DF("ERROR: Tool '%s' returned NULL", call->name);
+        continue;
+      }
+
+      DF("Tool result (length=%zu): %.500s%s",
+         strlen(tool_result),
+         tool_result,
+         strlen(tool_result) > 500 ? "..." : "");
+
+      int is_error = agent_tool_result_is_error(tool_result);
+
+      if (is_error) {
+        char current_error[256];
+        snprintf(current_error, sizeof(current_error), "%.200s", tool_result);
+        if (strcmp(current_error, last_error) == 0) {
+          consecutive_errors++;
+          DF("WARNING: Same error repeated %d times", consecutive_errors);
+          if (consecutive_errors >= 3) {
+            D("ERROR: Stopping due to 3 consecutive identical errors");
+            stop = 1;
+            break;
+          }
+        } else {
+          strncpy(last_error, current_error, sizeof(last_error) - 1);
+          consecutive_errors = 1;
+        }
+      } else {
+        consecutive_errors = 0;
+        last_error[0] = '\0';
+      }
+
+      if (streaming && is_error) {
+        sqlite3_str_appendf(run->history, "- %s %.200s: failed: %.200s\n", call->name, call->args, tool_result);
+        continue;
+      }
+
+      // Each page of a compacted result is extracted, or added to the history, on its own
+      agent_result_pages pages;
+      if (!conn->run_options->compact || is_error ||
+          !agent_compact_result(db, conn, table, call->name, tool_result, budget.result_tokens, &pages)) {
+        pages.count = 0;
+      }
+      int page_count = pages.count ? pages.count : 1;
+      int before = rows_inserted;
+      for (int p = 0; p < page_count; p++) {
+        const char *text = pages.count ? pages.pages[p].text : tool_result;
+        char label[96] = "";
+        if (pages.count) agent_result_page_label(&pages, p, NULL, label, sizeof(label));
+        int text_len = (int)strlen(text);
+        int keep = agent_token_prefix(db, conn, text, text_len, budget.result_tokens);
+        if (keep < text_len) {
+          agent_trace_truncate(db, conn, call->name, text, text_len, keep, budget.result_tokens);
+        }
+
+        if (!streaming) {
+          if (keep < text_len) {
+            sqlite3_str_appendf(run->history, "Tool %s returned%s (truncated to %d tokens): %.*s...\n",
+                                call->name, label, budget.result_tokens, keep, text);
+          } else {
+            sqlite3_str_appendf(run->history, "Tool %s returned%s: %s\n", call->name, label, text);
+          }
+          continue;
+        }
+
+        // Rows of this result are committed before the next tool runs
+        if (agent_limits_reached(conn)) {
+          agent_result_pages_free(&pages);
+          agent_limits_result(context, conn);
+          return;
+        }
+        char *data = sqlite3_mprintf("Tool %s returned%s: %.*s\n", call->name, label, keep, text);
+        if (!data) {
+          agent_result_pages_free(&pages);
+          sqlite3_result_error_nomem(context);
+          return;
+        }
+        // Once the chat is full the page gets a context of its own, and the
+        // chat is restarted after this iteration
+        rc = resume ? SQLITE_FULL : agent_extract_page(db, conn, run, schema_desc, data, &rules_sent, &error);
+        if (rc == SQLITE_FULL) {
+          rc = agent_extract_rows(db, conn, run, schema_desc, data, (int)strlen(data), &error);
+          resume = 1;
+        } else {
+          stored = 1;
+        }
+        sqlite3_free(data);
+        if (rc == SQLITE_OK) {
+          char *insert_error = NULL;
+          rc = agent_table_store_rows(db, conn, table, run, &rows_inserted, &insert_error);
+          if (rc != SQLITE_OK) {
+            agent_result_pages_free(&pages);
+            sqlite3_result_error(context, insert_error ? insert_error : "Failed to insert row", -1);
+            sqlite3_free(insert_error);
+            return;
+          }
+          run->rows = rows_inserted;
+        } else if (rc == SQLITE_NOMEM) {
+          agent_result_pages_free(&pages);
+          sqlite3_result_error_nomem(context);
+          return;
+        } else {
+          DF("WARNING: %s, continuing", error);
+        }
+      }
+      agent_result_pages_free(&pages);
+      if (streaming) {
+        DF("Streamed %d rows from %s", rows_inserted - before, call->name);
+        sqlite3_str_appendf(run->history, "- %s %.200s: %d rows stored\n",
+                            call->name, call->args, rows_inserted - before);
+      }
+    }
+    if (stop) break;
+
+    int decision = agent_policy_step(db, conn, run, table, loop + 1, max_iterations);
+    if (decision == SQLITE_AGENT_LOOP_STOP) break;
+    redirect = decision == SQLITE_AGENT_LOOP_REDIRECT;
+
+    if (resume) {
+      // An extraction replaced the chat: start a new one that lists the calls
+      // already made instead of replaying them
+      rules_sent = 0;
+      stored = 0;
+      const char *calls_made = sqlite3_str_value(run->history);
+      agent_run_set(&run->message, sqlite3_mprintf(
+        "%s\n\nTools already called, their data is stored:\n%sContinue with other calls, or type DONE.%s%s",
+        run->preamble, calls_made ? calls_made : "", redirect ? "\n" : "", redirect ? agent_policy_redirect : ""));
+      if (!run->message) {
+        sqlite3_result_error_nomem(context);
+        return;
+      }
+      int resume_size = chat_size + agent_token_count(db, conn, calls_made ? calls_made : "", -1);
+      if (conn->run_options->max_context > 0 && resume_size > conn->run_options->max_context) {
+        resume_size = conn->run_options->max_context;
+      }
+      if (agent_create_chat_context(db, resume_size) != SQLITE_OK) {
+        D("ERROR: Failed to create LLM chat context");
+        break;
+      }
+    }
+  }
+
+  agent_checkpoint_save(db, run, completed, sqlite3_str_value(run->history));
+
+  if (!streaming) {
+    int history_len = sqlite3_str_length(run->history);
+    const char *history = sqlite3_str_value(run->history);
+    if (!history) history = "";
+    DF("Conversation history (length=%d):", history_len);
+    DF("=== FULL CONVERSATION HISTORY ===\n%s\n=== END CONVERSATION HISTORY ===", history);
+
+    if (agent_limits_reached(conn)) {
+      agent_limits_result(context, conn);
+      return;
+    }
+
+    rc = agent_extract_rows(db, conn, run, schema_desc, history, history_len, &error);
+    if (rc == SQLITE_OK) rc = agent_table_prepare_insert(db, conn, table, &run->insert);
+    if (rc == SQLITE_NOMEM) {
+      sqlite3_result_error_nomem(context);
+      return;
+    }
+    if (rc != SQLITE_OK) {
+      sqlite3_result_error(context, error ? error : "Failed to prepare insert statement", -1);
+      return;
+    }
+
+    char *insert_error = NULL;
+    rc = agent_table_store_rows(db, conn, table, run, &rows_inserted, &insert_error);
+    if (rc != SQLITE_OK) {
+      sqlite3_result_error(context, insert_error ? insert_error : "Failed to insert row", -1);
+      sqlite3_free(insert_error);
+      return;
+    }
+  }
+
+  DF("Total rows inserted: %d", rows_inserted);
+
+  if (table->embedding_col_count > 0 && rows_inserted > 0) {
+      rc = sqlite3_prepare_v2(db, "SELECT llm_context_create_embedding('embedding_type=FLOAT32')", -1, &stmt, 0);
+      if (rc == SQLITE_OK) {
+        sqlite3_step(stmt);
+        sqlite3_finalize(stmt);
+      }
+
+      for (int emb_col = 0; emb_col < table->column_count; emb_col++) {
+        if (!table->columns[emb_col].embedding) continue;
+        const char *emb_col_name = table->columns[emb_col].name;
+
+        sqlite3_str *available = sqlite3_str_new(db);
+        for (int i = 0; i < table->column_count; i++) {
+          const agent_column *column = &table->columns[i];
+          if (column->embedding || column->affinity != AGENT_AFFINITY_TEXT) continue;
+          if (sqlite3_str_length(available) > 0) sqlite3_str_appendall(available, ", ");
+          sqlite3_str_appendall(available, column->name);
+        }
+        // NULL without any text column
+        char *available_cols = sqlite3_str_finish(available);
+        if (!available_cols) continue;
+
+        // Source columns come from agent_embedding_map, or from the model once.
+        // A mapping that names no column of the table any more (renamed or
+        // dropped) is asked for again and replaced.
+        char *source_sql = NULL;
+        char *source_list = NULL;
+        char *selected_cols = agent_embedding_map_get(db, table_name, emb_col_name);
+        int cached = selected_cols != NULL;
+        if (cached) {
+          DF("Embedding sources for %s (cached): %s", emb_col_name, selected_cols);
+          agent_embedding_sources(db, table, selected_cols, &source_sql, &source_list);
+          if (!source_list) {
+            DF("WARNING: Cached sources of %s match no column, asking again", emb_col_name);
+            sqlite3_free(source_sql);
+            source_sql = NULL;
+            cached = 0;
+          }
+        }
+        if (!cached) {
+          char *mapping_prompt = sqlite3_mprintf(
+            "Table has columns: %s\n\n"
+            "For the '%s' embedding column, which source columns should be embedded together?\n"
+            "Return ONLY comma-separated column names, no explanation.\n"
+            "Example: title, description\n\n"
+            "Relevant columns: ",
+            available_cols, emb_col_name);
+
+          selected_cols = NULL;
+          agent_sampler_constrain(db, conn, NULL);
+          stmt = mapping_prompt ? agent_stmt_acquire(db, conn, AGENT_STMT_CHAT_RESPOND) : NULL;
+          if (stmt && agent_chat_step(db, conn, stmt, "embedding_map", mapping_prompt) == SQLITE_ROW) {
+            const char *llm_response = (const char*)sqlite3_column_text(stmt, 0);
+            selected_cols = sqlite3_mprintf("%s", llm_response ? llm_response : "");
+          }
+          if (stmt) agent_stmt_release(stmt);
+          sqlite3_free(mapping_prompt);
+          if (selected_cols) {
+            DF("Embedding sources for %s (model): %s", emb_col_name, selected_cols);
+            agent_embedding_sources(db, table, selected_cols, &source_sql, &source_list);
+          }
+        }
+        sqlite3_free(available_cols);
+        if (!source_list || !source_sql) {
+          DF("WARNING: No source columns for %s, skipping its embeddings", emb_col_name);
+          sqlite3_free(source_sql);
+          sqlite3_free(source_list);
+          continue;
+        }
+        if (!cached) agent_embedding_map_put(db, table_name, emb_col_name, source_list);
+        sqlite3_free(source_list);
+
+        double embed_started = agent_clock_ms();
+        sqlite3_int64 changes = sqlite3_total_changes64(db);
+        agent_embed_rows(db, conn, run, table_name, emb_col_name, source_sql);
+        sqlite3_free(source_sql);
+        double embed_ms = agent_clock_ms() - embed_started;
+        agent_stats_add(conn, "embed", emb_col_name, embed_ms);
+        agent_trace_add(conn, "embed", emb_col_name, embed_ms, 0, 0, 0,
+                        sqlite3_total_changes64(db) - changes, cached ? "cached mapping" : NULL);
+      }
+
+    if (table->embedding_col_count > 0) {
+      DF("Initializing vector indices for %d embedding columns", table->embedding_col_count);
+
+      rc = sqlite3_prepare_v2(db, "SELECT llm_model_n_embd()", -1, &stmt, 0);
+      if (rc == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+        int n_embd = sqlite3_column_int(stmt, 0);
+        sqlite3_finalize(stmt);
+
+        DF("Embedding dimension: %d", n_embd);
+
+        if (n_embd > 0) {
+          sqlite3_int64 schema_version = agent_schema_version(db);
+          for (int emb_col = 0; emb_col < table->column_count; emb_col++) {
+            if (!table->columns[emb_col].embedding) continue;
+            const char *emb_col_name = table->columns[emb_col].name;
+
+            agent_vector_index *index = agent_vector_index_find(conn, table_name, emb_col_name);
+            if (index && index->dimension == n_embd && index->schema_version == schema_version) {
+              DF("Vector index for %s.%s is up to date", table_name, emb_col_name);
+              continue;
+            }
+
+            char *vector_init_sql = sqlite3_mprintf(
+              "SELECT vector_init('%s', '%s', 'dimension=%d,type=FLOAT32,distance=cosine')",
+              table_name, emb_col_name, n_embd);
+            if (!vector_init_sql) continue;
+
+            DF("Initializing vector index for %s.%s", table_name, emb_col_name);
+
+            char *vec_err = NULL;
+            rc = sqlite3_exec(db, vector_init_sql, 0, 0, &vec_err);
+            sqlite3_free(vector_init_sql);
+            if (rc != SQLITE_OK) {
+              DF("ERROR: vector_init failed for %s: %s", emb_col_name, vec_err ? vec_err : "(unknown)");
+              sqlite3_free(vec_err);
+            } else {
+              DF("Vector index initialized for %s", emb_col_name);
+              agent_vector_index_save(conn, table_name, emb_col_name, n_embd, schema_version);
+            }
+          }
+        } else {
+          D("WARNING: Embedding dimension is 0");
+        }
+      } else {
+        DF("WARNING: Failed to get embedding dimension (rc=%d): %s", rc, sqlite3_errmsg(db));
+        if (stmt) sqlite3_finalize(stmt);
+      }
+    }
+  }
+
+  run->rows = rows_inserted;
+  run->finished = 1;
+  sqlite3_result_int(context, rows_inserted);
+}
+
+static int agent_run_options(sqlite3 *db, agent_connection *conn, agent_options *options,
+                             sqlite3_value *value, char **error);
+
+// Runs agent_run() with run prepared by the caller, then releases it. The
+// options argument applies to a copy of the connection options kept in run,
+// so agent_config() values are left alone.
+static void agent_run_call(sqlite3_context *context, int argc, sqlite3_value **argv, agent_run_state *run) {
+  agent_connection *conn = (agent_connection*)sqlite3_user_data(context);
+  sqlite3 *db = sqlite3_context_db_handle(context);
+  char *error = NULL;
+  int rc = agent_options_copy(&run->options, &conn->options);
+  if (rc == SQLITE_OK && argc == 5 && sqlite3_value_type(argv[4]) != SQLITE_NULL) {
+    rc = agent_run_options(db, conn, &run->options, argv[4], &error);
+  }
+  if (rc != SQLITE_OK) {
+    if (error) sqlite3_result_error(context, error, -1);
+    else sqlite3_result_error_nomem(context);
+    sqlite3_free(error);
+    agent_run_state_free(run);
+    return;
+  }
+
+  // A tool statement may run agent_run() again: it starts from the connection
+  // options, and the outer options and budgets are back once it returns
+  const agent_options *options = conn->run_options;
+  agent_limits limits = conn->limits;
+  agent_trace trace = conn->trace;
+  conn->run_options = &run->options;
+  agent_trace_begin(conn);
+  double started = agent_clock_ms();
+  conn->limits.started = started;
+  conn->limits.deadline = run->options.timeout_ms > 0 ? started + run->options.timeout_ms : 0;
+  conn->limits.tokens = 0;
+  agent_run_execute(context, argc, argv, run);
+  double duration = agent_clock_ms() - started;
+  conn->limits = limits;
+  if (run->finished) agent_stats_add(conn, "run", run->table_mode ? "table" : "text", duration);
+  agent_trace_add(conn, "run", run->table_mode ? "table" : "text", duration, 0, 0, 0,
+                  run->rows, NULL);
+  agent_checkpoint_end(db, run);
+  conn->run_options = options;
+  conn->trace.run_id = trace.run_id;
+  conn->trace.step = trace.step;
+  conn->trace.iteration = trace.iteration;
+  conn->trace.active = trace.active;
+  conn->last_rows = run->rows;
+  if (conn->job) conn->job->rows = run->rows;
+  agent_run_state_free(run);
+  agent_sampler_constrain(db, conn, NULL);
+  // The goals of a batch share the internal statements, cleared when it ends
+  if (!conn->batch) {
+    agent_stmt_cache_clear(conn);
+    agent_pool_release(conn);
+  }
+}
+
+static void agent_run_func(
+  sqlite3_context *context,
+  int argc,
+  sqlite3_value **argv
+){
+  agent_run_state run;
+  memset(&run, 0, sizeof(run));
+  agent_run_call(context, argc, argv, &run);
+}
+
+// Continues a run recorded in agent_runs from its last checkpoint, with the
+// arguments it was started with. A finished run returns its result again.
+static void agent_resume_func(
+  sqlite3_context *context,
+  int argc,
+  sqlite3_value **argv
+){
+  sqlite3 *db = sqlite3_context_db_handle(context);
+  sqlite3_int64 id = sqlite3_value_int64(argv[0]);
+  sqlite3_stmt *stmt = NULL;
+  if (sqlite3_prepare_v2(db, "SELECT goal, table_name, max_iterations, system_prompt, status, iteration, "
+                             "rows, history, result FROM agent_runs WHERE id = ?1", -1, &stmt, 0) != SQLITE_OK) {
+    sqlite3_result_error(context, "agent_resume: no agent_runs table, enable the checkpoint option", -1);
+    return;
+  }
+  sqlite3_bind_int64(stmt, 1, id);
+  if (sqlite3_step(stmt) != SQLITE_ROW) {
+    sqlite3_finalize(stmt);
+    char *message = sqlite3_mprintf("agent_resume: no run %lld in agent_runs", id);
+    sqlite3_result_error(context, message ? message : "agent_resume: no such run", -1);
+    sqlite3_free(message);
+    return;
+  }
+
+  const char *status = (const char*)sqlite3_column_text(stmt, 4);
+  if (status && strcmp(status, "done") == 0) {
+    if (sqlite3_column_type(stmt, 8) == SQLITE_BLOB) {
+      char *result = agent_column_unpacked(stmt, 8);
+      if (result) sqlite3_result_text(context, result, -1, sqlite3_free);
+      else sqlite3_result_error(context, "agent_resume: the recorded result is damaged", -1);
+    } else {
+      sqlite3_result_value(context, sqlite3_column_value(stmt, 8));
+    }
+    sqlite3_finalize(stmt);
+    return;
+  }
+
+  agent_run_state run;
+  memset(&run, 0, sizeof(run));
+  run.checkpoint_id = id;
+  run.resumed = 1;
+  run.start_iteration = sqlite3_column_int(stmt, 5);
+  run.rows = sqlite3_column_int(stmt, 6);
+  int rc = SQLITE_OK;
+  if (sqlite3_column_type(stmt, 7) != SQLITE_NULL) {
+    run.saved_history = agent_column_unpacked(stmt, 7);
+    if (!run.saved_history) rc = SQLITE_CORRUPT;
+  }
+  sqlite3_value *args[4];
+  for (int i = 0; i < 4; i++) {
+    args[i] = sqlite3_value_dup(sqlite3_column_value(stmt, i));
+    if (!args[i]) rc = SQLITE_NOMEM;
+  }
+  sqlite3_finalize(stmt);
+
+  if (rc == SQLITE_OK) {
+    DF("Resuming agent_runs %lld at iteration %d", id, run.start_iteration);
+    agent_run_call(context, 4, args, &run);
+  } else {
+    agent_run_state_free(&run);
+    if (rc == SQLITE_CORRUPT) sqlite3_result_error(context, "agent_resume: the recorded history is damaged", -1);
+    else sqlite3_result_error_nomem(context);
+  }
+  for (int i = 0; i < 4; i++) sqlite3_value_free(args[i]);
+}
+
+static void agent_tools_refresh(
+  sqlite3_context *context,
+  int argc,
+  sqlite3_value **argv
+){
+  agent_connection *conn = (agent_connection*)sqlite3_user_data(context);
+  sqlite3 *db = sqlite3_context_db_handle(context);
+
+  agent_catalog_set(conn, NULL, NULL);
+  agent_cache_clear(conn);
+  agent_tool_catalog *catalog = NULL, *mcp = NULL;
+  int rc = agent_catalog_load(db, &mcp, &catalog);
+  if (rc == SQLITE_NOMEM) {
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+  if (rc != SQLITE_OK) {
+    sqlite3_result_error(context, "Not connected. Call mcp_connect() first", -1);
+    return;
+  }
+
+  agent_catalog_set(conn, catalog, mcp);
+  sqlite3_result_int(context, catalog->tool_count);
+}
+
+// Adds or replaces a tool of agent_tools, or removes it when sql is NULL.
+// Without an input schema one is made from the named parameters.
+static void agent_register_tool_func(
+  sqlite3_context *context,
+  int argc,
+  sqlite3_value **argv
+){
+  agent_connection *conn = (agent_connection*)sqlite3_user_data(context);
+  sqlite3 *db = sqlite3_context_db_handle(context);
+  const char *name = (const char*)sqlite3_value_text(argv[0]);
+  const char *description = (const char*)sqlite3_value_text(argv[1]);
+  const char *inputschema = (const char*)sqlite3_value_text(argv[2]);
+  const char *sql = (const char*)sqlite3_value_text(argv[3]);
+
+  int valid = name && name[0] && strlen(name) < sizeof(((agent_tool_call*)0)->name);
+  for (const char *p = name; valid && *p; p++) {
+    valid = isalnum((unsigned char)*p) || *p == '_' || *p == '-' || *p == '.';
+  }
+  if (!valid) {
+    sqlite3_result_error(context, "agent_register_tool: the name must be letters, digits, '_', '-' and '.'", -1);
+    return;
+  }
+
+  sqlite3_stmt *stmt = NULL;
+  if (!sql) {
+    int removed = 0;
+    if (sqlite3_prepare_v2(db, "DELETE FROM agent_tools WHERE name = ?1", -1, &stmt, 0) == SQLITE_OK) {
+      sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+      if (sqlite3_step(stmt) == SQLITE_DONE) removed = sqlite3_changes(db);
+    }
+    sqlite3_finalize(stmt);
+    if (removed) {
+      agent_catalog_set(conn, NULL, NULL);
+      agent_tool_cache_clear(&conn->tool_cache);
+    }
+    sqlite3_result_int(context, removed);
+    return;
+  }
+
+  // The statement is checked now rather than on the first call of the model
+  const char *tail = NULL;
+  int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, &tail);
+  if (rc != SQLITE_OK || !stmt) {
+    char *message = sqlite3_mprintf("agent_register_tool: %s", rc != SQLITE_OK ? sqlite3_errmsg(db) : "no statement");
+    sqlite3_result_error(context, message ? message : "agent_register_tool: invalid statement", -1);
+    sqlite3_free(message);
+    sqlite3_finalize(stmt);
+    return;
+  }
+  while (tail && isspace((unsigned char)*tail)) tail++;
+  if (tail && *tail) {
+    sqlite3_finalize(stmt);
+    sqlite3_result_error(context, "agent_register_tool: the tool must be a single statement", -1);
+    return;
+  }
+  if (!conn->run_options->tool_writes && !sqlite3_stmt_readonly(stmt)) {
+    sqlite3_finalize(stmt);
+    sqlite3_result_error(context, "agent_register_tool: the statement writes to the database, "
+                                  "set the tool_writes option to allow it", -1);
+    return;
+  }
+
+  sqlite3_str *schema = sqlite3_str_new(db);
+  if (inputschema) {
+    agent_json_parser parser;
+    agent_json_init(&parser);
+    valid = agent_json_parse(&parser, inputschema, (int)strlen(inputschema)) == AGENT_JSON_COMPLETE &&
+            parser.tokens[parser.root].type == AGENT_JSON_OBJECT;
+    agent_json_free(&parser);
+    sqlite3_str_appendall(schema, inputschema);
+  } else {
+    sqlite3_str_appendall(schema, "{\"type\":\"object\",\"properties\":{");
+    int count = sqlite3_bind_parameter_count(stmt);
+    int properties = 0;
+    for (int i = 1; i <= count; i++) {
+      const char *param = sqlite3_bind_parameter_name(stmt, i);
+      if (!param || param[0] == '?') continue;
+      if (properties++ > 0) sqlite3_str_appendchar(schema, 1, ',');
+      agent_json_append_string(schema, param + 1, (int)strlen(param + 1));
+      sqlite3_str_appendall(schema, ":{}");
+    }
+    sqlite3_str_appendall(schema, "}}");
+  }
+  sqlite3_finalize(stmt);
+  char *schema_text = sqlite3_str_finish(schema);
+  if (!schema_text) {
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+  if (!valid) {
+    sqlite3_free(schema_text);
+    sqlite3_result_error(context, "agent_register_tool: the input schema must be a JSON object", -1);
+    return;
+  }
+
+  rc = sqlite3_exec(db, agent_local_tools_schema, 0, 0, 0);
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_prepare_v2(db, "INSERT OR REPLACE INTO agent_tools (name, description, inputschema, sql, created_at) "
+                                "VALUES (?1, ?2, ?3, ?4, ?5)", -1, &stmt, 0);
+  }
+  if (rc == SQLITE_OK) {
+    sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+    if (description) sqlite3_bind_text(stmt, 2, description, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 3, schema_text, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 4, sql, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 5, (sqlite3_int64)time(NULL));
+    rc = sqlite3_step(stmt) == SQLITE_DONE ? SQLITE_OK : SQLITE_ERROR;
+  }
+  sqlite3_finalize(stmt);
+  sqlite3_free(schema_text);
+  if (rc != SQLITE_OK) {
+    char *message = sqlite3_mprintf("agent_register_tool: %s", sqlite3_errmsg(db));
+    sqlite3_result_error(context, message ? message : "agent_register_tool: cannot store the tool", -1);
+    sqlite3_free(message);
+    return;
+  }
+
+  // The next run merges the tools again, with this one; the MCP listing and
+  // results other connections share are left alone
+  agent_catalog_set(conn, NULL, NULL);
+  agent_tool_cache_clear(&conn->tool_cache);
+  sqlite3_result_int(context, 1);
+}
+
+// Sets option def of options, those of conn or of one of its calls, to value.
+// On failure *error is set to a message the caller frees, or left NULL when
+// memory is exhausted.
+static int agent_option_set(agent_connection *conn, agent_options *options, const agent_option_def *def,
+                            sqlite3_value *value, char **error) {
+  void *slot = (char*)options + def->offset;
+
+  // Worker connections are configured once, changes take effect on new ones
+  if (def->offset == offsetof(agent_options, tool_workers) ||
+      def->offset == offsetof(agent_options, worker_extensions) ||
+      def->offset == offsetof(agent_options, worker_init)) {
+    agent_pool_close(&conn->pool);
+  }
+
+  if (def->is_text) {
+    char **text = (char**)slot;
+    const char *new_text = (const char*)sqlite3_value_text(value);
+    char *copy = NULL;
+    if (new_text && new_text[0]) {
+      copy = sqlite3_mprintf("%s", new_text);
+      if (!copy) return SQLITE_NOMEM;
+    }
+    sqlite3_free(*text);
+    *text = copy;
+    // Joining a runtime drops the catalog and workers of the connection
+    if (def->offset == offsetof(agent_options, runtime) && agent_runtime_attach(conn) != SQLITE_OK) {
+      return SQLITE_NOMEM;
+    }
+    return SQLITE_OK;
+  }
+
+  int *number = (int*)slot;
+  if (def->choices) {
+    const char *name = (const char*)sqlite3_value_text(value);
+    int choice = -1;
+    for (int c = 0; name && def->choices[c]; c++) {
+      if (sqlite3_stricmp(def->choices[c], name) == 0) choice = c;
+    }
+    if (choice < 0) {
+      *error = sqlite3_mprintf("invalid value '%s' for %s", name ? name : "NULL", def->name);
+      return SQLITE_ERROR;
+    }
+    *number = choice;
+    return SQLITE_OK;
+  }
+
+  int new_value = sqlite3_value_int(value);
+  if (new_value < def->min_value) {
+    *error = sqlite3_mprintf("%s must be >= %d", def->name, def->min_value);
+    return SQLITE_ERROR;
+  }
+  *number = new_value;
+  return SQLITE_OK;
+}
+
+static const agent_option_def* agent_option_find(const char *name) {
+  for (int i = 0; name && i < AGENT_OPTION_COUNT; i++) {
+    if (sqlite3_stricmp(agent_option_defs[i].name, name) == 0) return &agent_option_defs[i];
+  }
+  return NULL;
+}
+
+static void agent_config_func(
+  sqlite3_context *context,
+  int argc,
+  sqlite3_value **argv
+){
+  agent_connection *conn = (agent_connection*)sqlite3_user_data(context);
+  const char *key = (const char*)sqlite3_value_text(argv[0]);
+  if (!key) {
+    sqlite3_result_error(context, "agent_config requires an option name", -1);
+    return;
+  }
+
+  const agent_option_def *def = agent_option_find(key);
+  if (!def) {
+    char *msg = sqlite3_mprintf("agent_config: unknown option '%s'", key);
+    sqlite3_result_error(context, msg, -1);
+    sqlite3_free(msg);
+    return;
+  }
+
+  if (argc == 2) {
+    char *error = NULL;
+    if (agent_option_set(conn, &conn->options, def, argv[1], &error) != SQLITE_OK) {
+      if (!error) {
+        sqlite3_result_error_nomem(context);
+        return;
+      }
+      char *msg = sqlite3_mprintf("agent_config: %s", error);
+      sqlite3_result_error(context, msg ? msg : error, -1);
+      sqlite3_free(msg);
+      sqlite3_free(error);
+      return;
+    }
+  }
+
+  void *slot = (char*)&conn->options + def->offset;
+  if (def->is_text) {
+    const char *text = *(char**)slot;
+    if (text) sqlite3_result_text(context, text, -1, SQLITE_TRANSIENT);
+    else sqlite3_result_null(context);
+  } else if (def->choices) {
+    sqlite3_result_text(context, def->choices[*(int*)slot], -1, SQLITE_STATIC);
+  } else {
+    sqlite3_result_int(context, *(int*)slot);
+  }
+}
+
+// Text options are owned copies
+static int agent_options_copy(agent_options *dst, const agent_options *src) {
+  *dst = *src;
+  int rc = SQLITE_OK;
+  for (int i = 0; i < AGENT_OPTION_COUNT; i++) {
+    if (!agent_option_defs[i].is_text) continue;
+    char **text = (char**)((char*)dst + agent_option_defs[i].offset);
+    if (*text && !(*text = sqlite3_mprintf("%s", *text))) rc = SQLITE_NOMEM;
+  }
+  return rc;
+}
+
+static void agent_options_free(agent_options *options) {
+  for (int i = 0; i < AGENT_OPTION_COUNT; i++) {
+    if (!agent_option_defs[i].is_text) continue;
+    char **text = (char**)((char*)options + agent_option_defs[i].offset);
+    sqlite3_free(*text);
+    *text = NULL;
+  }
+}
+
+// Sets the options of the JSON object value in options, the copy one
+// agent_run call runs with, as agent_config() would. Options of the worker
+// connections and the runtime are left to agent_config(). On failure *error
+// is set, or left NULL when memory is exhausted.
+static int agent_run_options(sqlite3 *db, agent_connection *conn, agent_options *options,
+                             sqlite3_value *value, char **error) {
+  sqlite3_stmt *stmt = NULL;
+  int rc = sqlite3_prepare_v2(db, "SELECT json_type(?1), key, value FROM json_each(?1)", -1, &stmt, NULL);
+  if (rc == SQLITE_OK) rc = sqlite3_bind_value(stmt, 1, value);
+  while (rc == SQLITE_OK && (rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    rc = SQLITE_OK;
+    const char *type = (const char*)sqlite3_column_text(stmt, 0);
+    const char *key = (const char*)sqlite3_column_text(stmt, 1);
+    if (!type || strcmp(type, "object") != 0) {
+      rc = SQLITE_MISMATCH;
+      break;
+    }
+    const agent_option_def *def = agent_option_find(key);
+    if (!def || def->connection_only) {
+      *error = sqlite3_mprintf(def ? "agent_run: %s can only be set with agent_config()"
+                                   : "agent_run: unknown option '%s'", key);
+      rc = SQLITE_ERROR;
+      break;
+    }
+    char *message = NULL;
+    rc = agent_option_set(conn, options, def, sqlite3_column_value(stmt, 2), &message);
+    if (message) *error = sqlite3_mprintf("agent_run: %s", message);
+    sqlite3_free(message);
+  }
+  if (rc == SQLITE_DONE) rc = SQLITE_OK;
+  if (rc != SQLITE_OK && rc != SQLITE_NOMEM && !*error) {
+    *error = sqlite3_mprintf("agent_run: options must be a JSON object");
+  }
+  sqlite3_finalize(stmt);
+  return rc;
+}
+
+// MARK: - Background jobs
+
+static int agent_register(sqlite3 *db, agent_connection *conn);
+static agent_connection* agent_connection_new(const agent_options *options);
+static void agent_connection_free(void *p);
+
+// agent_run() with the arguments of a job or batch, by argument count
+static const char *const agent_run_sql[] = {
+  "SELECT agent_run(?)", "SELECT agent_run(?, ?)",
+  "SELECT agent_run(?, ?, ?)", "SELECT agent_run(?, ?, ?, ?)", "SELECT agent_run(?, ?, ?, ?, ?)"
+};
+
+static void agent_job_free(agent_job *job) {
+  for (int i = 0; i < job->argc; i++) sqlite3_value_free(job->args[i]);
+  sqlite3_value_free(job->result);
+  sqlite3_free(job->error);
+  sqlite3_free(job->filename);
+  agent_options_free(&job->options);
+  sqlite3_free(job);
+}
+
+// Opens the job connection on the same database as the caller, with the
+// worker extensions, the agent functions and job_init applied. *state, when
+// given, is set to the agent state registered on it.
+static int agent_job_open(agent_job *job, sqlite3 **out, agent_connection **state, char **error) {
+  sqlite3 *db = NULL;
+  int rc = sqlite3_open_v2(job->filename, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL);
+  if (rc == SQLITE_OK) sqlite3_busy_timeout(db, 5000);
+
+  if (rc == SQLITE_OK && job->options.worker_extensions) {
+    sqlite3_db_config(db, SQLITE_DBCONFIG_ENABLE_LOAD_EXTENSION, 1, NULL);
+    char *paths = sqlite3_mprintf("%s", job->options.worker_extensions);
+    if (!paths) rc = SQLITE_NOMEM;
+    for (char *path = paths; rc == SQLITE_OK && path && *path; ) {
+      char *sep = strchr(path, ';');
+      if (sep) *sep = '\0';
+      if (*path) rc = sqlite3_load_extension(db, path, NULL, error);
+      path = sep ? sep + 1 : NULL;
+    }
+    sqlite3_free(paths);
+  }
+
+  if (rc == SQLITE_OK) {
+    agent_connection *conn = agent_connection_new(&job->options);
+    if (!conn) {
+      rc = SQLITE_NOMEM;
+    } else {
+      conn->job = job;
+      conn->batch = job->batch;
+      rc = agent_register(db, conn);
+      if (rc == SQLITE_OK && state) *state = conn;
+    }
+  }
+
+  if (rc == SQLITE_OK && job->options.job_init) {
+    rc = sqlite3_exec(db, job->options.job_init, NULL, NULL, error);
+  }
+
+  if (rc != SQLITE_OK && !*error) *error = sqlite3_mprintf("%s", db ? sqlite3_errmsg(db) : sqlite3_errstr(rc));
+  *out = db;
+  return rc;
+}
+
+static AGENT_THREAD_FUNC agent_job_main(void *arg) {
+  agent_job *job = (agent_job*)arg;
+  sqlite3 *db = NULL;
+  char *error = NULL;
+  sqlite3_value *result = NULL;
+
+  int rc = agent_job_open(job, &db, NULL, &error);
+
+  sqlite3_mutex_enter(job->mutex);
+  job->db = db;
+  if (!job->cancel) job->status = AGENT_JOB_RUNNING;
+  int cancelled = job->cancel;
+  sqlite3_mutex_leave(job->mutex);
+
+  if (rc == SQLITE_OK && !cancelled) {
+    sqlite3_stmt *stmt = NULL;
+    rc = sqlite3_prepare_v2(db, agent_run_sql[job->argc - 1], -1, &stmt, NULL);
+    for (int i = 0; rc == SQLITE_OK && i < job->argc; i++) {
+      rc = sqlite3_bind_value(stmt, i + 1, job->args[i]);
+    }
+    if (rc == SQLITE_OK) {
+      rc = sqlite3_step(stmt);
+      if (rc == SQLITE_ROW) {
+        result = sqlite3_value_dup(sqlite3_column_value(stmt, 0));
+        rc = SQLITE_OK;
+      }
+    }
+    if (rc != SQLITE_OK) error = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+    sqlite3_finalize(stmt);
+  }
+
+  // job->db is cleared under the mutex so that agent_cancel() never
+  // interrupts a closed connection
+  sqlite3_mutex_enter(job->mutex);
+  job->db = NULL;
+  job->finished_at = (sqlite3_int64)time(NULL);
+  if (job->cancel) {
+    // Whatever an interrupted run returned is not its result
+    job->status = AGENT_JOB_CANCELLED;
+    sqlite3_value_free(result);
+    sqlite3_free(error);
+  } else {
+    job->status = (rc == SQLITE_OK) ? AGENT_JOB_DONE : AGENT_JOB_FAILED;
+    job->result = result;
+    job->error = error;
+  }
+  sqlite3_mutex_leave(job->mutex);
+
+  sqlite3_close(db);
+  return AGENT_THREAD_RETURN;
+}
+
+// Frees the oldest finished jobs until at most keep are left, and returns how
+// many were freed. Nothing is freed while an agent_jobs cursor could point to
+// a job.
+static int agent_jobs_prune(agent_connection *conn, int keep) {
+  if (conn->job_cursors) return 0;
+  int finished = 0;
+  for (agent_job *job = conn->jobs; job; job = job->next) {
+    sqlite3_mutex_enter(job->mutex);
+    if (job->status >= AGENT_JOB_DONE) finished++;
+    sqlite3_mutex_leave(job->mutex);
+  }
+
+  int freed = 0;
+  agent_job **link = &conn->jobs;
+  while (*link && finished > keep) {
+    agent_job *job = *link;
+    sqlite3_mutex_enter(job->mutex);
+    int done = job->status >= AGENT_JOB_DONE;
+    sqlite3_mutex_leave(job->mutex);
+    if (!done) {
+      link = &job->next;
+      continue;
+    }
+    // The thread only closes its connection once the status is final
+    *link = job->next;
+    if (job->started) agent_thread_join(job->thread);
+    agent_job_free(job);
+    finished--;
+    freed++;
+  }
+  return freed;
+}
+
+static void agent_run_async_func(
+  sqlite3_context *context,
+  int argc,
+  sqlite3_value **argv
+){
+  agent_connection *conn = (agent_connection*)sqlite3_user_data(context);
+  sqlite3 *db = sqlite3_context_db_handle(context);
+
+  if (argc < 1 || argc > 5) {
+    sqlite3_result_error(context, "agent_run_async requires 1-5 arguments: (goal, [table_name], [max_iterations], [system_prompt], [options])", -1);
+    return;
+  }
+  if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+    sqlite3_result_error(context, "goal must be non-null", -1);
+    return;
+  }
+  if (!sqlite3_threadsafe()) {
+    sqlite3_result_error(context, "agent_run_async requires a thread-safe SQLite build", -1);
+    return;
+  }
+
+  // Table mode writes through the job connection, so it needs a shared file
+  const char *filename = sqlite3_db_filename(db, "main");
+  int table_mode = argc >= 2 && sqlite3_value_type(argv[1]) == SQLITE_TEXT && sqlite3_value_bytes(argv[1]) > 0;
+  if (!filename || !filename[0]) {
+    if (table_mode) {
+      sqlite3_result_error(context, "agent_run_async table mode requires a file database", -1);
+      return;
+    }
+    filename = ":memory:";
+  }
+
+  if (!conn->job_mutex) {
+    conn->job_mutex = sqlite3_mutex_alloc(SQLITE_MUTEX_FAST);
+    if (!conn->job_mutex) {
+      sqlite3_result_error_nomem(context);
+      return;
+    }
+  }
+
+  agent_job *job = sqlite3_malloc(sizeof(agent_job));
+  if (!job) {
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+  memset(job, 0, sizeof(*job));
+  job->mutex = conn->job_mutex;
+  job->argc = argc;
+  int rc = agent_options_copy(&job->options, &conn->options);
+  job->filename = sqlite3_mprintf("%s", filename);
+  if (!job->filename) rc = SQLITE_NOMEM;
+  for (int i = 0; i < argc; i++) {
+    job->args[i] = sqlite3_value_dup(argv[i]);
+    if (!job->args[i]) rc = SQLITE_NOMEM;
+  }
+  if (rc != SQLITE_OK) {
+    agent_job_free(job);
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+
+  job->id = ++conn->last_job_id;
+  job->status = AGENT_JOB_QUEUED;
+  job->created_at = (sqlite3_int64)time(NULL);
+  job->started = agent_thread_start(&job->thread, agent_job_main, job);
+  if (!job->started) {
+    agent_job_free(job);
+    sqlite3_result_error(context, "agent_run_async: failed to start the job thread", -1);
+    return;
+  }
+
+  agent_jobs_prune(conn, AGENT_MAX_FINISHED_JOBS - 1);
+
+  // Jobs are listed in id order; the list is only changed by this connection
+  agent_job **tail = &conn->jobs;
+  while (*tail) tail = &(*tail)->next;
+  *tail = job;
+
+  sqlite3_result_int64(context, job->id);
+}
+
+static void agent_cancel_func(
+  sqlite3_context *context,
+  int argc,
+  sqlite3_value **argv
+){
+  agent_connection *conn = (agent_connection*)sqlite3_user_data(context);
+  sqlite3_int64 id = sqlite3_value_int64(argv[0]);
+  int cancelled = 0;
+
+  for (agent_job *job = conn->jobs; job; job = job->next) {
+    if (job->id != id) continue;
+    sqlite3_mutex_enter(job->mutex);
+    if (job->status == AGENT_JOB_QUEUED || job->status == AGENT_JOB_RUNNING) {
+      job->cancel = 1;
+      if (job->db) sqlite3_interrupt(job->db);
+      cancelled = 1;
+    }
+    sqlite3_mutex_leave(job->mutex);
+    break;
+  }
+  sqlite3_result_int(context, cancelled);
+}
+
+static void agent_jobs_clear_func(
+  sqlite3_context *context,
+  int argc,
+  sqlite3_value **argv
+){
+  agent_connection *conn = (agent_connection*)sqlite3_user_data(context);
+  if (conn->job_cursors) {
+    sqlite3_result_error(context, "agent_jobs_clear cannot run while agent_jobs is being read", -1);
+    return;
+  }
+  sqlite3_result_int(context, agent_jobs_prune(conn, 0));
+}
+
+// Cancels the jobs still running and waits for their threads
+static void agent_jobs_shutdown(agent_connection *conn) {
+  for (agent_job *job = conn->jobs; job; job = job->next) {
+    sqlite3_mutex_enter(job->mutex);
+    job->cancel = 1;
+    if (job->db) sqlite3_interrupt(job->db);
+    sqlite3_mutex_leave(job->mutex);
+  }
+  while (conn->jobs) {
+    agent_job *job = conn->jobs;
+    conn->jobs = job->next;
+    if (job->started) agent_thread_join(job->thread);
+    agent_job_free(job);
+  }
+  sqlite3_mutex_free(conn->job_mutex);
+  conn->job_mutex = NULL;
+}
+
+// agent_jobs: eponymous virtual table listing the jobs of the connection
+
+enum {
+  AGENT_JOBS_ID,
+  AGENT_JOBS_STATUS,
+  AGENT_JOBS_GOAL,
+  AGENT_JOBS_TABLE_NAME,
+  AGENT_JOBS_ITERATION,
+  AGENT_JOBS_RESULT,
+  AGENT_JOBS_ERROR,
+  AGENT_JOBS_CREATED_AT,
+  AGENT_JOBS_FINISHED_AT
+};
+
+typedef struct {
+  sqlite3_vtab base;
+  agent_connection *conn;
+} agent_jobs_vtab;
+
+typedef struct {
+  sqlite3_vtab_cursor base;
+  agent_job *job;
+} agent_jobs_cursor;
+
+static int agent_jobs_connect(sqlite3 *db, void *aux, int argc, const char *const *argv,
+                              sqlite3_vtab **vtab, char **err) {
+  int rc = sqlite3_declare_vtab(db,
+    "CREATE TABLE x(id INTEGER, status TEXT, goal TEXT, table_name TEXT, iteration INTEGER, "
+    "result, error TEXT, created_at INTEGER, finished_at INTEGER)");
+  if (rc != SQLITE_OK) return rc;
+
+  agent_jobs_vtab *table = sqlite3_malloc(sizeof(agent_jobs_vtab));
+  if (!table) return SQLITE_NOMEM;
+  memset(table, 0, sizeof(*table));
+  table->conn = (agent_connection*)aux;
+  *vtab = &table->base;
+  return SQLITE_OK;
+}
+
+static int agent_jobs_disconnect(sqlite3_vtab *vtab) {
+  sqlite3_free(vtab);
+  return SQLITE_OK;
+}
+
+static int agent_jobs_best_index(sqlite3_vtab *vtab, sqlite3_index_info *info) {
+  info->estimatedCost = 100;
+  return SQLITE_OK;
+}
+
+static int agent_jobs_open(sqlite3_vtab *vtab, sqlite3_vtab_cursor **cursor) {
+  agent_jobs_cursor *cur = sqlite3_malloc(sizeof(agent_jobs_cursor));
+  if (!cur) return SQLITE_NOMEM;
+  memset(cur, 0, sizeof(*cur));
+  ((agent_jobs_vtab*)vtab)->conn->job_cursors++;
+  *cursor = &cur->base;
+  return SQLITE_OK;
+}
+
+static int agent_jobs_close(sqlite3_vtab_cursor *cursor) {
+  ((agent_jobs_vtab*)cursor->pVtab)->conn->job_cursors--;
+  sqlite3_free(cursor);
+  return SQLITE_OK;
+}
+
+static int agent_jobs_filter(sqlite3_vtab_cursor *cursor, int idx_num, const char *idx_str,
+                             int argc, sqlite3_value **argv) {
+  agent_jobs_cursor *cur = (agent_jobs_cursor*)cursor;
+  cur->job = ((agent_jobs_vtab*)cursor->pVtab)->conn->jobs;
+  return SQLITE_OK;
+}
+
+static int agent_jobs_next(sqlite3_vtab_cursor *cursor) {
+  agent_jobs_cursor *cur = (agent_jobs_cursor*)cursor;
+  cur->job = cur->job->next;
+  return SQLITE_OK;
+}
+
+static int agent_jobs_eof(sqlite3_vtab_cursor *cursor) {
+  return ((agent_jobs_cursor*)cursor)->job == NULL;
+}
+
+static int agent_jobs_column(sqlite3_vtab_cursor *cursor, sqlite3_context *context, int column) {
+  agent_job *job = ((agent_jobs_cursor*)cursor)->job;
+
+  // Arguments never change once the job is created
+  switch (column) {
+    case AGENT_JOBS_ID:
+      sqlite3_result_int64(context, job->id);
+      return SQLITE_OK;
+    case AGENT_JOBS_GOAL:
+      sqlite3_result_value(context, job->args[0]);
+      return SQLITE_OK;
+    case AGENT_JOBS_TABLE_NAME:
+      if (job->argc >= 2 && sqlite3_value_type(job->args[1]) == SQLITE_TEXT) {
+        sqlite3_result_value(context, job->args[1]);
+      }
+      return SQLITE_OK;
+    case AGENT_JOBS_CREATED_AT:
+      sqlite3_result_int64(context, job->created_at);
+      return SQLITE_OK;
+  }
+
+  sqlite3_mutex_enter(job->mutex);
+  switch (column) {
+    case AGENT_JOBS_STATUS:
+      sqlite3_result_text(context, agent_job_status_names[job->status], -1, SQLITE_STATIC);
+      break;
+    case AGENT_JOBS_ITERATION:
+      sqlite3_result_int(context, job->iteration);
+      break;
+    case AGENT_JOBS_RESULT:
+      if (job->result) sqlite3_result_value(context, job->result);
+      break;
+    case AGENT_JOBS_ERROR:
+      if (job->error) sqlite3_result_text(context, job->error, -1, SQLITE_TRANSIENT);
+      break;
+    case AGENT_JOBS_FINISHED_AT:
+      if (job->finished_at) sqlite3_result_int64(context, job->finished_at);
+      break;
+  }
+  sqlite3_mutex_leave(job->mutex);
+  return SQLITE_OK;
+}
 
-    rc = sqlite3_step(stmt);
-    if (rc != SQLITE_ROW) {
-      DF("ERROR: Failed to get LLM response (rc=%d): %s", rc, sqlite3_errmsg(db));
-      sqlite3_finalize(stmt);
-      continue;
-    }
+static int agent_jobs_rowid(sqlite3_vtab_cursor *cursor, sqlite3_int64 *rowid) {
+  *rowid = ((agent_jobs_cursor*)cursor)->job->id;
+  return SQLITE_OK;
+}
 
-    const char *agent_response = (const char*)sqlite3_column_text(stmt, 0);
-    if (!agent_response) {
-      D("WARNING: LLM returned NULL response");
-      sqlite3_finalize(stmt);
-      break;
-    }
+static sqlite3_module agent_jobs_module = {
+  0,                        // iVersion
+  0,                        // xCreate: eponymous only
+  agent_jobs_connect,
+  agent_jobs_best_index,
+  agent_jobs_disconnect,
+  0,                        // xDestroy
+  agent_jobs_open,
+  agent_jobs_close,
+  agent_jobs_filter,
+  agent_jobs_next,
+  agent_jobs_eof,
+  agent_jobs_column,
+  agent_jobs_rowid,
+  0, 0, 0, 0, 0, 0, 0,      // xUpdate ... xRename: read-only, no transactions
+  0, 0, 0, 0, 0             // xSavepoint ... xIntegrity
+};
+
+// agent_trace: eponymous virtual table listing the events of the last runs
+
+enum {
+  AGENT_TRACE_RUN_ID,
+  AGENT_TRACE_STEP,
+  AGENT_TRACE_ITERATION,
+  AGENT_TRACE_KIND,
+  AGENT_TRACE_NAME,
+  AGENT_TRACE_DURATION_MS,
+  AGENT_TRACE_TOKENS_IN,
+  AGENT_TRACE_TOKENS_OUT,
+  AGENT_TRACE_BYTES,
+  AGENT_TRACE_ROWS,
+  AGENT_TRACE_DETAIL,
+  AGENT_TRACE_CREATED_AT
+};
+
+typedef struct {
+  sqlite3_vtab_cursor base;
+  int index;
+} agent_trace_cursor;
+
+static int agent_trace_connect(sqlite3 *db, void *aux, int argc, const char *const *argv,
+                               sqlite3_vtab **vtab, char **err) {
+  int rc = sqlite3_declare_vtab(db,
+    "CREATE TABLE x(run_id INTEGER, step INTEGER, iteration INTEGER, kind TEXT, name TEXT, "
+    "duration_ms REAL, tokens_in INTEGER, tokens_out INTEGER, bytes INTEGER, rows INTEGER, "
+    "detail TEXT, created_at INTEGER)");
+  if (rc != SQLITE_OK) return rc;
 
-    char response_copy[8192];
-    strncpy(response_copy, agent_response, sizeof(response_copy) - 1);
-    response_copy[sizeof(response_copy) - 1] = '\0';
-    sqlite3_finalize(stmt);
+  agent_jobs_vtab *table = sqlite3_malloc(sizeof(agent_jobs_vtab));
+  if (!table) return SQLITE_NOMEM;
+  memset(table, 0, sizeof(*table));
+  table->conn = (agent_connection*)aux;
+  *vtab = &table->base;
+  return SQLITE_OK;
+}
 
-    DF("Agent Response:\n%s", response_copy);
+static int agent_trace_open(sqlite3_vtab *vtab, sqlite3_vtab_cursor **cursor) {
+  agent_trace_cursor *cur = sqlite3_malloc(sizeof(agent_trace_cursor));
+  if (!cur) return SQLITE_NOMEM;
+  memset(cur, 0, sizeof(*cur));
+  *cursor = &cur->base;
+  return SQLITE_OK;
+}
 
-    if (strstr(response_copy, "DONE") != NULL) {
-      D("Agent said DONE - ending loop");
-      break;
-    }
+static int agent_trace_close(sqlite3_vtab_cursor *cursor) {
+  sqlite3_free(cursor);
+  return SQLITE_OK;
+}
 
-    char tool_name[256] = {0};
-    char tool_args[4096] = {0};
+static int agent_trace_filter(sqlite3_vtab_cursor *cursor, int idx_num, const char *idx_str,
+                              int argc, sqlite3_value **argv) {
+  ((agent_trace_cursor*)cursor)->index = 0;
+  return SQLITE_OK;
+}
 
-    const char *tool_marker = strstr(response_copy, "\"tool\"");
-    const char *args_marker = strstr(response_copy, "\"args\"");
+static int agent_trace_next(sqlite3_vtab_cursor *cursor) {
+  ((agent_trace_cursor*)cursor)->index++;
+  return SQLITE_OK;
+}
 
-    if (tool_marker && args_marker) {
-      const char *tool_value = strchr(tool_marker + 6, '"');
-      if (tool_value) {
-        tool_value++;
-        const char *tool_end = strchr(tool_value, '"');
-        if (tool_end) {
-          size_t len = tool_end - tool_value;
-          if (len < sizeof(tool_name)) {
-            strncpy(tool_name, tool_value, len);
-            tool_name[len] = '\0';
-          }
-        }
-      }
+// A run started while scanning may drop events, so the index is checked on every access
+static const sqlite3_agent_trace_event* agent_trace_cursor_event(sqlite3_vtab_cursor *cursor) {
+  agent_trace *trace = &((agent_jobs_vtab*)cursor->pVtab)->conn->trace;
+  int index = ((agent_trace_cursor*)cursor)->index;
+  return index < trace->count ? &trace->events[index] : NULL;
+}
 
-      const char *args_start = strchr(args_marker + 6, '{');
-      if (args_start) {
-        int brace_count = 1;
-        const char *p = args_start + 1;
-        while (*p && brace_count > 0) {
-          if (*p == '{') brace_count++;
-          else if (*p == '}') brace_count--;
-          if (brace_count > 0) p++;
-        }
-        if (brace_count == 0) {
-          size_t len = p - args_start + 1;
-          if (len < sizeof(tool_args)) {
-            strncpy(tool_args, args_start, len);
-            tool_args[len] = '\0';
-          }
-        }
-      }
-    }
+static int agent_trace_eof(sqlite3_vtab_cursor *cursor) {
+  return agent_trace_cursor_event(cursor) == NULL;
+}
 
-    if (tool_name[0]) {
-      DF("Parsed tool: '%s' args: '%s'", tool_name, tool_args);
+static int agent_trace_column(sqlite3_vtab_cursor *cursor, sqlite3_context *context, int column) {
+  const sqlite3_agent_trace_event *event = agent_trace_cursor_event(cursor);
+  if (!event) return SQLITE_OK;
+
+  switch (column) {
+    case AGENT_TRACE_RUN_ID: sqlite3_result_int64(context, event->run_id); break;
+    case AGENT_TRACE_STEP: sqlite3_result_int(context, event->step); break;
+    case AGENT_TRACE_ITERATION: sqlite3_result_int(context, event->iteration); break;
+    case AGENT_TRACE_KIND: sqlite3_result_text(context, event->kind, -1, SQLITE_STATIC); break;
+    case AGENT_TRACE_NAME:
+      if (event->name) sqlite3_result_text(context, event->name, -1, SQLITE_TRANSIENT);
+      break;
+    case AGENT_TRACE_DURATION_MS: sqlite3_result_double(context, event->duration_ms); break;
+    case AGENT_TRACE_TOKENS_IN: sqlite3_result_int(context, event->tokens_in); break;
+    case AGENT_TRACE_TOKENS_OUT: sqlite3_result_int(context, event->tokens_out); break;
+    case AGENT_TRACE_BYTES: sqlite3_result_int64(context, event->bytes); break;
+    case AGENT_TRACE_ROWS: sqlite3_result_int64(context, event->rows); break;
+    case AGENT_TRACE_DETAIL:
+      if (event->detail) sqlite3_result_text(context, event->detail, -1, SQLITE_TRANSIENT);
+      break;
+    case AGENT_TRACE_CREATED_AT: sqlite3_result_int64(context, event->created_at); break;
+  }
+  return SQLITE_OK;
+}
 
-      if (strstr(tool_args, "{{") != NULL || strstr(tool_args, "}}") != NULL) {
-        D("ERROR: Tool args contain template syntax {{...}}");
-        char error_msg[512];
-        snprintf(error_msg, sizeof(error_msg),
-                 "ERROR: Tool args contain invalid template syntax: %.200s", tool_args);
-        strncat(conversation_history, error_msg,
-                sizeof(conversation_history) - strlen(conversation_history) - 1);
-        strncat(conversation_history, "\n",
-                sizeof(conversation_history) - strlen(conversation_history) - 1);
-        continue;
-      }
+static int agent_trace_rowid(sqlite3_vtab_cursor *cursor, sqlite3_int64 *rowid) {
+  *rowid = ((agent_trace_cursor*)cursor)->index + 1;
+  return SQLITE_OK;
+}
 
-      char *tool_result = agent_call_mcp_tool(db, tool_name, tool_args);
-      if (tool_result) {
-        DF("Tool result (length=%zu): %.500s%s",
-           strlen(tool_result),
-           tool_result,
-           strlen(tool_result) > 500 ? "..." : "");
-
-        int is_error = (strstr(tool_result, "\"isError\":true") != NULL ||
-                        strstr(tool_result, "404 Not Found") != NULL ||
-                        strstr(tool_result, "failed to") != NULL);
-
-        if (is_error) {
-          char current_error[256];
-          snprintf(current_error, sizeof(current_error), "%.200s", tool_result);
-          if (strcmp(current_error, last_error) == 0) {
-            consecutive_errors++;
-            DF("WARNING: Same error repeated %d times", consecutive_errors);
-            if (consecutive_errors >= 3) {
-              D("ERROR: Stopping due to 3 consecutive identical errors");
-              free(tool_result);
-              break;
-            }
-          } else {
-            strncpy(last_error, current_error, sizeof(last_error) - 1);
-            consecutive_errors = 1;
-          }
-        } else {
-          consecutive_errors = 0;
-          last_error[0] = '\0';
-        }
+static sqlite3_module agent_trace_module = {
+  0,                        // iVersion
+  0,                        // xCreate: eponymous only
+  agent_trace_connect,
+  agent_jobs_best_index,
+  agent_jobs_disconnect,
+  0,                        // xDestroy
+  agent_trace_open,
+  agent_trace_close,
+  agent_trace_filter,
+  agent_trace_next,
+  agent_trace_eof,
+  agent_trace_column,
+  agent_trace_rowid,
+  0, 0, 0, 0, 0, 0, 0,      // xUpdate ... xRename: read-only, no transactions
+  0, 0, 0, 0, 0             // xSavepoint ... xIntegrity
+};
+
+// agent_run_each: table-valued function running a list of goals, one row per goal
+
+enum {
+  AGENT_EACH_ID,
+  AGENT_EACH_GOAL,
+  AGENT_EACH_STATUS,
+  AGENT_EACH_RESULT,
+  AGENT_EACH_ROWS,
+  AGENT_EACH_DURATION_MS,
+  AGENT_EACH_ERROR,
+  AGENT_EACH_GOALS,           // hidden arguments, in agent_run() order
+  AGENT_EACH_TABLE_NAME,
+  AGENT_EACH_MAX_ITERATIONS,
+  AGENT_EACH_SYSTEM_PROMPT,
+  AGENT_EACH_OPTIONS
+};
+
+typedef struct {
+  sqlite3_value *goal;
+  agent_job_status status;    // queued until the goal was run
+  sqlite3_value *result;
+  char *error;
+  int rows;
+  double duration_ms;
+} agent_batch_goal;
+
+// Goals of one agent_run_each() call. Workers claim the next goal under
+// mutex; each goal is only written by the thread running it.
+typedef struct {
+  agent_batch_goal *goals;
+  int count;
+  sqlite3_value *args[4];     // table_name, max_iterations, system_prompt, options shared by the goals
+  int argc;                   // agent_run() arguments including the goal
+  int next;                   // next goal to run
+  sqlite3_mutex *mutex;
+  char *error;                // why a worker could not run goals
+} agent_batch;
+
+typedef struct {
+  agent_job job;              // job connection settings, the job itself is not listed
+  agent_batch *batch;
+} agent_batch_worker;
+
+typedef struct {
+  sqlite3_vtab base;
+  agent_connection *conn;
+  sqlite3 *db;
+} agent_run_each_vtab;
+
+typedef struct {
+  sqlite3_vtab_cursor base;
+  agent_batch batch;
+  int index;
+  sqlite3_stmt *stmt;         // agent_run() on the calling connection while goals are left
+  int batching;               // holds conn->batch
+} agent_run_each_cursor;
+
+static void agent_batch_clear(agent_batch *batch) {
+  for (int i = 0; i < batch->count; i++) {
+    sqlite3_value_free(batch->goals[i].goal);
+    sqlite3_value_free(batch->goals[i].result);
+    sqlite3_free(batch->goals[i].error);
+  }
+  sqlite3_free(batch->goals);
+  for (int i = 0; i < 4; i++) sqlite3_value_free(batch->args[i]);
+  sqlite3_free(batch->error);
+  memset(batch, 0, sizeof(*batch));
+}
 
-        char result_msg[16384];
-        // Use dynamic truncation calculated based on available context space
-        if (strlen(tool_result) > dynamic_truncate_at) {
-          // Dynamically create format string for truncation
-          char format_str[128];
-          snprintf(format_str, sizeof(format_str),
-                   "Tool %%s returned (truncated to %%zu chars): %%.%zus...\n",
-                   dynamic_truncate_at);
-          snprintf(result_msg, sizeof(result_msg), format_str,
-                   tool_name, dynamic_truncate_at, tool_result);
-        } else {
-          snprintf(result_msg, sizeof(result_msg),
-                   "Tool %s returned: %s\n", tool_name, tool_result);
-        }
-        strncat(conversation_history, result_msg,
-                sizeof(conversation_history) - strlen(conversation_history) - 1);
-        free(tool_result);
-      } else {
-        DF("ERROR: Tool '%s' returned NULL", tool_name);
-      }
-    } else {
-      D("WARNING: Could not parse tool call from agent response");
+// Runs one goal through stmt, agent_run() prepared on the connection running
+// it; rows is where that connection records the rows stored by the run
+static void agent_batch_run_goal(sqlite3 *db, sqlite3_stmt *stmt, agent_batch *batch,
+                                 agent_batch_goal *goal, const int *rows) {
+  double started = agent_clock_ms();
+  int rc = sqlite3_bind_value(stmt, 1, goal->goal);
+  for (int i = 1; rc == SQLITE_OK && i < batch->argc; i++) {
+    rc = sqlite3_bind_value(stmt, i + 1, batch->args[i - 1]);
+  }
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_step(stmt);
+    if (rc == SQLITE_ROW) {
+      goal->result = sqlite3_value_dup(sqlite3_column_value(stmt, 0));
+      rc = goal->result ? SQLITE_OK : SQLITE_NOMEM;
     }
   }
+  if (rc != SQLITE_OK) goal->error = sqlite3_mprintf("%s", rc == SQLITE_NOMEM ? sqlite3_errstr(rc) : sqlite3_errmsg(db));
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
 
-  DF("Conversation history (length=%zu):", strlen(conversation_history));
-  DF("=== FULL CONVERSATION HISTORY ===\n%s\n=== END CONVERSATION HISTORY ===", conversation_history);
-
-  char extraction_prompt[32768];
-  snprintf(extraction_prompt, sizeof(extraction_prompt),
-    "Extract structured data from the following information and format it as a JSON array.\n\n"
-    "%s\n\n"
-    "IMPORTANT:\n"
-    "- Return ONLY a JSON array of objects\n"
-    "- Each object must have these EXACT keys (matching column names):\n"
-    "%s\n"
-    "- Extract ALL available data that matches the schema\n"
-    "- Use null for missing values\n"
-    "- Do NOT include the 'embedding' column if present\n\n"
-    "CRITICAL ID EXTRACTION RULE:\n"
-    "If the schema has an 'id' column, look in the JSON data for fields like:\n"
-    "- \"id\", \"listing_id\", \"property_id\", \"item_id\", etc.\n"
-    "Extract the ACTUAL numeric/string ID value from the source data.\n"
-    "Example: if you see {\"id\": 123456789, \"title\": \"Rome Apartment\"}, use 123456789\n"
-    "NEVER use 0, 1, 2, 3 as IDs - use the real IDs from the data!\n\n"
-    "Data to extract:\n%.6000s\n\n"
-    "Return ONLY the JSON array:",
-    schema_desc, schema_desc, conversation_history);
+  goal->status = (rc == SQLITE_OK) ? AGENT_JOB_DONE : AGENT_JOB_FAILED;
+  goal->rows = (rc == SQLITE_OK) ? *rows : 0;
+  goal->duration_ms = agent_clock_ms() - started;
+}
 
-  DF("=== FULL EXTRACTION PROMPT ===\n%s\n=== END EXTRACTION PROMPT ===", extraction_prompt);
+static AGENT_THREAD_FUNC agent_batch_main(void *arg) {
+  agent_batch_worker *worker = (agent_batch_worker*)arg;
+  agent_batch *batch = worker->batch;
+  sqlite3 *db = NULL;
+  agent_connection *state = NULL;
+  sqlite3_stmt *stmt = NULL;
+  char *error = NULL;
 
-  sqlite3_stmt *ctx_size_stmt;
-  int ctx_size_for_extraction = 0;
-  rc = sqlite3_prepare_v2(db, "SELECT llm_context_size()", -1, &ctx_size_stmt, 0);
+  int rc = agent_job_open(&worker->job, &db, &state, &error);
   if (rc == SQLITE_OK) {
-    if (sqlite3_step(ctx_size_stmt) == SQLITE_ROW) {
-      ctx_size_for_extraction = sqlite3_column_int(ctx_size_stmt, 0);
-      DF("Context size for extraction: %d", ctx_size_for_extraction);
-    }
-    sqlite3_finalize(ctx_size_stmt);
+    rc = sqlite3_prepare_v2(db, agent_run_sql[batch->argc - 1], -1, &stmt, NULL);
+    if (rc != SQLITE_OK) error = sqlite3_mprintf("%s", sqlite3_errmsg(db));
   }
 
-  if (ctx_size_for_extraction > 0) {
-    char create_extraction_cmd[256];
-    snprintf(create_extraction_cmd, sizeof(create_extraction_cmd),
-             "SELECT llm_context_create_chat('context_size=%d')", ctx_size_for_extraction);
-    sqlite3_exec(db, create_extraction_cmd, 0, 0, 0);
-  } else {
-    sqlite3_exec(db, "SELECT llm_context_create_chat()", 0, 0, 0);
+  while (rc == SQLITE_OK) {
+    sqlite3_mutex_enter(batch->mutex);
+    int next = batch->next < batch->count ? batch->next++ : -1;
+    sqlite3_mutex_leave(batch->mutex);
+    if (next < 0) break;
+    agent_batch_run_goal(db, stmt, batch, &batch->goals[next], &worker->job.rows);
   }
 
-  rc = sqlite3_prepare_v2(db, "SELECT llm_chat_respond(?)", -1, &stmt, 0);
-  if (rc != SQLITE_OK) {
-    D("ERROR: Failed to prepare extraction query");
-    sqlite3_result_error(context, "Failed to prepare extraction", -1);
-    return;
+  // Goals no worker could run are failed with the first error
+  if (error) {
+    sqlite3_mutex_enter(batch->mutex);
+    if (!batch->error) {
+      batch->error = error;
+      error = NULL;
+    }
+    sqlite3_mutex_leave(batch->mutex);
+    sqlite3_free(error);
   }
 
-  sqlite3_bind_text(stmt, 1, extraction_prompt, -1, SQLITE_TRANSIENT);
+  // The batch kept the internal statements, which would keep db open
+  if (state) agent_stmt_cache_clear(state);
+  sqlite3_finalize(stmt);
+  sqlite3_close(db);
+  return AGENT_THREAD_RETURN;
+}
 
-  if (sqlite3_step(stmt) != SQLITE_ROW) {
-    D("ERROR: LLM extraction failed");
-    sqlite3_result_error(context, "Failed to extract structured data", -1);
-    sqlite3_finalize(stmt);
-    return;
+// Runs the goals on up to workers job connections and waits for all of them
+static int agent_batch_run_workers(agent_connection *conn, agent_batch *batch, const char *filename,
+                                   int workers) {
+  agent_batch_worker *pool = sqlite3_malloc(workers * (int)sizeof(agent_batch_worker));
+  batch->mutex = sqlite3_mutex_alloc(SQLITE_MUTEX_FAST);
+  if (!pool || !batch->mutex) {
+    sqlite3_free(pool);
+    sqlite3_mutex_free(batch->mutex);
+    batch->mutex = NULL;
+    return SQLITE_NOMEM;
   }
+  memset(pool, 0, workers * sizeof(agent_batch_worker));
 
-  const char *json_data = (const char*)sqlite3_column_text(stmt, 0);
-  char json_copy[32768];
-  strncpy(json_copy, json_data ? json_data : "[]", sizeof(json_copy) - 1);
-  json_copy[sizeof(json_copy) - 1] = '\0';
-  sqlite3_finalize(stmt);
-
-  DF("=== FULL EXTRACTED JSON ===\n%s\n=== END EXTRACTED JSON ===", json_copy);
+  int rc = SQLITE_OK;
+  for (int w = 0; rc == SQLITE_OK && w < workers; w++) {
+    agent_job *job = &pool[w].job;
+    pool[w].batch = batch;
+    job->mutex = batch->mutex;
+    job->batch = 1;
+    job->filename = sqlite3_mprintf("%s", filename);
+    rc = job->filename ? agent_options_copy(&job->options, &conn->options) : SQLITE_NOMEM;
+    if (rc == SQLITE_OK) job->started = agent_thread_start(&job->thread, agent_batch_main, &pool[w]);
+  }
 
-  sqlite3_exec(db, "BEGIN TRANSACTION", 0, 0, 0);
+  int started = 0;
+  for (int w = 0; w < workers; w++) {
+    agent_job *job = &pool[w].job;
+    if (job->started) {
+      agent_thread_join(job->thread);
+      started++;
+    }
+    sqlite3_free(job->filename);
+    agent_options_free(&job->options);
+  }
+  sqlite3_free(pool);
+  sqlite3_mutex_free(batch->mutex);
+  batch->mutex = NULL;
+
+  for (int i = 0; i < batch->count; i++) {
+    agent_batch_goal *goal = &batch->goals[i];
+    if (goal->status != AGENT_JOB_QUEUED) continue;
+    goal->status = AGENT_JOB_FAILED;
+    goal->error = sqlite3_mprintf("%s", batch->error ? batch->error :
+                                  started ? sqlite3_errstr(rc) : "agent_run_each: failed to start the batch workers");
+  }
+  return SQLITE_OK;
+}
 
-  int rows_inserted = 0;
+static int agent_run_each_connect(sqlite3 *db, void *aux, int argc, const char *const *argv,
+                                  sqlite3_vtab **vtab, char **err) {
+  int rc = sqlite3_declare_vtab(db,
+    "CREATE TABLE x(id INTEGER, goal TEXT, status TEXT, result, rows INTEGER, duration_ms REAL, "
+    "error TEXT, goals HIDDEN, table_name HIDDEN, max_iterations HIDDEN, system_prompt HIDDEN, options HIDDEN)");
+  if (rc != SQLITE_OK) return rc;
 
-  const char *pos = json_copy;
-  while ((pos = strchr(pos, '{')) != NULL) {
-    const char *obj_start = pos;
-    const char *obj_end = strchr(obj_start, '}');
-    if (!obj_end) {
-      D("WARNING: Could not find closing brace for object");
-      break;
-    }
+  agent_run_each_vtab *table = sqlite3_malloc(sizeof(agent_run_each_vtab));
+  if (!table) return SQLITE_NOMEM;
+  memset(table, 0, sizeof(*table));
+  table->conn = (agent_connection*)aux;
+  table->db = db;
+  *vtab = &table->base;
+  return SQLITE_OK;
+}
 
-    DF("Found JSON object (length=%ld): %.200s...", (long)(obj_end - obj_start), obj_start);
+// The arguments are passed to xFilter in column order, idxNum has a bit per argument
+static int agent_run_each_best_index(sqlite3_vtab *vtab, sqlite3_index_info *info) {
+  int args[5] = {-1, -1, -1, -1, -1};
+  for (int i = 0; i < info->nConstraint; i++) {
+    const struct sqlite3_index_constraint *c = &info->aConstraint[i];
+    if (c->iColumn < AGENT_EACH_GOALS || c->op != SQLITE_INDEX_CONSTRAINT_EQ) continue;
+    if (!c->usable) return SQLITE_CONSTRAINT;
+    args[c->iColumn - AGENT_EACH_GOALS] = i;
+  }
 
-    char insert_sql[2048];
-    char columns_part[512] = "";
-    char values_part[512] = "";
+  int argv_index = 0;
+  info->idxNum = 0;
+  for (int a = 0; a < 5; a++) {
+    if (args[a] < 0) continue;
+    info->aConstraintUsage[args[a]].argvIndex = ++argv_index;
+    info->aConstraintUsage[args[a]].omit = 1;
+    info->idxNum |= 1 << a;
+  }
+  info->estimatedCost = 100;
+  return SQLITE_OK;
+}
 
-    int first_col = 1;
-    for (int i = 0; i < column_count; i++) {
-      int is_embedding = 0;
-      for (int j = 0; j < embedding_col_count; j++) {
-        if (embedding_col_indices[j] == i) {
-          is_embedding = 1;
-          break;
-        }
-      }
-      if (is_embedding) continue;
+static int agent_run_each_open(sqlite3_vtab *vtab, sqlite3_vtab_cursor **cursor) {
+  agent_run_each_cursor *cur = sqlite3_malloc(sizeof(agent_run_each_cursor));
+  if (!cur) return SQLITE_NOMEM;
+  memset(cur, 0, sizeof(*cur));
+  *cursor = &cur->base;
+  return SQLITE_OK;
+}
 
-      if (!first_col) {
-        strcat(columns_part, ", ");
-        strcat(values_part, ", ");
-      }
-      strcat(columns_part, column_names[i]);
-      strcat(values_part, "?");
-      first_col = 0;
+// Releases the calling connection once its goals are done
+static void agent_run_each_end(agent_run_each_cursor *cur) {
+  agent_connection *conn = ((agent_run_each_vtab*)cur->base.pVtab)->conn;
+  sqlite3_finalize(cur->stmt);
+  cur->stmt = NULL;
+  if (cur->batching) {
+    cur->batching = 0;
+    if (--conn->batch == 0) {
+      agent_stmt_cache_clear(conn);
+      agent_pool_release(conn);
     }
+  }
+}
 
-    snprintf(insert_sql, sizeof(insert_sql),
-             "INSERT INTO %s (%s) VALUES (%s)",
-             table_name, columns_part, values_part);
+static int agent_run_each_close(sqlite3_vtab_cursor *cursor) {
+  agent_run_each_cursor *cur = (agent_run_each_cursor*)cursor;
+  agent_run_each_end(cur);
+  agent_batch_clear(&cur->batch);
+  sqlite3_free(cur);
+  return SQLITE_OK;
+}
 
-    DF("Preparing INSERT: %s", insert_sql);
+// Runs the goal at the cursor on the calling connection, if it is still queued
+static int agent_run_each_step(agent_run_each_cursor *cur) {
+  agent_run_each_vtab *table = (agent_run_each_vtab*)cur->base.pVtab;
+  if (cur->index >= cur->batch.count) {
+    agent_run_each_end(cur);
+    return SQLITE_OK;
+  }
+  if (cur->stmt) {
+    agent_batch_run_goal(table->db, cur->stmt, &cur->batch, &cur->batch.goals[cur->index],
+                         &table->conn->last_rows);
+  }
+  return SQLITE_OK;
+}
 
-    rc = sqlite3_prepare_v2(db, insert_sql, -1, &stmt, 0);
-    if (rc != SQLITE_OK) {
-      DF("ERROR: Failed to prepare insert statement: %s", sqlite3_errmsg(db));
-      sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
-      sqlite3_result_error(context, "Failed to prepare insert statement", -1);
-      return;
-    }
+static int agent_run_each_filter(sqlite3_vtab_cursor *cursor, int idx_num, const char *idx_str,
+                                 int argc, sqlite3_value **argv) {
+  agent_run_each_cursor *cur = (agent_run_each_cursor*)cursor;
+  agent_run_each_vtab *table = (agent_run_each_vtab*)cursor->pVtab;
+  agent_connection *conn = table->conn;
+  agent_batch *batch = &cur->batch;
+
+  agent_run_each_end(cur);
+  agent_batch_clear(batch);
+  cur->index = 0;
+
+  // Arguments are positional, so each one needs the ones before it
+  if (!(idx_num & 1) || (idx_num & (idx_num + 1))) {
+    cursor->pVtab->zErrMsg = sqlite3_mprintf(
+      "agent_run_each requires (goals, [table_name], [max_iterations], [system_prompt], [options])");
+    return SQLITE_ERROR;
+  }
+  batch->argc = argc;
+  for (int i = 1; i < argc; i++) {
+    batch->args[i - 1] = sqlite3_value_dup(argv[i]);
+    if (!batch->args[i - 1]) return SQLITE_NOMEM;
+  }
 
-    int bind_idx = 1;
-    for (int i = 0; i < column_count; i++) {
-      int is_embedding = 0;
-      for (int j = 0; j < embedding_col_count; j++) {
-        if (embedding_col_indices[j] == i) {
-          is_embedding = 1;
-          break;
-        }
-      }
-      if (is_embedding) continue;
-
-      char search_key[128];
-      snprintf(search_key, sizeof(search_key), "\"%s\"", column_names[i]);
-      const char *key_pos = strstr(obj_start, search_key);
-
-      if (key_pos && key_pos < obj_end) {
-        const char *value_start = strchr(key_pos, ':');
-        if (value_start) {
-          value_start++;
-          while (*value_start == ' ' || *value_start == '\t') value_start++;
-
-          if (strcmp(column_types[i], "INTEGER") == 0) {
-            if (strncmp(value_start, "null", 4) == 0) {
-              sqlite3_bind_null(stmt, bind_idx);
-            } else if (*value_start == '"') {
-              value_start++;
-              const char *value_end = strchr(value_start, '"');
-              if (value_end) {
-                char num_str[64];
-                size_t len = value_end - value_start;
-                if (len >= sizeof(num_str)) len = sizeof(num_str) - 1;
-                strncpy(num_str, value_start, len);
-                num_str[len] = '\0';
-                sqlite3_bind_int64(stmt, bind_idx, atoll(num_str));
-              } else {
-                sqlite3_bind_null(stmt, bind_idx);
-              }
-            } else {
-              sqlite3_bind_int64(stmt, bind_idx, atoll(value_start));
-            }
-          } else if (strcmp(column_types[i], "REAL") == 0) {
-            if (strncmp(value_start, "null", 4) == 0) {
-              sqlite3_bind_null(stmt, bind_idx);
-            } else if (*value_start == '"') {
-              value_start++;
-              const char *value_end = strchr(value_start, '"');
-              if (value_end) {
-                char num_str[64];
-                size_t len = value_end - value_start;
-                if (len >= sizeof(num_str)) len = sizeof(num_str) - 1;
-                strncpy(num_str, value_start, len);
-                num_str[len] = '\0';
-                sqlite3_bind_double(stmt, bind_idx, atof(num_str));
-              } else {
-                sqlite3_bind_null(stmt, bind_idx);
-              }
-            } else {
-              sqlite3_bind_double(stmt, bind_idx, atof(value_start));
-            }
-          } else {
-            if (*value_start == '"') {
-              value_start++;
-              const char *value_end = strchr(value_start, '"');
-              if (value_end) {
-                char str_value[512];
-                size_t len = value_end - value_start;
-                if (len >= sizeof(str_value)) len = sizeof(str_value) - 1;
-                strncpy(str_value, value_start, len);
-                str_value[len] = '\0';
-                sqlite3_bind_text(stmt, bind_idx, str_value, -1, SQLITE_TRANSIENT);
-              } else {
-                sqlite3_bind_null(stmt, bind_idx);
-              }
-            } else if (strncmp(value_start, "null", 4) == 0) {
-              sqlite3_bind_null(stmt, bind_idx);
-            }
-          }
-        } else {
-          sqlite3_bind_null(stmt, bind_idx);
-        }
-      } else {
-        sqlite3_bind_null(stmt, bind_idx);
+  // Goals are the values of a JSON array
+  sqlite3_stmt *stmt = NULL;
+  int rc = sqlite3_prepare_v2(table->db, "SELECT json_type(?1), value FROM json_each(?1)", -1, &stmt, NULL);
+  if (rc == SQLITE_OK) rc = sqlite3_bind_value(stmt, 1, argv[0]);
+  int capacity = 0;
+  while (rc == SQLITE_OK && (rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    rc = SQLITE_OK;
+    const char *type = (const char*)sqlite3_column_text(stmt, 0);
+    if (!type || strcmp(type, "array") != 0) {
+      rc = SQLITE_MISMATCH;
+      break;
+    }
+    if (batch->count == capacity) {
+      capacity = capacity ? capacity * 2 : 16;
+      agent_batch_goal *goals = sqlite3_realloc(batch->goals, capacity * (int)sizeof(agent_batch_goal));
+      if (!goals) {
+        rc = SQLITE_NOMEM;
+        break;
       }
-
-      bind_idx++;
+      batch->goals = goals;
     }
-
-    #ifdef AGENT_DEBUG
-    char *expanded_sql = sqlite3_expanded_sql(stmt);
-    if (expanded_sql) {
-      DF("Full INSERT:\n%s", expanded_sql);
-      sqlite3_free(expanded_sql);
+    agent_batch_goal *goal = &batch->goals[batch->count];
+    memset(goal, 0, sizeof(*goal));
+    goal->goal = sqlite3_value_dup(sqlite3_column_value(stmt, 1));
+    if (!goal->goal) {
+      rc = SQLITE_NOMEM;
+      break;
     }
-    #endif
-
-    rc = sqlite3_step(stmt);
-
-    if (rc != SQLITE_DONE) {
-      DF("ERROR: Insert failed (rc=%d): %s", rc, sqlite3_errmsg(db));
-      sqlite3_finalize(stmt);
-      sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
-
-      char error_msg[512];
-      snprintf(error_msg, sizeof(error_msg), "Failed to insert row: %s", sqlite3_errmsg(db));
-      sqlite3_result_error(context, error_msg, -1);
-      return;
+    batch->count++;
+  }
+  if (rc == SQLITE_DONE) rc = SQLITE_OK;
+  if (rc != SQLITE_OK && rc != SQLITE_NOMEM) {
+    cursor->pVtab->zErrMsg = sqlite3_mprintf("agent_run_each: goals must be a JSON array");
+    rc = SQLITE_ERROR;
+  }
+  sqlite3_finalize(stmt);
+  if (rc != SQLITE_OK || batch->count == 0) return rc;
+
+  // The goals share the tool catalog and internal statements of the connection
+  // that runs them; with batch_workers each job connection keeps its own
+  int workers = conn->options.batch_workers;
+  if (workers > batch->count) workers = batch->count;
+  if (workers > 1 && sqlite3_threadsafe()) {
+    const char *filename = sqlite3_db_filename(table->db, "main");
+    int table_mode = argc >= 2 && sqlite3_value_type(argv[1]) == SQLITE_TEXT && sqlite3_value_bytes(argv[1]) > 0;
+    if (!filename || !filename[0]) {
+      if (table_mode) {
+        cursor->pVtab->zErrMsg = sqlite3_mprintf(
+          "agent_run_each with batch_workers in table mode requires a file database");
+        return SQLITE_ERROR;
+      }
+      filename = ":memory:";
     }
+    DF("Running %d goals on %d batch workers", batch->count, workers);
+    return agent_batch_run_workers(conn, batch, filename, workers);
+  }
 
-    sqlite3_finalize(stmt);
-    rows_inserted++;
-    DF("Row %d inserted", rows_inserted);
-    pos = obj_end + 1;
+  rc = sqlite3_prepare_v2(table->db, agent_run_sql[argc - 1], -1, &cur->stmt, NULL);
+  if (rc != SQLITE_OK) {
+    cursor->pVtab->zErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(table->db));
+    return rc;
   }
+  conn->batch++;
+  cur->batching = 1;
+  return agent_run_each_step(cur);
+}
 
-  DF("Total rows inserted: %d", rows_inserted);
+static int agent_run_each_next(sqlite3_vtab_cursor *cursor) {
+  agent_run_each_cursor *cur = (agent_run_each_cursor*)cursor;
+  cur->index++;
+  return agent_run_each_step(cur);
+}
+
+static int agent_run_each_eof(sqlite3_vtab_cursor *cursor) {
+  agent_run_each_cursor *cur = (agent_run_each_cursor*)cursor;
+  return cur->index >= cur->batch.count;
+}
 
-  sqlite3_exec(db, "COMMIT", 0, 0, 0);
+static int agent_run_each_column(sqlite3_vtab_cursor *cursor, sqlite3_context *context, int column) {
+  agent_run_each_cursor *cur = (agent_run_each_cursor*)cursor;
+  agent_batch_goal *goal = &cur->batch.goals[cur->index];
 
-  if (embedding_col_count > 0 && rows_inserted > 0) {
-      rc = sqlite3_prepare_v2(db, "SELECT llm_context_create_embedding('embedding_type=FLOAT32')", -1, &stmt, 0);
-      if (rc == SQLITE_OK) {
-        sqlite3_step(stmt);
-        sqlite3_finalize(stmt);
+  switch (column) {
+    case AGENT_EACH_ID: sqlite3_result_int(context, cur->index + 1); break;
+    case AGENT_EACH_GOAL: sqlite3_result_value(context, goal->goal); break;
+    case AGENT_EACH_STATUS:
+      sqlite3_result_text(context, agent_job_status_names[goal->status], -1, SQLITE_STATIC);
+      break;
+    case AGENT_EACH_RESULT: if (goal->result) sqlite3_result_value(context, goal->result); break;
+    case AGENT_EACH_ROWS: sqlite3_result_int(context, goal->rows); break;
+    case AGENT_EACH_DURATION_MS: sqlite3_result_double(context, goal->duration_ms); break;
+    case AGENT_EACH_ERROR:
+      if (goal->error) sqlite3_result_text(context, goal->error, -1, SQLITE_TRANSIENT);
+      break;
+    case AGENT_EACH_TABLE_NAME:
+    case AGENT_EACH_MAX_ITERATIONS:
+    case AGENT_EACH_SYSTEM_PROMPT:
+    case AGENT_EACH_OPTIONS:
+      if (column - AGENT_EACH_TABLE_NAME < cur->batch.argc - 1) {
+        sqlite3_result_value(context, cur->batch.args[column - AGENT_EACH_TABLE_NAME]);
       }
+      break;
+  }
+  return SQLITE_OK;
+}
 
-      for (int emb_idx = 0; emb_idx < embedding_col_count; emb_idx++) {
-        int emb_col = embedding_col_indices[emb_idx];
-        const char *emb_col_name = column_names[emb_col];
-
-        char available_cols[1024] = "";
-        int first = 1;
-        for (int i = 0; i < column_count; i++) {
-          int is_embedding = 0;
-          for (int j = 0; j < embedding_col_count; j++) {
-            if (embedding_col_indices[j] == i) {
-              is_embedding = 1;
-              break;
-            }
-          }
-          if (is_embedding) continue;
-          if (strcmp(column_types[i], "TEXT") != 0) continue;
-
-          if (!first) strcat(available_cols, ", ");
-          first = 0;
-          strcat(available_cols, column_names[i]);
-        }
+static int agent_run_each_rowid(sqlite3_vtab_cursor *cursor, sqlite3_int64 *rowid) {
+  *rowid = ((agent_run_each_cursor*)cursor)->index + 1;
+  return SQLITE_OK;
+}
 
-        if (strlen(available_cols) == 0) continue;
+static sqlite3_module agent_run_each_module = {
+  0,                        // iVersion
+  0,                        // xCreate: eponymous only
+  agent_run_each_connect,
+  agent_run_each_best_index,
+  agent_jobs_disconnect,
+  0,                        // xDestroy
+  agent_run_each_open,
+  agent_run_each_close,
+  agent_run_each_filter,
+  agent_run_each_next,
+  agent_run_each_eof,
+  agent_run_each_column,
+  agent_run_each_rowid,
+  0, 0, 0, 0, 0, 0, 0,      // xUpdate ... xRename: read-only, no transactions
+  0, 0, 0, 0, 0             // xSavepoint ... xIntegrity
+};
+
+static agent_connection* agent_connection_new(const agent_options *options) {
+  agent_connection *conn = sqlite3_malloc(sizeof(agent_connection));
+  if (!conn) return NULL;
+  memset(conn, 0, sizeof(*conn));
+  conn->run_options = &conn->options;
+  conn->stats = agent_stats_open();
+  if (options) {
+    if (agent_options_copy(&conn->options, options) != SQLITE_OK || agent_runtime_attach(conn) != SQLITE_OK) {
+      agent_connection_free(conn);
+      return NULL;
+    }
+  } else {
+    conn->options.tools_ttl = DEFAULT_AGENT_TOOLS_TTL;
+    conn->options.result_tokens = DEFAULT_AGENT_RESULT_TOKENS;
+    conn->options.tool_workers = DEFAULT_AGENT_TOOL_WORKERS;
+    conn->options.batch_workers = 1;
+    conn->options.embed_batch = DEFAULT_AGENT_EMBED_BATCH;
+    conn->options.early_stop = 1;
+    conn->options.loop_patience = DEFAULT_AGENT_LOOP_PATIENCE;
+    conn->options.max_iterations = DEFAULT_AGENT_MAX_ITERATIONS;
+  }
+  return conn;
+}
 
-        char mapping_prompt[2048];
-        snprintf(mapping_prompt, sizeof(mapping_prompt),
-          "Table has columns: %s\n\n"
-          "For the '%s' embedding column, which source columns should be embedded together?\n"
-          "Return ONLY comma-separated column names, no explanation.\n"
-          "Example: title, description\n\n"
-          "Relevant columns: ",
-          available_cols, emb_col_name);
+static void agent_connection_free(void *p) {
+  agent_connection *conn = (agent_connection*)p;
+  if (!conn) return;
+  agent_jobs_shutdown(conn);
+  agent_stmt_cache_clear(conn);
+  agent_runtime_detach(conn);
+  agent_tool_cache_clear(&conn->tool_cache);
+  agent_vector_indexes_clear(conn);
+  agent_tables_clear(conn);
+  agent_trace_clear(&conn->trace);
+  agent_stats_close(conn->stats);
+  sqlite3_free(conn->chat.tools);
+  agent_options_free(&conn->options);
+  sqlite3_free(conn);
+}
 
-        rc = sqlite3_prepare_v2(db, "SELECT llm_chat_respond(?)", -1, &stmt, 0);
-        if (rc != SQLITE_OK) continue;
+// Registers the agent functions with conn as their state. conn is released
+// with the database connection, or right away when registration fails.
+static int agent_register(sqlite3 *db, agent_connection *conn) {
+  int rc = sqlite3_create_function(db, "agent_version", 0,
+                                   SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+                                   0, agent_version, 0, 0);
+  if (rc != SQLITE_OK) {
+    agent_connection_free(conn);
+    return rc;
+  }
 
-        sqlite3_bind_text(stmt, 1, mapping_prompt, -1, SQLITE_TRANSIENT);
+  // agent_run owns the connection state: it is released when the function is
+  // dropped or the database is closed
+  rc = sqlite3_create_function_v2(db, "agent_run", -1,
+                                  SQLITE_UTF8,
+                                  conn, agent_run_func, 0, 0, agent_connection_free);
+  if (rc != SQLITE_OK) return rc;
 
-        if (sqlite3_step(stmt) != SQLITE_ROW) {
-          sqlite3_finalize(stmt);
-          continue;
-        }
+  rc = sqlite3_create_function(db, "agent_resume", 1,
+                               SQLITE_UTF8,
+                               conn, agent_resume_func, 0, 0);
+  if (rc != SQLITE_OK) return rc;
 
-        const char *llm_response = (const char*)sqlite3_column_text(stmt, 0);
-        char selected_cols[1024];
-        strncpy(selected_cols, llm_response ? llm_response : "", sizeof(selected_cols) - 1);
-        selected_cols[sizeof(selected_cols) - 1] = '\0';
-        sqlite3_finalize(stmt);
+  rc = sqlite3_create_function(db, "agent_unpack", 1,
+                               SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+                               0, agent_unpack_func, 0, 0);
+  if (rc != SQLITE_OK) return rc;
 
-        char embed_sql[2048];
-        snprintf(embed_sql, sizeof(embed_sql), "UPDATE %s SET %s = llm_embed_generate(",
-                table_name, emb_col_name);
-
-        char *token = strtok(selected_cols, ",");
-        first = 1;
-        while (token != NULL) {
-          while (*token == ' ') token++;
-          char *end = token + strlen(token) - 1;
-          while (end > token && (*end == ' ' || *end == '\n' || *end == '\r')) {
-            *end = '\0';
-            end--;
-          }
+  rc = sqlite3_create_function(db, "agent_stats", 0,
+                               SQLITE_UTF8 | SQLITE_RESULT_SUBTYPE,
+                               0, agent_stats_func, 0, 0);
+  if (rc != SQLITE_OK) return rc;
 
-          int found = 0;
-          for (int i = 0; i < column_count; i++) {
-            if (strcmp(column_names[i], token) == 0) {
-              found = 1;
-              break;
-            }
-          }
+  rc = sqlite3_create_function(db, "agent_stats_reset", 0,
+                               SQLITE_UTF8,
+                               0, agent_stats_reset_func, 0, 0);
+  if (rc != SQLITE_OK) return rc;
 
-          if (found) {
-            if (!first) strcat(embed_sql, " || ' | ' || ");
-            first = 0;
-            strcat(embed_sql, "COALESCE(");
-            strcat(embed_sql, token);
-            strcat(embed_sql, ", '')");
-          }
+  rc = sqlite3_create_function(db, "agent_tools_refresh", 0,
+                               SQLITE_UTF8,
+                               conn, agent_tools_refresh, 0, 0);
+  if (rc != SQLITE_OK) return rc;
 
-          token = strtok(NULL, ",");
-        }
+  rc = sqlite3_create_function(db, "agent_register_tool", 4,
+                               SQLITE_UTF8,
+                               conn, agent_register_tool_func, 0, 0);
+  if (rc != SQLITE_OK) return rc;
 
-        strcat(embed_sql, ", '') WHERE ");
-        strcat(embed_sql, emb_col_name);
-        strcat(embed_sql, " IS NULL");
+  rc = sqlite3_create_function(db, "agent_config", 1,
+                               SQLITE_UTF8,
+                               conn, agent_config_func, 0, 0);
+  if (rc != SQLITE_OK) return rc;
 
-        sqlite3_exec(db, embed_sql, 0, 0, 0);
-      }
+  rc = sqlite3_create_function(db, "agent_config", 2,
+                               SQLITE_UTF8,
+                               conn, agent_config_func, 0, 0);
+  if (rc != SQLITE_OK) return rc;
 
-    if (embedding_col_count > 0) {
-      DF("Initializing vector indices for %d embedding columns", embedding_col_count);
+  rc = sqlite3_create_function(db, "agent_run_async", -1,
+                               SQLITE_UTF8,
+                               conn, agent_run_async_func, 0, 0);
+  if (rc != SQLITE_OK) return rc;
 
-      rc = sqlite3_prepare_v2(db, "SELECT llm_model_n_embd()", -1, &stmt, 0);
-      if (rc == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
-        int n_embd = sqlite3_column_int(stmt, 0);
-        sqlite3_finalize(stmt);
+  rc = sqlite3_create_function(db, "agent_cancel", 1,
+                               SQLITE_UTF8,
+                               conn, agent_cancel_func, 0, 0);
+  if (rc != SQLITE_OK) return rc;
 
-        DF("Embedding dimension: %d", n_embd);
+  rc = sqlite3_create_function(db, "agent_jobs_clear", 0,
+                               SQLITE_UTF8,
+                               conn, agent_jobs_clear_func, 0, 0);
+  if (rc != SQLITE_OK) return rc;
 
-        if (n_embd > 0) {
-          for (int emb_idx = 0; emb_idx < embedding_col_count; emb_idx++) {
-            int emb_col = embedding_col_indices[emb_idx];
-            const char *emb_col_name = column_names[emb_col];
+  rc = sqlite3_create_module(db, "agent_jobs", &agent_jobs_module, conn);
+  if (rc != SQLITE_OK) return rc;
 
-            char vector_init_sql[512];
-            snprintf(vector_init_sql, sizeof(vector_init_sql),
-              "SELECT vector_init('%s', '%s', 'dimension=%d,type=FLOAT32,distance=cosine')",
-              table_name, emb_col_name, n_embd);
+  rc = sqlite3_create_module(db, "agent_trace", &agent_trace_module, conn);
+  if (rc != SQLITE_OK) return rc;
 
-            DF("Initializing vector index for %s.%s", table_name, emb_col_name);
+  rc = sqlite3_create_module(db, "agent_run_each", &agent_run_each_module, conn);
+  if (rc != SQLITE_OK) return rc;
 
-            char *vec_err = NULL;
-            rc = sqlite3_exec(db, vector_init_sql, 0, 0, &vec_err);
-            if (rc != SQLITE_OK) {
-              DF("ERROR: vector_init failed for %s: %s", emb_col_name, vec_err ? vec_err : "(unknown)");
-              sqlite3_free(vec_err);
-            } else {
-              DF("Vector index initialized for %s", emb_col_name);
-            }
-          }
-        } else {
-          D("WARNING: Embedding dimension is 0");
-        }
-      } else {
-        DF("WARNING: Failed to get embedding dimension (rc=%d): %s", rc, sqlite3_errmsg(db));
-        if (stmt) sqlite3_finalize(stmt);
-      }
-    }
+  // Lets sqlite3_agent_trace_hook() find the state of db; conn outlives it
+  // since it is only released when the connection closes
+  if (sqlite3_libversion_number() >= 3044000) {
+    sqlite3_set_clientdata(db, AGENT_CLIENT_DATA, conn, NULL);
   }
+  return SQLITE_OK;
+}
 
-  free(tools_list);
-  sqlite3_result_int(context, rows_inserted);
+SQLITE_AGENT_API int sqlite3_agent_trace_hook(sqlite3 *db, sqlite3_agent_trace_callback callback, void *arg) {
+#ifndef SQLITE_CORE
+  if (!sqlite3_api) return SQLITE_MISUSE;
+#endif
+  if (!db || sqlite3_libversion_number() < 3044000) return SQLITE_MISUSE;
+  agent_connection *conn = (agent_connection*)sqlite3_get_clientdata(db, AGENT_CLIENT_DATA);
+  if (!conn) return SQLITE_MISUSE;
+  conn->trace.hook = callback;
+  conn->trace.hook_arg = arg;
+  return SQLITE_OK;
+}
+
+SQLITE_AGENT_API int sqlite3_agent_loop_hook(sqlite3 *db, sqlite3_agent_loop_callback callback, void *arg) {
+#ifndef SQLITE_CORE
+  if (!sqlite3_api) return SQLITE_MISUSE;
+#endif
+  if (!db || sqlite3_libversion_number() < 3044000) return SQLITE_MISUSE;
+  agent_connection *conn = (agent_connection*)sqlite3_get_clientdata(db, AGENT_CLIENT_DATA);
+  if (!conn) return SQLITE_MISUSE;
+  conn->loop_hook = callback;
+  conn->loop_hook_arg = arg;
+  return SQLITE_OK;
 }
 
 #ifdef _WIN32
@@ -1061,18 +7345,9 @@ int sqlite3_agent_init(
   char **pzErrMsg,
   const sqlite3_api_routines *pApi
 ){
-  int rc = SQLITE_OK;
   SQLITE_EXTENSION_INIT2(pApi);
 
-  rc = sqlite3_create_function(db, "agent_version", 0,
-                               SQLITE_UTF8 | SQLITE_DETERMINISTIC,
-                               0, agent_version, 0, 0);
-  if (rc != SQLITE_OK) return rc;
-
-  rc = sqlite3_create_function(db, "agent_run", -1,
-                               SQLITE_UTF8,
-                               0, agent_run_func, 0, 0);
-  if (rc != SQLITE_OK) return rc;
-
-  return rc;
+  agent_connection *conn = agent_connection_new(NULL);
+  if (!conn) return SQLITE_NOMEM;
+  return agent_register(db, conn);
 }
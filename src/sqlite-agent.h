@@ -39,6 +39,74 @@ extern "C" {
  */
 SQLITE_AGENT_API int sqlite3_agent_init(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *pApi);
 
+/**
+ * Step of an agent_run call, as listed by the agent_trace virtual table
+ */
+typedef struct {
+  sqlite3_int64 run_id;     // agent_run call on the connection, starting at 1
+  int step;                 // event number within the run
+  int iteration;            // agent iteration, 0 outside the loop
+  const char *kind;         // "llm", "tools", "tool", "truncate", "compact", "parse_error", "policy", "limit", "insert", "embed" or "run"
+  const char *name;         // tool name, LLM stage or embedding column, may be NULL
+  double duration_ms;
+  int tokens_in;            // prompt tokens, or tokens of the untruncated text
+  int tokens_out;           // response tokens, or tokens kept
+  sqlite3_int64 bytes;      // size of the tool result or text involved
+  sqlite3_int64 rows;       // rows inserted or embedded
+  const char *detail;       // additional information, may be NULL
+  sqlite3_int64 created_at; // Unix time
+} sqlite3_agent_trace_event;
+
+typedef void (*sqlite3_agent_trace_callback)(void *arg, const sqlite3_agent_trace_event *event);
+
+/**
+ * Calls callback with every event of the agent_run calls made on db, as it is
+ * recorded. The event strings are only valid during the call.
+ *
+ * @param db SQLite database connection with the agent extension loaded
+ * @param callback Function called for each event, NULL removes the hook
+ * @param arg First argument of callback
+ * @return SQLITE_OK on success, SQLITE_MISUSE if the extension is not loaded on db
+ */
+SQLITE_AGENT_API int sqlite3_agent_trace_hook(sqlite3 *db, sqlite3_agent_trace_callback callback, void *arg);
+
+/**
+ * Progress of an agent_run loop, given to the loop hook after each iteration
+ */
+typedef struct {
+  sqlite3_int64 run_id;     // as in sqlite3_agent_trace_event
+  int iteration;            // iteration just completed, starting at 1
+  int max_iterations;
+  int table_mode;
+  int calls;                // tool calls of the iteration, 0 when none could be parsed
+  int repeated_calls;       // calls with the tool and arguments of an earlier call of the run
+  int failed_calls;         // calls without a result or with an error result
+  int new_results;          // successful results unlike any earlier one of the run
+  int stalled;              // consecutive iterations without new results, columns or rows
+  int columns_filled;       // table mode: target columns some tool result had a value for
+  int column_count;         // table mode: target columns, embedding columns excluded
+  int rows;                 // table mode: rows stored so far
+} sqlite3_agent_loop_state;
+
+#define SQLITE_AGENT_LOOP_CONTINUE 0
+#define SQLITE_AGENT_LOOP_REDIRECT 1  // go on, telling the model to change its approach
+#define SQLITE_AGENT_LOOP_STOP     2  // end the loop, table mode still stores the collected rows
+
+typedef int (*sqlite3_agent_loop_callback)(void *arg, const sqlite3_agent_loop_state *state, int decision);
+
+/**
+ * Calls callback after each iteration of the agent_run loops on db with the
+ * decision of the loop_patience policy, and applies the decision it returns
+ * instead. The callback also runs when loop_patience is 0, with
+ * SQLITE_AGENT_LOOP_CONTINUE, so that it can replace the policy.
+ *
+ * @param db SQLite database connection with the agent extension loaded
+ * @param callback Function called after each iteration, NULL removes the hook
+ * @param arg First argument of callback
+ * @return SQLITE_OK on success, SQLITE_MISUSE if the extension is not loaded on db
+ */
+SQLITE_AGENT_API int sqlite3_agent_loop_hook(sqlite3 *db, sqlite3_agent_loop_callback callback, void *arg);
+
 #ifdef __cplusplus
 }
 #endif
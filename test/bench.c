@@ -0,0 +1,543 @@
+//
+//  bench.c
+//  sqlite-agent
+//
+//  Offline benchmark of the agent loop. The sqlite-ai, sqlite-mcp and
+//  sqlite-vector functions used by the extension are replaced by in-process
+//  stubs that replay recorded model answers and tool results, so the timings
+//  measure the agent itself (prompt building, parsing, inserts, embedding
+//  updates) without network, model or GPU, and are repeatable between runs.
+//
+//  Usage: bench [scale]   (scale multiplies the number of runs, default 1)
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sqlite3.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#define AGENT_EXT "./dist/agent"
+#define BENCH_TOOLS 8          // tools returned by mcp_list_tools_respond
+#define BENCH_LISTINGS 24      // listings in each recorded tool result
+#define BENCH_EMBED_DIM 384    // dimension reported by llm_model_n_embd
+
+// MARK: - Recorded responses
+
+typedef struct {
+    int table_mode;            // answers in the table mode format
+    int tool_turns;            // tool calls before the final answer
+    int turn;                  // model answers given in the current run
+    char *tool_result;         // replayed by mcp_call_tool_respond
+    char *extraction;          // replayed for extraction prompts
+    sqlite3_int64 chat_calls;
+    sqlite3_int64 tool_calls;
+    sqlite3_int64 embed_calls;
+    sqlite3_int64 prompt_bytes;
+    sqlite3_int64 streamed_bytes;  // reply bytes generated, less when replies stop early
+    char last_turn;            // 'u' or 'a': role of the last turn in the chat history, 0 when empty
+    int streaming;             // an llm_chat() cursor is generating an assistant turn
+    sqlite3_int64 stopped_turns;   // assistant turns committed before the reply was complete
+    sqlite3_int64 history_errors;  // user or assistant turns out of order
+} bench_state;
+
+static bench_state bench;
+
+static const char *bench_cities[] = {"Rome", "Milan", "Florence", "Naples", "Turin", "Venice"};
+
+static char *bench_tool_result(void) {
+    sqlite3_str *s = sqlite3_str_new(NULL);
+    sqlite3_str_appendall(s, "{\"searchResults\": [");
+    for (int i = 0; i < BENCH_LISTINGS; i++) {
+        sqlite3_str_appendf(s,
+            "%s{\"id\": %d, \"name\": \"Apartment %d near the center\", \"city\": \"%s\", "
+            "\"price\": %d.%02d, \"rating\": %d.%d, \"url\": \"https://example.com/rooms/%d\", "
+            "\"description\": \"Bright flat with %d rooms, balcony and fast wifi, %d minutes from the station\"}",
+            i ? ", " : "", 1000 + i, i, bench_cities[i % 6], 40 + (i * 7) % 120, (i * 13) % 100,
+            3 + i % 2, (i * 3) % 10, 1000 + i, 1 + i % 4, 5 + i % 20);
+    }
+    sqlite3_str_appendall(s, "]}");
+    return sqlite3_str_finish(s);
+}
+
+static char *bench_extraction(int rows) {
+    sqlite3_str *s = sqlite3_str_new(NULL);
+    sqlite3_str_appendchar(s, 1, '[');
+    for (int i = 0; i < rows; i++) {
+        sqlite3_str_appendf(s,
+            "%s\n{\"id\": %d, \"name\": \"Apartment %d near the center\", \"city\": \"%s\", "
+            "\"price\": %d.%02d, \"rating\": %d.%d, "
+            "\"description\": \"Bright flat with %d rooms, balcony and fast wifi\"}",
+            i ? "," : "", 1000 + i, i, bench_cities[i % 6], 40 + (i * 7) % 120, (i * 13) % 100,
+            3 + i % 2, (i * 3) % 10, 1 + i % 4);
+    }
+    sqlite3_str_appendall(s, "\n]");
+    return sqlite3_str_finish(s);
+}
+
+// MARK: - sqlite-ai stubs
+
+// Chat history as sqlite-ai keeps it: a user turn is added when a prompt is
+// sent, the assistant turn when the reply ends, and an llm_chat() cursor that
+// is closed early commits the part of the reply generated so far. Turns must
+// alternate, and no prompt may be sent while another reply is generating.
+static void bench_history_add(char role) {
+    if (bench.last_turn == role || (role == 'u' && bench.streaming)) bench.history_errors++;
+    bench.last_turn = role;
+}
+
+// Tool calls are followed by the kind of chatter small models add, which
+// llm_chat() streaming lets the agent skip
+#define BENCH_CHATTER "\nI will look at the results of this search and then decide whether " \
+    "another page is needed before giving the final answer to the user."
+
+static char *bench_answer(const char *prompt) {
+    bench.chat_calls++;
+    if (prompt) bench.prompt_bytes += (sqlite3_int64)strlen(prompt);
+
+    if (prompt && strncmp(prompt, "Extract structured data", 23) == 0) {
+        return sqlite3_mprintf("%s", bench.extraction ? bench.extraction : "[]");
+    }
+    if (prompt && strstr(prompt, "embedding column")) {
+        return sqlite3_mprintf("name, description");
+    }
+
+    // Each call asks for a different page, so the tool result cache never hits
+    int turn = bench.turn++;
+    if (turn < bench.tool_turns) {
+        return bench.table_mode
+            ? sqlite3_mprintf("{\"tool\": \"search_listings\", \"args\": {\"location\": \"Rome\", \"page\": %d}}" BENCH_CHATTER, turn + 1)
+            : sqlite3_mprintf("TOOL_CALL: search_listings\nARGS: {\"location\": \"Rome\", \"page\": %d}" BENCH_CHATTER, turn + 1);
+    }
+    return sqlite3_mprintf("%s", bench.table_mode ? "DONE"
+        : "Found 24 apartments in Rome, the cheapest is Apartment 0 at 40 EUR per night.");
+}
+
+static void bench_chat_respond(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    bench_history_add('u');
+    bench_history_add('a');
+    char *answer = bench_answer((const char *)sqlite3_value_text(argv[0]));
+    bench.streamed_bytes += (sqlite3_int64)strlen(answer);
+    sqlite3_result_text(context, answer, -1, sqlite3_free);
+}
+
+static void bench_int_one(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    sqlite3_result_int(context, 1);
+}
+
+static void bench_context_create_chat(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    if (bench.streaming) bench.history_errors++;
+    bench.last_turn = 0;
+    sqlite3_result_int(context, 1);
+}
+
+static void bench_context_size(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    sqlite3_result_int(context, 8192);
+}
+
+static void bench_context_used(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    sqlite3_result_int(context, 0);
+}
+
+// Roughly four bytes per token, like most BPE vocabularies on English text
+static void bench_token_count(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    sqlite3_result_int(context, (sqlite3_value_bytes(argv[0]) + 3) / 4);
+}
+
+static void bench_n_embd(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    sqlite3_result_int(context, BENCH_EMBED_DIM);
+}
+
+static void bench_embed_generate(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    float vector[BENCH_EMBED_DIM] = {0};
+    const unsigned char *text = sqlite3_value_text(argv[0]);
+    bench.embed_calls++;
+    for (int i = 0; text && text[i]; i++) vector[(i * 31 + text[i]) % BENCH_EMBED_DIM] += 1.0f;
+    sqlite3_result_blob(context, vector, sizeof(vector), SQLITE_TRANSIENT);
+}
+
+// MARK: - Table-valued stubs
+
+// mcp_list_tools_respond(name, description, inputschema),
+// mcp_call_tool_respond(text, tool HIDDEN, args HIDDEN) and
+// llm_chat(reply, prompt HIDDEN), all eponymous only
+typedef enum {
+    BENCH_LIST_TOOLS,
+    BENCH_CALL_TOOL,
+    BENCH_CHAT
+} bench_vtab_kind;
+
+#define BENCH_TOKEN_BYTES 4    // bytes of each llm_chat() row
+
+typedef struct {
+    sqlite3_vtab base;
+    bench_vtab_kind kind;
+} bench_vtab;
+
+typedef struct {
+    sqlite3_vtab_cursor base;
+    int row;
+    char *reply;               // llm_chat(): whole answer, streamed in BENCH_TOKEN_BYTES rows
+    int reply_len;
+    int generating;            // llm_chat(): the assistant turn is not committed yet
+} bench_cursor;
+
+static int bench_vtab_connect(sqlite3 *db, void *aux, int argc, const char *const *argv,
+                              sqlite3_vtab **vtab, char **err) {
+    static const char *schemas[] = {
+        "CREATE TABLE x(name TEXT, description TEXT, inputschema TEXT)",
+        "CREATE TABLE x(text TEXT, tool HIDDEN, args HIDDEN)",
+        "CREATE TABLE x(reply TEXT, prompt HIDDEN)",
+    };
+    bench_vtab *table = sqlite3_malloc(sizeof(*table));
+    if (!table) return SQLITE_NOMEM;
+    memset(table, 0, sizeof(*table));
+    table->kind = (bench_vtab_kind)(size_t)aux;
+    int rc = sqlite3_declare_vtab(db, schemas[table->kind]);
+    *vtab = &table->base;
+    return rc;
+}
+
+static int bench_vtab_disconnect(sqlite3_vtab *vtab) {
+    sqlite3_free(vtab);
+    return SQLITE_OK;
+}
+
+// Hidden columns are the arguments, in column order
+static int bench_vtab_best_index(sqlite3_vtab *vtab, sqlite3_index_info *info) {
+    bench_vtab_kind kind = ((bench_vtab *)vtab)->kind;
+    if (kind == BENCH_LIST_TOOLS) return SQLITE_OK;
+    int required = (kind == BENCH_CALL_TOOL) ? 3 : 1;
+    int found = 0;
+    for (int i = 0; i < info->nConstraint; i++) {
+        int column = info->aConstraint[i].iColumn;
+        if (!info->aConstraint[i].usable || info->aConstraint[i].op != SQLITE_INDEX_CONSTRAINT_EQ) continue;
+        if (column < 1 || (1 << (column - 1)) > required) continue;
+        info->aConstraintUsage[i].argvIndex = column;
+        info->aConstraintUsage[i].omit = 1;
+        found |= 1 << (column - 1);
+    }
+    return (found == required) ? SQLITE_OK : SQLITE_CONSTRAINT;
+}
+
+static int bench_vtab_open(sqlite3_vtab *vtab, sqlite3_vtab_cursor **cursor) {
+    bench_cursor *c = sqlite3_malloc(sizeof(*c));
+    if (!c) return SQLITE_NOMEM;
+    memset(c, 0, sizeof(*c));
+    *cursor = &c->base;
+    return SQLITE_OK;
+}
+
+// Ends the assistant turn of an llm_chat() cursor, complete or not
+static void bench_chat_commit(bench_cursor *c) {
+    if (!c->generating) return;
+    c->generating = 0;
+    bench.streaming = 0;
+    if ((c->row + 1) * BENCH_TOKEN_BYTES < c->reply_len) bench.stopped_turns++;
+    bench_history_add('a');
+}
+
+static int bench_vtab_close(sqlite3_vtab_cursor *cursor) {
+    bench_chat_commit((bench_cursor *)cursor);
+    sqlite3_free(((bench_cursor *)cursor)->reply);
+    sqlite3_free(cursor);
+    return SQLITE_OK;
+}
+
+static int bench_vtab_filter(sqlite3_vtab_cursor *cursor, int idx, const char *idx_str,
+                             int argc, sqlite3_value **argv) {
+    bench_cursor *c = (bench_cursor *)cursor;
+    bench_vtab_kind kind = ((bench_vtab *)cursor->pVtab)->kind;
+    c->row = 0;
+    if (kind == BENCH_CALL_TOOL) bench.tool_calls++;
+    if (kind == BENCH_CHAT) {
+        bench_chat_commit(c);
+        bench_history_add('u');
+        bench.streaming = c->generating = 1;
+        sqlite3_free(c->reply);
+        c->reply = bench_answer((const char *)sqlite3_value_text(argv[0]));
+        c->reply_len = c->reply ? (int)strlen(c->reply) : 0;
+    }
+    return SQLITE_OK;
+}
+
+static int bench_vtab_next(sqlite3_vtab_cursor *cursor) {
+    bench_cursor *c = (bench_cursor *)cursor;
+    c->row++;
+    if (c->generating && c->row * BENCH_TOKEN_BYTES >= c->reply_len) bench_chat_commit(c);
+    return SQLITE_OK;
+}
+
+static int bench_vtab_eof(sqlite3_vtab_cursor *cursor) {
+    bench_cursor *c = (bench_cursor *)cursor;
+    switch (((bench_vtab *)cursor->pVtab)->kind) {
+        case BENCH_LIST_TOOLS: return c->row >= BENCH_TOOLS;
+        case BENCH_CALL_TOOL: return c->row >= 1;
+        default: return c->row * BENCH_TOKEN_BYTES >= c->reply_len;
+    }
+}
+
+static int bench_vtab_column(sqlite3_vtab_cursor *cursor, sqlite3_context *context, int column) {
+    bench_cursor *c = (bench_cursor *)cursor;
+    bench_vtab_kind kind = ((bench_vtab *)cursor->pVtab)->kind;
+    if (kind == BENCH_CHAT) {
+        int offset = c->row * BENCH_TOKEN_BYTES;
+        int bytes = c->reply_len - offset < BENCH_TOKEN_BYTES ? c->reply_len - offset : BENCH_TOKEN_BYTES;
+        if (column == 0) {
+            bench.streamed_bytes += bytes;
+            sqlite3_result_text(context, c->reply + offset, bytes, SQLITE_TRANSIENT);
+        }
+        return SQLITE_OK;
+    }
+    if (kind == BENCH_CALL_TOOL) {
+        if (column == 0) sqlite3_result_text(context, bench.tool_result, -1, SQLITE_STATIC);
+        return SQLITE_OK;
+    }
+    if (column == 0) {
+        if (c->row == 0) sqlite3_result_text(context, "search_listings", -1, SQLITE_STATIC);
+        else sqlite3_result_text(context, sqlite3_mprintf("tool_%d", c->row), -1, sqlite3_free);
+    } else if (column == 1) {
+        sqlite3_result_text(context, "Searches listings by location, dates and number of guests", -1, SQLITE_STATIC);
+    } else {
+        sqlite3_result_text(context,
+            "{\"type\": \"object\", \"properties\": {\"location\": {\"type\": \"string\"}, "
+            "\"page\": {\"type\": \"integer\"}, \"adults\": {\"type\": \"integer\"}}, \"required\": [\"location\"]}",
+            -1, SQLITE_STATIC);
+    }
+    return SQLITE_OK;
+}
+
+static int bench_vtab_rowid(sqlite3_vtab_cursor *cursor, sqlite3_int64 *rowid) {
+    *rowid = ((bench_cursor *)cursor)->row;
+    return SQLITE_OK;
+}
+
+static sqlite3_module bench_module = {
+    0,                          // iVersion
+    0,                          // xCreate: eponymous only
+    bench_vtab_connect,
+    bench_vtab_best_index,
+    bench_vtab_disconnect,
+    0,                          // xDestroy
+    bench_vtab_open,
+    bench_vtab_close,
+    bench_vtab_filter,
+    bench_vtab_next,
+    bench_vtab_eof,
+    bench_vtab_column,
+    bench_vtab_rowid,
+    0, 0, 0, 0, 0, 0, 0,        // xUpdate ... xRename
+    0, 0, 0, 0, 0               // xSavepoint ... xIntegrity
+};
+
+// Registered as an auto extension, so worker and job connections get the stubs too
+static int bench_stubs_init(sqlite3 *db, char **err, const void *api) {
+    static const struct {
+        const char *name;
+        int argc;
+        void (*func)(sqlite3_context *, int, sqlite3_value **);
+    } functions[] = {
+        {"llm_chat_respond", 1, bench_chat_respond},
+        {"llm_context_create_chat", -1, bench_context_create_chat},
+        {"llm_context_create_embedding", -1, bench_int_one},
+        {"llm_context_size", 0, bench_context_size},
+        {"llm_context_used", 0, bench_context_used},
+        {"llm_token_count", 1, bench_token_count},
+        {"llm_model_n_embd", 0, bench_n_embd},
+        {"llm_embed_generate", -1, bench_embed_generate},
+        {"vector_init", 3, bench_int_one},
+    };
+    for (size_t i = 0; i < sizeof(functions) / sizeof(functions[0]); i++) {
+        sqlite3_create_function(db, functions[i].name, functions[i].argc, SQLITE_UTF8, NULL,
+                                functions[i].func, NULL, NULL);
+    }
+    sqlite3_create_module(db, "mcp_list_tools_respond", &bench_module, (void *)BENCH_LIST_TOOLS);
+    sqlite3_create_module(db, "mcp_call_tool_respond", &bench_module, (void *)BENCH_CALL_TOOL);
+    sqlite3_create_module(db, "llm_chat", &bench_module, (void *)BENCH_CHAT);
+    return SQLITE_OK;
+}
+
+// MARK: - Benchmarks
+
+static double bench_clock_ms(void) {
+#ifdef _WIN32
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart * 1000.0 / (double)frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1000000.0;
+#endif
+}
+
+static void print_separator(void) {
+    printf("--------------------------------------------------------------------\n");
+}
+
+static int exec_simple(sqlite3 *db, const char *sql) {
+    char *err = NULL;
+    int rc = sqlite3_exec(db, sql, 0, 0, &err);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "Error: %s\n  in: %s\n", err ? err : sqlite3_errmsg(db), sql);
+        sqlite3_free(err);
+    }
+    return rc;
+}
+
+// Runs sql `runs` times, running reset (untimed) before each run, and
+// returns the total time in milliseconds or -1 on error
+static double bench_run(sqlite3 *db, const char *sql, const char *reset, int runs) {
+    sqlite3_stmt *stmt;
+    double total = 0;
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) != SQLITE_OK) {
+        fprintf(stderr, "Error: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+    for (int i = 0; i < runs; i++) {
+        if (reset && exec_simple(db, reset) != SQLITE_OK) break;
+        bench.turn = 0;
+        double start = bench_clock_ms();
+        int rc = sqlite3_step(stmt);
+        total += bench_clock_ms() - start;
+        if (rc != SQLITE_ROW) {
+            fprintf(stderr, "Error: %s\n", sqlite3_errmsg(db));
+            total = -1;
+            break;
+        }
+        sqlite3_reset(stmt);
+    }
+    sqlite3_finalize(stmt);
+    return total;
+}
+
+static void bench_report(const char *name, int runs, double total, double units, const char *unit) {
+    if (total < 0) {
+        printf("  %-18s FAILED\n", name);
+        return;
+    }
+    printf("  %-18s %6d runs %10.2f ms %10.1f us/run", name, runs, total, total * 1000.0 / runs);
+    if (units > 0 && total > 0) printf(" %12.0f %s/s", units * 1000.0 / total, unit);
+    printf("\n");
+}
+
+// Warns when the last run did not store the replayed rows, which would make
+// the timings meaningless
+static void bench_check_rows(sqlite3 *db, const char *from, int expected) {
+    sqlite3_stmt *stmt;
+    char *sql = sqlite3_mprintf("SELECT count(*) FROM %s", from);
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+        int count = sqlite3_column_int(stmt, 0);
+        if (count != expected) printf("  WARNING: %d of %d rows stored in %s\n", count, expected, from);
+    }
+    sqlite3_finalize(stmt);
+    sqlite3_free(sql);
+}
+
+static void bench_reset_counters(void) {
+    bench.chat_calls = bench.tool_calls = bench.embed_calls = 0;
+    bench.prompt_bytes = bench.streamed_bytes = 0;
+    bench.stopped_turns = 0;
+}
+
+int main(int argc, char **argv) {
+    sqlite3 *db = NULL;
+    int scale = (argc > 1) ? atoi(argv[1]) : 1;
+    if (scale < 1) scale = 1;
+
+    printf("\n");
+    print_separator();
+    printf("SQLite Agent offline benchmark (scale %d)\n", scale);
+    print_separator();
+
+    sqlite3_auto_extension((void (*)(void))bench_stubs_init);
+    if (sqlite3_open(":memory:", &db) != SQLITE_OK) {
+        fprintf(stderr, "Error: Cannot open database: %s\n", sqlite3_errmsg(db));
+        return 1;
+    }
+    sqlite3_enable_load_extension(db, 1);
+    if (sqlite3_load_extension(db, AGENT_EXT, 0, 0) != SQLITE_OK) {
+        fprintf(stderr, "Error: Failed to load agent extension: %s\n", sqlite3_errmsg(db));
+        return 1;
+    }
+
+    bench.tool_result = bench_tool_result();
+    int failed = 0;
+    double total;
+
+    // Text mode: prompt building, tool call parsing and result budgeting
+    int runs = 1000 * scale;
+    bench.table_mode = 0;
+    bench.tool_turns = 3;
+    bench_reset_counters();
+    total = bench_run(db, "SELECT agent_run('Find affordable apartments in Rome', 8)", NULL, runs);
+    bench_report("text_loop", runs, total, (double)bench.chat_calls, "llm calls");
+    sqlite3_int64 streamed = bench.streamed_bytes;
+    failed |= (total < 0);
+    // Replies stopped early must still leave one assistant turn per prompt
+    if (bench.stopped_turns == 0) printf("  WARNING: no reply was stopped early\n");
+    failed |= (bench.stopped_turns == 0);
+
+    // Same loop reading whole replies, where every byte of chatter is generated
+    exec_simple(db, "SELECT agent_config('early_stop', 0)");
+    bench_reset_counters();
+    total = bench_run(db, "SELECT agent_run('Find affordable apartments in Rome', 8)", NULL, runs);
+    bench_report("text_loop_full", runs, total, (double)bench.chat_calls, "llm calls");
+    if (total > 0) {
+        printf("  %-18s %6s      %10lld reply bytes generated, %lld with early_stop\n", "", "",
+               (long long)bench.streamed_bytes, (long long)streamed);
+    }
+    exec_simple(db, "SELECT agent_config('early_stop', 1)");
+    failed |= (total < 0);
+
+    // Table mode without embeddings: extraction answer parsing and inserts
+    int rows = 2000;
+    runs = 10 * scale;
+    bench.table_mode = 1;
+    bench.tool_turns = 2;
+    bench.extraction = bench_extraction(rows);
+    exec_simple(db, "CREATE TABLE listings (id INTEGER PRIMARY KEY, name TEXT, city TEXT, "
+                    "price REAL, rating REAL, description TEXT)");
+    bench_reset_counters();
+    total = bench_run(db, "SELECT agent_run('Find apartments in Rome', 'listings', 8)",
+                      "DELETE FROM listings", runs);
+    bench_report("table_extract", runs, total, (double)rows * runs, "rows");
+    bench_check_rows(db, "listings", rows);
+    if (total > 0) {
+        printf("  %-18s %6s      %10.2f MB/s of extraction JSON\n", "", "",
+               (double)strlen(bench.extraction) * runs / 1048576.0 * 1000.0 / total);
+    }
+    failed |= (total < 0);
+
+    // Table mode with an embedding column: inserts plus batched embedding updates
+    rows = 1000;
+    runs = 5 * scale;
+    sqlite3_free(bench.extraction);
+    bench.extraction = bench_extraction(rows);
+    exec_simple(db, "CREATE TABLE listings_vec (id INTEGER PRIMARY KEY, name TEXT, city TEXT, "
+                    "price REAL, rating REAL, description TEXT, embedding BLOB)");
+    bench_reset_counters();
+    total = bench_run(db, "SELECT agent_run('Find apartments in Rome', 'listings_vec', 8)",
+                      "DELETE FROM listings_vec", runs);
+    bench_report("table_embed", runs, total, (double)bench.embed_calls, "embeddings");
+    bench_check_rows(db, "listings_vec WHERE embedding IS NOT NULL", rows);
+    failed |= (total < 0);
+
+    if (bench.history_errors > 0) {
+        printf("  WARNING: %lld chat history turns out of order\n", (long long)bench.history_errors);
+        failed = 1;
+    }
+    print_separator();
+    printf("\n");
+
+    sqlite3_free(bench.extraction);
+    sqlite3_free(bench.tool_result);
+    sqlite3_close(db);
+    return failed ? 1 : 0;
+}
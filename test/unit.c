@@ -0,0 +1,1316 @@
+//
+//  unit.c
+//  sqlite-agent
+//
+//  Behaviour checks of the extension internals. The extension source is
+//  compiled into this program with SQLITE_CORE, so static helpers can be
+//  called directly, and the agent functions are registered on in-memory
+//  databases next to stubs of the sqlite-ai and sqlite-mcp functions.
+//
+//  Usage: unit   (exits with the number of failed checks)
+//
+
+// sqlite3ext.h is not used with SQLITE_CORE, the API is linked in
+#define SQLITE_EXTENSION_INIT1
+#define SQLITE_EXTENSION_INIT2(api)
+#include "sqlite-agent.c"
+
+static int unit_checks;
+static int unit_failures;
+
+#define CHECK(cond) do { \
+    unit_checks++; \
+    if (!(cond)) { \
+        unit_failures++; \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+    } \
+} while (0)
+
+// MARK: - JSON tokenizer
+
+typedef struct {
+    const char *json;
+    agent_json_status status;  // of the whole input
+    int tokens;                // tokens once complete, -1 when not checked
+} unit_json_case;
+
+static const unit_json_case unit_json_cases[] = {
+    {"{}", AGENT_JSON_COMPLETE, 1},
+    {"[]", AGENT_JSON_COMPLETE, 1},
+    {"{\"a\": 1}", AGENT_JSON_COMPLETE, 3},
+    {"{\"a\": [1, 2, [3, [4, {\"b\": null}]]]}", AGENT_JSON_COMPLETE, 12},
+    {"[true, false, null, -1.5e3]", AGENT_JSON_COMPLETE, 5},
+    {"{\"s\": \"quote \\\" backslash \\\\ slash \\/ tab \\t\"}", AGENT_JSON_COMPLETE, 3},
+    {"{\"u\": \"\\u00e9\\ud83d\\ude00\"}", AGENT_JSON_COMPLETE, 3},
+    {"{\"long\": \"0123456789abcdef0123456789abcdef0123456789\\\"abcdef\"}", AGENT_JSON_COMPLETE, 3},
+    {"  \n[1]  trailing text", AGENT_JSON_COMPLETE, 2},
+    {"{\"a\": 1", AGENT_JSON_PARTIAL, -1},
+    {"{\"a\": \"open string", AGENT_JSON_PARTIAL, -1},
+    {"{\"a\": \"escape at the end\\", AGENT_JSON_PARTIAL, -1},
+    {"[1, 2", AGENT_JSON_PARTIAL, -1},
+    {"", AGENT_JSON_PARTIAL, -1},
+    {"{\"a\": 1]", AGENT_JSON_ERROR, -1},
+    {"[1, 2}", AGENT_JSON_ERROR, -1},
+    {"{1: 2}", AGENT_JSON_ERROR, -1},
+    {"{\"a\"}", AGENT_JSON_ERROR, -1},
+    {"]", AGENT_JSON_ERROR, -1},
+    {"tru", AGENT_JSON_ERROR, -1},
+};
+
+static void unit_json_tokenizer(void) {
+    int count = (int)(sizeof(unit_json_cases) / sizeof(unit_json_cases[0]));
+    for (int i = 0; i < count; i++) {
+        const unit_json_case *c = &unit_json_cases[i];
+        int len = (int)strlen(c->json);
+        agent_json_parser whole;
+        agent_json_init(&whole);
+        agent_json_status status = agent_json_tokenize(&whole, c->json, len);
+        if (status != c->status) fprintf(stderr, "json case %d: %s\n", i, c->json);
+        CHECK(status == c->status);
+        if (c->tokens >= 0) CHECK(whole.count == c->tokens);
+
+        // Fed byte by byte, as streamed replies are, the tokens are the same
+        agent_json_parser fed;
+        agent_json_init(&fed);
+        agent_json_status last = AGENT_JSON_PARTIAL;
+        for (int n = 0; n <= len && last == AGENT_JSON_PARTIAL; n++) {
+            last = agent_json_tokenize(&fed, c->json, n);
+            if (n < len && c->status != AGENT_JSON_ERROR && last == AGENT_JSON_ERROR) break;
+        }
+        CHECK(last == status);
+        if (status == AGENT_JSON_COMPLETE) {
+            CHECK(fed.count == whole.count);
+            for (int t = 0; t < whole.count && t < fed.count; t++) {
+                CHECK(fed.tokens[t].type == whole.tokens[t].type);
+                CHECK(fed.tokens[t].start == whole.tokens[t].start);
+                CHECK(fed.tokens[t].end == whole.tokens[t].end);
+                CHECK(fed.tokens[t].next == whole.tokens[t].next);
+            }
+        }
+        agent_json_free(&fed);
+        agent_json_free(&whole);
+    }
+
+    // Truncations of a valid document are never errors
+    const char *doc = "{\"tool\": \"search\", \"args\": {\"q\": \"a \\\"b\\\" c\", \"n\": [1, {\"x\": true}]}}";
+    int doc_len = (int)strlen(doc);
+    for (int n = 0; n < doc_len; n++) {
+        agent_json_parser parser;
+        agent_json_init(&parser);
+        CHECK(agent_json_tokenize(&parser, doc, n) == AGENT_JSON_PARTIAL);
+        agent_json_free(&parser);
+    }
+
+    // Subtree links and lookups
+    agent_json_parser parser;
+    agent_json_init(&parser);
+    CHECK(agent_json_tokenize(&parser, doc, doc_len) == AGENT_JSON_COMPLETE);
+    int args = agent_json_object_get(&parser, doc, 0, "args");
+    CHECK(args > 0 && parser.tokens[args].type == AGENT_JSON_OBJECT);
+    int q = args > 0 ? agent_json_object_get(&parser, doc, args, "q") : -1;
+    CHECK(q > 0 && parser.tokens[q].escaped);
+    if (q > 0) {
+        char *value = agent_json_dup(doc, &parser.tokens[q]);
+        CHECK(value && strcmp(value, "a \"b\" c") == 0);
+        sqlite3_free(value);
+    }
+    CHECK(agent_json_object_get(&parser, doc, 0, "missing") < 0);
+    CHECK(parser.tokens[0].next == parser.count);
+    agent_json_free(&parser);
+
+    // Escapes, including a surrogate pair and an invalid \u
+    static const struct { const char *in; const char *out; } escapes[] = {
+        {"a\\nb\\tc", "a\nb\tc"},
+        {"\\u00e9", "\xc3\xa9"},
+        {"\\u20ac", "\xe2\x82\xac"},
+        {"\\ud83d\\ude00", "\xf0\x9f\x98\x80"},
+        {"\\uzzzz", "uzzzz"},
+        {"\\\"\\\\\\/", "\"\\/"},
+    };
+    for (size_t i = 0; i < sizeof(escapes) / sizeof(escapes[0]); i++) {
+        char out[64];
+        int n = agent_json_unescape(escapes[i].in, 0, (int)strlen(escapes[i].in), out);
+        CHECK(n == (int)strlen(escapes[i].out) && strcmp(out, escapes[i].out) == 0);
+    }
+}
+
+// The vector scan of strings finds the same byte as the scalar one, from
+// every start offset and around every 16 byte boundary
+static void unit_json_scan_parity(void) {
+    char buffer[256];
+    unsigned int seed = 12345;
+    for (int round = 0; round < 200; round++) {
+        int len = 1 + (int)(seed % sizeof(buffer));
+        for (int i = 0; i < len; i++) {
+            seed = seed * 1103515245u + 12345u;
+            unsigned int r = (seed >> 16) % 64;
+            buffer[i] = r == 0 ? '"' : r == 1 ? '\\' : (char)('a' + r % 26);
+        }
+        for (int pos = 0; pos <= len; pos++) {
+            CHECK(agent_json_scan_string(buffer, pos, len) == agent_json_scan_string_scalar(buffer, pos, len));
+        }
+    }
+    memset(buffer, 'x', sizeof(buffer));
+    CHECK(agent_json_scan_string(buffer, 0, (int)sizeof(buffer)) == (int)sizeof(buffer));
+    for (int at = 0; at < 40; at++) {
+        memset(buffer, 'x', sizeof(buffer));
+        buffer[at] = '"';
+        CHECK(agent_json_scan_string(buffer, 0, 64) == at);
+    }
+}
+
+// Binding of extracted values by column affinity
+static void unit_json_bind(void) {
+    sqlite3 *db = NULL;
+    sqlite3_open(":memory:", &db);
+    sqlite3_stmt *stmt = NULL;
+    sqlite3_prepare_v2(db, "SELECT typeof(?1), quote(?1)", -1, &stmt, NULL);
+
+    static const struct {
+        const char *json;          // array holding one value
+        int affinity;
+        const char *type;
+        const char *quoted;
+    } cases[] = {
+        {"[true]", AGENT_AFFINITY_INTEGER, "integer", "1"},
+        {"[false]", AGENT_AFFINITY_INTEGER, "integer", "0"},
+        {"[false]", AGENT_AFFINITY_TEXT, "text", "'false'"},
+        {"[fals]", AGENT_AFFINITY_INTEGER, "integer", "0"},
+        {"[truex]", AGENT_AFFINITY_TEXT, "text", "'truex'"},
+        {"[null]", AGENT_AFFINITY_TEXT, "null", "NULL"},
+        {"[42]", AGENT_AFFINITY_INTEGER, "integer", "42"},
+        {"[\"42\"]", AGENT_AFFINITY_INTEGER, "integer", "42"},
+        {"[2.5]", AGENT_AFFINITY_REAL, "real", "2.5"},
+        {"[\"a\\nb\"]", AGENT_AFFINITY_TEXT, "text", "'a\nb'"},
+        {"[{\"k\": [1]}]", AGENT_AFFINITY_TEXT, "text", "'{\"k\": [1]}'"},
+        {"[[1]]", AGENT_AFFINITY_INTEGER, "null", "NULL"},
+    };
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        agent_json_parser parser;
+        agent_json_init(&parser);
+        CHECK(agent_json_tokenize(&parser, cases[i].json, (int)strlen(cases[i].json)) == AGENT_JSON_COMPLETE);
+        agent_json_bind(stmt, 1, cases[i].json, &parser.tokens[1], cases[i].affinity);
+        CHECK(sqlite3_step(stmt) == SQLITE_ROW);
+        const char *type = (const char *)sqlite3_column_text(stmt, 0);
+        const char *quoted = (const char *)sqlite3_column_text(stmt, 1);
+        if (!type || strcmp(type, cases[i].type) != 0 || !quoted || strcmp(quoted, cases[i].quoted) != 0) {
+            fprintf(stderr, "bind case %s: %s %s\n", cases[i].json, type ? type : "-", quoted ? quoted : "-");
+        }
+        CHECK(type && strcmp(type, cases[i].type) == 0);
+        CHECK(quoted && strcmp(quoted, cases[i].quoted) == 0);
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+        agent_json_free(&parser);
+    }
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+}
+
+// A DONE search resumed on every streamed chunk finds the same DONE as a
+// search of the whole reply, whatever the chunk size
+static void unit_done_scan(void) {
+    static const char *replies[] = {
+        "DONE",
+        "All rows are stored. DONE",
+        "DONES are not DONE",
+        "UNDONE",
+        "{\"tool\": \"t\", \"args\": {\"q\": \"DONE\"}}\nDONE",
+        "{\"q\": \"a \\\" DONE\"}",
+        "\"open quote\nDONE",
+        "no answer yet",
+    };
+    for (size_t r = 0; r < sizeof(replies) / sizeof(replies[0]); r++) {
+        const char *reply = replies[r];
+        size_t len = strlen(reply);
+        const char *expected = agent_find_done(reply);
+        for (size_t chunk = 1; chunk <= 7; chunk++) {
+            agent_done_scan scan = {0};
+            const char *found = NULL;
+            for (size_t received = chunk; !found; received += chunk) {
+                if (received >= len) {
+                    found = agent_find_done_next(&scan, reply, len + 1);
+                    break;
+                }
+                found = agent_find_done_next(&scan, reply, received);
+            }
+            CHECK(found == expected);
+        }
+    }
+    CHECK(agent_find_done("UNDONE") == NULL);
+    CHECK(agent_find_done("DONES are not DONE") == replies[2] + 14);
+}
+
+// MARK: - Tool result cache
+
+static void unit_tool_errors(void) {
+    static const struct { const char *result; int error; } cases[] = {
+        {"{\"isError\":true,\"error\":\"unknown tool\"}", 1},
+        {"  {\"content\": [], \"isError\" : true}", 1},
+        {"{\"jsonrpc\":\"2.0\",\"result\":{\"content\":[],\"isError\":true}}", 1},
+        {"{\"isError\":false,\"content\":[{\"text\":\"failed to load\"}]}", 0},
+        {"{\"items\":[{\"title\":\"404 Not Found\"},{\"isError\":true}]}", 0},
+        {"{\"note\":\"\\\"isError\\\":true\"}", 0},
+        {"{\"data\":{\"isError\":true}}", 0},
+        {"{\"isError\":trueish}", 0},
+        {"the request failed to complete", 0},
+        {"[{\"isError\":true}]", 0},
+        {"", 0},
+    };
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        if (agent_tool_result_is_error(cases[i].result) != cases[i].error) {
+            fprintf(stderr, "error case %s\n", cases[i].result);
+        }
+        CHECK(agent_tool_result_is_error(cases[i].result) == cases[i].error);
+    }
+}
+
+static char *unit_key(int i) {
+    return sqlite3_mprintf("search\n{\"q\":%d}", i);
+}
+
+static void unit_tool_cache(void) {
+    agent_tool_cache cache;
+    memset(&cache, 0, sizeof(cache));
+
+    // Miss, then hit, then a new result for the same key replaces the old one
+    char *key = unit_key(1);
+    CHECK(agent_tool_cache_get(&cache, key, 60) == NULL);
+    agent_tool_cache_put(&cache, sqlite3_mprintf("%s", key), "first");
+    char *hit = agent_tool_cache_get(&cache, key, 60);
+    CHECK(hit && strcmp(hit, "first") == 0);
+    sqlite3_free(hit);
+    agent_tool_cache_put(&cache, sqlite3_mprintf("%s", key), "second");
+    CHECK(cache.count == 1);
+    hit = agent_tool_cache_get(&cache, key, 60);
+    CHECK(hit && strcmp(hit, "second") == 0);
+    sqlite3_free(hit);
+
+    // Past the TTL the entry is dropped
+    cache.newest->created_at -= 61;
+    CHECK(agent_tool_cache_get(&cache, key, 60) == NULL);
+    CHECK(cache.count == 0 && !cache.newest && !cache.oldest);
+    sqlite3_free(key);
+
+    // The oldest entries go first once the cache is full
+    for (int i = 0; i < AGENT_TOOL_CACHE_SIZE + 10; i++) {
+        agent_tool_cache_put(&cache, unit_key(i), "value");
+    }
+    CHECK(cache.count == AGENT_TOOL_CACHE_SIZE);
+    int present = 0;
+    for (int i = 0; i < AGENT_TOOL_CACHE_SIZE + 10; i++) {
+        key = unit_key(i);
+        hit = agent_tool_cache_get(&cache, key, 60);
+        if (hit) present++;
+        CHECK((hit != NULL) == (i >= 10));
+        sqlite3_free(hit);
+        sqlite3_free(key);
+    }
+    CHECK(present == AGENT_TOOL_CACHE_SIZE);
+    int linked = 0;
+    for (agent_cached_result *entry = cache.oldest; entry; entry = entry->newer) linked++;
+    CHECK(linked == cache.count);
+    agent_tool_cache_clear(&cache);
+    CHECK(cache.count == 0);
+}
+
+// MARK: - Packed storage
+
+static void unit_pack_roundtrip(const char *text, int len) {
+    int size = 0;
+    unsigned char *packed = agent_pack(text, len, &size);
+    CHECK(packed != NULL);
+    if (!packed) return;
+    char *unpacked = agent_unpack(packed, size);
+    CHECK(unpacked && memcmp(unpacked, text, len) == 0 && unpacked[len] == '\0');
+    sqlite3_free(unpacked);
+    sqlite3_free(packed);
+}
+
+static void unit_pack(void) {
+    unit_pack_roundtrip("", 0);
+    unit_pack_roundtrip("short", 5);
+
+    // Repetitive JSON shrinks, and matches overlapping their own output decode
+    sqlite3_str *json = sqlite3_str_new(NULL);
+    sqlite3_str_appendchar(json, 1, '[');
+    for (int i = 0; i < 500; i++) {
+        sqlite3_str_appendf(json, "%s{\"id\": %d, \"city\": \"Rome\", \"price\": %d}", i ? ", " : "", i, 40 + i % 9);
+    }
+    sqlite3_str_appendchar(json, 1, ']');
+    sqlite3_str_appendchar(json, 70000, 'a');
+    int len = sqlite3_str_length(json);
+    char *text = sqlite3_str_finish(json);
+    unit_pack_roundtrip(text, len);
+    int size = 0;
+    unsigned char *packed = agent_pack(text, len, &size);
+    CHECK(packed && AGENT_PACK_METHOD(packed[0]) == AGENT_PACK_LZ && size < len / 4);
+    CHECK(packed && packed[0] >> 4 == AGENT_PACK_VERSION);
+
+    // Values written before the version bits still read, a later version does not
+    if (packed) {
+        packed[0] = AGENT_PACK_LZ;
+        char *unpacked = agent_unpack(packed, size);
+        CHECK(unpacked && strcmp(unpacked, text) == 0);
+        sqlite3_free(unpacked);
+        packed[0] = (AGENT_PACK_VERSION + 1) << 4 | AGENT_PACK_LZ;
+        CHECK(agent_unpack(packed, size) == NULL);
+    }
+    sqlite3_free(packed);
+    sqlite3_free(text);
+
+    // Random bytes are stored as they are
+    char noise[4096];
+    unsigned int seed = 7;
+    for (int i = 0; i < (int)sizeof(noise); i++) {
+        seed = seed * 1103515245u + 12345u;
+        noise[i] = (char)(1 + (seed >> 16) % 255);
+    }
+    unit_pack_roundtrip(noise, (int)sizeof(noise));
+    packed = agent_pack(noise, (int)sizeof(noise), &size);
+    CHECK(packed && AGENT_PACK_METHOD(packed[0]) == AGENT_PACK_STORED);
+    sqlite3_free(packed);
+}
+
+// Texts of random length over alphabets from one letter to any byte round
+// trip, truncated packed values are refused, and corrupted ones never read
+// or write out of bounds (which the ASAN build of this test checks)
+static void unit_pack_fuzz(void) {
+    static char text[20000];
+    unsigned int seed = 2024;
+    for (int round = 0; round < 300; round++) {
+        seed = seed * 1103515245u + 12345u;
+        int len = (int)((seed >> 8) % sizeof(text));
+        int alphabet = 1 + (int)((seed >> 4) % 5) * 60;
+        for (int i = 0; i < len; i++) {
+            seed = seed * 1103515245u + 12345u;
+            // Runs copied from earlier in the text make long and overlapping matches
+            if (i > 64 && (seed >> 28) == 0) {
+                int from = (int)((seed >> 8) % (unsigned int)i);
+                int run = 1 + (int)((seed >> 2) % 300);
+                for (int k = 0; k < run && i < len; k++) text[i++] = text[from + k];
+                i--;
+                continue;
+            }
+            text[i] = (char)(1 + (seed >> 16) % alphabet);
+        }
+        unit_pack_roundtrip(text, len);
+
+        int size = 0;
+        unsigned char *packed = agent_pack(text, len, &size);
+        if (!packed) continue;
+        for (int cut = 0; cut < size; cut += 1 + size / 16) {
+            char *unpacked = agent_unpack(packed, cut);
+            // Only the empty sequence ending every LZ value can go
+            CHECK(unpacked == NULL || (cut == size - 1 && memcmp(unpacked, text, len) == 0));
+            sqlite3_free(unpacked);
+        }
+        for (int flip = 0; flip < 16; flip++) {
+            seed = seed * 1103515245u + 12345u;
+            int at = (int)((seed >> 8) % (unsigned int)size);
+            unsigned char saved = packed[at];
+            packed[at] ^= (unsigned char)(1 + (seed >> 20) % 255);
+            sqlite3_free(agent_unpack(packed, size));
+            packed[at] = saved;
+        }
+        sqlite3_free(packed);
+    }
+
+    // A forged length is refused before anything is allocated for it
+    unsigned char forged[] = {AGENT_PACK_VERSION << 4 | AGENT_PACK_LZ, 0xff, 0xff, 0xff, 0xff, 0x07, 0x10, 'a'};
+    CHECK(agent_unpack(forged, (int)sizeof(forged)) == NULL);
+}
+
+// MARK: - Agent runs
+
+// The sqlite-ai and sqlite-mcp functions are stubs answering from a queue of
+// model replies, with one "search" tool returning unit_tool_result
+
+#define UNIT_MAX_ANSWERS 32
+
+static struct {
+    const char *answers[UNIT_MAX_ANSWERS];
+    int head, tail;
+    const char *tool_result;
+    int tool_calls;
+    int chats;
+    int chat_contexts;
+    int embeddings;
+    int streaming;    // llm_chat() exists, replies are then streamed by it
+    char *last_prompt;
+} unit_stub;
+
+static void unit_answer(const char *answer) {
+    unit_stub.answers[unit_stub.tail++ % UNIT_MAX_ANSWERS] = answer;
+}
+
+static void unit_answers_clear(void) {
+    unit_stub.head = unit_stub.tail = 0;
+    unit_stub.tool_calls = unit_stub.chats = 0;
+    unit_stub.chat_contexts = unit_stub.embeddings = 0;
+    sqlite3_free(unit_stub.last_prompt);
+    unit_stub.last_prompt = NULL;
+}
+
+// Next queued reply to prompt
+static const char *unit_next_answer(sqlite3_value *prompt) {
+    const char *answer = unit_stub.head < unit_stub.tail
+        ? unit_stub.answers[unit_stub.head++ % UNIT_MAX_ANSWERS] : "DONE";
+    unit_stub.chats++;
+    sqlite3_free(unit_stub.last_prompt);
+    unit_stub.last_prompt = sqlite3_mprintf("%s", (const char *)sqlite3_value_text(prompt));
+    return answer;
+}
+
+static void unit_chat_respond(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    sqlite3_result_text(context, unit_next_answer(argv[0]), -1, SQLITE_STATIC);
+}
+
+static void unit_int_one(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    sqlite3_result_int(context, 1);
+}
+
+static void unit_context_create_chat(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    unit_stub.chat_contexts++;
+    sqlite3_result_int(context, 1);
+}
+
+static void unit_context_size(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    sqlite3_result_int(context, 8192);
+}
+
+static void unit_context_used(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    sqlite3_result_int(context, 0);
+}
+
+static void unit_token_count(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    sqlite3_result_int(context, (sqlite3_value_bytes(argv[0]) + 3) / 4);
+}
+
+static void unit_embed_generate(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    float vector[4] = {0};
+    const unsigned char *text = sqlite3_value_text(argv[0]);
+    unit_stub.embeddings++;
+    for (int i = 0; text && text[i]; i++) vector[i % 4] += text[i];
+    sqlite3_result_blob(context, vector, sizeof(vector), SQLITE_TRANSIENT);
+}
+
+static void unit_n_embd(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    sqlite3_result_int(context, 4);
+}
+
+// mcp_list_tools_respond(name, description, inputschema),
+// mcp_call_tool_respond(text, tool HIDDEN, args HIDDEN) and, with
+// unit_stub.streaming, llm_chat(reply, prompt HIDDEN), eponymous only
+#define UNIT_CHAT_BYTES 4    // bytes of each llm_chat() row
+
+typedef struct {
+    sqlite3_vtab base;
+    int call;
+    int chat;
+} unit_vtab;
+
+typedef struct {
+    sqlite3_vtab_cursor base;
+    int row;
+    const char *reply;       // llm_chat(): whole answer, streamed in UNIT_CHAT_BYTES rows
+} unit_cursor;
+
+static int unit_vtab_connect(sqlite3 *db, void *aux, int argc, const char *const *argv,
+                             sqlite3_vtab **vtab, char **err) {
+    if ((size_t)aux == 2 && !unit_stub.streaming) return SQLITE_ERROR;
+    unit_vtab *table = sqlite3_malloc(sizeof(*table));
+    if (!table) return SQLITE_NOMEM;
+    memset(table, 0, sizeof(*table));
+    table->call = (size_t)aux == 1;
+    table->chat = (size_t)aux == 2;
+    *vtab = &table->base;
+    return sqlite3_declare_vtab(db, table->chat ? "CREATE TABLE x(reply TEXT, prompt HIDDEN)"
+                                    : table->call ? "CREATE TABLE x(text TEXT, tool HIDDEN, args HIDDEN)"
+                                    : "CREATE TABLE x(name TEXT, description TEXT, inputschema TEXT)");
+}
+
+static int unit_vtab_disconnect(sqlite3_vtab *vtab) {
+    sqlite3_free(vtab);
+    return SQLITE_OK;
+}
+
+static int unit_vtab_best_index(sqlite3_vtab *vtab, sqlite3_index_info *info) {
+    const unit_vtab *table = (unit_vtab *)vtab;
+    if (!table->call && !table->chat) return SQLITE_OK;
+    int required = table->chat ? 1 : 3;
+    int found = 0;
+    for (int i = 0; i < info->nConstraint; i++) {
+        int column = info->aConstraint[i].iColumn;
+        if (!info->aConstraint[i].usable || info->aConstraint[i].op != SQLITE_INDEX_CONSTRAINT_EQ) continue;
+        if (column < 1 || column > (table->chat ? 1 : 2)) continue;
+        info->aConstraintUsage[i].argvIndex = column;
+        info->aConstraintUsage[i].omit = 1;
+        found |= column;
+    }
+    return found == required ? SQLITE_OK : SQLITE_CONSTRAINT;
+}
+
+static int unit_vtab_open(sqlite3_vtab *vtab, sqlite3_vtab_cursor **cursor) {
+    unit_cursor *c = sqlite3_malloc(sizeof(*c));
+    if (!c) return SQLITE_NOMEM;
+    memset(c, 0, sizeof(*c));
+    *cursor = &c->base;
+    return SQLITE_OK;
+}
+
+static int unit_vtab_close(sqlite3_vtab_cursor *cursor) {
+    sqlite3_free(cursor);
+    return SQLITE_OK;
+}
+
+static int unit_vtab_filter(sqlite3_vtab_cursor *cursor, int idx, const char *idx_str,
+                            int argc, sqlite3_value **argv) {
+    unit_cursor *c = (unit_cursor *)cursor;
+    c->row = 0;
+    if (((unit_vtab *)cursor->pVtab)->call) unit_stub.tool_calls++;
+    if (((unit_vtab *)cursor->pVtab)->chat) c->reply = unit_next_answer(argv[0]);
+    return SQLITE_OK;
+}
+
+static int unit_vtab_next(sqlite3_vtab_cursor *cursor) {
+    ((unit_cursor *)cursor)->row++;
+    return SQLITE_OK;
+}
+
+static int unit_vtab_eof(sqlite3_vtab_cursor *cursor) {
+    const unit_cursor *c = (unit_cursor *)cursor;
+    if (((unit_vtab *)cursor->pVtab)->chat) return c->row * UNIT_CHAT_BYTES >= (int)strlen(c->reply);
+    return c->row >= 1;
+}
+
+static int unit_vtab_column(sqlite3_vtab_cursor *cursor, sqlite3_context *context, int column) {
+    const unit_cursor *c = (unit_cursor *)cursor;
+    if (((unit_vtab *)cursor->pVtab)->chat) {
+        const char *piece = c->reply + c->row * UNIT_CHAT_BYTES;
+        int len = (int)strlen(piece);
+        if (column == 0) sqlite3_result_text(context, piece, len < UNIT_CHAT_BYTES ? len : UNIT_CHAT_BYTES, SQLITE_STATIC);
+        return SQLITE_OK;
+    }
+    if (((unit_vtab *)cursor->pVtab)->call) {
+        if (column == 0) sqlite3_result_text(context, unit_stub.tool_result, -1, SQLITE_STATIC);
+        return SQLITE_OK;
+    }
+    static const char *const tool[] = {
+        "search", "Searches listings by city",
+        "{\"type\": \"object\", \"properties\": {\"q\": {\"type\": \"string\"}}}"
+    };
+    sqlite3_result_text(context, tool[column], -1, SQLITE_STATIC);
+    return SQLITE_OK;
+}
+
+static int unit_vtab_rowid(sqlite3_vtab_cursor *cursor, sqlite3_int64 *rowid) {
+    *rowid = ((unit_cursor *)cursor)->row;
+    return SQLITE_OK;
+}
+
+static sqlite3_module unit_module = {
+    0,                          // iVersion
+    0,                          // xCreate: eponymous only
+    unit_vtab_connect,
+    unit_vtab_best_index,
+    unit_vtab_disconnect,
+    0,                          // xDestroy
+    unit_vtab_open,
+    unit_vtab_close,
+    unit_vtab_filter,
+    unit_vtab_next,
+    unit_vtab_eof,
+    unit_vtab_column,
+    unit_vtab_rowid,
+    0, 0, 0, 0, 0, 0, 0,        // xUpdate ... xRename
+    0, 0, 0, 0, 0               // xSavepoint ... xIntegrity
+};
+
+// vector_full_scan(table, column, vector, k): rowids of the k rows of table
+// nearest to vector, nearest first, eponymous only
+typedef struct {
+    sqlite3_vtab base;
+    sqlite3 *db;
+} unit_scan_vtab;
+
+typedef struct {
+    sqlite3_vtab_cursor base;
+    sqlite3_int64 rowids[16];
+    double distances[16];
+    int count;
+    int row;
+} unit_scan_cursor;
+
+static int unit_scan_connect(sqlite3 *db, void *aux, int argc, const char *const *argv,
+                             sqlite3_vtab **vtab, char **err) {
+    unit_scan_vtab *table = sqlite3_malloc(sizeof(*table));
+    if (!table) return SQLITE_NOMEM;
+    memset(table, 0, sizeof(*table));
+    table->db = db;
+    *vtab = &table->base;
+    return sqlite3_declare_vtab(db, "CREATE TABLE x(distance REAL, tbl HIDDEN, col HIDDEN, vector HIDDEN, k HIDDEN)");
+}
+
+static int unit_scan_best_index(sqlite3_vtab *vtab, sqlite3_index_info *info) {
+    int found = 0;
+    for (int i = 0; i < info->nConstraint; i++) {
+        int column = info->aConstraint[i].iColumn;
+        if (!info->aConstraint[i].usable || info->aConstraint[i].op != SQLITE_INDEX_CONSTRAINT_EQ) continue;
+        if (column < 1 || column > 4) continue;
+        info->aConstraintUsage[i].argvIndex = column;
+        info->aConstraintUsage[i].omit = 1;
+        found |= 1 << (column - 1);
+    }
+    return found == 15 ? SQLITE_OK : SQLITE_CONSTRAINT;
+}
+
+static int unit_scan_open(sqlite3_vtab *vtab, sqlite3_vtab_cursor **cursor) {
+    unit_scan_cursor *c = sqlite3_malloc(sizeof(*c));
+    if (!c) return SQLITE_NOMEM;
+    memset(c, 0, sizeof(*c));
+    *cursor = &c->base;
+    return SQLITE_OK;
+}
+
+static int unit_scan_filter(sqlite3_vtab_cursor *cursor, int idx, const char *idx_str,
+                            int argc, sqlite3_value **argv) {
+    unit_scan_cursor *c = (unit_scan_cursor *)cursor;
+    const float *goal = sqlite3_value_blob(argv[2]);
+    int k = sqlite3_value_int(argv[3]);
+    float query[4] = {0};
+    if (goal && sqlite3_value_bytes(argv[2]) == sizeof(query)) memcpy(query, goal, sizeof(query));
+    c->count = c->row = 0;
+
+    sqlite3_stmt *stmt = NULL;
+    char *sql = sqlite3_mprintf("SELECT rowid, \"%w\" FROM \"%w\"", sqlite3_value_text(argv[1]),
+                                sqlite3_value_text(argv[0]));
+    int rc = sqlite3_prepare_v2(((unit_scan_vtab *)cursor->pVtab)->db, sql, -1, &stmt, NULL);
+    sqlite3_free(sql);
+    while (rc == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+        float vector[4] = {0};
+        if (sqlite3_column_bytes(stmt, 1) == sizeof(vector)) memcpy(vector, sqlite3_column_blob(stmt, 1), sizeof(vector));
+        double dot = 0, norm_a = 0, norm_b = 0;
+        for (int i = 0; i < 4; i++) {
+            dot += query[i] * vector[i];
+            norm_a += query[i] * query[i];
+            norm_b += vector[i] * vector[i];
+        }
+        // Ordered as the cosine distance, without a square root
+        double distance = (norm_a > 0 && norm_b > 0) ? 1 - dot * (dot < 0 ? -dot : dot) / (norm_a * norm_b) : 1;
+        // Kept sorted, nearest first
+        if (c->count == 16) continue;
+        int at = c->count++;
+        for (; at > 0 && c->distances[at - 1] > distance; at--) {
+            c->rowids[at] = c->rowids[at - 1];
+            c->distances[at] = c->distances[at - 1];
+        }
+        c->rowids[at] = sqlite3_column_int64(stmt, 0);
+        c->distances[at] = distance;
+    }
+    if (c->count > k) c->count = k;
+    sqlite3_finalize(stmt);
+    return rc;
+}
+
+static int unit_scan_next(sqlite3_vtab_cursor *cursor) {
+    ((unit_scan_cursor *)cursor)->row++;
+    return SQLITE_OK;
+}
+
+static int unit_scan_eof(sqlite3_vtab_cursor *cursor) {
+    unit_scan_cursor *c = (unit_scan_cursor *)cursor;
+    return c->row >= c->count;
+}
+
+static int unit_scan_column(sqlite3_vtab_cursor *cursor, sqlite3_context *context, int column) {
+    unit_scan_cursor *c = (unit_scan_cursor *)cursor;
+    if (column == 0) sqlite3_result_double(context, c->distances[c->row]);
+    return SQLITE_OK;
+}
+
+static int unit_scan_rowid(sqlite3_vtab_cursor *cursor, sqlite3_int64 *rowid) {
+    unit_scan_cursor *c = (unit_scan_cursor *)cursor;
+    *rowid = c->rowids[c->row];
+    return SQLITE_OK;
+}
+
+static sqlite3_module unit_scan_module = {
+    0,                          // iVersion
+    0,                          // xCreate: eponymous only
+    unit_scan_connect,
+    unit_scan_best_index,
+    unit_vtab_disconnect,
+    0,                          // xDestroy
+    unit_scan_open,
+    unit_vtab_close,
+    unit_scan_filter,
+    unit_scan_next,
+    unit_scan_eof,
+    unit_scan_column,
+    unit_scan_rowid,
+    0, 0, 0, 0, 0, 0, 0,        // xUpdate ... xRename
+    0, 0, 0, 0, 0               // xSavepoint ... xIntegrity
+};
+
+// Registered as an auto extension, so worker and job connections get the stubs too
+static int unit_stubs_init(sqlite3 *db, char **err, const void *api) {
+    static const struct {
+        const char *name;
+        int argc;
+        void (*func)(sqlite3_context *, int, sqlite3_value **);
+    } functions[] = {
+        {"llm_chat_respond", 1, unit_chat_respond},
+        {"llm_context_create_chat", -1, unit_context_create_chat},
+        {"llm_context_create_embedding", -1, unit_int_one},
+        {"llm_context_size", 0, unit_context_size},
+        {"llm_context_used", 0, unit_context_used},
+        {"llm_token_count", 1, unit_token_count},
+        {"llm_model_n_embd", 0, unit_n_embd},
+        {"llm_embed_generate", -1, unit_embed_generate},
+        {"vector_init", 3, unit_int_one},
+    };
+    for (size_t i = 0; i < sizeof(functions) / sizeof(functions[0]); i++) {
+        sqlite3_create_function(db, functions[i].name, functions[i].argc, SQLITE_UTF8, NULL,
+                                functions[i].func, NULL, NULL);
+    }
+    sqlite3_create_module(db, "mcp_list_tools_respond", &unit_module, NULL);
+    sqlite3_create_module(db, "mcp_call_tool_respond", &unit_module, (void *)1);
+    sqlite3_create_module(db, "llm_chat", &unit_module, (void *)2);
+    sqlite3_create_module(db, "vector_full_scan", &unit_scan_module, NULL);
+    return SQLITE_OK;
+}
+
+static sqlite3 *unit_open(void) {
+    sqlite3 *db = NULL;
+    sqlite3_open(":memory:", &db);
+    sqlite3_agent_init(db, NULL, NULL);
+    unit_answers_clear();
+    unit_stub.tool_result = "{\"items\": [{\"id\": 1, \"name\": \"a\"}]}";
+    return db;
+}
+
+static void unit_exec(sqlite3 *db, const char *sql) {
+    char *err = NULL;
+    if (sqlite3_exec(db, sql, NULL, NULL, &err) != SQLITE_OK) {
+        fprintf(stderr, "%s\n  in: %s\n", err ? err : sqlite3_errmsg(db), sql);
+        unit_failures++;
+    }
+    sqlite3_free(err);
+}
+
+// Text of the first column of the first row of sql, "ERROR: message" when it
+// fails, to be freed with sqlite3_free
+static char *unit_query(sqlite3 *db, const char *sql) {
+    sqlite3_stmt *stmt = NULL;
+    char *text = NULL;
+    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+    if (rc == SQLITE_OK) rc = sqlite3_step(stmt);
+    if (rc == SQLITE_ROW) {
+        const char *value = (const char *)sqlite3_column_text(stmt, 0);
+        text = sqlite3_mprintf("%s", value ? value : "NULL");
+    } else if (rc != SQLITE_DONE) {
+        text = sqlite3_mprintf("ERROR: %s", sqlite3_errmsg(db));
+    }
+    sqlite3_finalize(stmt);
+    return text ? text : sqlite3_mprintf("");
+}
+
+#define CHECK_QUERY(db, sql, expected) do { \
+    char *got = unit_query(db, sql); \
+    if (strcmp(got, expected) != 0) fprintf(stderr, "%s\n  got: %s\n  expected: %s\n", sql, got, expected); \
+    CHECK(strcmp(got, expected) == 0); \
+    sqlite3_free(got); \
+} while (0)
+
+#define UNIT_TEXT_CALL "TOOL_CALL: search\nARGS: {\"q\": \"rome\"}"
+#define UNIT_TABLE_CALL "{\"tool\": \"search\", \"args\": {\"q\": \"rome\"}}"
+
+// Rows stored and skipped with each on_conflict policy
+static void unit_on_conflict(void) {
+    static const struct {
+        const char *policy;
+        const char *returned;    // agent_run() result: rows stored
+        const char *names;       // names in the table afterwards
+    } cases[] = {
+        {"ignore", "1", "old,b"},
+        {"update", "2", "new,b"},
+        {"replace", "2", "new,b"},
+        {"abort", "ERROR: Failed to insert row: UNIQUE constraint failed: t.id", "old"},
+    };
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        sqlite3 *db = unit_open();
+        unit_exec(db, "CREATE TABLE t(id INTEGER PRIMARY KEY, name TEXT, name_embedding BLOB)");
+        unit_exec(db, "INSERT INTO t(id, name) VALUES (1, 'old')");
+        unit_exec(db, "UPDATE t SET name_embedding = x'00'");
+        char *config = sqlite3_mprintf("SELECT agent_config('on_conflict', '%s')", cases[i].policy);
+        unit_exec(db, config);
+        sqlite3_free(config);
+        unit_answer(UNIT_TABLE_CALL);
+        unit_answer("DONE");
+        unit_answer("[{\"id\": 1, \"name\": \"new\"}, {\"id\": 2, \"name\": \"b\"}]");
+        unit_answer("name");
+        CHECK_QUERY(db, "SELECT agent_run('find', 't', 3)", cases[i].returned);
+        CHECK_QUERY(db, "SELECT group_concat(name, ',') FROM (SELECT name FROM t ORDER BY id)", cases[i].names);
+        // Rows stored by the run get their embedding, an updated one again
+        if (strcmp(cases[i].policy, "abort") != 0) {
+            CHECK_QUERY(db, "SELECT count(*) FROM t WHERE length(name_embedding) = 16",
+                        strcmp(cases[i].policy, "ignore") == 0 ? "1" : "2");
+        }
+        sqlite3_close(db);
+    }
+}
+
+// Rows are stored in savepoints: inside a transaction of the caller they are
+// committed or rolled back with its own work, and a failing page only drops
+// its rows
+static void unit_caller_transaction(void) {
+    for (int streaming = 0; streaming <= 1; streaming++) {
+        sqlite3 *db = unit_open();
+        unit_exec(db, "CREATE TABLE t(id INTEGER PRIMARY KEY, name TEXT, name_embedding BLOB)");
+        unit_exec(db, "CREATE TABLE other(x)");
+        if (streaming) unit_exec(db, "SELECT agent_config('streaming', 1)");
+        unit_exec(db, "BEGIN");
+        unit_exec(db, "INSERT INTO other VALUES (1)");
+        // Streaming asks for the rows of the result before the next step
+        unit_answer(UNIT_TABLE_CALL);
+        unit_answer(streaming ? "[{\"id\": 1, \"name\": \"a\"}]" : "DONE");
+        unit_answer(streaming ? "DONE" : "[{\"id\": 1, \"name\": \"a\"}]");
+        unit_answer("name");
+        CHECK_QUERY(db, "SELECT agent_run('find', 't', 3)", "1");
+        CHECK(!sqlite3_get_autocommit(db));
+        CHECK_QUERY(db, "SELECT count(*) FROM t WHERE length(name_embedding) = 16", "1");
+        unit_exec(db, "ROLLBACK");
+        CHECK_QUERY(db, "SELECT (SELECT count(*) FROM t) || ' ' || (SELECT count(*) FROM other)", "0 0");
+
+        // A row the table refuses rolls back the rows of the answer only
+        unit_exec(db, "INSERT INTO t(id, name) VALUES (1, 'old')");
+        unit_exec(db, "BEGIN");
+        unit_exec(db, "INSERT INTO other VALUES (2)");
+        unit_answers_clear();
+        unit_answer(UNIT_TABLE_CALL);
+        if (!streaming) unit_answer("DONE");
+        unit_answer("[{\"id\": 2, \"name\": \"b\"}, {\"id\": 1, \"name\": \"new\"}]");
+        CHECK_QUERY(db, "SELECT agent_run('find', 't', 3)",
+                    "ERROR: Failed to insert row: UNIQUE constraint failed: t.id");
+        CHECK(!sqlite3_get_autocommit(db));
+        unit_exec(db, "COMMIT");
+        CHECK_QUERY(db, "SELECT (SELECT group_concat(name) FROM t) || ' ' || (SELECT count(*) FROM other)", "old 1");
+        sqlite3_close(db);
+    }
+}
+
+// A cached embedding map naming only columns the table lost is asked for
+// again and replaced, instead of leaving the column without embeddings
+static void unit_embedding_map_stale(void) {
+    sqlite3 *db = unit_open();
+    unit_exec(db, "CREATE TABLE t(id INTEGER PRIMARY KEY, name TEXT, name_embedding BLOB)");
+    unit_exec(db, "CREATE TABLE agent_embedding_map (table_name TEXT NOT NULL, column_name TEXT NOT NULL, "
+                  "sources TEXT NOT NULL, PRIMARY KEY (table_name, column_name))");
+    unit_exec(db, "INSERT INTO agent_embedding_map VALUES ('t', 'name_embedding', 'title')");
+    unit_answer(UNIT_TABLE_CALL);
+    unit_answer("DONE");
+    unit_answer("[{\"id\": 1, \"name\": \"a\"}]");
+    unit_answer("name");
+    CHECK_QUERY(db, "SELECT agent_run('find', 't', 3)", "1");
+    CHECK_QUERY(db, "SELECT count(*) FROM t WHERE length(name_embedding) = 16", "1");
+    CHECK_QUERY(db, "SELECT sources FROM agent_embedding_map WHERE table_name = 't'", "name");
+    sqlite3_close(db);
+}
+
+// The cached descriptor of a target table in temp or an attached schema is
+// read again after that schema changes, not only after main does
+static void unit_schema_change(void) {
+    static const char *schemas[] = {"temp", "aux"};
+    for (int i = 0; i < 2; i++) {
+        sqlite3 *db = unit_open();
+        unit_exec(db, "ATTACH ':memory:' AS aux");
+        char *sql = sqlite3_mprintf("CREATE TABLE %s.t(id INTEGER PRIMARY KEY, name TEXT)", schemas[i]);
+        unit_exec(db, sql);
+        sqlite3_free(sql);
+        unit_answer(UNIT_TABLE_CALL);
+        unit_answer("DONE");
+        unit_answer("[{\"id\": 1, \"name\": \"a\"}]");
+        CHECK_QUERY(db, "SELECT agent_run('find', 't', 3)", "1");
+
+        sql = sqlite3_mprintf("DROP TABLE %s.t; CREATE TABLE %s.t(id INTEGER PRIMARY KEY, title TEXT)",
+                              schemas[i], schemas[i]);
+        unit_exec(db, sql);
+        sqlite3_free(sql);
+        unit_answer(UNIT_TABLE_CALL);
+        unit_answer("DONE");
+        unit_answer("[{\"id\": 2, \"title\": \"b\"}]");
+        CHECK_QUERY(db, "SELECT agent_run('find', 't', 3)", "1");
+        CHECK_QUERY(db, "SELECT title FROM t", "b");
+        sqlite3_close(db);
+    }
+}
+
+// A run stopped by its token budget is resumed from its checkpoint without
+// calling the tools it already called
+static void unit_resume(void) {
+    sqlite3 *db = unit_open();
+    unit_exec(db, "SELECT agent_config('checkpoint', 1)");
+    unit_answer(UNIT_TEXT_CALL);
+    unit_answer(UNIT_TEXT_CALL);
+    CHECK_QUERY(db, "SELECT agent_run('find', NULL, 4, NULL, '{\"token_budget\": 160}')",
+                "ERROR: agent_run exceeded its token_budget: 187 of 160 tokens used");
+    CHECK_QUERY(db, "SELECT status || ' ' || (iteration > 0) FROM agent_runs WHERE id = 1", "failed 1");
+    int calls = unit_stub.tool_calls;
+    CHECK(calls >= 1);
+
+    unit_answer(UNIT_TEXT_CALL);
+    unit_answer("Apartment a is the one");
+    CHECK_QUERY(db, "SELECT agent_resume(1)", "Apartment a is the one");
+    CHECK(unit_stub.tool_calls == calls);
+    CHECK_QUERY(db, "SELECT status FROM agent_runs WHERE id = 1", "done");
+    CHECK_QUERY(db, "SELECT agent_resume(1)", "Apartment a is the one");
+    CHECK_QUERY(db, "SELECT agent_resume(42)", "ERROR: agent_resume: no run 42 in agent_runs");
+    sqlite3_close(db);
+}
+
+// With prefetch, a resumed run neither starts nor uses a worker call for a
+// tool call its checkpoint answers
+static void unit_resume_prefetch(void) {
+    unit_stub.streaming = 1;
+    sqlite3 *db = unit_open();
+    unit_exec(db, "SELECT agent_config('checkpoint', 1)");
+    unit_exec(db, "SELECT agent_config('worker_init', 'SELECT 1')");
+    unit_exec(db, "SELECT agent_config('prefetch', 1)");
+    unit_answer(UNIT_TEXT_CALL);
+    unit_answer(UNIT_TEXT_CALL);
+    CHECK_QUERY(db, "SELECT agent_run('find', NULL, 4, NULL, '{\"token_budget\": 160}')",
+                "ERROR: agent_run exceeded its token_budget: 187 of 160 tokens used");
+    int calls = unit_stub.tool_calls;
+    CHECK(calls >= 1);
+
+    unit_answer(UNIT_TEXT_CALL);
+    unit_answer("Apartment a is the one");
+    CHECK_QUERY(db, "SELECT agent_resume(1)", "Apartment a is the one");
+    CHECK(unit_stub.tool_calls == calls);
+    sqlite3_close(db);
+    unit_stub.streaming = 0;
+}
+
+// A result is stored once in agent_payloads by its hash, and one whose hash
+// is taken by different bytes stays in its agent_steps row
+static void unit_payload_collision(void) {
+    sqlite3 *db = unit_open();
+    unit_stub.tool_result = "{\"items\": [{\"id\": 1, \"name\": \"a long enough result to be stored in "
+                            "agent_payloads rather than in the row of its step, as results of 128 bytes or more are\"}]}";
+    unit_exec(db, "SELECT agent_config('checkpoint', 1)");
+    unit_exec(db, agent_checkpoint_schema);
+    char *forged = sqlite3_mprintf("INSERT INTO agent_payloads VALUES ('%016llx', 3, x'1003616263')",
+                                   (unsigned long long)agent_hash(unit_stub.tool_result));
+    unit_exec(db, forged);
+    sqlite3_free(forged);
+    unit_answer(UNIT_TEXT_CALL);
+    unit_answer("found it");
+    CHECK_QUERY(db, "SELECT agent_run('find', NULL, 3)", "found it");
+    CHECK_QUERY(db, "SELECT count(*) FROM agent_steps WHERE run_id = 1 AND result IS NOT NULL", "1");
+    CHECK_QUERY(db, "SELECT agent_unpack(data) FROM agent_payloads", "abc");
+
+    // Without the collision the same result goes to agent_payloads, once for both runs
+    unit_exec(db, "DELETE FROM agent_payloads");
+    unit_answer(UNIT_TEXT_CALL);
+    unit_answer("found it");
+    unit_answer(UNIT_TEXT_CALL);
+    unit_answer("found it");
+    CHECK_QUERY(db, "SELECT agent_run('find', NULL, 3) || agent_run('find', NULL, 3)", "found itfound it");
+    CHECK_QUERY(db, "SELECT count(*) FROM agent_steps WHERE run_id > 1 AND result IS NULL", "2");
+    CHECK_QUERY(db, "SELECT count(*) FROM agent_payloads", "1");
+    CHECK_QUERY(db, "SELECT agent_unpack(data) = (SELECT result FROM agent_steps WHERE run_id = 1) FROM agent_payloads", "1");
+    sqlite3_close(db);
+}
+
+// Options of one call, and the ones only agent_config() may set
+static void unit_run_options(void) {
+    sqlite3 *db = unit_open();
+    CHECK_QUERY(db, "SELECT agent_run('find', NULL, NULL, NULL, '{\"runtime\": \"shared\"}')",
+                "ERROR: agent_run: runtime can only be set with agent_config()");
+    CHECK_QUERY(db, "SELECT agent_run('find', NULL, NULL, NULL, '{\"tool_workers\": 2}')",
+                "ERROR: agent_run: tool_workers can only be set with agent_config()");
+    CHECK_QUERY(db, "SELECT agent_run('find', NULL, NULL, NULL, '{\"no_such_option\": 1}')",
+                "ERROR: agent_run: unknown option 'no_such_option'");
+    CHECK_QUERY(db, "SELECT agent_run('find', NULL, NULL, NULL, '[1]')",
+                "ERROR: agent_run: options must be a JSON object");
+
+    unit_answer("done quickly");
+    CHECK_QUERY(db, "SELECT agent_run('find', NULL, NULL, NULL, '{\"max_iterations\": 1, \"trace\": 1}')",
+                "done quickly");
+    // The overrides were for that call only
+    CHECK_QUERY(db, "SELECT agent_config('max_iterations')", "5");
+    CHECK_QUERY(db, "SELECT agent_config('trace')", "0");
+
+    // A tool running agent_run() again gets the connection options, and the
+    // outer call keeps recording its own events once it returns
+    unit_exec(db, "SELECT agent_register_tool('search', 'nested run', NULL, "
+                  "'SELECT agent_run(''inner'') AS answer')");
+    unit_answer(UNIT_TEXT_CALL);
+    unit_answer("inner done");
+    unit_answer("outer done");
+    CHECK_QUERY(db, "SELECT agent_run('outer', NULL, NULL, NULL, '{\"trace\": 1}')", "outer done");
+    CHECK(strstr(unit_stub.last_prompt, "inner done") != NULL);
+    CHECK_QUERY(db, "SELECT count(DISTINCT run_id) || ' ' || sum(kind = 'run') FROM agent_trace", "1 1");
+    CHECK_QUERY(db, "SELECT kind FROM agent_trace ORDER BY step DESC LIMIT 1", "run");
+    sqlite3_close(db);
+}
+
+// Every connection counts its steps in its own histograms; agent_stats()
+// sums them and keeps those of closed connections
+static void unit_stats(void) {
+    sqlite3 *first = unit_open();
+    sqlite3 *second = unit_open();
+    unit_exec(first, "SELECT agent_stats_reset()");
+    unit_answer("first");
+    unit_answer("second");
+    CHECK_QUERY(first, "SELECT agent_run('find')", "first");
+    CHECK_QUERY(second, "SELECT agent_run('find')", "second");
+    CHECK_QUERY(first, "SELECT agent_stats() ->> '$.\"run:text\".count'", "2");
+    sqlite3_close(first);
+    CHECK_QUERY(second, "SELECT agent_stats() ->> '$.\"run:text\".count'", "2");
+    CHECK_QUERY(second, "SELECT agent_stats_reset() > 0", "1");
+    CHECK_QUERY(second, "SELECT agent_stats()", "{}");
+    sqlite3_close(second);
+}
+
+// A local tool returns at most AGENT_LOCAL_TOOL_MAX_ROWS rows and says when
+// it left some out; statements that write need the tool_writes option
+static void unit_local_tool_limits(void) {
+    sqlite3 *db = unit_open();
+    static const char *counting = "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < :count) "
+                                  "SELECT i FROM n";
+    char *all = agent_call_local_tool(db, counting, "{\"count\": 1000}", 0);
+    CHECK(all && all[0] == '[' && strstr(all, "{\"i\":1000}]") && !strstr(all, "truncated"));
+    sqlite3_free(all);
+    char *cut = agent_call_local_tool(db, counting, "{\"count\": 1001}", 0);
+    CHECK(cut && strncmp(cut, "{\"rows\":[{\"i\":1},", 16) == 0);
+    CHECK(cut && strstr(cut, "{\"i\":1000}],\"truncated\":true}") && !strstr(cut, "1001"));
+    sqlite3_free(cut);
+
+    unit_exec(db, "CREATE TABLE notes(body TEXT)");
+    CHECK_QUERY(db, "SELECT agent_register_tool('note', 'keeps a note', NULL, 'INSERT INTO notes VALUES (:body)')",
+                "ERROR: agent_register_tool: the statement writes to the database, set the tool_writes option to allow it");
+    char *refused = agent_call_local_tool(db, "INSERT INTO notes VALUES (:body)", "{\"body\": \"x\"}", 0);
+    CHECK(refused && strstr(refused, "\"isError\":true"));
+    sqlite3_free(refused);
+    CHECK_QUERY(db, "SELECT count(*) FROM notes", "0");
+
+    unit_exec(db, "SELECT agent_config('tool_writes', 1)");
+    CHECK_QUERY(db, "SELECT agent_register_tool('note', 'keeps a note', NULL, 'INSERT INTO notes VALUES (:body)')", "1");
+    unit_answer("TOOL_CALL: note\nARGS: {\"body\": \"remember\"}");
+    unit_answer("noted");
+    CHECK_QUERY(db, "SELECT agent_run('note it')", "noted");
+    CHECK_QUERY(db, "SELECT body FROM notes", "remember");
+    // Turned off again, the registered tool no longer writes
+    unit_exec(db, "SELECT agent_config('tool_writes', 0)");
+    unit_answer("TOOL_CALL: note\nARGS: {\"body\": \"again\"}");
+    unit_answer("refused");
+    CHECK_QUERY(db, "SELECT agent_run('note it')", "refused");
+    CHECK(strstr(unit_stub.last_prompt, "tool_writes option is off") != NULL);
+    CHECK_QUERY(db, "SELECT count(*) FROM notes", "1");
+    sqlite3_close(db);
+}
+
+// Connections of a runtime share the MCP listing and MCP results, never the
+// local tools of one another or what those returned
+static void unit_runtime_local_tools(void) {
+    sqlite3 *first = unit_open();
+    sqlite3 *second = unit_open();
+    unit_exec(first, "SELECT agent_config('runtime', 'local_tools')");
+    unit_exec(second, "SELECT agent_config('runtime', 'local_tools')");
+    unit_exec(first, "SELECT agent_config('tool_cache_ttl', 60)");
+    unit_exec(second, "SELECT agent_config('tool_cache_ttl', 60)");
+    unit_exec(first, "SELECT agent_register_tool('search', 'looks in the first database', NULL, "
+                     "'SELECT ''first rows'' AS answer')");
+
+    unit_answer(UNIT_TEXT_CALL);
+    unit_answer("first done");
+    CHECK_QUERY(first, "SELECT agent_run('find')", "first done");
+    CHECK(strstr(unit_stub.last_prompt, "first rows") != NULL);
+    CHECK(unit_stub.tool_calls == 0);
+
+    // The second connection takes the shared listing without the local tool
+    unit_answer(UNIT_TEXT_CALL);
+    unit_answer("second done");
+    CHECK_QUERY(second, "SELECT agent_run('find')", "second done");
+    CHECK(strstr(unit_stub.last_prompt, "first rows") == NULL);
+    CHECK(strstr(unit_stub.last_prompt, "looks in the first database") == NULL);
+    CHECK(unit_stub.tool_calls == 1);
+
+    // Each connection gets its own result back from the cache
+    unit_answer(UNIT_TEXT_CALL);
+    unit_answer("first again");
+    CHECK_QUERY(first, "SELECT agent_run('find')", "first again");
+    CHECK(strstr(unit_stub.last_prompt, "first rows") != NULL);
+    unit_answer(UNIT_TEXT_CALL);
+    unit_answer("second again");
+    CHECK_QUERY(second, "SELECT agent_run('find')", "second again");
+    CHECK(strstr(unit_stub.last_prompt, "first rows") == NULL);
+    CHECK(unit_stub.tool_calls == 1);
+    sqlite3_close(first);
+    sqlite3_close(second);
+}
+
+// Members fill columns of the same normalized name or of an alias, not any
+// name sharing a prefix
+static void unit_compact_names(void) {
+    static const struct {
+        const char *member;
+        const char *column;
+        int matches;
+    } cases[] = {
+        {"pricePerNight", "price_per_night", 1},
+        {"Listing_URL", "listingurl", 1},
+        {"link", "url", 1},
+        {"title", "name", 1},
+        {"description", "de", 0},
+        {"description", "desc", 1},
+        {"listingUrl", "url", 0},
+        {"id", "listing_id", 0},
+        {"", "", 0},
+    };
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        char member[64], column[64];
+        agent_compact_key(cases[i].member, (int)strlen(cases[i].member), member, sizeof(member));
+        agent_compact_key(cases[i].column, (int)strlen(cases[i].column), column, sizeof(column));
+        CHECK(agent_compact_name_matches(member, column) == cases[i].matches);
+    }
+}
+
+// A paged result in text mode: every page reaches the model before its
+// answer is taken, and what the iterations leave unread is traced
+static void unit_compact_pages(void) {
+    sqlite3_str *result = sqlite3_str_new(NULL);
+    sqlite3_str_appendall(result, "{\"items\": [");
+    for (int i = 0; i < 40; i++) {
+        sqlite3_str_appendf(result, "%s{\"id\": %d, \"name\": \"listing number %d\"}", i ? ", " : "", i, i);
+    }
+    sqlite3_str_appendall(result, "]}");
+    char *text = sqlite3_str_finish(result);
+
+    sqlite3 *db = unit_open();
+    unit_stub.tool_result = text;
+    unit_exec(db, "SELECT agent_config('compact', 1)");
+    unit_exec(db, "SELECT agent_config('result_tokens', 64)");
+    unit_answer(UNIT_TEXT_CALL);
+    for (int i = 0; i < 20; i++) unit_answer("Listing 0 is the one");
+    CHECK_QUERY(db, "SELECT agent_run('find', NULL, 20)", "Listing 0 is the one");
+    int chats = unit_stub.chats;
+    CHECK(chats > 3);
+    CHECK(strstr(unit_stub.last_prompt, "of 40)") != NULL);
+    CHECK(strstr(unit_stub.last_prompt, "listing number 39") != NULL);
+
+    // With fewer iterations than pages the last answer is returned, and traced
+    unit_answers_clear();
+    unit_exec(db, "SELECT agent_config('trace', 1)");
+    unit_answer(UNIT_TEXT_CALL);
+    for (int i = 0; i < 20; i++) unit_answer("Listing 0 is the one");
+    CHECK_QUERY(db, "SELECT agent_run('find', NULL, 3)", "Listing 0 is the one");
+    CHECK(unit_stub.chats == 3);
+    char *expected = sqlite3_mprintf("%d result pages not sent", chats - 3);
+    CHECK_QUERY(db, "SELECT detail FROM agent_trace WHERE kind = 'truncate' AND name = 'pages'", expected);
+    sqlite3_free(expected);
+    sqlite3_close(db);
+    unit_stub.tool_result = NULL;
+    sqlite3_free(text);
+}
+
+// tool_top_k lists the tools nearest to the goal, embedded once per catalog
+// into agent_tool_vectors; a chat continued by persistent_context keeps the
+// tools it lists rather than embed the goal over it
+static void unit_tool_top_k(void) {
+    static const char *weather = "weather: forecast for a city";
+    static const char *stocks = "stocks: quote of a ticker symbol on the exchange";
+    sqlite3 *db = unit_open();
+    unit_exec(db, "SELECT agent_register_tool('weather', 'forecast for a city', NULL, 'SELECT 1')");
+    unit_exec(db, "SELECT agent_register_tool('stocks', 'quote of a ticker symbol on the exchange', NULL, 'SELECT 2')");
+    unit_exec(db, "SELECT agent_config('tool_top_k', 1)");
+    char *sql = sqlite3_mprintf("SELECT agent_run('%q', NULL, 2) || agent_run('%q', NULL, 2)", weather, stocks);
+
+    unit_answer("sunny");
+    unit_answer("up");
+    CHECK_QUERY(db, sql, "sunnyup");
+    CHECK(strstr(unit_stub.last_prompt, "- stocks:") && !strstr(unit_stub.last_prompt, "- weather:") &&
+          !strstr(unit_stub.last_prompt, "- search:"));
+    // Three tools once, then each goal
+    CHECK(unit_stub.embeddings == 5);
+    CHECK_QUERY(db, "SELECT count(*) FROM temp.agent_tool_vectors", "3");
+    CHECK(unit_stub.chat_contexts == 2);
+
+    unit_exec(db, "SELECT agent_config('persistent_context', 1)");
+    unit_answers_clear();
+    unit_answer("sunny");
+    unit_answer("sunny again");
+    CHECK_QUERY(db, sql, "sunnysunny again");
+    CHECK(unit_stub.embeddings == 1);
+    CHECK(unit_stub.chat_contexts == 1);
+    CHECK(strncmp(unit_stub.last_prompt, "New task.", 9) == 0);
+
+    // Embedding the tools inside a transaction of the caller leaves it open
+    unit_exec(db, "SELECT agent_config('persistent_context', 0)");
+    unit_exec(db, "CREATE TABLE log(entry TEXT)");
+    unit_exec(db, "BEGIN");
+    unit_exec(db, "INSERT INTO log VALUES ('pending')");
+    unit_exec(db, "SELECT agent_register_tool('news', 'headlines of the day', NULL, 'SELECT 3')");
+    unit_answer("read");
+    CHECK_QUERY(db, "SELECT agent_run('news', NULL, 2)", "read");
+    CHECK_QUERY(db, "SELECT count(*) FROM temp.agent_tool_vectors", "4");
+    CHECK(sqlite3_get_autocommit(db) == 0);
+    unit_exec(db, "ROLLBACK");
+    CHECK_QUERY(db, "SELECT count(*) FROM log", "0");
+    sqlite3_free(sql);
+    sqlite3_close(db);
+}
+
+// Per-goal rows of agent_run_each(), a failing goal does not stop the batch
+static void unit_run_each(void) {
+    sqlite3 *db = unit_open();
+    unit_exec(db, "CREATE TABLE t(id INTEGER PRIMARY KEY, name TEXT)");
+    unit_answer("DONE");
+    unit_answer("[{\"id\": 1, \"name\": \"a\"}, {\"id\": 2, \"name\": \"b\"}]");
+    unit_answer("DONE");
+    unit_answer("[{\"id\": 2, \"name\": \"b\"}]");
+    unit_answer("DONE");
+    unit_answer("[{\"id\": 3, \"name\": \"c\"}]");
+    CHECK_QUERY(db, "SELECT group_concat(id || ' ' || goal || ' ' || status || ' ' || rows || ' ' || "
+                    "coalesce(error, '-'), ' | ') FROM agent_run_each('[\"g1\", \"g2\", \"g3\"]', 't', 2)",
+                "1 g1 done 2 - | 2 g2 failed 0 Failed to insert row: UNIQUE constraint failed: t.id | "
+                "3 g3 done 1 -");
+    CHECK_QUERY(db, "SELECT count(*) FROM t", "3");
+    CHECK_QUERY(db, "SELECT count(*) FROM agent_run_each('not json')",
+                "ERROR: agent_run_each: goals must be a JSON array");
+    sqlite3_close(db);
+}
+
+// MARK: - Main
+
+int main(void) {
+    unit_json_tokenizer();
+    unit_json_scan_parity();
+    unit_json_bind();
+    unit_done_scan();
+    unit_tool_errors();
+    unit_tool_cache();
+    unit_pack();
+    unit_pack_fuzz();
+
+    sqlite3_auto_extension((void (*)(void))unit_stubs_init);
+    unit_on_conflict();
+    unit_caller_transaction();
+    unit_embedding_map_stale();
+    unit_schema_change();
+    unit_resume();
+    unit_resume_prefetch();
+    unit_payload_collision();
+    unit_run_options();
+    unit_run_each();
+    unit_stats();
+    unit_local_tool_limits();
+    unit_runtime_local_tools();
+    unit_tool_top_k();
+    unit_compact_names();
+    unit_compact_pages();
+
+    printf("%d checks, %d failed\n", unit_checks, unit_failures);
+    return unit_failures ? 1 : 0;
+}